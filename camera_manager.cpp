@@ -2,6 +2,10 @@
 #include "pch.h"
 #include "camera_manager.h"
 #include "logging.h"
+#include "flight_recorder.h"
+#include "warp_mesh.h"
+#include "stereo_depth.h"
+#include "render_target_size.h"
 
 
 inline Matrix4 FromHMDMatrix34(vr::HmdMatrix34_t& in)
@@ -15,6 +19,20 @@ inline Matrix4 FromHMDMatrix34(vr::HmdMatrix34_t& in)
 }
 
 
+inline vr::HmdMatrix34_t ToHMDMatrix34(const Matrix4& in)
+{
+    vr::HmdMatrix34_t out;
+    for (int row = 0; row < 3; row++)
+    {
+        for (int column = 0; column < 4; column++)
+        {
+            out.m[row][column] = in[column * 4 + row];
+        }
+    }
+    return out;
+}
+
+
 inline Matrix4 FromHMDMatrix44(vr::HmdMatrix44_t& in)
 {
     return Matrix4(
@@ -26,11 +44,13 @@ inline Matrix4 FromHMDMatrix44(vr::HmdMatrix44_t& in)
 }
 
 
-CameraManager::CameraManager(std::shared_ptr<PassthroughRenderer> renderer, std::shared_ptr<ConfigManager> configManager, std::shared_ptr<OpenVRManager> openVRManager)
+CameraManager::CameraManager(std::shared_ptr<PassthroughRenderer> renderer, std::shared_ptr<ConfigManager> configManager, std::shared_ptr<OpenVRManager> openVRManager, std::shared_ptr<Watchdog> watchdog)
     : m_renderer(renderer)
     , m_configManager(configManager)
     , m_openVRManager(openVRManager)
+    , m_watchdog(watchdog)
     , m_frameType(vr::VRTrackedCameraFrameType_MaximumUndistorted)
+    , m_projectionFrameType(vr::VRTrackedCameraFrameType_MaximumUndistorted)
     , m_frameLayout(EStereoFrameLayout::Mono)
 {
     m_projectionDistanceFar = 0.0f;
@@ -39,6 +59,7 @@ CameraManager::CameraManager(std::shared_ptr<PassthroughRenderer> renderer, std:
     m_renderFrame = std::make_shared<CameraFrame>();
     m_servedFrame = std::make_shared<CameraFrame>();
     m_underConstructionFrame = std::make_shared<CameraFrame>();
+    m_projectionEstimator = std::make_unique<ProjectionDistanceEstimator>(openVRManager);
 
     m_renderFrame->frameUVProjectionLeft.identity();
     m_renderFrame->frameUVProjectionRight.identity();
@@ -63,6 +84,12 @@ bool CameraManager::InitCamera()
 {
     if (m_bCameraInitialized) { return true; }
 
+    // The projection inverses depend on the camera intrinsics.
+    m_projectionCacheSize = 0;
+    m_projectionCacheNext = 0;
+    m_projectionDistanceFar = 0.0f;
+    m_projectionDistanceNear = 0.0f;
+
     m_hmdDeviceId = m_openVRManager->GetHMDDeviceId();
     vr::IVRTrackedCamera* trackedCamera = m_openVRManager->GetVRTrackedCamera();
 
@@ -85,8 +112,49 @@ bool CameraManager::InitCamera()
         return false;
     }
 
+    // Distorted frames skip the SteamVR undistortion pass, and are undistorted on the CPU
+    // into the same image as the undistorted frame type, which is then used for the projection.
+    m_bUseDistortedFrames = m_configManager->GetConfigSnapshot()->UseDistortedFrames;
+
+    // Synthetic frames are generated at the size and layout of the undistorted camera frames,
+    // and keep the camera intrinsics for the projection.
+    m_bUseSyntheticFrames = m_configManager->GetConfigSnapshot()->SyntheticCameraFrames;
+    if (m_bUseSyntheticFrames)
+    {
+        m_bUseDistortedFrames = false;
+    }
+
+    m_frameType = m_bUseDistortedFrames ? vr::VRTrackedCameraFrameType_Distorted : vr::VRTrackedCameraFrameType_MaximumUndistorted;
+    m_projectionFrameType = m_bUseDistortedFrames ? vr::VRTrackedCameraFrameType_Undistorted : vr::VRTrackedCameraFrameType_MaximumUndistorted;
+
     UpdateStaticCameraParameters();
 
+    if (m_bUseDistortedFrames && !InitUndistortion())
+    {
+        Log("Failed to set up undistortion, falling back to undistorted frames\n");
+
+        m_bUseDistortedFrames = false;
+        m_frameType = vr::VRTrackedCameraFrameType_MaximumUndistorted;
+        m_projectionFrameType = vr::VRTrackedCameraFrameType_MaximumUndistorted;
+        UpdateStaticCameraParameters();
+    }
+
+    if (m_bUseSyntheticFrames)
+    {
+        std::shared_ptr<const Config_Main> config = m_configManager->GetConfigSnapshot();
+
+        SyntheticSceneParams params;
+        params.width = m_cameraTextureWidth;
+        params.height = m_cameraTextureHeight;
+        params.layout = m_frameLayout;
+        params.keyColor[0] = config->MaskedKeyColor[0];
+        params.keyColor[1] = config->MaskedKeyColor[1];
+        params.keyColor[2] = config->MaskedKeyColor[2];
+
+        m_syntheticGenerator = std::make_unique<SyntheticFrameGenerator>(params, std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+        Log("Serving synthetic camera frames: %u x %u\n", params.width, params.height);
+    }
+
     vr::EVRTrackedCameraError cameraError = trackedCamera->AcquireVideoStreamingService(m_hmdDeviceId, &m_cameraHandle);
 
     if (cameraError != vr::VRTrackedCameraError_None)
@@ -98,6 +166,30 @@ bool CameraManager::InitCamera()
     m_bCameraInitialized = true;
     m_bRunThread = true;
 
+    if (m_frameLayout != EStereoFrameLayout::Mono && !m_bUseSyntheticFrames)
+    {
+        // The features are matched along the rows with the intrinsics of the projection frame type,
+        // so the estimator reads that type rather than the raw frames when they are undistorted here.
+        uint32_t projectionFrameWidth = 0;
+        uint32_t projectionFrameHeight = 0;
+        uint32_t projectionFrameBufferSize = m_cameraFrameBufferSize;
+
+        if (m_projectionFrameType != m_frameType)
+        {
+            cameraError = trackedCamera->GetCameraFrameSize(m_hmdDeviceId, m_projectionFrameType, &projectionFrameWidth, &projectionFrameHeight, &projectionFrameBufferSize);
+            if (cameraError != vr::VRTrackedCameraError_None)
+            {
+                ErrorLog("CameraFrameSize error %i for the projection frame type\n", cameraError);
+                projectionFrameBufferSize = 0;
+            }
+        }
+
+        if (projectionFrameBufferSize > 0)
+        {
+            m_projectionEstimator->Start(m_cameraHandle, m_projectionFrameType, projectionFrameBufferSize, m_frameLayout, m_stereoCameraParams);
+        }
+    }
+
     if (!m_serveThread.joinable())
     {
         m_serveThread = std::thread(&CameraManager::ServeFrames, this);
@@ -112,6 +204,8 @@ void CameraManager::DeinitCamera()
     m_bCameraInitialized = false;
     m_bRunThread = false;
 
+    m_projectionEstimator->Stop();
+
     vr::IVRTrackedCamera* trackedCamera = m_openVRManager->GetVRTrackedCamera();
 
     if (trackedCamera)
@@ -128,6 +222,8 @@ void CameraManager::DeinitCamera()
     {
         m_serveThread.join();
     }
+
+    m_watchdog->SetSourceInactive(WatchdogSource_Serve);
 }
 
 void CameraManager::GetFrameSize(uint32_t& width, uint32_t& height, uint32_t& bufferSize)
@@ -217,14 +313,14 @@ void CameraManager::UpdateStaticCameraParameters()
         m_frameLayout = EStereoFrameLayout::Mono;
     }
 
-    vr::HmdMatrix44_t vrHMDProjectionLeft = vrSystem->GetProjectionMatrix(vr::Hmd_Eye::Eye_Left, m_projectionDistanceFar * 0.1f, m_projectionDistanceFar * 2.0f);
-    m_rawHMDProjectionLeft = FromHMDMatrix44(vrHMDProjectionLeft);
+    FrustumTangents& displayLeft = m_displayFrustums[LEFT_EYE];
+    vrSystem->GetProjectionRaw(vr::Hmd_Eye::Eye_Left, &displayLeft.left, &displayLeft.right, &displayLeft.top, &displayLeft.bottom);
 
     vr::HmdMatrix34_t vrHMDViewLeft = vrSystem->GetEyeToHeadTransform(vr::Hmd_Eye::Eye_Left);
     m_rawHMDViewLeft = FromHMDMatrix34(vrHMDViewLeft).invert();
 
-    vr::HmdMatrix44_t vrHMDProjectionRight = vrSystem->GetProjectionMatrix(vr::Hmd_Eye::Eye_Right, m_projectionDistanceFar * 0.1f, m_projectionDistanceFar * 2.0f);
-    m_rawHMDProjectionRight = FromHMDMatrix44(vrHMDProjectionRight);
+    FrustumTangents& displayRight = m_displayFrustums[RIGHT_EYE];
+    vrSystem->GetProjectionRaw(vr::Hmd_Eye::Eye_Right, &displayRight.left, &displayRight.right, &displayRight.top, &displayRight.bottom);
 
     vr::HmdMatrix34_t vrHMDViewRight = vrSystem->GetEyeToHeadTransform(vr::Hmd_Eye::Eye_Right);
     m_rawHMDViewRight = FromHMDMatrix34(vrHMDViewRight).invert();
@@ -237,6 +333,176 @@ void CameraManager::UpdateStaticCameraParameters()
     Matrix4 LeftCameraPoseInv = LeftCameraPose;
     LeftCameraPoseInv.invert();
     m_cameraLeftToRightPose = LeftCameraPoseInv * RightCameraPose;
+
+    m_stereoCameraParams.baseline = Vector3(m_cameraLeftToRightPose[12], m_cameraLeftToRightPose[13], m_cameraLeftToRightPose[14]).length();
+
+    vr::HmdVector2_t focalLength;
+    vr::HmdVector2_t center;
+    cameraError = trackedCamera->GetCameraIntrinsics(m_hmdDeviceId, 0, m_projectionFrameType, &focalLength, &center);
+    if (cameraError != vr::VRTrackedCameraError_None)
+    {
+        ErrorLog("CameraIntrinsics error %i on device Id %i\n", cameraError, m_hmdDeviceId);
+        m_stereoCameraParams.focalLength = 0.0f;
+    }
+    else
+    {
+        m_stereoCameraParams.focalLength = focalLength.v[0];
+    }
+
+    UpdateRenderFrustums();
+}
+
+
+// Finds the tangents of the camera image corners at the distance as seen from the eye.
+bool CameraManager::GetCameraFrustum(const ERenderEye eye, const float distance, FrustumTangents& outFrustum)
+{
+    bool bIsStereo = m_frameLayout != EStereoFrameLayout::Mono;
+    uint32_t cameraId = (eye == RIGHT_EYE && bIsStereo) ? 1 : 0;
+
+    Matrix4 cameraProjectionInv;
+    if (!GetCameraProjectionInv(cameraId, distance, cameraProjectionInv))
+    {
+        return false;
+    }
+
+    Matrix4 cameraToHMD = (cameraId == 0) ? m_cameraLeftToHMDPose : m_cameraLeftToHMDPose * m_cameraLeftToRightPose;
+    Matrix4 cameraToEye = ((eye == LEFT_EYE) ? m_rawHMDViewLeft : m_rawHMDViewRight) * cameraToHMD * cameraProjectionInv;
+
+    outFrustum.left = FLT_MAX;
+    outFrustum.right = -FLT_MAX;
+    outFrustum.top = FLT_MAX;
+    outFrustum.bottom = -FLT_MAX;
+
+    const Vector4 corners[4] = { Vector4(-1, -1, 1, 1), Vector4(1, -1, 1, 1), Vector4(1, 1, 1, 1), Vector4(-1, 1, 1, 1) };
+
+    for (const Vector4& corner : corners)
+    {
+        Vector4 point = cameraToEye * corner;
+
+        // The w component is shared by both divisions, only the sign of the depth matters.
+        if (point.w == 0.0f || point.z / point.w >= 0.0f)
+        {
+            return false;
+        }
+
+        float tangentX = point.x / -point.z;
+        float tangentY = point.y / -point.z;
+
+        outFrustum.left = std::min(outFrustum.left, tangentX);
+        outFrustum.right = std::max(outFrustum.right, tangentX);
+        outFrustum.top = std::min(outFrustum.top, tangentY);
+        outFrustum.bottom = std::max(outFrustum.bottom, tangentY);
+    }
+
+    return true;
+}
+
+
+// Renders only the part of the display frustums the camera covers, at the configured pixel density,
+// or by default at the density of the camera or the display, whichever is lower.
+void CameraManager::UpdateRenderFrustums()
+{
+    std::shared_ptr<const Config_Main> config = m_configManager->GetConfigSnapshot();
+
+    // The configured distance is used even with the automatic distance, to avoid reallocating the targets as it changes.
+    float distance = config->ProjectionDistanceFar;
+
+    for (int eye = 0; eye < 2; eye++)
+    {
+        FrustumTangents cameraFrustum;
+
+        if (GetCameraFrustum((ERenderEye)eye, distance, cameraFrustum))
+        {
+            m_renderFrustums[eye] = IntersectFrustums(ExpandFrustum(cameraFrustum, RENDER_FRUSTUM_MARGIN), m_displayFrustums[eye]);
+        }
+        else
+        {
+            m_renderFrustums[eye] = m_displayFrustums[eye];
+        }
+
+        m_displayUVTransforms[eye] = GetFrustumUVTransform(m_renderFrustums[eye], m_displayFrustums[eye]);
+    }
+
+    // The projection distance is only known once the first frame is projected.
+    UpdateHMDProjections((m_projectionDistanceFar > 0.0f) ? m_projectionDistanceFar : distance);
+
+    float pixelsPerDegree = config->RenderPixelsPerDegree;
+
+    if (pixelsPerDegree <= 0.0f)
+    {
+        uint32_t displayWidth = 0;
+        uint32_t displayHeight = 0;
+        m_openVRManager->GetVRSystem()->GetRecommendedRenderTargetSize(&displayWidth, &displayHeight);
+
+        const FrustumTangents& display = m_displayFrustums[LEFT_EYE];
+        float displayDensity = GetCenterPixelsPerDegree(display.right - display.left, (float)displayWidth);
+        float cameraDensity = m_stereoCameraParams.focalLength / DEGREES_PER_RADIAN;
+
+        pixelsPerDegree = (cameraDensity > 0.0f) ? std::min(cameraDensity, displayDensity) : displayDensity;
+    }
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+
+    // The eyes share the render target size, the frustums are usually mirror images of each other.
+    for (int eye = 0; eye < 2; eye++)
+    {
+        uint32_t eyeWidth;
+        uint32_t eyeHeight;
+        CalculateRenderTargetSize(m_renderFrustums[eye], pixelsPerDegree, eyeWidth, eyeHeight);
+        width = std::max(width, eyeWidth);
+        height = std::max(height, eyeHeight);
+    }
+
+    m_renderPixelsPerDegree = pixelsPerDegree;
+
+    if (width == m_renderTargetWidth && height == m_renderTargetHeight)
+    {
+        return;
+    }
+
+    m_renderTargetWidth = width;
+    m_renderTargetHeight = height;
+
+    Log("Render targets %ux%u at %.1f pixels per degree\n", width, height, pixelsPerDegree);
+
+    // Compared against targets the size of one view of the camera frame, for each layout the frame could have.
+    // The fill is what both eyes shade per second at the display refresh rate, for a single pass over the target.
+    vr::IVRSystem* vrSystem = m_openVRManager->GetVRSystem();
+    float displayFrequency = vrSystem ? vrSystem->GetFloatTrackedDeviceProperty(m_hmdDeviceId, vr::Prop_DisplayFrequency_Float) : 0.0f;
+    displayFrequency = (displayFrequency > 0.0f) ? displayFrequency : 90.0f;
+
+    const EStereoFrameLayout layouts[] = { Mono, StereoHorizontalLayout, StereoVerticalLayout };
+    const char* layoutNames[] = { "mono", "horizontal stereo", "vertical stereo" };
+
+    float targetFillMPixels = 2.0f * width * height * displayFrequency / 1000000.0f;
+
+    for (int i = 0; i < 3; i++)
+    {
+        uint32_t cameraSizedWidth = (layouts[i] == StereoHorizontalLayout) ? m_cameraTextureWidth / 2 : m_cameraTextureWidth;
+        uint32_t cameraSizedHeight = (layouts[i] == StereoVerticalLayout) ? m_cameraTextureHeight / 2 : m_cameraTextureHeight;
+        uint32_t cameraSizedPixels = std::max(cameraSizedWidth * cameraSizedHeight, 1u);
+
+        float pixelFraction = (float)(width * height) / cameraSizedPixels;
+        float cameraSizedFillMPixels = 2.0f * cameraSizedPixels * displayFrequency / 1000000.0f;
+
+        if (layouts[i] == m_frameLayout)
+        {
+            m_renderTargetPixelFraction = pixelFraction;
+        }
+
+        Log("  %s%s: camera sized %ux%u, %.0f%% of the pixels, %.0f%% saved, fill %.0f of %.0f Mpixels/s at %.0f Hz, %.0f Mpixels/s saved\n",
+            layoutNames[i], (layouts[i] == m_frameLayout) ? " (current)" : "", cameraSizedWidth, cameraSizedHeight, pixelFraction * 100.0f, (1.0f - pixelFraction) * 100.0f,
+            targetFillMPixels, cameraSizedFillMPixels, displayFrequency, cameraSizedFillMPixels - targetFillMPixels);
+    }
+}
+
+// The HMD projections are only used through the far plane, which is placed at the projection distance
+// so that the key mask history is reprojected at the same depth as the far plane of the warp mesh.
+void CameraManager::UpdateHMDProjections(const float distanceFar)
+{
+    m_rawHMDProjectionLeft = ComposeProjection(m_renderFrustums[LEFT_EYE], distanceFar * 0.1f, distanceFar);
+    m_rawHMDProjectionRight = ComposeProjection(m_renderFrustums[RIGHT_EYE], distanceFar * 0.1f, distanceFar);
 }
 
 bool CameraManager::GetCameraFrame(std::shared_ptr<CameraFrame>& frame)
@@ -273,13 +539,26 @@ void CameraManager::ServeFrames()
     bool bHasFrame = false;
     uint32_t lastFrameSequence = 0;
 
+    std::chrono::steady_clock::duration syntheticFrameInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(1.0f / SyntheticSceneParams().frameRate));
+    std::chrono::steady_clock::time_point nextSyntheticFrameTime = std::chrono::steady_clock::now();
+
     while (m_bRunThread)
     {
-        std::this_thread::sleep_for(POSTFRAME_SLEEP_INTERVAL);
+        if (m_bUseSyntheticFrames)
+        {
+            // Synthetic frames are served at their frame rate instead of polling the camera.
+            nextSyntheticFrameTime = std::max(nextSyntheticFrameTime + syntheticFrameInterval, std::chrono::steady_clock::now());
+            std::this_thread::sleep_until(nextSyntheticFrameTime);
+        }
+        else
+        {
+            std::this_thread::sleep_for(POSTFRAME_SLEEP_INTERVAL);
+        }
+        RecordFlightEvent(FlightEvent_ServeWake);
 
         if (!m_bRunThread) { return; }
 
-        while (true)
+        while (!m_bUseSyntheticFrames)
         {
             vr::EVRTrackedCameraError error = trackedCamera->GetVideoStreamFrameBuffer(m_cameraHandle, m_frameType, nullptr, 0, &m_underConstructionFrame->header, sizeof(vr::CameraVideoStreamFrameHeader_t));
 
@@ -296,6 +575,7 @@ void CameraManager::ServeFrames()
             }
             else if (error != vr::VRTrackedCameraError_NoFrameAvailable)
             {
+                RecordFlightEvent(FlightEvent_OpenVRError, error, FlightSource_FrameHeader);
                 ErrorLog("GetVideoStreamFrameBuffer-header error %i\n", error);
             }
 
@@ -308,8 +588,19 @@ void CameraManager::ServeFrames()
 
         if (!m_bRunThread) { return; }
 
+        if (m_configManager->UpdateConfigSnapshot(m_serveConfig, m_serveConfigGeneration))
+        {
+            RecordFlightEvent(FlightEvent_ConfigGeneration, FlightSource_ServeThread, m_serveConfigGeneration);
+        }
+
+        // Skipped at reduced quality, leaving the frame with the flat projection.
+        bool bEstimateDepth = m_serveConfig->EnableStereoDepth && m_frameLayout != EStereoFrameLayout::Mono && m_qualityTier < QualityTier_ReducedDetail;
 
-        if (true)
+        if (m_bUseSyntheticFrames)
+        {
+            ServeSyntheticFrame(m_underConstructionFrame);
+        }
+        else if (!m_bUseDistortedFrames)
         {
             std::shared_ptr<PassthroughRenderer> renderer = m_renderer.lock();
 
@@ -318,12 +609,39 @@ void CameraManager::ServeFrames()
                 continue;
             }
 
-            vr::EVRTrackedCameraError error = trackedCamera->GetVideoStreamTextureD3D11(m_cameraHandle, m_frameType, renderer->GetRenderDevice(), (void**)&m_underConstructionFrame->frameTextureResource, nullptr, 0);
+            // The header is read with the texture, since a newer frame may have arrived after polling.
+            vr::EVRTrackedCameraError error = trackedCamera->GetVideoStreamTextureD3D11(m_cameraHandle, m_frameType, renderer->GetRenderDevice(), (void**)&m_underConstructionFrame->frameTextureResource, &m_underConstructionFrame->header, sizeof(vr::CameraVideoStreamFrameHeader_t));
             if (error != vr::VRTrackedCameraError_None)
             {
+                RecordFlightEvent(FlightEvent_OpenVRError, error, FlightSource_FrameTexture);
                 ErrorLog("GetVideoStreamTextureD3D11 error %i\n", error);
                 continue;
             }
+
+            // Depth is estimated on the CPU, so the same frame is also read into the buffer.
+            // The buffer header tells if a newer frame arrived in between.
+            if (bEstimateDepth)
+            {
+                if (m_underConstructionFrame->frameBuffer.get() == nullptr)
+                {
+                    m_underConstructionFrame->frameBuffer = std::make_shared<std::vector<uint8_t>>(m_cameraFrameBufferSize);
+                }
+
+                error = trackedCamera->GetVideoStreamFrameBuffer(m_cameraHandle, m_frameType, m_underConstructionFrame->frameBuffer->data(), (uint32_t)m_underConstructionFrame->frameBuffer->size(), &m_underConstructionFrame->frameBufferHeader, sizeof(vr::CameraVideoStreamFrameHeader_t));
+                if (error != vr::VRTrackedCameraError_None)
+                {
+                    RecordFlightEvent(FlightEvent_OpenVRError, error, FlightSource_FrameBuffer);
+                    ErrorLog("GetVideoStreamFrameBuffer error %i\n", error);
+                    bEstimateDepth = false;
+                }
+            }
+        }
+        else if (m_bUseDistortedFrames)
+        {
+            if (!UndistortFrame(m_underConstructionFrame))
+            {
+                continue;
+            }
         }
         else
         {
@@ -335,11 +653,22 @@ void CameraManager::ServeFrames()
             vr::EVRTrackedCameraError error = trackedCamera->GetVideoStreamFrameBuffer(m_cameraHandle, m_frameType, m_underConstructionFrame->frameBuffer->data(), (uint32_t)m_underConstructionFrame->frameBuffer->size(), nullptr, 0);
             if (error != vr::VRTrackedCameraError_None)
             {
+                RecordFlightEvent(FlightEvent_OpenVRError, error, FlightSource_FrameBuffer);
                 ErrorLog("GetVideoStreamFrameBuffer error %i\n", error);
                 continue;
             }
         }
 
+        if (bEstimateDepth)
+        {
+            UpdateFrameDepth(m_underConstructionFrame);
+        }
+        else if (m_underConstructionFrame->depthGrid)
+        {
+            m_underConstructionFrame->depthGrid->width = 0;
+            m_underConstructionFrame->depthGrid->height = 0;
+        }
+
         bHasFrame = true;
         lastFrameSequence = m_underConstructionFrame->header.nFrameSequence;
 
@@ -351,9 +680,277 @@ void CameraManager::ServeFrames()
 
             m_servedFrame.swap(m_underConstructionFrame);
         }
+
+        RecordFlightEvent(FlightEvent_FrameServed, lastFrameSequence, m_servedFrame->header.ulFrameExposureTime);
+        m_watchdog->Heartbeat(WatchdogSource_Serve);
     }
 }
 
+// Estimates the scene depth from the stereo views in the frame buffer.
+void CameraManager::UpdateFrameDepth(std::shared_ptr<CameraFrame>& frame)
+{
+    if (!frame->depthGrid)
+    {
+        frame->depthGrid = std::make_shared<DepthGrid>();
+    }
+
+    frame->depthGrid->width = 0;
+    frame->depthGrid->height = 0;
+
+    const vr::CameraVideoStreamFrameHeader_t& header = frame->frameBufferHeader;
+
+    // The depth would not match the displayed image if the buffer holds a different frame than the texture.
+    // A raw frame left for the fused undistortion can't be matched along rows with the undistorted intrinsics,
+    // so the mesh falls back to the projection planes until the frames are undistorted again.
+    if (frame->frameBuffer.get() == nullptr || header.nFrameSequence != frame->header.nFrameSequence || frame->bIsDistorted)
+    {
+        m_depthFramesSkipped++;
+        return;
+    }
+
+    if ((size_t)header.nWidth * header.nHeight * header.nBytesPerPixel > frame->frameBuffer->size())
+    {
+        return;
+    }
+
+    if (!m_depthEstimator)
+    {
+        m_depthEstimator = std::make_unique<StereoDepthEstimator>(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+    }
+
+    if (m_depthEstimator->EstimateDepth(frame->frameBuffer->data(), header, m_frameLayout, m_stereoCameraParams, *frame->depthGrid))
+    {
+        m_depthEstimateTimeMS = m_depthEstimator->GetLastEstimateTimeMS();
+    }
+}
+
+
+// Copies the next generated frame into the frame buffer, which the renderer uploads in place of the camera texture.
+void CameraManager::ServeSyntheticFrame(std::shared_ptr<CameraFrame>& frame)
+{
+    m_syntheticGenerator->GetFrame(m_syntheticFrame);
+
+    if (frame->frameBuffer.get() == nullptr || frame->frameBuffer->size() != m_syntheticFrame.image.size())
+    {
+        frame->frameBuffer = std::make_shared<std::vector<uint8_t>>(m_syntheticFrame.image.size());
+    }
+    memcpy(frame->frameBuffer->data(), m_syntheticFrame.image.data(), m_syntheticFrame.image.size());
+    frame->frameTextureResource = nullptr;
+
+    LARGE_INTEGER exposureTime;
+    QueryPerformanceCounter(&exposureTime);
+
+    vr::CameraVideoStreamFrameHeader_t& header = frame->header;
+    header.eFrameType = m_frameType;
+    header.nWidth = m_syntheticFrame.width;
+    header.nHeight = m_syntheticFrame.height;
+    header.nBytesPerPixel = 4;
+    header.nFrameSequence = m_syntheticFrame.index + 1;
+    header.ulFrameExposureTime = exposureTime.QuadPart;
+
+    // The frame pose is the left camera pose in the tracking space.
+    header.trackedDevicePose.mDeviceToAbsoluteTracking = ToHMDMatrix34(m_syntheticFrame.hmdPose * m_cameraLeftToHMDPose);
+    header.trackedDevicePose.vVelocity = { 0.0f, 0.0f, 0.0f };
+    header.trackedDevicePose.vAngularVelocity = { m_syntheticFrame.angularVelocity.x, m_syntheticFrame.angularVelocity.y, m_syntheticFrame.angularVelocity.z };
+    header.trackedDevicePose.eTrackingResult = vr::TrackingResult_Running_OK;
+    header.trackedDevicePose.bPoseIsValid = true;
+    header.trackedDevicePose.bDeviceIsConnected = true;
+
+    frame->frameBufferHeader = header;
+}
+
+
+// Reads the camera distortion model and builds the remap table for undistorting frames on the CPU.
+bool CameraManager::InitUndistortion()
+{
+    vr::IVRSystem* vrSystem = m_openVRManager->GetVRSystem();
+    vr::IVRTrackedCamera* trackedCamera = m_openVRManager->GetVRTrackedCamera();
+
+    if (m_cameraFrameBufferSize < m_cameraTextureWidth * m_cameraTextureHeight * 4)
+    {
+        ErrorLog("Unexpected distorted frame size %u\n", m_cameraFrameBufferSize);
+        return false;
+    }
+
+    int32_t functions[vr::k_unMaxCameras] = {};
+    float coefficients[vr::k_unMaxCameras * vr::k_unMaxDistortionFunctionParameters] = {};
+    vr::TrackedPropertyError propError;
+
+    vrSystem->GetArrayTrackedDeviceProperty(m_hmdDeviceId, vr::Prop_CameraDistortionFunction_Int32_Array, vr::k_unInt32PropertyTag, functions, sizeof(functions), &propError);
+    if (propError != vr::TrackedProp_Success)
+    {
+        ErrorLog("Failed to get camera distortion functions, error [%i]\n", propError);
+        return false;
+    }
+
+    vrSystem->GetArrayTrackedDeviceProperty(m_hmdDeviceId, vr::Prop_CameraDistortionCoefficients_Float_Array, vr::k_unFloatPropertyTag, coefficients, sizeof(coefficients), &propError);
+    if (propError != vr::TrackedProp_Success)
+    {
+        ErrorLog("Failed to get camera distortion coefficients, error [%i]\n", propError);
+        return false;
+    }
+
+    CameraDistortionParameters cameraParams[2];
+    uint32_t numCameras = (m_frameLayout == EStereoFrameLayout::Mono) ? 1 : 2;
+
+    for (uint32_t i = 0; i < numCameras; i++)
+    {
+        // Vertical layouts have the right camera at index 0.
+        uint32_t cameraIndex = (m_frameLayout == EStereoFrameLayout::StereoVerticalLayout) ? 1 - i : i;
+
+        cameraParams[i].function = (vr::EVRDistortionFunctionType)functions[cameraIndex];
+        memcpy(cameraParams[i].coefficients, &coefficients[cameraIndex * vr::k_unMaxDistortionFunctionParameters], sizeof(cameraParams[i].coefficients));
+
+        vr::EVRTrackedCameraError cameraError = trackedCamera->GetCameraIntrinsics(m_hmdDeviceId, cameraIndex, m_frameType, &cameraParams[i].sourceFocalLength, &cameraParams[i].sourceCenter);
+        if (cameraError == vr::VRTrackedCameraError_None)
+        {
+            cameraError = trackedCamera->GetCameraIntrinsics(m_hmdDeviceId, cameraIndex, m_projectionFrameType, &cameraParams[i].targetFocalLength, &cameraParams[i].targetCenter);
+        }
+
+        if (cameraError != vr::VRTrackedCameraError_None)
+        {
+            ErrorLog("CameraIntrinsics error %i on device Id %i\n", cameraError, m_hmdDeviceId);
+            return false;
+        }
+    }
+
+    if (!m_undistorter)
+    {
+        m_undistorter = std::make_unique<FrameUndistorter>(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_displayedRegionMutex);
+        m_bHasDisplayedRegions = false;
+    }
+
+    return m_undistorter->BuildRemapTable(m_cameraTextureWidth, m_cameraTextureHeight, m_frameLayout, cameraParams);
+}
+
+// Reads the distorted frame and undistorts the displayed regions into the frame buffer.
+// With fused undistortion the raw frame is passed on, and the warp mesh applies the distortion instead.
+bool CameraManager::UndistortFrame(std::shared_ptr<CameraFrame>& frame)
+{
+    vr::IVRTrackedCamera* trackedCamera = m_openVRManager->GetVRTrackedCamera();
+
+    bool bFused = m_serveConfig->FusedUndistortion;
+
+    if (frame->frameBuffer.get() == nullptr)
+    {
+        frame->frameBuffer = std::make_shared<std::vector<uint8_t>>(m_cameraFrameBufferSize);
+    }
+
+    m_distortedFrameBuffer.resize(m_cameraFrameBufferSize);
+    std::vector<uint8_t>& readBuffer = bFused ? *frame->frameBuffer : m_distortedFrameBuffer;
+
+    vr::EVRTrackedCameraError error = trackedCamera->GetVideoStreamFrameBuffer(m_cameraHandle, m_frameType, readBuffer.data(), (uint32_t)readBuffer.size(), &frame->header, sizeof(vr::CameraVideoStreamFrameHeader_t));
+    if (error != vr::VRTrackedCameraError_None)
+    {
+        ErrorLog("GetVideoStreamFrameBuffer error %i\n", error);
+        return false;
+    }
+
+    frame->frameBufferHeader = frame->header;
+    frame->bIsDistorted = bFused;
+
+    FrameRect regions[2];
+    uint32_t numRegions = 1;
+
+    {
+        std::lock_guard<std::mutex> lock(m_displayedRegionMutex);
+
+        if (!m_bHasDisplayedRegions)
+        {
+            regions[0].right = m_cameraTextureWidth;
+            regions[0].bottom = m_cameraTextureHeight;
+        }
+        else if (m_frameLayout == EStereoFrameLayout::Mono)
+        {
+            // Both eyes sample the same image, so undistort their union once.
+            regions[0].left = std::min(m_displayedRegions[0].left, m_displayedRegions[1].left);
+            regions[0].top = std::min(m_displayedRegions[0].top, m_displayedRegions[1].top);
+            regions[0].right = std::max(m_displayedRegions[0].right, m_displayedRegions[1].right);
+            regions[0].bottom = std::max(m_displayedRegions[0].bottom, m_displayedRegions[1].bottom);
+        }
+        else
+        {
+            regions[0] = m_displayedRegions[0];
+            regions[1] = m_displayedRegions[1];
+            numRegions = 2;
+        }
+    }
+
+    if (bFused)
+    {
+        // The separate pass would have read the distorted and written the undistorted pixels of the regions.
+        uint32_t numPixels = 0;
+        for (uint32_t i = 0; i < numRegions; i++)
+        {
+            numPixels += (regions[i].right - regions[i].left) * (regions[i].bottom - regions[i].top);
+        }
+
+        m_undistortTimeMS = 0.0f;
+        m_undistortedPixels = 0;
+        m_undistortBytesSaved = numPixels * 8;
+        return true;
+    }
+
+    m_undistorter->Undistort(m_distortedFrameBuffer.data(), frame->frameBuffer->data(), regions, numRegions);
+
+    m_undistortTimeMS = m_undistorter->GetLastRemapTimeMS();
+    m_undistortedPixels = m_undistorter->GetLastRemappedPixels();
+    m_undistortBytesSaved = 0;
+
+    return true;
+}
+
+// Finds the part of the camera frame sampled through the warp mesh, so that only it needs undistorting.
+void CameraManager::UpdateDisplayedRegion(const ERenderEye eye, const std::vector<WarpMeshVertex>& mesh)
+{
+    Vector2 uvOffset = GetFrameUVOffset(eye, m_frameLayout);
+
+    float minU = 1.0f;
+    float minV = 1.0f;
+    float maxU = 0.0f;
+    float maxV = 0.0f;
+
+    for (const WarpMeshVertex& vertex : mesh)
+    {
+        // Vertices behind the camera wrap around, so the whole eye may be visible.
+        if (vertex.uvCoords.z <= 0.0f)
+        {
+            minU = 0.0f;
+            minV = 0.0f;
+            maxU = 0.5f;
+            maxV = 1.0f;
+            break;
+        }
+
+        // Same transform as the passthrough pixel shaders.
+        float u = std::clamp(vertex.uvCoords.x / vertex.uvCoords.z * -0.5f + 0.5f, 0.0f, 0.5f);
+        float v = std::clamp(vertex.uvCoords.y / vertex.uvCoords.z * -0.5f + 0.5f, 0.0f, 1.0f);
+
+        minU = std::min(minU, u);
+        minV = std::min(minV, v);
+        maxU = std::max(maxU, u);
+        maxV = std::max(maxV, v);
+    }
+
+    FrameRect region;
+    region.left = (uint32_t)std::clamp((int)((minU + uvOffset.x) * m_cameraTextureWidth) - UNDISTORT_REGION_MARGIN, 0, (int)m_cameraTextureWidth);
+    region.top = (uint32_t)std::clamp((int)((minV + uvOffset.y) * m_cameraTextureHeight) - UNDISTORT_REGION_MARGIN, 0, (int)m_cameraTextureHeight);
+    region.right = (uint32_t)std::clamp((int)((maxU + uvOffset.x) * m_cameraTextureWidth) + UNDISTORT_REGION_MARGIN, 0, (int)m_cameraTextureWidth);
+    region.bottom = (uint32_t)std::clamp((int)((maxV + uvOffset.y) * m_cameraTextureHeight) + UNDISTORT_REGION_MARGIN, 0, (int)m_cameraTextureHeight);
+
+    std::lock_guard<std::mutex> lock(m_displayedRegionMutex);
+
+    m_displayedRegions[(eye == LEFT_EYE) ? 0 : 1] = region;
+
+    if (eye == RIGHT_EYE)
+    {
+        m_bHasDisplayedRegions = true;
+    }
+}
 
 // Constructs a matrix from the roomscale origin to the HMD eye space.
 Matrix4 CameraManager::GetHMDViewToTrackingMatrix(const ERenderEye eye)
@@ -395,41 +992,107 @@ Matrix4 CameraManager::GetHMDViewToTrackingMatrix(const ERenderEye eye)
     }
 }
 
-void CameraManager::CalculateFrameProjection(std::shared_ptr<CameraFrame>& frame, RenderFrame& renderFrame)
+bool CameraManager::GetCameraProjectionInv(const uint32_t cameraId, const float distance, Matrix4& outProjectionInv)
 {
     vr::IVRTrackedCamera* trackedCamera = m_openVRManager->GetVRTrackedCamera();
 
-    if (m_configManager->GetConfig_Main().ProjectionDistanceFar != m_projectionDistanceFar || 
-        m_configManager->GetConfig_Main().ProjectionDistanceNear != m_projectionDistanceNear)
+    vr::HmdMatrix44_t vrProjection;
+    vr::EVRTrackedCameraError error = trackedCamera->GetCameraProjection(m_hmdDeviceId, cameraId, m_projectionFrameType, distance * 0.5f, distance, &vrProjection);
+
+    if (error != vr::VRTrackedCameraError_None)
+    {
+        ErrorLog("CameraProjection error %i on device %i\n", error, m_hmdDeviceId);
+        return false;
+    }
+
+    outProjectionInv = FromHMDMatrix44(vrProjection).invert();
+    return true;
+}
+
+void CameraManager::CalculateFrameProjection(std::shared_ptr<CameraFrame>& frame, RenderFrame& renderFrame)
+{
+    uint32_t changedDependencies = ConfigDep_None;
+    m_configManager->UpdateConfigSnapshot(m_config, m_configGeneration, &changedDependencies);
+
+    if (changedDependencies & ConfigDep_Projection)
     {
-        m_projectionDistanceFar = m_configManager->GetConfig_Main().ProjectionDistanceFar;
-        m_projectionDistanceNear = m_configManager->GetConfig_Main().ProjectionDistanceNear;
+        m_projectionEstimator->SetEnabled(m_config->AutoProjectionDistance);
+        UpdateRenderFrustums();
+    }
 
-        vr::HmdMatrix44_t vrProjection;
-        vr::EVRTrackedCameraError error = trackedCamera->GetCameraProjection(m_hmdDeviceId, 0, m_frameType, m_projectionDistanceFar * 0.5f, m_projectionDistanceFar, &vrProjection);
+    const Config_Main& mainConf = *m_config;
 
-        if (error != vr::VRTrackedCameraError_None)
-        {
-            ErrorLog("CameraProjection error %i on device %i\n", error, m_hmdDeviceId);
-            return;
-        }
+    float distanceFar = mainConf.ProjectionDistanceFar;
+    float estimatedDistance = m_projectionEstimator->GetProjectionDistance();
+    bool bUseEstimate = mainConf.AutoProjectionDistance && estimatedDistance > 0.0f;
 
-        m_cameraProjectionInvFarLeft = FromHMDMatrix44(vrProjection).invert();
+    if (bUseEstimate)
+    {
+        distanceFar = estimatedDistance;
+    }
+
+    float distanceNear = std::min(mainConf.ProjectionDistanceNear, distanceFar);
+
+    if (distanceFar != m_projectionDistanceFar || distanceNear != m_projectionDistanceNear)
+    {
+        m_projectionDistanceFar = distanceFar;
+        m_projectionDistanceNear = distanceNear;
+        UpdateHMDProjections(distanceFar);
 
-        if (m_frameLayout != EStereoFrameLayout::Mono)
+        CachedProjectionInverses* cached = nullptr;
+        for (uint32_t i = 0; i < m_projectionCacheSize; i++)
         {
-            error = trackedCamera->GetCameraProjection(m_hmdDeviceId, 1, m_frameType, m_projectionDistanceFar * 0.5f, m_projectionDistanceFar, &vrProjection);
+            if (m_projectionCache[i].distanceFar == distanceFar && m_projectionCache[i].distanceNear == distanceNear)
+            {
+                cached = &m_projectionCache[i];
+                break;
+            }
+        }
 
-            if (error != vr::VRTrackedCameraError_None)
+        if (cached)
+        {
+            m_cameraProjectionInvFarLeft = cached->invFarLeft;
+            m_cameraProjectionInvNearLeft = cached->invNearLeft;
+            m_cameraProjectionInvFarRight = cached->invFarRight;
+            m_cameraProjectionInvNearRight = cached->invNearRight;
+        }
+        else
+        {
+            if (!GetCameraProjectionInv(0, m_projectionDistanceFar, m_cameraProjectionInvFarLeft) ||
+                !GetCameraProjectionInv(0, m_projectionDistanceNear, m_cameraProjectionInvNearLeft))
             {
-                ErrorLog("CameraProjection error %i on device %i\n", error, m_hmdDeviceId);
                 return;
             }
 
-            m_cameraProjectionInvFarRight = FromHMDMatrix44(vrProjection).invert();
+            if (m_frameLayout != EStereoFrameLayout::Mono)
+            {
+                if (!GetCameraProjectionInv(1, m_projectionDistanceFar, m_cameraProjectionInvFarRight) ||
+                    !GetCameraProjectionInv(1, m_projectionDistanceNear, m_cameraProjectionInvNearRight))
+                {
+                    return;
+                }
+            }
+
+            // Estimated distances rarely repeat exactly, so only the configured ones are kept.
+            if (!bUseEstimate)
+            {
+                CachedProjectionInverses& entry = m_projectionCache[m_projectionCacheNext];
+                entry.distanceFar = distanceFar;
+                entry.distanceNear = distanceNear;
+                entry.invFarLeft = m_cameraProjectionInvFarLeft;
+                entry.invNearLeft = m_cameraProjectionInvNearLeft;
+                entry.invFarRight = m_cameraProjectionInvFarRight;
+                entry.invNearRight = m_cameraProjectionInvNearRight;
+
+                m_projectionCacheNext = (m_projectionCacheNext + 1) % PROJECTION_CACHE_SIZE;
+                m_projectionCacheSize = std::min(m_projectionCacheSize + 1, (uint32_t)PROJECTION_CACHE_SIZE);
+            }
         }
     }
     
+    renderFrame.targetWidth = m_renderTargetWidth;
+    renderFrame.targetHeight = m_renderTargetHeight;
+
     CalculateFrameProjectionForEye(LEFT_EYE, frame, renderFrame);
     CalculateFrameProjectionForEye(RIGHT_EYE, frame, renderFrame);
 }
@@ -439,25 +1102,132 @@ void CameraManager::CalculateFrameProjectionForEye(const ERenderEye eye, std::sh
     bool bIsStereo = m_frameLayout != EStereoFrameLayout::Mono;
     uint32_t CameraId = (eye == RIGHT_EYE && bIsStereo) ? 1 : 0;
 
-    
-
     Matrix4 hmdModelViewMatrix = GetHMDViewToTrackingMatrix(eye);
     Matrix4 hmdMVPMatrix = ((eye == LEFT_EYE) ? m_rawHMDProjectionLeft : m_rawHMDProjectionRight) * hmdModelViewMatrix;
+
+    // Maps the far plane of the current view to the previous, for reprojecting the key mask history.
+    // The history isn't used if the previous projection can't be inverted.
+    Matrix4 previousHMDMVPInverse = m_previousHMDMVP[eye];
+    bool bHasMaskHistoryProjection = m_bHasPreviousHMDMVP[eye] && fabsf(previousHMDMVPInverse.getDeterminant()) > MASK_HISTORY_MIN_DETERMINANT;
+    previousHMDMVPInverse.invert();
+    Matrix4 maskHistoryProjection = CalculateCameraUVProjection(hmdMVPMatrix * previousHMDMVPInverse);
+    m_previousHMDMVP[eye] = hmdMVPMatrix;
+    m_bHasPreviousHMDMVP[eye] = true;
     Matrix4 leftCameraToTrackingPose = FromHMDMatrix34(frame->header.trackedDevicePose.mDeviceToAbsoluteTracking);
 
-    Matrix4 transformToCamera;
+    Matrix4 cameraProjectionInvFar;
+    Matrix4 cameraProjectionInvNear;
 
     if (CameraId == 0)
     {
-        transformToCamera = hmdMVPMatrix * leftCameraToTrackingPose * m_cameraProjectionInvFarLeft;
+        cameraProjectionInvFar = m_cameraProjectionInvFarLeft;
+        cameraProjectionInvNear = m_cameraProjectionInvNearLeft;
     }
     else
     {
-        transformToCamera = hmdMVPMatrix * leftCameraToTrackingPose * m_cameraLeftToRightPose * m_cameraProjectionInvFarRight;
+        cameraProjectionInvFar = m_cameraLeftToRightPose * m_cameraProjectionInvFarRight;
+        cameraProjectionInvNear = m_cameraLeftToRightPose * m_cameraProjectionInvNearRight;
     }
 
-    // Calculate matrix for transforming the clip space quad to the quad output by the camera transform
-    // as per: https://mrl.cs.nyu.edu/~dzorin/ug-graphics/lectures/lecture7/
+    Matrix4 T = CalculateCameraUVProjection(hmdMVPMatrix * leftCameraToTrackingPose * cameraProjectionInvFar);
+
+    LARGE_INTEGER perfFrequency;
+    LARGE_INTEGER startTime;
+    QueryPerformanceFrequency(&perfFrequency);
+    QueryPerformanceCounter(&startTime);
+
+    // The camera rows are exposed sequentially, so calculate a separate projection
+    // for bands of rows using the camera pose extrapolated to the band exposure time.
+    Matrix4 bandProjections[ROLLING_SHUTTER_BANDS];
+    uint32_t numBands = 0;
+    float readoutTime = m_config->RollingShutterReadoutMS / 1000.0f;
+
+    if (fabsf(readoutTime) > 0.0f && frame->header.trackedDevicePose.bPoseIsValid)
+    {
+        for (uint32_t i = 0; i < ROLLING_SHUTTER_BANDS; i++)
+        {
+            // The frame exposure time is assumed to be at the middle row.
+            float bandTime = ((i + 0.5f) / ROLLING_SHUTTER_BANDS - 0.5f) * readoutTime;
+
+            Matrix4 bandPose = ExtrapolatePoseRotation(leftCameraToTrackingPose, frame->header.trackedDevicePose.vAngularVelocity, bandTime);
+            bandProjections[i] = CalculateCameraUVProjection(hmdMVPMatrix * bandPose * cameraProjectionInvFar);
+        }
+        numBands = ROLLING_SHUTTER_BANDS;
+    }
+
+    WarpMeshParams meshParams;
+    meshParams.uvProjectionFar = T;
+    meshParams.uvProjectionNear = CalculateCameraUVProjection(hmdMVPMatrix * leftCameraToTrackingPose * cameraProjectionInvNear);
+    meshParams.distanceFar = m_projectionDistanceFar;
+    meshParams.distanceNear = m_projectionDistanceNear;
+    meshParams.bandProjections = bandProjections;
+    meshParams.numBands = numBands;
+    meshParams.cells = m_config->WarpMeshCells;
+
+    bool bReducedDetail = m_qualityTier >= QualityTier_ReducedDetail;
+    if (bReducedDetail)
+    {
+        meshParams.cells = std::max(meshParams.cells / 2, 4u);
+    }
+
+    // The depth is estimated from the left camera view, but is close enough to use for the right as well.
+    if (m_config->EnableStereoDepth && !bReducedDetail)
+    {
+        meshParams.depthGrid = frame->depthGrid.get();
+    }
+
+    std::vector<WarpMeshVertex>& warpMesh = (eye == LEFT_EYE) ? frame->warpMeshLeft : frame->warpMeshRight;
+    GenerateWarpMesh(warpMesh, meshParams);
+
+    if (m_bUseDistortedFrames)
+    {
+        UpdateDisplayedRegion(eye, warpMesh);
+
+        if (frame->bIsDistorted)
+        {
+            m_undistorter->DistortWarpMesh(warpMesh, eye);
+        }
+    }
+
+    // Taken from the final mesh, so it also covers the depth, rolling shutter and distortion offsets.
+    TargetRect coverage = GetWarpMeshCoverage(warpMesh);
+    float coveredArea = std::max(coverage.right - coverage.left, 0.0f) * std::max(coverage.bottom - coverage.top, 0.0f);
+
+    LARGE_INTEGER endTime;
+    QueryPerformanceCounter(&endTime);
+
+    float meshTime = (float)(endTime.QuadPart - startTime.QuadPart);
+    meshTime *= 1000.0f;
+    meshTime /= perfFrequency.QuadPart;
+    m_warpMeshTimeMS = (eye == LEFT_EYE) ? meshTime : m_warpMeshTimeMS + meshTime;
+    m_scissorSkippedFraction = (eye == LEFT_EYE) ? (1.0f - coveredArea) * 0.5f : m_scissorSkippedFraction + (1.0f - coveredArea) * 0.5f;
+
+    if (eye == LEFT_EYE)
+    {
+        frame->frameUVProjectionLeft = T;
+        frame->warpMeshCoverageLeft = coverage;
+        renderFrame.hmdTrackingToViewLeft = hmdModelViewMatrix;
+        renderFrame.renderFrustumLeft = m_renderFrustums[LEFT_EYE];
+        renderFrame.displayUVTransformLeft = m_displayUVTransforms[LEFT_EYE];
+        renderFrame.maskHistoryProjectionLeft = maskHistoryProjection;
+        renderFrame.bHasMaskHistoryProjection = bHasMaskHistoryProjection;
+    }
+    else
+    {
+        frame->frameUVProjectionRight = T;
+        frame->warpMeshCoverageRight = coverage;
+        renderFrame.hmdTrackingToViewRight = hmdModelViewMatrix;
+        renderFrame.renderFrustumRight = m_renderFrustums[RIGHT_EYE];
+        renderFrame.displayUVTransformRight = m_displayUVTransforms[RIGHT_EYE];
+        renderFrame.maskHistoryProjectionRight = maskHistoryProjection;
+        renderFrame.bHasMaskHistoryProjection = renderFrame.bHasMaskHistoryProjection && bHasMaskHistoryProjection;
+    }
+}
+
+// Calculates the matrix for transforming the clip space quad to the quad output by the camera transform.
+Matrix4 CameraManager::CalculateCameraUVProjection(const Matrix4& transformToCamera)
+{
+    // As per: https://mrl.cs.nyu.edu/~dzorin/ug-graphics/lectures/lecture7/
 
     Vector4 P1 = Vector4(-1, -1, 1, 1);
     Vector4 P2 = Vector4(1, -1, 1, 1);
@@ -488,14 +1258,37 @@ void CameraManager::CalculateFrameProjectionForEye(const ERenderEye eye, std::sh
     T.invert();
     T.transpose();
 
-    if (eye == LEFT_EYE)
-    {
-        frame->frameUVProjectionLeft = T;
-        renderFrame.hmdTrackingToViewLeft = hmdModelViewMatrix;
-    }
-    else
+    return T;
+}
+
+// Rotates a pose around its origin by the given angular velocity over a time period.
+Matrix4 CameraManager::ExtrapolatePoseRotation(const Matrix4& pose, const vr::HmdVector3_t& angularVelocity, const float time)
+{
+    Vector3 axis = Vector3(angularVelocity.v[0], angularVelocity.v[1], angularVelocity.v[2]);
+    float angle = axis.length() * time;
+
+    if (fabsf(angle) < 0.00001f)
     {
-        frame->frameUVProjectionRight = T;
-        renderFrame.hmdTrackingToViewRight = hmdModelViewMatrix;
+        return pose;
     }
+
+    axis.normalize();
+
+    // Rodrigues rotation in tracking space.
+    float c = cosf(angle);
+    float s = sinf(angle);
+    float t = 1.0f - c;
+
+    Matrix4 rotation = Matrix4(
+        t * axis.x * axis.x + c, t * axis.x * axis.y + s * axis.z, t * axis.x * axis.z - s * axis.y, 0.0f,
+        t * axis.x * axis.y - s * axis.z, t * axis.y * axis.y + c, t * axis.y * axis.z + s * axis.x, 0.0f,
+        t * axis.x * axis.z + s * axis.y, t * axis.y * axis.z - s * axis.x, t * axis.z * axis.z + c, 0.0f,
+        0.0f, 0.0f, 0.0f, 1.0f);
+
+    Matrix4 outPose = rotation * pose;
+    outPose[12] = pose[12];
+    outPose[13] = pose[13];
+    outPose[14] = pose[14];
+
+    return outPose;
 }
@@ -7,6 +7,12 @@
 #include "passthrough_renderer.h"
 #include "openvr_manager.h"
 #include "shared_structs.h"
+#include "stereo_depth.h"
+#include "projection_distance_estimator.h"
+#include "frame_undistorter.h"
+#include "watchdog.h"
+#include "render_target_size.h"
+#include "synthetic_frames.h"
 
 enum ETrackedCameraFrameType
 {
@@ -18,12 +24,32 @@ enum ETrackedCameraFrameType
 #define POSTFRAME_SLEEP_INTERVAL (std::chrono::milliseconds(10))
 #define FRAME_POLL_INTERVAL (std::chrono::microseconds(100))
 
+// Extra pixels undistorted around the displayed area to cover head motion until the next frame.
+#define UNDISTORT_REGION_MARGIN 32
+
+// Number of projection distance pairs to keep the camera projection inverses for, covering the saved profiles.
+#define PROJECTION_CACHE_SIZE 8
+
+// Matrix4::invert returns the identity for matrices with a smaller determinant.
+#define MASK_HISTORY_MIN_DETERMINANT 0.00001f
+
+
+struct CachedProjectionInverses
+{
+	float distanceFar;
+	float distanceNear;
+	Matrix4 invFarLeft;
+	Matrix4 invNearLeft;
+	Matrix4 invFarRight;
+	Matrix4 invNearRight;
+};
+
 
 class CameraManager
 {
 public:
 
-	CameraManager(std::shared_ptr<PassthroughRenderer> renderer, std::shared_ptr<ConfigManager> configManager, std::shared_ptr<OpenVRManager> openVRManager);
+	CameraManager(std::shared_ptr<PassthroughRenderer> renderer, std::shared_ptr<ConfigManager> configManager, std::shared_ptr<OpenVRManager> openVRManager, std::shared_ptr<Watchdog> watchdog);
 	~CameraManager();
 
 	bool InitCamera();
@@ -33,15 +59,48 @@ public:
 	void UpdateStaticCameraParameters();
 	bool GetCameraFrame(std::shared_ptr<CameraFrame>& frame);
 	void CalculateFrameProjection(std::shared_ptr<CameraFrame>& frame, RenderFrame& renderFrame);
+	void SetQualityTier(const EQualityTier tier) { m_qualityTier = tier; }
+	void GetRenderTargetSize(uint32_t& width, uint32_t& height) const { width = m_renderTargetWidth; height = m_renderTargetHeight; }
+	float GetRenderPixelsPerDegree() const { return m_renderPixelsPerDegree; }
+	float GetRenderTargetPixelFraction() const { return m_renderTargetPixelFraction; }
+
+	float GetWarpMeshTimeMS() const { return m_warpMeshTimeMS; }
+	float GetScissorSkippedFraction() const { return m_scissorSkippedFraction; }
+	float GetDepthEstimateTimeMS() const { return m_depthEstimateTimeMS; }
+	uint32_t GetDepthFramesSkipped() const { return m_depthFramesSkipped; }
+	float GetProjectionDistanceFar() const { return m_projectionDistanceFar; }
+	float GetProjectionEstimateTimeMS() const { return m_projectionEstimator->GetLastUpdateTimeMS(); }
+	int GetProjectionEstimateMatches() const { return m_projectionEstimator->GetLastNumMatches(); }
+	float GetUndistortTimeMS() const { return m_undistortTimeMS; }
+	uint32_t GetUndistortedPixels() const { return m_undistortedPixels; }
+	uint32_t GetUndistortBytesSaved() const { return m_undistortBytesSaved; }
 
 private:
 	void ServeFrames();
+	void UpdateFrameDepth(std::shared_ptr<CameraFrame>& frame);
+	void ServeSyntheticFrame(std::shared_ptr<CameraFrame>& frame);
+	bool InitUndistortion();
+	bool UndistortFrame(std::shared_ptr<CameraFrame>& frame);
+	void UpdateDisplayedRegion(const ERenderEye eye, const std::vector<WarpMeshVertex>& mesh);
 	void GetTrackedCameraEyePoses(Matrix4& LeftPose, Matrix4& RightPose);
 	Matrix4 GetHMDViewToTrackingMatrix(const ERenderEye eye);
 	void CalculateFrameProjectionForEye(const ERenderEye eye, std::shared_ptr<CameraFrame>& frame, RenderFrame& renderFrame);
+	bool GetCameraProjectionInv(const uint32_t cameraId, const float distance, Matrix4& outProjectionInv);
+	bool GetCameraFrustum(const ERenderEye eye, const float distance, FrustumTangents& outFrustum);
+	void UpdateRenderFrustums();
+	void UpdateHMDProjections(const float distanceFar);
+	Matrix4 CalculateCameraUVProjection(const Matrix4& transformToCamera);
+	Matrix4 ExtrapolatePoseRotation(const Matrix4& pose, const vr::HmdVector3_t& angularVelocity, const float time);
 
 	std::shared_ptr<ConfigManager> m_configManager;
+	// Config snapshots cached separately for the render and frame serving threads.
+	std::shared_ptr<const Config_Main> m_config;
+	uint64_t m_configGeneration = 0;
+	std::shared_ptr<const Config_Main> m_serveConfig;
+	uint64_t m_serveConfigGeneration = 0;
 	std::shared_ptr<OpenVRManager> m_openVRManager;
+	std::shared_ptr<Watchdog> m_watchdog;
+	std::atomic<EQualityTier> m_qualityTier = QualityTier_Full;
 
 	bool m_bCameraInitialized = false;
 
@@ -51,6 +110,30 @@ private:
 
 	float m_projectionDistanceFar;
 	float m_projectionDistanceNear;
+	float m_warpMeshTimeMS = 0.0f;
+	// Fraction of the render target pixels outside the warp mesh coverage, averaged over both eyes.
+	float m_scissorSkippedFraction = 0.0f;
+	std::atomic<float> m_depthEstimateTimeMS = 0.0f;
+	// Frames without depth because the buffer read returned a different frame than the texture.
+	std::atomic<uint32_t> m_depthFramesSkipped = 0;
+
+	std::unique_ptr<StereoDepthEstimator> m_depthEstimator;
+	StereoCameraParameters m_stereoCameraParams;
+	std::unique_ptr<ProjectionDistanceEstimator> m_projectionEstimator;
+
+	bool m_bUseDistortedFrames = false;
+	std::unique_ptr<FrameUndistorter> m_undistorter;
+	std::vector<uint8_t> m_distortedFrameBuffer;
+	std::mutex m_displayedRegionMutex;
+	FrameRect m_displayedRegions[2];
+	bool m_bHasDisplayedRegions = false;
+	std::atomic<float> m_undistortTimeMS = 0.0f;
+	std::atomic<uint32_t> m_undistortedPixels = 0;
+	std::atomic<uint32_t> m_undistortBytesSaved = 0;
+
+	bool m_bUseSyntheticFrames = false;
+	std::unique_ptr<SyntheticFrameGenerator> m_syntheticGenerator;
+	SyntheticFrame m_syntheticFrame;
 
 	std::weak_ptr<PassthroughRenderer> m_renderer;
 	std::thread m_serveThread;
@@ -63,9 +146,24 @@ private:
 
 	int m_hmdDeviceId = -1;
 	vr::EVRTrackedCameraFrameType m_frameType;
+	vr::EVRTrackedCameraFrameType m_projectionFrameType;
 	vr::TrackedCameraHandle_t m_cameraHandle;
 	EStereoFrameLayout m_frameLayout;
 
+	FrustumTangents m_displayFrustums[2];
+	FrustumTangents m_renderFrustums[2];
+	Vector4 m_displayUVTransforms[2];
+	uint32_t m_renderTargetWidth = 0;
+	uint32_t m_renderTargetHeight = 0;
+	float m_renderPixelsPerDegree = 0.0f;
+	// Pixels of the render targets relative to the previous camera sized targets.
+	float m_renderTargetPixelFraction = 1.0f;
+
+	// View projections of the last frame, for reprojecting the key mask history.
+	Matrix4 m_previousHMDMVP[2];
+	bool m_bHasPreviousHMDMVP[2] = {};
+
+	// Projections for the render frustums.
 	Matrix4 m_rawHMDProjectionLeft{};
 	Matrix4 m_rawHMDViewLeft{};
 	Matrix4 m_rawHMDProjectionRight{};
@@ -73,6 +171,12 @@ private:
 
 	Matrix4 m_cameraProjectionInvFarLeft{};
 	Matrix4 m_cameraProjectionInvFarRight{};
+	Matrix4 m_cameraProjectionInvNearLeft{};
+	Matrix4 m_cameraProjectionInvNearRight{};
+
+	CachedProjectionInverses m_projectionCache[PROJECTION_CACHE_SIZE];
+	uint32_t m_projectionCacheSize = 0;
+	uint32_t m_projectionCacheNext = 0;
 
 	Matrix4 m_cameraLeftToHMDPose{};
 	Matrix4 m_cameraLeftToRightPose{};
@@ -6,109 +6,495 @@
 
 ConfigManager::ConfigManager(std::wstring configFile)
 	: m_configFile(configFile)
-	, m_bConfigUpdated(false)
 	, m_iniData()
 {
 	m_iniData.SetUnicode(true);
+	PublishConfig();
+	PublishProfileList(std::make_shared<const ConfigProfileList>());
+
+	m_persistThread = std::thread(&ConfigManager::PersistThread, this);
 }
 
 ConfigManager::~ConfigManager()
 {
-	DispatchUpdate();
+	{
+		std::lock_guard<std::mutex> lock(m_persistMutex);
+		m_bRunPersistThread = false;
+	}
+	m_persistCondition.notify_all();
+
+	if (m_persistThread.joinable())
+	{
+		m_persistThread.join();
+	}
 }
 
 void ConfigManager::ReadConfigFile()
 {
+	std::unique_lock<std::mutex> iniLock(m_iniMutex);
+
 	SI_Error result = m_iniData.LoadFile(m_configFile.c_str());
 	if (result < 0)
 	{
+		iniLock.unlock();
 		Log("Failed to read config file, writing default values...\n");
-		UpdateConfigFile();
+		PublishConfig();
+		RequestSave(true);
+		return;
+	}
+
+	LARGE_INTEGER perfFrequency;
+	LARGE_INTEGER startTime;
+	QueryPerformanceFrequency(&perfFrequency);
+	QueryPerformanceCounter(&startTime);
+
+	ParseConfig_Main(m_configMain);
+	ParseProfiles();
+
+	LARGE_INTEGER endTime;
+	QueryPerformanceCounter(&endTime);
+	Log("Parsed %u config fields and %u profiles in %.3fms\n", (uint32_t)g_numConfigFields_Main, (uint32_t)m_profileList->profiles.size(), (endTime.QuadPart - startTime.QuadPart) * 1000.0f / perfFrequency.QuadPart);
+
+	iniLock.unlock();
+
+	// Share the snapshot with the active profile if the config hasn't been edited since it was activated.
+	int activeProfile = m_profileList->activeProfile;
+	if (activeProfile >= 0 && *m_profileList->profiles[activeProfile].config == m_configMain)
+	{
+		PublishConfig(m_profileList->profiles[activeProfile].config);
 	}
 	else
 	{
-		ParseConfig_Main();
+		PublishConfig();
 	}
-	m_bConfigUpdated = false;
+
+	std::lock_guard<std::mutex> lock(m_persistMutex);
+	m_lastSavedConfig = m_publishedConfig;
+	m_lastSavedProfiles = m_profileList;
 }
 
-void ConfigManager::UpdateConfigFile()
+// Writes through a temporary file that replaces the config file, so that it is never left partially written.
+void ConfigManager::WriteConfigFile(const Config_Main& config, const ConfigProfileList& profileList)
 {
-	UpdateConfig_Main();
+	std::lock_guard<std::mutex> lock(m_iniMutex);
 
-	SI_Error result = m_iniData.SaveFile(m_configFile.c_str());
+	UpdateConfig_Main(config);
+	UpdateProfiles(profileList);
+
+	std::wstring tempFile = m_configFile + L".tmp";
+
+	SI_Error result = m_iniData.SaveFile(tempFile.c_str());
 	if (result < 0)
 	{
 		ErrorLog("Failed to save config file, %i \n", errno);
+		return;
+	}
+
+	if (!MoveFileExW(tempFile.c_str(), m_configFile.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		ErrorLog("Failed to replace config file, %lu \n", GetLastError());
+		DeleteFileW(tempFile.c_str());
+		return;
+	}
+
+	m_numConfigWrites++;
+}
+
+void ConfigManager::PersistThread()
+{
+	std::unique_lock<std::mutex> lock(m_persistMutex);
+
+	while (true)
+	{
+		m_persistCondition.wait(lock, [this] { return m_bSavePending || !m_bRunPersistThread; });
+
+		if (!m_bSavePending)
+		{
+			return;
+		}
+
+		// Keep coalescing until the config has been left alone for a while, or a write is needed now.
+		while (m_bRunPersistThread && !m_bFlushRequested && std::chrono::steady_clock::now() < m_lastSaveRequestTime + CONFIG_SAVE_DELAY)
+		{
+			m_persistCondition.wait_until(lock, m_lastSaveRequestTime + CONFIG_SAVE_DELAY);
+		}
+
+		std::shared_ptr<const Config_Main> config = m_pendingSaveConfig;
+		std::shared_ptr<const ConfigProfileList> profileList = m_pendingSaveProfiles;
+		m_pendingSaveConfig.reset();
+		m_pendingSaveProfiles.reset();
+		m_bSavePending = false;
+		m_bFlushRequested = false;
+
+		if (m_lastSavedConfig && *m_lastSavedConfig == *config && m_lastSavedProfiles == profileList)
+		{
+			m_numConfigWritesAvoided++;
+			continue;
+		}
+
+		m_lastSavedConfig = config;
+		m_lastSavedProfiles = profileList;
+
+		lock.unlock();
+		WriteConfigFile(*config, *profileList);
+		lock.lock();
+	}
+}
+
+// Never waits on file IO, the persistence thread only holds the lock while idle.
+void ConfigManager::RequestSave(const bool bFlush)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_persistMutex);
+
+		if (m_bSavePending)
+		{
+			m_numConfigWritesAvoided++;
+		}
+
+		m_pendingSaveConfig = m_publishedConfig;
+		m_pendingSaveProfiles = m_profileList;
+		m_bSavePending = true;
+		m_bFlushRequested |= bFlush;
+		m_lastSaveRequestTime = std::chrono::steady_clock::now();
 	}
+	m_persistCondition.notify_one();
+}
+
+void ConfigManager::RecordCallerStall(const LARGE_INTEGER& startTime)
+{
+	LARGE_INTEGER perfFrequency;
+	LARGE_INTEGER endTime;
+	QueryPerformanceFrequency(&perfFrequency);
+	QueryPerformanceCounter(&endTime);
 
-	m_bConfigUpdated = false;
+	float stallTime = (endTime.QuadPart - startTime.QuadPart) * 1000.0f / perfFrequency.QuadPart;
+
+	if (stallTime > m_maxCallerStallMS)
+	{
+		m_maxCallerStallMS = stallTime;
+	}
 }
 
 void ConfigManager::ConfigUpdated()
 {
-	m_bConfigUpdated = true;
+	if (*m_publishedConfig == m_configMain)
+	{
+		return;
+	}
+
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+
+	PublishConfig();
+	RequestSave(false);
+
+	RecordCallerStall(startTime);
+}
+
+// Publishes a copy of the editable config, or the given snapshot of the same values. The generation
+// is incremented after the snapshot and the dependency generations are stored, so a reader that
+// observes the new generation is guaranteed to see at least that snapshot and its invalidations.
+void ConfigManager::PublishConfig(std::shared_ptr<const Config_Main> snapshot)
+{
+	uint64_t generation = m_configGeneration.load(std::memory_order_relaxed) + 1;
+	uint32_t changedDependencies = m_publishedConfig ? ConfigDep_None : UINT32_MAX;
+
+	if (m_publishedConfig)
+	{
+		for (const ConfigField& field : g_configFields_Main)
+		{
+			if (!ConfigFieldEquals(*m_publishedConfig, m_configMain, field))
+			{
+				changedDependencies |= field.dependencies;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < ConfigDep_Count; i++)
+	{
+		if (changedDependencies & (1 << i))
+		{
+			m_dependencyGenerations[i].store(generation, std::memory_order_relaxed);
+		}
+	}
+
+	m_publishedConfig = snapshot ? snapshot : std::make_shared<const Config_Main>(m_configMain);
+	m_configSnapshot.store(m_publishedConfig, std::memory_order_release);
+	m_configGeneration.store(generation, std::memory_order_release);
+}
+
+void ConfigManager::PublishProfileList(std::shared_ptr<const ConfigProfileList> profileList)
+{
+	m_profileList = profileList;
+	m_profileListSnapshot.store(m_profileList, std::memory_order_release);
+	m_profileListGeneration.fetch_add(1, std::memory_order_release);
 }
 
+// Stores the current values under the given name, replacing any profile with the same name.
+void ConfigManager::SaveProfile(const char* name)
+{
+	// Brackets would end the ini section name.
+	if (!name || name[0] == '\0' || strpbrk(name, "[]"))
+	{
+		return;
+	}
+
+	std::shared_ptr<ConfigProfileList> profileList = std::make_shared<ConfigProfileList>(*m_profileList);
+	std::shared_ptr<const Config_Main> config = std::make_shared<const Config_Main>(m_configMain);
+
+	auto it = std::find_if(profileList->profiles.begin(), profileList->profiles.end(), [name](const ConfigProfile& profile) { return profile.name == name; });
+
+	if (it != profileList->profiles.end())
+	{
+		it->config = config;
+	}
+	else
+	{
+		it = profileList->profiles.insert(profileList->profiles.end(), ConfigProfile{ std::string(name, strnlen(name, CONFIG_PROFILE_MAX_NAME_LENGTH)), config });
+	}
+
+	profileList->activeProfile = (int)(it - profileList->profiles.begin());
+
+	PublishProfileList(profileList);
+	PublishConfig(config);
+	RequestSave(false);
+}
+
+void ConfigManager::DeleteProfile(const int index)
+{
+	if (index < 0 || index >= (int)m_profileList->profiles.size())
+	{
+		return;
+	}
+
+	std::shared_ptr<ConfigProfileList> profileList = std::make_shared<ConfigProfileList>(*m_profileList);
+	profileList->profiles.erase(profileList->profiles.begin() + index);
+
+	if (profileList->activeProfile == index)
+	{
+		profileList->activeProfile = -1;
+	}
+	else if (profileList->activeProfile > index)
+	{
+		profileList->activeProfile--;
+	}
+
+	PublishProfileList(profileList);
+	RequestSave(false);
+}
+
+// Publishes the stored snapshot of the profile, so state cached for it can be reused as is.
+void ConfigManager::ActivateProfile(const int index)
+{
+	if (index < 0 || index >= (int)m_profileList->profiles.size())
+	{
+		return;
+	}
+
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+
+	std::shared_ptr<ConfigProfileList> profileList = std::make_shared<ConfigProfileList>(*m_profileList);
+	profileList->activeProfile = index;
+	std::shared_ptr<const Config_Main> config = profileList->profiles[index].config;
+
+	m_configMain = *config;
+	PublishProfileList(profileList);
+	PublishConfig(config);
+	RequestSave(false);
+
+	RecordCallerStall(startTime);
+}
+
+void ConfigManager::ActivateNextProfile()
+{
+	if (m_profileList->profiles.empty())
+	{
+		return;
+	}
+
+	ActivateProfile((m_profileList->activeProfile + 1) % (int)m_profileList->profiles.size());
+}
+
+bool ConfigManager::IsActiveProfileModified() const
+{
+	int activeProfile = m_profileList->activeProfile;
+	return activeProfile >= 0 && m_publishedConfig != m_profileList->profiles[activeProfile].config;
+}
+
+// Writes any pending changes without waiting for the save delay.
 void ConfigManager::DispatchUpdate()
 {
-	if (m_bConfigUpdated)
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+
+	std::unique_lock<std::mutex> lock(m_persistMutex);
+	if (m_bSavePending)
 	{
-		UpdateConfigFile();
+		m_bFlushRequested = true;
+		lock.unlock();
+		m_persistCondition.notify_one();
 	}
+
+	RecordCallerStall(startTime);
 }
 
 void ConfigManager::ResetToDefaults()
 {
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+
 	m_configMain = Config_Main();
-	UpdateConfigFile();
+	PublishConfig();
+	RequestSave(true);
+
+	RecordCallerStall(startTime);
 }
 
-void ConfigManager::ParseConfig_Main()
+void ConfigManager::ParseConfig_Main(Config_Main& config, const char* section)
 {
-	m_configMain.EnablePassthoughOnLaunch = m_iniData.GetBoolValue("Main", "EnablePassthoughOnLaunch", m_configMain.EnablePassthoughOnLaunch);
-	m_configMain.ShowTestImage = m_iniData.GetBoolValue("Main", "ShowTestImage", m_configMain.ShowTestImage);
-	m_configMain.PassthroughOpacity = (float)m_iniData.GetDoubleValue("Main", "PassthroughOpacity", m_configMain.PassthroughOpacity);
-	m_configMain.ProjectionDistanceFar = (float)m_iniData.GetDoubleValue("Main", "ProjectionDistanceFar", m_configMain.ProjectionDistanceFar);
-	m_configMain.ProjectionDistanceNear = (float)m_iniData.GetDoubleValue("Main", "ProjectionDistanceNear", m_configMain.ProjectionDistanceNear);
+	for (const ConfigField& field : g_configFields_Main)
+	{
+		const char* fieldSection = section ? section : field.section;
 
-	m_configMain.Brightness = (float)m_iniData.GetDoubleValue("Main", "Brightness", m_configMain.Brightness);
-	m_configMain.Contrast = (float)m_iniData.GetDoubleValue("Main", "Contrast", m_configMain.Contrast);
-	m_configMain.Saturation = (float)m_iniData.GetDoubleValue("Main", "Saturation", m_configMain.Saturation);
+		switch (field.type)
+		{
+		case ConfigBool:
+		{
+			bool& value = GetConfigFieldValue<bool>(config, field);
+			value = m_iniData.GetBoolValue(fieldSection, field.name, value);
+			break;
+		}
+		case ConfigInt:
+		case ConfigEnum:
+		{
+			int& value = GetConfigFieldValue<int>(config, field);
+			value = std::clamp((int)m_iniData.GetLongValue(fieldSection, field.name, value), (int)field.minValue, (int)field.maxValue);
+			break;
+		}
+		case ConfigFloat:
+		{
+			float& value = GetConfigFieldValue<float>(config, field);
+			value = std::clamp((float)m_iniData.GetDoubleValue(fieldSection, field.name, value), field.minValue, field.maxValue);
+			break;
+		}
+		}
+	}
+}
+
+void ConfigManager::UpdateConfig_Main(const Config_Main& config, const char* section)
+{
+	for (const ConfigField& field : g_configFields_Main)
+	{
+		const char* fieldSection = section ? section : field.section;
 
-	m_configMain.PassthroughMode = (EPassthroughBlendMode)m_iniData.GetLongValue("Core", "PassthroughMode", m_configMain.PassthroughMode);
+		switch (field.type)
+		{
+		case ConfigBool:
+			m_iniData.SetBoolValue(fieldSection, field.name, GetConfigFieldValue<bool>(config, field));
+			break;
+		case ConfigInt:
+		case ConfigEnum:
+			m_iniData.SetLongValue(fieldSection, field.name, GetConfigFieldValue<int>(config, field));
+			break;
+		case ConfigFloat:
+			m_iniData.SetDoubleValue(fieldSection, field.name, GetConfigFieldValue<float>(config, field));
+			break;
+		}
+	}
+}
 
-	m_configMain.MaskedFractionChroma = (float)m_iniData.GetDoubleValue("Core", "MaskedFractionChroma", m_configMain.MaskedFractionChroma);
-	m_configMain.MaskedFractionLuma = (float)m_iniData.GetDoubleValue("Core", "MaskedFractionLuma", m_configMain.MaskedFractionLuma);
-	m_configMain.MaskedSmoothing = (float)m_iniData.GetDoubleValue("Core", "MaskedSmoothing", m_configMain.MaskedSmoothing);
+void ConfigManager::ParseProfiles()
+{
+	std::shared_ptr<ConfigProfileList> profileList = std::make_shared<ConfigProfileList>();
+	const size_t prefixLength = strlen(CONFIG_PROFILE_SECTION_PREFIX);
 
-	m_configMain.MaskedKeyColor[0] = (float)m_iniData.GetDoubleValue("Core", "MaskedKeyColorR", m_configMain.MaskedKeyColor[0]);
-	m_configMain.MaskedKeyColor[1] = (float)m_iniData.GetDoubleValue("Core", "MaskedKeyColorG", m_configMain.MaskedKeyColor[1]);
-	m_configMain.MaskedKeyColor[2] = (float)m_iniData.GetDoubleValue("Core", "MaskedKeyColorB", m_configMain.MaskedKeyColor[2]);
+	CSimpleIniA::TNamesDepend sections;
+	m_iniData.GetAllSections(sections);
+	sections.sort(CSimpleIniA::Entry::LoadOrder());
+
+	for (const CSimpleIniA::Entry& section : sections)
+	{
+		if (strncmp(section.pItem, CONFIG_PROFILE_SECTION_PREFIX, prefixLength) != 0 || section.pItem[prefixLength] == '\0')
+		{
+			continue;
+		}
 
-	m_configMain.MaskedUseCameraImage = m_iniData.GetBoolValue("Core", "MaskedUseCameraImage", m_configMain.MaskedUseCameraImage);
+		Config_Main config;
+		ParseConfig_Main(config, section.pItem);
+		profileList->profiles.push_back(ConfigProfile{ section.pItem + prefixLength, std::make_shared<const Config_Main>(config) });
+	}
+
+	const char* activeName = m_iniData.GetValue("Main", "ActiveProfile", "");
+
+	for (int i = 0; i < (int)profileList->profiles.size(); i++)
+	{
+		if (profileList->profiles[i].name == activeName)
+		{
+			profileList->activeProfile = i;
+		}
+	}
+
+	PublishProfileList(profileList);
 }
 
-void ConfigManager::UpdateConfig_Main()
+void ConfigManager::UpdateProfiles(const ConfigProfileList& profileList)
 {
-	m_iniData.SetBoolValue("Main", "EnablePassthoughOnLaunch", m_configMain.EnablePassthoughOnLaunch);
-	m_iniData.SetBoolValue("Main", "ShowTestImage", m_configMain.ShowTestImage);
-	m_iniData.SetDoubleValue("Main", "PassthroughOpacity", m_configMain.PassthroughOpacity);
-	m_iniData.SetDoubleValue("Main", "ProjectionDistanceFar", m_configMain.ProjectionDistanceFar);
-	m_iniData.SetDoubleValue("Main", "ProjectionDistanceNear", m_configMain.ProjectionDistanceNear);
+	const size_t prefixLength = strlen(CONFIG_PROFILE_SECTION_PREFIX);
 
-	m_iniData.SetDoubleValue("Main", "Brightness", m_configMain.Brightness);
-	m_iniData.SetDoubleValue("Main", "Contrast", m_configMain.Contrast);
-	m_iniData.SetDoubleValue("Main", "Saturation", m_configMain.Saturation);
+	CSimpleIniA::TNamesDepend sections;
+	m_iniData.GetAllSections(sections);
 
-	m_iniData.SetLongValue("Core", "PassthroughMode", (int)m_configMain.PassthroughMode);
-	m_iniData.SetDoubleValue("Core", "MaskedFractionChroma", m_configMain.MaskedFractionChroma);
-	m_iniData.SetDoubleValue("Core", "MaskedFractionLuma", m_configMain.MaskedFractionLuma);
-	m_iniData.SetDoubleValue("Core", "MaskedSmoothing", m_configMain.MaskedSmoothing);
+	// Copy the names first, since deleting a section frees its name.
+	std::vector<std::string> staleSections;
+	for (const CSimpleIniA::Entry& section : sections)
+	{
+		if (strncmp(section.pItem, CONFIG_PROFILE_SECTION_PREFIX, prefixLength) == 0)
+		{
+			staleSections.push_back(section.pItem);
+		}
+	}
 
-	m_iniData.SetDoubleValue("Core", "MaskedKeyColorR", m_configMain.MaskedKeyColor[0]);
-	m_iniData.SetDoubleValue("Core", "MaskedKeyColorG", m_configMain.MaskedKeyColor[1]);
-	m_iniData.SetDoubleValue("Core", "MaskedKeyColorB", m_configMain.MaskedKeyColor[2]);
+	for (const std::string& section : staleSections)
+	{
+		m_iniData.Delete(section.c_str(), nullptr);
+	}
+
+	for (const ConfigProfile& profile : profileList.profiles)
+	{
+		std::string section = CONFIG_PROFILE_SECTION_PREFIX + profile.name;
+		UpdateConfig_Main(*profile.config, section.c_str());
+	}
+
+	const char* activeName = (profileList.activeProfile >= 0) ? profileList.profiles[profileList.activeProfile].name.c_str() : "";
+	m_iniData.SetValue("Main", "ActiveProfile", activeName);
+}
+
+uint32_t ConfigManager::GetChangedDependencies(const uint64_t sinceGeneration) const
+{
+	uint32_t dependencies = ConfigDep_None;
+
+	for (uint32_t i = 0; i < ConfigDep_Count; i++)
+	{
+		if (m_dependencyGenerations[i].load(std::memory_order_acquire) > sinceGeneration)
+		{
+			dependencies |= 1 << i;
+		}
+	}
 
-	m_iniData.SetBoolValue("Core", "MaskedUseCameraImage", m_configMain.MaskedUseCameraImage);
-}
\ No newline at end of file
+	return dependencies;
+}
+
+const ConfigField* FindConfigField(const char* name)
+{
+	for (const ConfigField& field : g_configFields_Main)
+	{
+		if (strcmp(field.name, name) == 0)
+		{
+			return &field;
+		}
+	}
+
+	return nullptr;
+}
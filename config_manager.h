@@ -1,10 +1,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "SimpleIni.h"
 #include "shared_structs.h"
 
 
+// Keys that can be defined besides MaskedKeyColor.
+#define CONFIG_MAX_EXTRA_KEYS 3
+
 struct Config_Main
 {
 	bool EnablePassthoughOnLaunch = true;
@@ -12,21 +19,201 @@ struct Config_Main
 	float PassthroughOpacity = 1.0f;
 	float ProjectionDistanceFar = 5.0f;
 	float ProjectionDistanceNear = 1.0f;
+	float RollingShutterReadoutMS = 0.0f;
+	int WarpMeshCells = 32;
+	bool EnableStereoDepth = false;
+	bool AutoProjectionDistance = false;
+	bool UseDistortedFrames = false;
+	bool FusedUndistortion = false;
+	// Replaces the camera frames with generated key screen test frames and a scripted pose.
+	bool SyntheticCameraFrames = false;
+	bool DynamicResolution = true;
+	float GPUFrameBudgetMS = 4.0f;
+	float MinResolutionScale = 0.5f;
+	float RenderPixelsPerDegree = 0.0f;
 
 	float Brightness = 0.0f;
 	float Contrast = 1.0f;
 	float Saturation = 1.0f;
 
-	EPassthroughBlendMode PassthroughMode;
+	EPassthroughBlendMode PassthroughMode = Masked;
 
 	float MaskedFractionChroma = 0.2f;
 	float MaskedFractionLuma = 0.4f;
 	float MaskedSmoothing = 0.01f;
 	float MaskedKeyColor[3] = { 0 ,0 ,0 };
+	EKeyColorSpace MaskedKeyColorSpace = KeyColorSpace_CIELAB;
 	bool MaskedUseCameraImage = false;
+	int MaskedResolutionDivisor = 2;
+	float MaskedTemporalSmoothing = 0.5f;
+	int MaskedCleanupRadius = 0;
+	bool MaskedAutoThresholds = false;
+	// Keys combined with the main key, numbered from 2 in the dashboard and the config file.
+	int MaskedExtraKeyCount = 0;
+	float MaskedExtraKeyColor[CONFIG_MAX_EXTRA_KEYS][3] = { { 0.2f, 0.35f, 0.9f }, { 0.2f, 0.35f, 0.9f }, { 0.2f, 0.35f, 0.9f } };
+	float MaskedExtraKeyFractionChroma[CONFIG_MAX_EXTRA_KEYS] = { 0.2f, 0.2f, 0.2f };
+	float MaskedExtraKeyFractionLuma[CONFIG_MAX_EXTRA_KEYS] = { 0.4f, 0.4f, 0.4f };
+	float MaskedDespillStrength = 0.0f;
+	float MaskedDespillRange = 1.5f;
+
+	bool operator==(const Config_Main&) const = default;
+};
+
+
+enum EConfigFieldType
+{
+	ConfigBool,
+	ConfigInt,
+	ConfigFloat,
+	ConfigEnum
+};
+
+// Subsystems holding state derived from config fields, invalidated when any of their fields change.
+enum EConfigDependency : uint32_t
+{
+	ConfigDep_None = 0,
+	ConfigDep_Projection = 1 << 0,
+	ConfigDep_PassConstants = 1 << 1,
+	ConfigDep_MaskedConstants = 1 << 2,
+	ConfigDep_CameraRestart = 1 << 3,
+
+	ConfigDep_Count = 4
+};
+
+
+struct ConfigField
+{
+	const char* name;
+	const char* section;
+	EConfigFieldType type;
+	size_t offset;
+	float minValue;
+	float maxValue;
+	uint32_t dependencies;
+
+	// Dashboard widget, fields without a label are edited with custom widgets.
+	const char* label;
+	const char* format;
+	float scrollStep;
 };
 
+// Ini sections holding the saved profiles are named with this prefix followed by the profile name.
+#define CONFIG_PROFILE_SECTION_PREFIX "Profile."
+#define CONFIG_PROFILE_MAX_NAME_LENGTH 32
+
+// Time without further changes before the config file is written.
+#define CONFIG_SAVE_DELAY (std::chrono::milliseconds(1000))
+
+
+#define CONFIG_FIELD(section, name, type, minValue, maxValue, dependencies, label, format, scrollStep) \
+	{ #name, section, type, offsetof(Config_Main, name), minValue, maxValue, dependencies, label, format, scrollStep }
+
+#define CONFIG_FIELD_ELEMENT(section, keyName, name, index, minValue, maxValue, dependencies) \
+	{ keyName, section, ConfigFloat, offsetof(Config_Main, name) + index * sizeof(float), minValue, maxValue, dependencies, nullptr, nullptr, 0.0f }
+
+inline constexpr ConfigField g_configFields_Main[] =
+{
+	CONFIG_FIELD("Main", EnablePassthoughOnLaunch, ConfigBool, 0.0f, 1.0f, ConfigDep_None, "Start on launch", nullptr, 0.0f),
+	CONFIG_FIELD("Main", ShowTestImage, ConfigBool, 0.0f, 1.0f, ConfigDep_None, "Show Test Image", nullptr, 0.0f),
+	CONFIG_FIELD("Main", PassthroughOpacity, ConfigFloat, 0.0f, 1.0f, ConfigDep_PassConstants, "Opacity", "%.1f", 0.1f),
+	CONFIG_FIELD("Main", ProjectionDistanceFar, ConfigFloat, 0.5f, 20.0f, ConfigDep_Projection, "Projection Dist.", "%.1f", 0.1f),
+	CONFIG_FIELD("Main", ProjectionDistanceNear, ConfigFloat, 0.2f, 5.0f, ConfigDep_Projection, "Near Projection Dist.", "%.1f", 0.1f),
+	CONFIG_FIELD("Main", RollingShutterReadoutMS, ConfigFloat, -30.0f, 30.0f, ConfigDep_None, "Shutter Readout", "%.1fms", 0.5f),
+	CONFIG_FIELD("Main", WarpMeshCells, ConfigInt, 4.0f, 64.0f, ConfigDep_None, "Warp Mesh Cells", nullptr, 1.0f),
+	CONFIG_FIELD("Main", EnableStereoDepth, ConfigBool, 0.0f, 1.0f, ConfigDep_None, "Stereo Depth Projection", nullptr, 0.0f),
+	CONFIG_FIELD("Main", AutoProjectionDistance, ConfigBool, 0.0f, 1.0f, ConfigDep_Projection, "Auto Projection Dist.", nullptr, 0.0f),
+	CONFIG_FIELD("Main", UseDistortedFrames, ConfigBool, 0.0f, 1.0f, ConfigDep_CameraRestart, "Undistort on CPU (restart required)", nullptr, 0.0f),
+	CONFIG_FIELD("Main", FusedUndistortion, ConfigBool, 0.0f, 1.0f, ConfigDep_None, "Fused Undistortion", nullptr, 0.0f),
+	CONFIG_FIELD("Main", SyntheticCameraFrames, ConfigBool, 0.0f, 1.0f, ConfigDep_CameraRestart, "Synthetic Test Frames (restart required)", nullptr, 0.0f),
+	CONFIG_FIELD("Main", DynamicResolution, ConfigBool, 0.0f, 1.0f, ConfigDep_None, "Dynamic Resolution", nullptr, 0.0f),
+	CONFIG_FIELD("Main", GPUFrameBudgetMS, ConfigFloat, 1.0f, 20.0f, ConfigDep_None, "GPU Budget", "%.1fms", 0.5f),
+	CONFIG_FIELD("Main", MinResolutionScale, ConfigFloat, 0.25f, 1.0f, ConfigDep_None, "Min. Resolution Scale", "%.2f", 0.05f),
+	CONFIG_FIELD("Main", RenderPixelsPerDegree, ConfigFloat, 0.0f, 40.0f, ConfigDep_Projection, "Pixels Per Degree (0 = auto)", "%.1f", 0.5f),
+
+	CONFIG_FIELD("Main", Brightness, ConfigFloat, -50.0f, 50.0f, ConfigDep_PassConstants, "Brightness", "%.0f", 1.0f),
+	CONFIG_FIELD("Main", Contrast, ConfigFloat, 0.0f, 2.0f, ConfigDep_PassConstants, "Contrast", "%.1f", 0.1f),
+	CONFIG_FIELD("Main", Saturation, ConfigFloat, 0.0f, 2.0f, ConfigDep_PassConstants, "Saturation", "%.1f", 0.1f),
+
+	CONFIG_FIELD("Core", PassthroughMode, ConfigEnum, 0.0f, 2.0f, ConfigDep_None, nullptr, nullptr, 0.0f),
+
+	CONFIG_FIELD("Core", MaskedFractionChroma, ConfigFloat, 0.0f, 1.0f, ConfigDep_MaskedConstants, "Chroma Range", "%.2f", 0.01f),
+	CONFIG_FIELD("Core", MaskedFractionLuma, ConfigFloat, 0.0f, 1.0f, ConfigDep_MaskedConstants, "Luma Range", "%.2f", 0.01f),
+	CONFIG_FIELD("Core", MaskedSmoothing, ConfigFloat, 0.01f, 0.2f, ConfigDep_MaskedConstants, "Smoothing", "%.3f", 0.005f),
+
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKeyColorR", MaskedKeyColor, 0, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKeyColorG", MaskedKeyColor, 1, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKeyColorB", MaskedKeyColor, 2, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD("Core", MaskedKeyColorSpace, ConfigEnum, 0.0f, 2.0f, ConfigDep_MaskedConstants, nullptr, nullptr, 0.0f),
+
+	CONFIG_FIELD("Core", MaskedUseCameraImage, ConfigBool, 0.0f, 1.0f, ConfigDep_MaskedConstants, nullptr, nullptr, 0.0f),
+	CONFIG_FIELD("Core", MaskedResolutionDivisor, ConfigInt, 1.0f, 4.0f, ConfigDep_None, "Mask Resolution Divisor", nullptr, 1.0f),
+	CONFIG_FIELD("Core", MaskedTemporalSmoothing, ConfigFloat, 0.0f, 0.9f, ConfigDep_None, "Temporal Stability", "%.2f", 0.05f),
+	CONFIG_FIELD("Core", MaskedCleanupRadius, ConfigInt, 0.0f, 15.0f, ConfigDep_None, "Mask Cleanup Radius", nullptr, 1.0f),
+	CONFIG_FIELD("Core", MaskedAutoThresholds, ConfigBool, 0.0f, 1.0f, ConfigDep_None, "Auto Key Ranges", nullptr, 0.0f),
+
+	CONFIG_FIELD("Core", MaskedExtraKeyCount, ConfigInt, 0.0f, (float)CONFIG_MAX_EXTRA_KEYS, ConfigDep_MaskedConstants, "Extra Keys", nullptr, 1.0f),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey2R", MaskedExtraKeyColor, 0, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey2G", MaskedExtraKeyColor, 1, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey2B", MaskedExtraKeyColor, 2, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey2FractionChroma", MaskedExtraKeyFractionChroma, 0, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey2FractionLuma", MaskedExtraKeyFractionLuma, 0, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey3R", MaskedExtraKeyColor, 3, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey3G", MaskedExtraKeyColor, 4, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey3B", MaskedExtraKeyColor, 5, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey3FractionChroma", MaskedExtraKeyFractionChroma, 1, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey3FractionLuma", MaskedExtraKeyFractionLuma, 1, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey4R", MaskedExtraKeyColor, 6, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey4G", MaskedExtraKeyColor, 7, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey4B", MaskedExtraKeyColor, 8, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey4FractionChroma", MaskedExtraKeyFractionChroma, 2, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD_ELEMENT("Core", "MaskedKey4FractionLuma", MaskedExtraKeyFractionLuma, 2, 0.0f, 1.0f, ConfigDep_MaskedConstants),
+	CONFIG_FIELD("Core", MaskedDespillStrength, ConfigFloat, 0.0f, 1.0f, ConfigDep_MaskedConstants, "Despill Strength", "%.2f", 0.05f),
+	CONFIG_FIELD("Core", MaskedDespillRange, ConfigFloat, 0.1f, 2.0f, ConfigDep_MaskedConstants, "Despill Range", "%.2f", 0.05f),
+};
 
+inline constexpr size_t g_numConfigFields_Main = sizeof(g_configFields_Main) / sizeof(ConfigField);
+
+const ConfigField* FindConfigField(const char* name);
+
+template<typename T>
+inline T& GetConfigFieldValue(Config_Main& config, const ConfigField& field)
+{
+	return *(T*)((uint8_t*)&config + field.offset);
+}
+
+template<typename T>
+inline const T& GetConfigFieldValue(const Config_Main& config, const ConfigField& field)
+{
+	return *(const T*)((const uint8_t*)&config + field.offset);
+}
+
+inline bool ConfigFieldEquals(const Config_Main& a, const Config_Main& b, const ConfigField& field)
+{
+	switch (field.type)
+	{
+	case ConfigBool:
+		return GetConfigFieldValue<bool>(a, field) == GetConfigFieldValue<bool>(b, field);
+	case ConfigFloat:
+		return GetConfigFieldValue<float>(a, field) == GetConfigFieldValue<float>(b, field);
+	default:
+		return GetConfigFieldValue<int>(a, field) == GetConfigFieldValue<int>(b, field);
+	}
+}
+
+
+// Named set of config values. The snapshot is shared with the published config while the profile
+// is active, so consumers can key state derived from it on the snapshot pointer.
+struct ConfigProfile
+{
+	std::string name;
+	std::shared_ptr<const Config_Main> config;
+};
+
+struct ConfigProfileList
+{
+	std::vector<ConfigProfile> profiles;
+	int activeProfile = -1;
+};
 
 
 class ConfigManager
@@ -40,19 +227,109 @@ public:
 	void DispatchUpdate();
 	void ResetToDefaults();
 
+	// Editable copy of the config, only to be accessed from the dashboard thread.
+	// Changes become visible to other threads when published through ConfigUpdated().
 	Config_Main& GetConfig_Main() { return m_configMain; }
 
+	// Immutable snapshot of the last published config, safe to read from any thread.
+	std::shared_ptr<const Config_Main> GetConfigSnapshot() const { return m_configSnapshot.load(std::memory_order_acquire); }
+	uint64_t GetConfigGeneration() const { return m_configGeneration.load(std::memory_order_acquire); }
+
+	// Refreshes a cached snapshot if a newer one has been published, costing a single atomic load otherwise.
+	// Returns true if the snapshot changed, along with the dependencies of the fields changed since the previous one.
+	bool UpdateConfigSnapshot(std::shared_ptr<const Config_Main>& snapshot, uint64_t& generation, uint32_t* outChangedDependencies = nullptr) const
+	{
+		uint64_t currentGeneration = GetConfigGeneration();
+		if (snapshot && currentGeneration == generation)
+		{
+			if (outChangedDependencies) { *outChangedDependencies = ConfigDep_None; }
+			return false;
+		}
+
+		if (outChangedDependencies)
+		{
+			*outChangedDependencies = snapshot ? GetChangedDependencies(generation) : UINT32_MAX;
+		}
+
+		snapshot = GetConfigSnapshot();
+		generation = currentGeneration;
+		return true;
+	}
+
+	uint32_t GetChangedDependencies(const uint64_t sinceGeneration) const;
+
+	// Profiles are edited from the dashboard thread only, other threads use the published snapshot.
+	const ConfigProfileList& GetProfileList() const { return *m_profileList; }
+	std::shared_ptr<const ConfigProfileList> GetProfileListSnapshot() const { return m_profileListSnapshot.load(std::memory_order_acquire); }
+	bool UpdateProfileListSnapshot(std::shared_ptr<const ConfigProfileList>& snapshot, uint64_t& generation) const
+	{
+		uint64_t currentGeneration = m_profileListGeneration.load(std::memory_order_acquire);
+		if (snapshot && currentGeneration == generation)
+		{
+			return false;
+		}
+
+		snapshot = GetProfileListSnapshot();
+		generation = currentGeneration;
+		return true;
+	}
+
+	void SaveProfile(const char* name);
+	void DeleteProfile(const int index);
+	void ActivateProfile(const int index);
+	void ActivateNextProfile();
+	bool IsActiveProfileModified() const;
+
+	uint32_t GetNumConfigWrites() const { return m_numConfigWrites; }
+	uint32_t GetNumConfigWritesAvoided() const { return m_numConfigWritesAvoided; }
+	float GetMaxCallerStallMS() const { return m_maxCallerStallMS; }
+
 
 private:
-	void UpdateConfigFile();
+	void PersistThread();
+	void RequestSave(const bool bFlush);
+	void WriteConfigFile(const Config_Main& config, const ConfigProfileList& profileList);
+	void PublishConfig(std::shared_ptr<const Config_Main> snapshot = nullptr);
+	void PublishProfileList(std::shared_ptr<const ConfigProfileList> profileList);
+	void RecordCallerStall(const LARGE_INTEGER& startTime);
 
-	void ParseConfig_Main();
-	void UpdateConfig_Main();
+	// The section overrides the per field sections, for reading and writing profiles.
+	void ParseConfig_Main(Config_Main& config, const char* section = nullptr);
+	void UpdateConfig_Main(const Config_Main& config, const char* section = nullptr);
+	void ParseProfiles();
+	void UpdateProfiles(const ConfigProfileList& profileList);
 
 	std::wstring m_configFile;
+	std::mutex m_iniMutex;
 	CSimpleIniA m_iniData;
-	bool m_bConfigUpdated;
 
 	Config_Main m_configMain;
+	std::shared_ptr<const Config_Main> m_publishedConfig;
+	std::atomic<std::shared_ptr<const Config_Main>> m_configSnapshot;
+	std::atomic<uint64_t> m_configGeneration = 0;
+
+	std::shared_ptr<const ConfigProfileList> m_profileList;
+	std::atomic<std::shared_ptr<const ConfigProfileList>> m_profileListSnapshot;
+	std::atomic<uint64_t> m_profileListGeneration = 0;
+
+	// Generation each dependency was last invalidated in.
+	std::atomic<uint64_t> m_dependencyGenerations[ConfigDep_Count] = {};
+
+	// Saves are handed to the persistence thread, which coalesces them until the config stops changing.
+	std::thread m_persistThread;
+	std::mutex m_persistMutex;
+	std::condition_variable m_persistCondition;
+	bool m_bRunPersistThread = true;
+	bool m_bSavePending = false;
+	bool m_bFlushRequested = false;
+	std::chrono::steady_clock::time_point m_lastSaveRequestTime;
+	std::shared_ptr<const Config_Main> m_pendingSaveConfig;
+	std::shared_ptr<const ConfigProfileList> m_pendingSaveProfiles;
+	std::shared_ptr<const Config_Main> m_lastSavedConfig;
+	std::shared_ptr<const ConfigProfileList> m_lastSavedProfiles;
+
+	std::atomic<uint32_t> m_numConfigWrites = 0;
+	std::atomic<uint32_t> m_numConfigWritesAvoided = 0;
+	std::atomic<float> m_maxCallerStallMS = 0.0f;
 };
 
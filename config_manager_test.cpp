@@ -0,0 +1,373 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "config_manager.h"
+
+
+#define SELF_TEST_CONFIG_PUBLISHES 20000
+#define SELF_TEST_CONFIG_READERS 3
+#define SELF_TEST_CONFIG_READ_ITERATIONS 1000000
+#define SELF_TEST_CONFIG_FANOUT_ITERATIONS 100
+
+// Edits in the burst of the persistence check, published well within the save delay.
+#define SELF_TEST_CONFIG_BURST_EDITS 500
+
+// Float config values are picked on this grid, which the six decimals of the ini values represent exactly.
+#define SELF_TEST_CONFIG_FLOAT_STEPS 64.0f
+
+
+// Readers refresh their snapshots while the dashboard thread publishes changes as fast as it can.
+// The writer counts up a field with a dependency on every publish, so each reader can check that
+// the generation never goes backwards, that the snapshot is at least as new as the generation,
+// and that every new snapshot reports the dependency.
+bool TestConfigSnapshotStress()
+{
+	ScratchConfigManager configManager;
+
+	const uint64_t baseGeneration = configManager->GetConfigGeneration();
+	std::atomic<bool> bRunReaders = true;
+	std::atomic<uint32_t> numErrors = 0;
+	std::atomic<uint64_t> numReads = 0;
+	std::atomic<uint64_t> numUpdates = 0;
+
+	auto reader = [&]()
+	{
+		std::shared_ptr<const Config_Main> snapshot;
+		uint64_t generation = 0;
+		uint64_t reads = 0;
+		uint64_t updates = 0;
+		float lastCount = -1.0f;
+
+		configManager->UpdateConfigSnapshot(snapshot, generation);
+
+		while (bRunReaders.load(std::memory_order_relaxed))
+		{
+			uint64_t previousGeneration = generation;
+			uint32_t changedDependencies;
+			reads++;
+
+			// Both sides yield to interleave even on a single core.
+			if (!configManager->UpdateConfigSnapshot(snapshot, generation, &changedDependencies))
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			updates++;
+			float count = snapshot->Brightness;
+
+			if (generation < previousGeneration || count < lastCount ||
+				count < (float)(generation - baseGeneration) ||
+				!(changedDependencies & ConfigDep_PassConstants))
+			{
+				numErrors++;
+			}
+
+			lastCount = count;
+		}
+
+		numReads += reads;
+		numUpdates += updates;
+	};
+
+	std::vector<std::thread> readers;
+	for (int i = 0; i < SELF_TEST_CONFIG_READERS; i++)
+	{
+		readers.emplace_back(reader);
+	}
+
+	for (int i = 1; i <= SELF_TEST_CONFIG_PUBLISHES; i++)
+	{
+		configManager->GetConfig_Main().Brightness = (float)i;
+		configManager->ConfigUpdated();
+		std::this_thread::yield();
+	}
+
+	bRunReaders = false;
+	for (std::thread& thread : readers)
+	{
+		thread.join();
+	}
+
+	uint64_t publishedGenerations = configManager->GetConfigGeneration() - baseGeneration;
+
+	Log("Config snapshot stress: %u publishes, %llu reads seeing %llu updates over %u readers, %u errors\n",
+		SELF_TEST_CONFIG_PUBLISHES, (unsigned long long)numReads, (unsigned long long)numUpdates, SELF_TEST_CONFIG_READERS, (uint32_t)numErrors);
+
+	// Without enough updates seen the readers never raced the writer.
+	return numErrors == 0 && numUpdates > SELF_TEST_CONFIG_PUBLISHES / 10 && publishedGenerations == SELF_TEST_CONFIG_PUBLISHES && configManager->GetConfigSnapshot()->Brightness == (float)SELF_TEST_CONFIG_PUBLISHES;
+}
+
+
+// Cost of the per frame snapshot refresh when nothing changed, of loading the snapshot itself,
+// and of publishing a change from the dashboard thread.
+bool BenchmarkConfigSnapshot()
+{
+	ScratchConfigManager configManager;
+
+	std::shared_ptr<const Config_Main> snapshot;
+	uint64_t generation = 0;
+	uint32_t changedDependencies;
+	uint32_t numChanged = 0;
+
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+
+	for (int i = 0; i < SELF_TEST_CONFIG_READ_ITERATIONS; i++)
+	{
+		numChanged += configManager->UpdateConfigSnapshot(snapshot, generation, &changedDependencies) ? 1 : 0;
+	}
+
+	float refreshTimeMS = GetElapsedMS(startTime);
+	QueryPerformanceCounter(&startTime);
+
+	float sum = 0.0f;
+	for (int i = 0; i < SELF_TEST_CONFIG_READ_ITERATIONS; i++)
+	{
+		sum += configManager->GetConfigSnapshot()->PassthroughOpacity;
+	}
+
+	float loadTimeMS = GetElapsedMS(startTime);
+	QueryPerformanceCounter(&startTime);
+
+	for (int i = 1; i <= SELF_TEST_CONFIG_PUBLISHES; i++)
+	{
+		configManager->GetConfig_Main().Brightness = (float)(i % 100);
+		configManager->ConfigUpdated();
+	}
+
+	float publishTimeMS = GetElapsedMS(startTime);
+
+	Log("Config snapshot: %.2f ns per unchanged refresh, %.2f ns per snapshot load, %.2f us per publish\n",
+		refreshTimeMS * 1000000.0f / SELF_TEST_CONFIG_READ_ITERATIONS, loadTimeMS * 1000000.0f / SELF_TEST_CONFIG_READ_ITERATIONS, publishTimeMS * 1000.0f / SELF_TEST_CONFIG_PUBLISHES);
+
+	return numChanged == 1 && sum == (float)SELF_TEST_CONFIG_READ_ITERATIONS * snapshot->PassthroughOpacity;
+}
+
+
+// Sets the field to a different value inside its range.
+static void ChangeConfigField(Config_Main& config, const ConfigField& field, uint32_t& randomState)
+{
+	switch (field.type)
+	{
+	case ConfigBool:
+	{
+		bool& value = GetConfigFieldValue<bool>(config, field);
+		value = !value;
+		break;
+	}
+	case ConfigInt:
+	case ConfigEnum:
+	{
+		int& value = GetConfigFieldValue<int>(config, field);
+		int minValue = (int)field.minValue;
+		int range = (int)field.maxValue - minValue + 1;
+		value = minValue + (value - minValue + 1 + (int)(NextRandom(randomState) % (range - 1))) % range;
+		break;
+	}
+	case ConfigFloat:
+	{
+		float& value = GetConfigFieldValue<float>(config, field);
+		int minStep = (int)ceilf(field.minValue * SELF_TEST_CONFIG_FLOAT_STEPS);
+		int maxStep = (int)floorf(field.maxValue * SELF_TEST_CONFIG_FLOAT_STEPS);
+		float newValue = value;
+		while (newValue == value)
+		{
+			newValue = (minStep + (int)(NextRandom(randomState) % (maxStep - minStep + 1))) / SELF_TEST_CONFIG_FLOAT_STEPS;
+		}
+		value = newValue;
+		break;
+	}
+	}
+}
+
+
+// Writes a profile and the main section with every schema field changed, so that each field
+// differs between them and from the defaults, and checks that both read back the same.
+bool TestConfigSchemaRoundTrip()
+{
+	uint32_t randomState = 3;
+	uint32_t numElements = 0;
+
+	Config_Main profileConfig;
+	for (const ConfigField& field : g_configFields_Main)
+	{
+		ChangeConfigField(profileConfig, field, randomState);
+		numElements += (field.label == nullptr && field.type == ConfigFloat) ? 1 : 0;
+	}
+
+	Config_Main mainConfig = profileConfig;
+	for (const ConfigField& field : g_configFields_Main)
+	{
+		ChangeConfigField(mainConfig, field, randomState);
+	}
+
+	ScratchConfigManager configManager;
+	configManager->GetConfig_Main() = profileConfig;
+	configManager->SaveProfile("Self Test");
+	configManager->GetConfig_Main() = mainConfig;
+	configManager->ConfigUpdated();
+
+	configManager.Reload();
+
+	const ConfigProfileList& profileList = configManager->GetProfileList();
+	if (profileList.profiles.size() != 1 || profileList.activeProfile != 0 || profileList.profiles[0].name != "Self Test")
+	{
+		Log("Config schema round trip: the profile was not read back\n");
+		return false;
+	}
+
+	const Config_Main& readConfig = configManager->GetConfig_Main();
+	const Config_Main& readProfileConfig = *profileList.profiles[0].config;
+	uint32_t numMismatches = 0;
+
+	for (const ConfigField& field : g_configFields_Main)
+	{
+		if (!ConfigFieldEquals(readConfig, mainConfig, field) || !ConfigFieldEquals(readProfileConfig, profileConfig, field))
+		{
+			Log("Config field %s did not round trip\n", field.name);
+			numMismatches++;
+		}
+	}
+
+	Log("Config schema round trip: %u fields including %u array elements, %u mismatches\n", (uint32_t)g_numConfigFields_Main, numElements, numMismatches);
+
+	return numMismatches == 0 && readConfig == mainConfig && readProfileConfig == profileConfig && configManager->IsActiveProfileModified();
+}
+
+
+// Changes each field in turn, checking that the consumers are told exactly its dependencies,
+// and times the publish and the dependency lookup of the refreshed snapshot.
+bool BenchmarkConfigDependencies()
+{
+	ScratchConfigManager configManager;
+
+	std::shared_ptr<const Config_Main> snapshot;
+	uint64_t generation = 0;
+	configManager->UpdateConfigSnapshot(snapshot, generation);
+
+	LARGE_INTEGER perfFrequency;
+	QueryPerformanceFrequency(&perfFrequency);
+
+	uint32_t randomState = 4;
+	uint32_t numWrong = 0;
+	uint32_t numChanges = 0;
+	int64_t publishTicks = 0;
+	int64_t refreshTicks = 0;
+
+	for (int i = 0; i < SELF_TEST_CONFIG_FANOUT_ITERATIONS; i++)
+	{
+		for (const ConfigField& field : g_configFields_Main)
+		{
+			ChangeConfigField(configManager->GetConfig_Main(), field, randomState);
+
+			LARGE_INTEGER startTime;
+			LARGE_INTEGER publishTime;
+			LARGE_INTEGER endTime;
+			uint32_t changedDependencies;
+
+			QueryPerformanceCounter(&startTime);
+			configManager->ConfigUpdated();
+			QueryPerformanceCounter(&publishTime);
+			configManager->UpdateConfigSnapshot(snapshot, generation, &changedDependencies);
+			QueryPerformanceCounter(&endTime);
+
+			publishTicks += publishTime.QuadPart - startTime.QuadPart;
+			refreshTicks += endTime.QuadPart - publishTime.QuadPart;
+			numChanges++;
+
+			if (changedDependencies != field.dependencies)
+			{
+				numWrong++;
+			}
+		}
+	}
+
+	Log("Config dependency fan-out: %u field changes, %.2f us per publish, %.0f ns per refresh with the dependencies, %u wrong\n",
+		numChanges, publishTicks * 1000000.0f / perfFrequency.QuadPart / numChanges, refreshTicks * 1000000000.0f / perfFrequency.QuadPart / numChanges, numWrong);
+
+	return numWrong == 0;
+}
+
+// Waits for the persistence thread to write the config file the given number of times, up to a few save delays.
+static bool WaitForConfigWrites(ScratchConfigManager& configManager, const uint32_t numWrites)
+{
+	auto deadline = std::chrono::steady_clock::now() + CONFIG_SAVE_DELAY * 3;
+
+	while (configManager->GetNumConfigWrites() < numWrites && std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	return configManager->GetNumConfigWrites() >= numWrites;
+}
+
+
+// A burst of edits is written once after the save delay, an edit that is reverted before the
+// write is skipped, and an edit still pending at shutdown is flushed. The callers never wait on the file.
+bool TestConfigPersistence()
+{
+	ScratchConfigManager configManager;
+	bool bPassed = true;
+
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+
+	for (int i = 1; i <= SELF_TEST_CONFIG_BURST_EDITS; i++)
+	{
+		configManager->GetConfig_Main().Brightness = (float)(i % 50);
+		configManager->ConfigUpdated();
+	}
+
+	float burstTimeMS = GetElapsedMS(startTime);
+	const float burstBrightness = configManager->GetConfig_Main().Brightness;
+
+	// Nothing is written while the edits keep coming.
+	uint32_t burstWritesEarly = configManager->GetNumConfigWrites();
+	bool bBurstWritten = WaitForConfigWrites(configManager, 1);
+	std::this_thread::sleep_for(CONFIG_SAVE_DELAY / 2);
+	uint32_t burstWrites = configManager->GetNumConfigWrites();
+
+	if (burstWritesEarly != 0 || !bBurstWritten || burstWrites != 1)
+	{
+		Log("Config persistence: the burst of %u edits was written %u times, %u before the save delay\n", SELF_TEST_CONFIG_BURST_EDITS, burstWrites, burstWritesEarly);
+		bPassed = false;
+	}
+
+	// Changing a field and changing it back leaves the file as it is.
+	uint32_t avoidedBefore = configManager->GetNumConfigWritesAvoided();
+	configManager->GetConfig_Main().Brightness = burstBrightness + 1.0f;
+	configManager->ConfigUpdated();
+	configManager->GetConfig_Main().Brightness = burstBrightness;
+	configManager->ConfigUpdated();
+
+	std::this_thread::sleep_for(CONFIG_SAVE_DELAY * 2);
+
+	if (configManager->GetNumConfigWrites() != burstWrites || configManager->GetNumConfigWritesAvoided() <= avoidedBefore)
+	{
+		Log("Config persistence: a reverted edit was written\n");
+		bPassed = false;
+	}
+
+	// An edit made right before shutdown reaches the file.
+	configManager->GetConfig_Main().Brightness = burstBrightness + 2.0f;
+	configManager->ConfigUpdated();
+
+	float maxStallMS = configManager->GetMaxCallerStallMS();
+	configManager.Reload();
+
+	if (configManager->GetConfig_Main().Brightness != burstBrightness + 2.0f)
+	{
+		Log("Config persistence: the edit pending at shutdown was lost\n");
+		bPassed = false;
+	}
+
+	Log("Config persistence: %u edits in %.2f ms written once, %.3f ms max caller stall\n", SELF_TEST_CONFIG_BURST_EDITS, burstTimeMS, maxStallMS);
+
+	return bPassed;
+}
+
+#endif
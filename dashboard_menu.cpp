@@ -2,15 +2,19 @@
 #include "pch.h"
 #include "dashboard_menu.h"
 #include "logging.h"
+#include "flight_recorder.h"
 //#include "imgui.h"
 //#include "imgui_internal.h"
 //#include "imgui_impl_dx11.h"
 
 
 
-DashboardMenu::DashboardMenu(std::shared_ptr<ConfigManager> configManager, std::shared_ptr<OpenVRManager> openVRManager)
+DashboardMenu::DashboardMenu(std::shared_ptr<ConfigManager> configManager, std::shared_ptr<OpenVRManager> openVRManager, std::shared_ptr<Watchdog> watchdog, std::shared_ptr<KeyCalibrator> keyCalibrator, std::shared_ptr<KeyThresholdTuner> keyThresholdTuner)
 	: m_configManager(configManager)
 	, m_openVRManager(openVRManager)
+	, m_watchdog(watchdog)
+	, m_keyCalibrator(keyCalibrator)
+	, m_keyThresholdTuner(keyThresholdTuner)
 	, m_overlayHandle(vr::k_ulOverlayHandleInvalid)
 	, m_thumbnailHandle(vr::k_ulOverlayHandleInvalid)
 	, m_bMenuIsVisible(false)
@@ -63,6 +67,7 @@ void DashboardMenu::RunThread()
 
 	while (m_bRunThread)
 	{
+		m_watchdog->Heartbeat(WatchdogSource_Dashboard);
 		TickMenu();
 
 		//std::this_thread::sleep_for(std::chrono::milliseconds(11));
@@ -70,6 +75,8 @@ void DashboardMenu::RunThread()
 	}
 
 
+	m_watchdog->SetSourceInactive(WatchdogSource_Dashboard);
+
 	ImGui_ImplDX11_Shutdown();
 	ImGui::GetIO().BackendRendererUserData = NULL;
 	ImGui::DestroyContext();
@@ -105,10 +112,76 @@ void ScrollableSlider(const char* label, float* v, float v_min, float v_max, con
 }
 
 
+// Draws the widget described by the config schema for the named field.
+void ConfigFieldWidget(Config_Main& config, const char* name)
+{
+	const ConfigField* field = FindConfigField(name);
+	if (!field || !field->label) { return; }
+
+	switch (field->type)
+	{
+	case ConfigBool:
+		ImGui::Checkbox(field->label, &GetConfigFieldValue<bool>(config, *field));
+		break;
+	case ConfigInt:
+		ImGui::SliderInt(field->label, &GetConfigFieldValue<int>(config, *field), (int)field->minValue, (int)field->maxValue);
+		break;
+	case ConfigFloat:
+		ScrollableSlider(field->label, &GetConfigFieldValue<float>(config, *field), field->minValue, field->maxValue, field->format, field->scrollStep);
+		break;
+	default:
+		break;
+	}
+}
+
+
 void DashboardMenu::TickMenu() 
 {
 	HandleEvents();
 
+	// Checked while the menu is hidden as well, so profiles can be switched without opening the dashboard.
+	bool bProfileHotkeyDown = (GetAsyncKeyState(VK_CONTROL) & 0x8000) && (GetAsyncKeyState(PROFILE_HOTKEY) & 0x8000);
+	if (bProfileHotkeyDown && !m_bProfileHotkeyDown)
+	{
+		m_configManager->ActivateNextProfile();
+	}
+	m_bProfileHotkeyDown = bProfileHotkeyDown;
+
+	if (m_bCycleProfiles)
+	{
+		m_configManager->ActivateNextProfile();
+	}
+
+	if (m_keyCalibrator->GetResult(m_lastCalibration) && m_lastCalibration.bSuccess)
+	{
+		Config_Main& mainConfig = m_configManager->GetConfig_Main();
+		mainConfig.MaskedKeyColor[0] = m_lastCalibration.keyColor[0];
+		mainConfig.MaskedKeyColor[1] = m_lastCalibration.keyColor[1];
+		mainConfig.MaskedKeyColor[2] = m_lastCalibration.keyColor[2];
+
+		// The suggested ranges are in CIELAB units, and don't carry over to the other spaces.
+		if (mainConfig.MaskedKeyColorSpace == KeyColorSpace_CIELAB)
+		{
+			mainConfig.MaskedFractionChroma = m_lastCalibration.fractionChroma;
+			mainConfig.MaskedFractionLuma = m_lastCalibration.fractionLuma;
+		}
+		m_configManager->ConfigUpdated();
+	}
+
+	// The tuned ranges are approached gradually, so a single misjudged frame doesn't pop the mask.
+	if (m_keyThresholdTuner->GetResult(m_lastThresholds) && m_lastThresholds.bValid && m_configManager->GetConfig_Main().MaskedAutoThresholds &&
+		m_configManager->GetConfig_Main().MaskedKeyColorSpace == KeyColorSpace_CIELAB)
+	{
+		Config_Main& mainConfig = m_configManager->GetConfig_Main();
+		bool bChromaChanged = StepKeyThreshold(mainConfig.MaskedFractionChroma, m_lastThresholds.fractionChroma);
+		bool bLumaChanged = StepKeyThreshold(mainConfig.MaskedFractionLuma, m_lastThresholds.fractionLuma);
+
+		if (bChromaChanged || bLumaChanged)
+		{
+			m_configManager->ConfigUpdated();
+		}
+	}
+
 	if (!m_bMenuIsVisible)
 	{
 		return;
@@ -157,27 +230,124 @@ void DashboardMenu::TickMenu()
 
 
 		ImGui::Text("Resolution: %i x %i", m_displayValues.frameBufferWidth, m_displayValues.frameBufferHeight);
+		ImGui::Text("Render target: %.1f pixels/degree, %.0f%% of camera sized pixels", m_displayValues.renderPixelsPerDegree, m_displayValues.renderTargetPixelFraction * 100.0f);
 		ImGui::Text("Exposure to render latency: %.1fms", m_displayValues.frameToRenderLatencyMS);
 		ImGui::Text("Exposure to photons latency: %.1fms", m_displayValues.frameToPhotonsLatencyMS);
 		ImGui::Text("Passthrough CPU render duration: %.2fms", m_displayValues.renderTimeMS);
+		ImGui::Text("Passthrough GPU duration: %.2fms at %.0f%% resolution", m_displayValues.gpuRenderTimeMS, m_displayValues.resolutionScale * 100.0f);
+		ImGui::Text("Warp mesh CPU duration: %.3fms", m_displayValues.warpMeshTimeMS);
+		ImGui::Text("Pixels outside camera view skipped: %.0f%%", m_displayValues.scissorSkippedFraction * 100.0f);
+		ImGui::Text("Stereo depth CPU duration: %.2fms (%u mismatched frames skipped)", m_displayValues.depthEstimateTimeMS, m_displayValues.depthFramesSkipped);
+		ImGui::Text("Projection distance: %.1fm (%i matches, %.2fms)", m_displayValues.projectionDistance, m_displayValues.projectionEstimateMatches, m_displayValues.projectionEstimateTimeMS);
+		ImGui::Text("Undistortion CPU duration: %.2fms (%.2f MP)", m_displayValues.undistortTimeMS, m_displayValues.undistortedMegapixels);
+		ImGui::Text("Fused undistortion traffic saved: %.1fMB/frame", m_displayValues.undistortSavedMB);
+		ImGui::Text("Config writes: %u (%u avoided), max UI stall %.3fms", m_configManager->GetNumConfigWrites(), m_configManager->GetNumConfigWritesAvoided(), m_configManager->GetMaxCallerStallMS());
+
+		LogStats logStats;
+		GetLogStats(logStats);
+		ImGui::Text("Log: %llu messages (%llu suppressed, %llu dropped), %.2fus enqueue", logStats.numMessages, logStats.numSuppressed, logStats.numDropped, logStats.averageEnqueueUS);
+
+		FlightRecorderStats flightStats;
+		GetFlightRecorderStats(flightStats);
+		ImGui::Text("Flight recorder: %llu events, %llu dropped, %u dumps, %.1fns/event", flightStats.numEvents, flightStats.numDroppedEvents, flightStats.numDumps, flightStats.recordCostNS);
+
+		static const char* qualityTierNames[QualityTier_Count] = { "Full", "No color adjustment", "Reduced detail", "Reprojection only" };
+		WatchdogStats watchdogStats;
+		m_watchdog->GetStats(watchdogStats);
+		ImGui::Text("Quality: %s (%u changes), %u stalls", qualityTierNames[watchdogStats.qualityTier], watchdogStats.numTierChanges, watchdogStats.numStalls);
+		ImGui::Text("Frames over budget: %u of %llu", watchdogStats.numOverruns, watchdogStats.numFrames);
+		float simulatedLoadMS = m_simulatedRenderLoadMS.load(std::memory_order_relaxed);
+		ScrollableSlider("Simulated render load", &simulatedLoadMS, 0.0f, SIMULATED_LOAD_MAX_MS, "%.1fms", 0.5f);
+		m_simulatedRenderLoadMS.store(simulatedLoadMS, std::memory_order_relaxed);
+		if (ImGui::Checkbox("Cycle profiles every frame", &m_bCycleProfiles) && !m_bCycleProfiles)
+		{
+			Log("Profile cycling stopped: %u config switch frames, CPU %.2fms avg, %.2fms max, %.2fms steady\n", m_displayValues.configSwitchFrames, m_displayValues.configSwitchProcessingTimeMS, m_displayValues.configSwitchMaxProcessingTimeMS, m_displayValues.steadyProcessingTimeMS);
+		}
+		ImGui::Text("Config switch frames: %u, CPU %.2fms avg, %.2fms max (%.2fms steady)", m_displayValues.configSwitchFrames, m_displayValues.configSwitchProcessingTimeMS, m_displayValues.configSwitchMaxProcessingTimeMS, m_displayValues.steadyProcessingTimeMS);
 	}
 
 
 	if (ImGui::CollapsingHeader("Main Settings"), ImGuiTreeNodeFlags_DefaultOpen)
 	{
 		ImGui::BeginGroup();
-		ImGui::Checkbox("Start on launch", &mainConfig.EnablePassthoughOnLaunch);
-		ImGui::Checkbox("Show Test Image", &mainConfig.ShowTestImage);
+
+		// The profile list is replaced when modified, so changes are applied after it is no longer referenced.
+		const ConfigProfileList& profileList = m_configManager->GetProfileList();
+		int activeProfile = profileList.activeProfile;
+		int selectedProfile = -1;
+		bool bSaveProfile = false;
+		bool bDeleteProfile = false;
+
+		std::string profilePreview = (activeProfile >= 0) ? profileList.profiles[activeProfile].name : "None";
+		if (m_configManager->IsActiveProfileModified())
+		{
+			profilePreview += " (modified)";
+		}
+
+		if (ImGui::BeginCombo("Profile", profilePreview.c_str()))
+		{
+			for (int i = 0; i < (int)profileList.profiles.size(); i++)
+			{
+				if (ImGui::Selectable(profileList.profiles[i].name.c_str(), i == activeProfile))
+				{
+					selectedProfile = i;
+				}
+			}
+			ImGui::EndCombo();
+		}
+
+		ImGui::InputText("##ProfileName", m_profileNameBuffer, sizeof(m_profileNameBuffer));
+		ImGui::SameLine();
+		bSaveProfile = ImGui::Button("Save Profile");
+		ImGui::SameLine();
+		if (activeProfile < 0) { ImGui::BeginDisabled(); }
+		bDeleteProfile = ImGui::Button("Delete Profile");
+		if (activeProfile < 0) { ImGui::EndDisabled(); }
+
+		if (selectedProfile >= 0)
+		{
+			m_configManager->ActivateProfile(selectedProfile);
+		}
+		else if (bSaveProfile)
+		{
+			m_configManager->SaveProfile(m_profileNameBuffer);
+		}
+		else if (bDeleteProfile)
+		{
+			m_configManager->DeleteProfile(activeProfile);
+		}
 		ImGui::Separator();
 
-		ScrollableSlider("Projection Dist.", &mainConfig.ProjectionDistanceFar, 0.5f, 20.0f, "%.1f", 0.1f);
-		//ScrollableSlider("Near Projection Distance", &mainConfig.ProjectionDistanceNear, 0.5f, 10.0f, "%.1f", 0.1f);
+		ConfigFieldWidget(mainConfig, "EnablePassthoughOnLaunch");
+		ConfigFieldWidget(mainConfig, "ShowTestImage");
+		ImGui::Separator();
 
-		ScrollableSlider("Opacity", &mainConfig.PassthroughOpacity, 0.0f, 1.0f, "%.1f", 0.1f);
+		ConfigFieldWidget(mainConfig, "AutoProjectionDistance");
+		if (mainConfig.AutoProjectionDistance) { ImGui::BeginDisabled(); }
+		ConfigFieldWidget(mainConfig, "ProjectionDistanceFar");
+		if (mainConfig.AutoProjectionDistance) { ImGui::EndDisabled(); }
+		ConfigFieldWidget(mainConfig, "ProjectionDistanceNear");
+		ConfigFieldWidget(mainConfig, "RollingShutterReadoutMS");
+		ConfigFieldWidget(mainConfig, "WarpMeshCells");
+		ConfigFieldWidget(mainConfig, "EnableStereoDepth");
+		ConfigFieldWidget(mainConfig, "UseDistortedFrames");
+		if (!mainConfig.UseDistortedFrames) { ImGui::BeginDisabled(); }
+		ConfigFieldWidget(mainConfig, "FusedUndistortion");
+		if (!mainConfig.UseDistortedFrames) { ImGui::EndDisabled(); }
+		ConfigFieldWidget(mainConfig, "SyntheticCameraFrames");
+
+		ConfigFieldWidget(mainConfig, "RenderPixelsPerDegree");
+		ConfigFieldWidget(mainConfig, "DynamicResolution");
+		if (!mainConfig.DynamicResolution) { ImGui::BeginDisabled(); }
+		ConfigFieldWidget(mainConfig, "GPUFrameBudgetMS");
+		ConfigFieldWidget(mainConfig, "MinResolutionScale");
+		if (!mainConfig.DynamicResolution) { ImGui::EndDisabled(); }
+
+		ConfigFieldWidget(mainConfig, "PassthroughOpacity");
 		ImGui::Separator();
-		ScrollableSlider("Brightness", &mainConfig.Brightness, -50.0f, 50.0f, "%.0f", 1.0f);
-		ScrollableSlider("Contrast", &mainConfig.Contrast, 0.0f, 2.0f, "%.1f", 0.1f);
-		ScrollableSlider("Saturation", &mainConfig.Saturation, 0.0f, 2.0f, "%.1f", 0.1f);
+		ConfigFieldWidget(mainConfig, "Brightness");
+		ConfigFieldWidget(mainConfig, "Contrast");
+		ConfigFieldWidget(mainConfig, "Saturation");
 		ImGui::EndGroup();
 		
 	}
@@ -199,6 +369,13 @@ void DashboardMenu::TickMenu()
 
 	ImGui::SameLine();
 
+	if (ImGui::Button("Dump Flight Recorder"))
+	{
+		RequestFlightRecorderDump(FlightDump_User);
+	}
+
+	ImGui::SameLine();
+
 	if (ImGui::Button("Shut Down"))
 	{
 		m_bSignalShutdown = true;
@@ -230,11 +407,69 @@ void DashboardMenu::TickMenu()
 		ImGui::EndGroup();
 		ImGui::Separator();
 		ImGui::Text("Masked Croma Key Settings");
-		ScrollableSlider("Chroma Range", &mainConfig.MaskedFractionChroma, 0.0f, 1.0f, "%.2f", 0.01f);
-		ScrollableSlider("Luma Range", &mainConfig.MaskedFractionLuma, 0.0f, 1.0f, "%.2f", 0.01f);
-		ScrollableSlider("Smoothing", &mainConfig.MaskedSmoothing, 0.01f, 0.2f, "%.3f", 0.005f);
+		ConfigFieldWidget(mainConfig, "MaskedFractionChroma");
+		ConfigFieldWidget(mainConfig, "MaskedFractionLuma");
+		ConfigFieldWidget(mainConfig, "MaskedSmoothing");
 		ImGui::ColorEdit3("Key", mainConfig.MaskedKeyColor);
 
+		// All the spaces are baked into the key LUT, so they cost the same to render. They differ in the key shape.
+		ImGui::BeginGroup();
+		ImGui::Text("Key Color Space");
+		if (ImGui::RadioButton("CIELAB", mainConfig.MaskedKeyColorSpace == KeyColorSpace_CIELAB))
+		{
+			mainConfig.MaskedKeyColorSpace = KeyColorSpace_CIELAB;
+		}
+		ImGui::SameLine();
+		if (ImGui::RadioButton("YCbCr", mainConfig.MaskedKeyColorSpace == KeyColorSpace_YCbCr))
+		{
+			mainConfig.MaskedKeyColorSpace = KeyColorSpace_YCbCr;
+		}
+		ImGui::SameLine();
+		if (ImGui::RadioButton("HSV Hue", mainConfig.MaskedKeyColorSpace == KeyColorSpace_HSV))
+		{
+			mainConfig.MaskedKeyColorSpace = KeyColorSpace_HSV;
+		}
+		ImGui::EndGroup();
+
+		// The frame is copied from the masked view, so calibration needs the masked mode active.
+		ImGui::BeginDisabled(mainConfig.PassthroughMode != Masked || m_keyCalibrator->IsCalibrating());
+		if (ImGui::Button("Calibrate Key"))
+		{
+			m_keyCalibrator->RequestCalibration();
+		}
+		ImGui::EndDisabled();
+		ImGui::SameLine();
+		if (m_keyCalibrator->IsCalibrating())
+		{
+			ImGui::Text("Calibrating...");
+		}
+		else if (m_lastCalibration.bSuccess)
+		{
+			ImGui::Text("Key coverage %.0f%%, %.1f ms", m_lastCalibration.keyCoverage * 100.0f, m_lastCalibration.timeMS);
+		}
+
+		ConfigFieldWidget(mainConfig, "MaskedResolutionDivisor");
+		ConfigFieldWidget(mainConfig, "MaskedTemporalSmoothing");
+		ConfigFieldWidget(mainConfig, "MaskedCleanupRadius");
+		if (mainConfig.MaskedKeyColorSpace != KeyColorSpace_CIELAB) { ImGui::BeginDisabled(); }
+		ConfigFieldWidget(mainConfig, "MaskedAutoThresholds");
+		if (mainConfig.MaskedKeyColorSpace != KeyColorSpace_CIELAB) { ImGui::EndDisabled(); }
+		if (mainConfig.MaskedAutoThresholds && m_lastThresholds.bValid)
+		{
+			ImGui::SameLine();
+			ImGui::Text("Target %.2f / %.2f", m_lastThresholds.fractionChroma, m_lastThresholds.fractionLuma);
+		}
+
+		ConfigFieldWidget(mainConfig, "MaskedExtraKeyCount");
+		for (int k = 0; k < std::clamp(mainConfig.MaskedExtraKeyCount, 0, CONFIG_MAX_EXTRA_KEYS); k++)
+		{
+			ImGui::PushID(k);
+			ImGui::ColorEdit3(std::format("Key {}", k + 2).c_str(), mainConfig.MaskedExtraKeyColor[k]);
+			ScrollableSlider("Chroma Range", &mainConfig.MaskedExtraKeyFractionChroma[k], 0.0f, 1.0f, "%.2f", 0.01f);
+			ScrollableSlider("Luma Range", &mainConfig.MaskedExtraKeyFractionLuma[k], 0.0f, 1.0f, "%.2f", 0.01f);
+			ImGui::PopID();
+		}
+
 		ImGui::BeginGroup();
 		ImGui::Text("Chroma Key Source");
 		if (ImGui::RadioButton("VR View", !mainConfig.MaskedUseCameraImage))
@@ -247,15 +482,19 @@ void DashboardMenu::TickMenu()
 		}
 		ImGui::EndGroup();
 
+		// The despill only applies to the camera image.
+		if (!mainConfig.MaskedUseCameraImage) { ImGui::BeginDisabled(); }
+		ConfigFieldWidget(mainConfig, "MaskedDespillStrength");
+		ConfigFieldWidget(mainConfig, "MaskedDespillRange");
+		if (!mainConfig.MaskedUseCameraImage) { ImGui::EndDisabled(); }
+
 
 		ImGui::EndGroup();
 	}
 	ImGui::EndChild();
 
-	if (ImGui::IsAnyItemActive())
-	{
-		m_configManager->ConfigUpdated();
-	}
+	// Publishes the edited config if any value changed this frame.
+	m_configManager->ConfigUpdated();
 
 	ImGui::End();
 
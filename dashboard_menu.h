@@ -2,8 +2,12 @@
 #pragma once
 
 #include <thread>
+#include <atomic>
 #include "config_manager.h"
 #include "openvr_manager.h"
+#include "watchdog.h"
+#include "key_calibration.h"
+#include "key_threshold_tuner.h"
 
 
 using Microsoft::WRL::ComPtr;
@@ -14,6 +18,12 @@ using Microsoft::WRL::ComPtr;
 #define OVERLAY_RES_WIDTH 800
 #define OVERLAY_RES_HEIGHT 420
 
+// Pressed together with Ctrl to switch to the next saved profile.
+#define PROFILE_HOTKEY VK_F9
+
+// Upper limit of the simulated render load used to test the quality tiers.
+#define SIMULATED_LOAD_MAX_MS 20.0f
+
 
 
 struct MenuDisplayValues
@@ -23,7 +33,27 @@ struct MenuDisplayValues
 
 	float frameToRenderLatencyMS = 0.0f;
 	float frameToPhotonsLatencyMS = 0.0f;
+	float renderPixelsPerDegree = 0.0f;
+	float renderTargetPixelFraction = 1.0f;
 	float renderTimeMS = 0.0f;
+	float gpuRenderTimeMS = 0.0f;
+	float resolutionScale = 1.0f;
+	float warpMeshTimeMS = 0.0f;
+	float scissorSkippedFraction = 0.0f;
+	float depthEstimateTimeMS = 0.0f;
+	uint32_t depthFramesSkipped = 0;
+	float projectionDistance = 0.0f;
+	float projectionEstimateTimeMS = 0.0f;
+	int projectionEstimateMatches = 0;
+	float undistortTimeMS = 0.0f;
+	float undistortedMegapixels = 0.0f;
+	float undistortSavedMB = 0.0f;
+
+	// CPU frame processing time of the frames applying a config change, such as a profile switch, and of the others.
+	uint32_t configSwitchFrames = 0;
+	float configSwitchProcessingTimeMS = 0.0f;
+	float configSwitchMaxProcessingTimeMS = 0.0f;
+	float steadyProcessingTimeMS = 0.0f;
 };
 
 
@@ -31,7 +61,7 @@ class DashboardMenu
 {
 public:
 
-	DashboardMenu(std::shared_ptr<ConfigManager> configManager, std::shared_ptr<OpenVRManager> openVRManager);
+	DashboardMenu(std::shared_ptr<ConfigManager> configManager, std::shared_ptr<OpenVRManager> openVRManager, std::shared_ptr<Watchdog> watchdog, std::shared_ptr<KeyCalibrator> keyCalibrator, std::shared_ptr<KeyThresholdTuner> keyThresholdTuner);
 
 	~DashboardMenu();
 	
@@ -39,6 +69,7 @@ public:
 
 	inline bool IsPassthroughEnabled() const { return m_bPassthroughEnabled; }
 	inline bool IsShutdownSignaled() const { return m_bSignalShutdown; }
+	inline float GetSimulatedRenderLoadMS() const { return m_simulatedRenderLoadMS.load(std::memory_order_relaxed); }
 
 	inline bool IsCaptureSignaled()
 	{
@@ -64,6 +95,11 @@ private:
 
 	std::shared_ptr<ConfigManager> m_configManager;
 	std::shared_ptr<OpenVRManager> m_openVRManager;
+	std::shared_ptr<Watchdog> m_watchdog;
+	std::shared_ptr<KeyCalibrator> m_keyCalibrator;
+	KeyCalibrationResult m_lastCalibration;
+	std::shared_ptr<KeyThresholdTuner> m_keyThresholdTuner;
+	KeyThresholdResult m_lastThresholds;
 	HMODULE m_dllModule;
 
 	vr::VROverlayHandle_t m_overlayHandle;
@@ -78,6 +114,12 @@ private:
 	ComPtr<ID3D11RenderTargetView> m_d3d11RTV;
 
 	bool m_bMenuIsVisible;
+	bool m_bProfileHotkeyDown = false;
+	char m_profileNameBuffer[CONFIG_PROFILE_MAX_NAME_LENGTH + 1] = {};
+	// Not saved, so an overload test doesn't carry over to the next session. Read by the render thread.
+	std::atomic<float> m_simulatedRenderLoadMS = 0.0f;
+	// Stress test switching to the next profile on every menu tick, which follows the display frame rate.
+	bool m_bCycleProfiles = false;
 	MenuDisplayValues m_displayValues;
 
 	bool m_bPassthroughEnabled;
@@ -0,0 +1,261 @@
+
+#include "pch.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "flight_recorder.h"
+#include "logging.h"
+
+#define FLIGHT_RECORDER_CALIBRATION_EVENTS 100000
+
+// Set in the slot sequence while a writer owns the slot.
+#define FLIGHT_EVENT_WRITING (1ull << 63)
+
+
+struct FlightEventSlot
+{
+	// Index of the event plus one, with the writing bit set while it is being written.
+	std::atomic<uint64_t> sequence;
+	uint64_t timestamp;
+	uint32_t threadId;
+	uint32_t data32;
+	uint64_t data64;
+	uint16_t type;
+};
+
+
+static FlightEventSlot g_flightEvents[FLIGHT_RECORDER_EVENTS];
+static std::atomic<uint64_t> g_flightWriteIndex = 0;
+static std::atomic<uint64_t> g_numDroppedEvents = 0;
+
+static std::wstring g_dumpFilePrefix;
+static std::thread g_dumpThread;
+static std::mutex g_dumpMutex;
+static std::condition_variable g_dumpCondition;
+static bool g_bRunDumpThread = false;
+static EFlightDumpReason g_pendingDumpReason = FlightDump_None;
+static std::atomic<int64_t> g_lastDumpTime = INT64_MIN;
+static std::atomic<uint32_t> g_numDumps = 0;
+static float g_recordCostNS = 0.0f;
+
+
+void RecordFlightEvent(const EFlightEventType type, const uint32_t data32, const uint64_t data64)
+{
+	LARGE_INTEGER timestamp;
+	QueryPerformanceCounter(&timestamp);
+
+	uint64_t index = g_flightWriteIndex.fetch_add(1, std::memory_order_relaxed);
+	FlightEventSlot& slot = g_flightEvents[index % FLIGHT_RECORDER_EVENTS];
+
+	// A writer that finds its slot being written or holding a later event has been lapped by the whole
+	// ring while it was preempted. It drops its event, rather than overwrite or tear the other one.
+	uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+	do
+	{
+		if ((sequence & FLIGHT_EVENT_WRITING) || sequence > index)
+		{
+			g_numDroppedEvents.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+	while (!slot.sequence.compare_exchange_weak(sequence, (index + 1) | FLIGHT_EVENT_WRITING, std::memory_order_relaxed));
+
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot.timestamp = timestamp.QuadPart;
+	slot.threadId = GetCurrentThreadId();
+	slot.data32 = data32;
+	slot.data64 = data64;
+	slot.type = type;
+
+	slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+
+// Copies the ring while writers keep recording, skipping slots that were overwritten during the copy.
+void CopyFlightEvents(std::vector<FlightEvent>& outEvents)
+{
+	uint64_t endIndex = g_flightWriteIndex.load(std::memory_order_acquire);
+	uint64_t startIndex = (endIndex > FLIGHT_RECORDER_EVENTS) ? endIndex - FLIGHT_RECORDER_EVENTS : 0;
+
+	outEvents.clear();
+	outEvents.reserve(endIndex - startIndex);
+
+	for (uint64_t index = startIndex; index < endIndex; index++)
+	{
+		const FlightEventSlot& slot = g_flightEvents[index % FLIGHT_RECORDER_EVENTS];
+
+		if (slot.sequence.load(std::memory_order_acquire) != index + 1) { continue; }
+
+		FlightEvent event = {};
+		event.timestamp = slot.timestamp;
+		event.index = (uint32_t)index;
+		event.type = slot.type;
+		event.threadId = slot.threadId;
+		event.data32 = slot.data32;
+		event.data64 = slot.data64;
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) != index + 1) { continue; }
+
+		outEvents.push_back(event);
+	}
+}
+
+
+static void WriteDump(const EFlightDumpReason reason)
+{
+	LARGE_INTEGER perfFrequency;
+	LARGE_INTEGER dumpTime;
+	QueryPerformanceFrequency(&perfFrequency);
+	QueryPerformanceCounter(&dumpTime);
+
+	std::vector<FlightEvent> events;
+	CopyFlightEvents(events);
+
+	FlightDumpHeader header = {};
+	header.magic = FLIGHT_RECORDER_MAGIC;
+	header.version = FLIGHT_RECORDER_VERSION;
+	header.perfFrequency = perfFrequency.QuadPart;
+	header.dumpTimestamp = dumpTime.QuadPart;
+	header.reason = reason;
+	header.numEvents = (uint32_t)events.size();
+
+	std::time_t time = std::time(nullptr);
+	std::tm localTime;
+	localtime_s(&localTime, &time);
+
+	std::wstringstream fileName;
+	fileName << g_dumpFilePrefix << std::put_time(&localTime, L"%Y%m%d_%H%M%S") << L".bin";
+
+	PWSTR appdataPath;
+	SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL, &appdataPath);
+	std::filesystem::path filePath = std::filesystem::path(appdataPath) / fileName.str();
+	CoTaskMemFree(appdataPath);
+
+	std::ofstream file(filePath, std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+	{
+		ErrorLog("Failed to open flight recorder dump file\n");
+		return;
+	}
+
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)events.data(), events.size() * sizeof(FlightEvent));
+
+	if (!file.good())
+	{
+		ErrorLog("Failed to write flight recorder dump\n");
+		return;
+	}
+
+	g_numDumps++;
+	Log("Flight recorder dumped %u events, reason %u\n", header.numEvents, (uint32_t)reason);
+}
+
+
+static void DumpThread()
+{
+	std::unique_lock<std::mutex> lock(g_dumpMutex);
+
+	while (true)
+	{
+		g_dumpCondition.wait(lock, [] { return g_pendingDumpReason != FlightDump_None || !g_bRunDumpThread; });
+
+		if (!g_bRunDumpThread)
+		{
+			return;
+		}
+
+		EFlightDumpReason reason = g_pendingDumpReason;
+		g_pendingDumpReason = FlightDump_None;
+
+		lock.unlock();
+		WriteDump(reason);
+		lock.lock();
+	}
+}
+
+
+void RequestFlightRecorderDump(const EFlightDumpReason reason)
+{
+	RecordFlightEvent(FlightEvent_DumpRequested, reason);
+
+	int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+	int64_t lastDump = g_lastDumpTime.load(std::memory_order_relaxed);
+	int64_t minInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(FLIGHT_RECORDER_MIN_DUMP_INTERVAL).count();
+
+	// Errors and stalls tend to come in bursts, only the first one of a burst is dumped.
+	if (reason != FlightDump_User && lastDump != INT64_MIN && now - lastDump < minInterval)
+	{
+		return;
+	}
+
+	if (!g_lastDumpTime.compare_exchange_strong(lastDump, now, std::memory_order_relaxed) && reason != FlightDump_User)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_dumpMutex);
+		if (!g_bRunDumpThread) { return; }
+		g_pendingDumpReason = reason;
+	}
+	g_dumpCondition.notify_one();
+}
+
+
+// Measures the recording cost before any other thread starts recording, then clears the calibration events.
+void InitFlightRecorder(std::wstring filePrefix)
+{
+	g_dumpFilePrefix = filePrefix;
+
+	LARGE_INTEGER perfFrequency;
+	LARGE_INTEGER startTime;
+	LARGE_INTEGER endTime;
+	QueryPerformanceFrequency(&perfFrequency);
+	QueryPerformanceCounter(&startTime);
+
+	for (uint32_t i = 0; i < FLIGHT_RECORDER_CALIBRATION_EVENTS; i++)
+	{
+		RecordFlightEvent(FlightEvent_None, i);
+	}
+
+	QueryPerformanceCounter(&endTime);
+	g_recordCostNS = (endTime.QuadPart - startTime.QuadPart) * 1000000000.0f / perfFrequency.QuadPart / FLIGHT_RECORDER_CALIBRATION_EVENTS;
+
+	for (FlightEventSlot& slot : g_flightEvents)
+	{
+		slot.sequence.store(0, std::memory_order_relaxed);
+	}
+	g_flightWriteIndex.store(0, std::memory_order_release);
+	g_numDroppedEvents.store(0, std::memory_order_relaxed);
+
+	Log("Flight recorder started, %.1fns per event\n", g_recordCostNS);
+
+	std::lock_guard<std::mutex> lock(g_dumpMutex);
+	g_bRunDumpThread = true;
+	g_dumpThread = std::thread(DumpThread);
+}
+
+void ShutdownFlightRecorder()
+{
+	{
+		std::lock_guard<std::mutex> lock(g_dumpMutex);
+		g_bRunDumpThread = false;
+	}
+	g_dumpCondition.notify_all();
+
+	if (g_dumpThread.joinable())
+	{
+		g_dumpThread.join();
+	}
+}
+
+void GetFlightRecorderStats(FlightRecorderStats& outStats)
+{
+	outStats.numEvents = g_flightWriteIndex.load(std::memory_order_relaxed);
+	outStats.numDroppedEvents = g_numDroppedEvents.load(std::memory_order_relaxed);
+	outStats.numDumps = g_numDumps;
+	outStats.recordCostNS = g_recordCostNS;
+}
@@ -0,0 +1,96 @@
+
+#pragma once
+
+
+// Number of events kept in memory, a power of two. At the usual few hundred events per second this covers minutes.
+#define FLIGHT_RECORDER_EVENTS 65536
+
+// Automatic dumps are skipped if one was written less than this long ago.
+#define FLIGHT_RECORDER_MIN_DUMP_INTERVAL (std::chrono::seconds(10))
+
+#define FLIGHT_RECORDER_MAGIC 0x52464C46
+#define FLIGHT_RECORDER_VERSION 1
+
+
+// The values are stored in the dump files, tools/decode_flight_recorder.py mirrors these enums.
+enum EFlightEventType : uint16_t
+{
+	FlightEvent_None = 0,
+	FlightEvent_ServeWake,
+	FlightEvent_FrameServed,
+	FlightEvent_RenderStart,
+	FlightEvent_RenderEnd,
+	FlightEvent_FrameSubmitted,
+	FlightEvent_OpenVRError,
+	FlightEvent_ConfigGeneration,
+	FlightEvent_ErrorLogged,
+	FlightEvent_Stall,
+	FlightEvent_DumpRequested,
+	FlightEvent_QualityTier
+};
+
+enum EFlightEventSource : uint32_t
+{
+	FlightSource_None = 0,
+	FlightSource_FrameHeader,
+	FlightSource_FrameTexture,
+	FlightSource_FrameBuffer,
+	FlightSource_OverlaySubmit,
+	FlightSource_RenderThread,
+	FlightSource_ServeThread,
+	FlightSource_DashboardThread
+};
+
+enum EFlightDumpReason : uint32_t
+{
+	FlightDump_None = 0,
+	FlightDump_Error,
+	FlightDump_Stall,
+	FlightDump_User
+};
+
+
+// Layout of the events in the dump files.
+struct FlightEvent
+{
+	uint64_t timestamp;
+	uint32_t index;
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t threadId;
+	uint32_t data32;
+	uint64_t data64;
+};
+
+struct FlightDumpHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t perfFrequency;
+	uint64_t dumpTimestamp;
+	uint32_t reason;
+	uint32_t numEvents;
+};
+
+struct FlightRecorderStats
+{
+	uint64_t numEvents;
+	uint64_t numDroppedEvents;
+	uint32_t numDumps;
+	float recordCostNS;
+};
+
+
+void InitFlightRecorder(std::wstring filePrefix);
+void ShutdownFlightRecorder();
+
+// Safe to call from any thread, costing an atomic increment and a timestamp.
+void RecordFlightEvent(const EFlightEventType type, const uint32_t data32 = 0, const uint64_t data64 = 0);
+
+// Copies the recorded events still in memory in recording order, without stopping the recording threads.
+void CopyFlightEvents(std::vector<FlightEvent>& outEvents);
+
+// Writes the recorded events to disk from a background thread.
+void RequestFlightRecorderDump(const EFlightDumpReason reason);
+
+void GetFlightRecorderStats(FlightRecorderStats& outStats);
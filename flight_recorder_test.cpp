@@ -0,0 +1,154 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "flight_recorder.h"
+
+
+#define SELF_TEST_FLIGHT_THREADS 4
+
+// Each thread wraps the ring once, so the copies race the slots being overwritten.
+#define SELF_TEST_FLIGHT_EVENTS_PER_THREAD FLIGHT_RECORDER_EVENTS
+
+// Events each thread records between yields, minus one.
+#define SELF_TEST_FLIGHT_YIELD_MASK 1023
+
+// Marks the events of the check apart from the events other threads may be recording.
+#define SELF_TEST_FLIGHT_MARKER 0x5E1F0000
+
+
+// Checks a copy of the ring: the indices follow the recording order, and the events of the check
+// are whole, with each thread's sequence and timestamps increasing. Returns the number of errors.
+static uint32_t CheckFlightEvents(const std::vector<FlightEvent>& events)
+{
+	uint32_t numErrors = 0;
+	int64_t lastSequence[SELF_TEST_FLIGHT_THREADS];
+	uint64_t lastTimestamp[SELF_TEST_FLIGHT_THREADS] = {};
+	std::fill(lastSequence, lastSequence + SELF_TEST_FLIGHT_THREADS, -1);
+
+	if (events.size() > FLIGHT_RECORDER_EVENTS)
+	{
+		numErrors++;
+	}
+
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		const FlightEvent& event = events[i];
+
+		if (i > 0 && event.index <= events[i - 1].index)
+		{
+			numErrors++;
+		}
+
+		if (event.type != FlightEvent_None || (event.data32 & 0xFFFF0000) != SELF_TEST_FLIGHT_MARKER)
+		{
+			continue;
+		}
+
+		// A torn event would mix the fields of two records.
+		uint32_t thread = event.data32 & 0xFFFF;
+		if (thread >= SELF_TEST_FLIGHT_THREADS || (event.data64 >> 32) != event.data32)
+		{
+			numErrors++;
+			continue;
+		}
+
+		int64_t sequence = (int64_t)(event.data64 & 0xFFFFFFFF);
+		if (sequence <= lastSequence[thread] || event.timestamp < lastTimestamp[thread])
+		{
+			numErrors++;
+		}
+
+		lastSequence[thread] = sequence;
+		lastTimestamp[thread] = event.timestamp;
+	}
+
+	return numErrors;
+}
+
+
+// Records from several threads at once while copying the ring, as the dumps do, and checks every copy.
+// Also times the recording from a single thread.
+bool TestFlightRecorder()
+{
+	// Cost of recording from a single thread, timed apart from the threads below, which yield while recording.
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+
+	for (uint32_t i = 0; i < SELF_TEST_FLIGHT_EVENTS_PER_THREAD; i++)
+	{
+		RecordFlightEvent(FlightEvent_None, i);
+	}
+
+	float recordCostNS = GetElapsedMS(startTime) * 1000000.0f / SELF_TEST_FLIGHT_EVENTS_PER_THREAD;
+
+	std::atomic<bool> bRecording = true;
+	std::atomic<uint32_t> numRunning = SELF_TEST_FLIGHT_THREADS;
+
+	auto recorder = [&](const uint32_t thread)
+	{
+		const uint32_t data32 = SELF_TEST_FLIGHT_MARKER | thread;
+
+		for (uint32_t i = 0; i < SELF_TEST_FLIGHT_EVENTS_PER_THREAD; i++)
+		{
+			RecordFlightEvent(FlightEvent_None, data32, ((uint64_t)data32 << 32) | i);
+
+			// Both sides yield to interleave even on a single core.
+			if ((i & SELF_TEST_FLIGHT_YIELD_MASK) == 0)
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		if (--numRunning == 0)
+		{
+			bRecording = false;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (uint32_t i = 0; i < SELF_TEST_FLIGHT_THREADS; i++)
+	{
+		threads.emplace_back(recorder, i);
+	}
+
+	std::vector<FlightEvent> events;
+	uint32_t numCopies = 0;
+	uint32_t numErrors = 0;
+
+	// Only the copies made while the events of the check are being recorded count.
+	while (bRecording)
+	{
+		CopyFlightEvents(events);
+		numErrors += CheckFlightEvents(events);
+
+		if (bRecording && !events.empty() && (events.back().data32 & 0xFFFF0000) == SELF_TEST_FLIGHT_MARKER)
+		{
+			numCopies++;
+		}
+
+		std::this_thread::yield();
+	}
+
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	// Once the writers are done, the ring holds the last events, less any dropped by writers lapped by the ring.
+	FlightRecorderStats stats;
+	GetFlightRecorderStats(stats);
+	CopyFlightEvents(events);
+	numErrors += CheckFlightEvents(events);
+
+	bool bFull = events.size() + stats.numDroppedEvents >= FLIGHT_RECORDER_EVENTS && !events.empty() && events.back().index >= (uint32_t)(stats.numEvents - 1);
+
+	Log("Flight recorder: %u copies during recording from %u threads, %u errors, %llu events dropped, %.1f ns per event\n",
+		numCopies, SELF_TEST_FLIGHT_THREADS, numErrors, (unsigned long long)stats.numDroppedEvents, recordCostNS);
+
+	return numErrors == 0 && bFull && numCopies > 0;
+}
+
+#endif
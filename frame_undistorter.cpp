@@ -0,0 +1,244 @@
+
+#include "pch.h"
+#include "frame_undistorter.h"
+#include "logging.h"
+#include <emmintrin.h>
+
+
+FrameUndistorter::FrameUndistorter(const uint32_t numThreads)
+	: m_workerPool(numThreads)
+{
+}
+
+
+bool FrameUndistorter::BuildRemapTable(const uint32_t frameWidth, const uint32_t frameHeight, const EStereoFrameLayout layout, const CameraDistortionParameters cameraParams[2])
+{
+	uint32_t numEyes = (layout == Mono) ? 1 : 2;
+	uint32_t eyeWidth = (layout == StereoHorizontalLayout) ? frameWidth / 2 : frameWidth;
+	uint32_t eyeHeight = (layout == StereoVerticalLayout) ? frameHeight / 2 : frameHeight;
+
+	if (eyeWidth < 2 || eyeHeight < 2)
+	{
+		return false;
+	}
+
+	for (uint32_t eye = 0; eye < numEyes; eye++)
+	{
+		if (cameraParams[eye].function != vr::VRDistortionFunctionType_None &&
+			cameraParams[eye].function != vr::VRDistortionFunctionType_FTheta)
+		{
+			ErrorLog("Unsupported camera distortion function %i\n", cameraParams[eye].function);
+			return false;
+		}
+
+		if (cameraParams[eye].sourceFocalLength.v[0] <= 0.0f || cameraParams[eye].targetFocalLength.v[0] <= 0.0f)
+		{
+			ErrorLog("Invalid camera intrinsics for undistortion\n");
+			return false;
+		}
+	}
+
+	m_frameWidth = frameWidth;
+	m_frameHeight = frameHeight;
+	m_cameraParams[0] = cameraParams[0];
+	m_cameraParams[1] = cameraParams[numEyes - 1];
+	m_remapTable.resize(frameWidth * frameHeight);
+
+	const float fractionScale = (float)(1 << UNDISTORT_FRACTION_BITS);
+
+	for (uint32_t eye = 0; eye < numEyes; eye++)
+	{
+		// The vertical layout has the left camera at the bottom.
+		uint32_t offsetX = (layout == StereoHorizontalLayout && eye == 1) ? eyeWidth : 0;
+		uint32_t offsetY = (layout == StereoVerticalLayout && eye == 0) ? eyeHeight : 0;
+
+		for (uint32_t y = 0; y < eyeHeight; y++)
+		{
+			for (uint32_t x = 0; x < eyeWidth; x++)
+			{
+				RemapEntry& entry = m_remapTable[(offsetY + y) * frameWidth + offsetX + x];
+
+				float sourceX, sourceY;
+				if (!DistortPoint(cameraParams[eye], x + 0.5f, y + 0.5f, sourceX, sourceY))
+				{
+					entry.sourceOffset = UNDISTORT_INVALID_OFFSET;
+					continue;
+				}
+
+				// Move from pixel centers to the top left of the bilinear footprint.
+				sourceX -= 0.5f;
+				sourceY -= 0.5f;
+
+				if (sourceX < -0.5f || sourceY < -0.5f || sourceX > eyeWidth - 0.5f || sourceY > eyeHeight - 0.5f)
+				{
+					entry.sourceOffset = UNDISTORT_INVALID_OFFSET;
+					continue;
+				}
+
+				// Keep the footprint inside the eye so the kernel never reads the other view.
+				sourceX = std::clamp(sourceX, 0.0f, eyeWidth - 1.0f);
+				sourceY = std::clamp(sourceY, 0.0f, eyeHeight - 1.0f);
+
+				uint32_t baseX = std::min((uint32_t)sourceX, eyeWidth - 2);
+				uint32_t baseY = std::min((uint32_t)sourceY, eyeHeight - 2);
+
+				entry.sourceOffset = ((offsetY + baseY) * frameWidth + offsetX + baseX) * 4;
+				entry.fractionX = (uint16_t)std::min((sourceX - baseX) * fractionScale + 0.5f, fractionScale);
+				entry.fractionY = (uint16_t)std::min((sourceY - baseY) * fractionScale + 0.5f, fractionScale);
+			}
+		}
+	}
+
+	return true;
+}
+
+
+bool FrameUndistorter::DistortPoint(const CameraDistortionParameters& params, const float x, const float y, float& outX, float& outY)
+{
+	float normX = (x - params.targetCenter.v[0]) / params.targetFocalLength.v[0];
+	float normY = (y - params.targetCenter.v[1]) / params.targetFocalLength.v[1];
+
+	if (params.function == vr::VRDistortionFunctionType_FTheta)
+	{
+		// Equidistant fisheye model: theta_d = theta * (1 + k1 * theta^2 + k2 * theta^4 + k3 * theta^6 + k4 * theta^8)
+		float radius = sqrtf(normX * normX + normY * normY);
+
+		if (radius > 1e-6f)
+		{
+			float theta = atanf(radius);
+			float theta2 = theta * theta;
+			const float* k = params.coefficients;
+			float thetaDistorted = theta * (1.0f + theta2 * (k[0] + theta2 * (k[1] + theta2 * (k[2] + theta2 * k[3]))));
+
+			if (thetaDistorted <= 0.0f)
+			{
+				return false;
+			}
+
+			float scale = thetaDistorted / radius;
+			normX *= scale;
+			normY *= scale;
+		}
+	}
+
+	outX = normX * params.sourceFocalLength.v[0] + params.sourceCenter.v[0];
+	outY = normY * params.sourceFocalLength.v[1] + params.sourceCenter.v[1];
+
+	return true;
+}
+
+
+// The distorted UVs are interpolated linearly between the vertices instead of perspective correct,
+// which is accurate enough at the mesh resolution since the lens distortion dominates.
+void FrameUndistorter::DistortWarpMesh(std::vector<WarpMeshVertex>& mesh, const ERenderEye eye)
+{
+	if (m_remapTable.empty()) { return; }
+
+	const CameraDistortionParameters& params = m_cameraParams[(eye == RIGHT_EYE) ? 1 : 0];
+
+	for (WarpMeshVertex& vertex : mesh)
+	{
+		float w = vertex.uvCoords.z;
+		if (fabsf(w) < 0.0001f)
+		{
+			w = (w < 0.0f) ? -0.0001f : 0.0001f;
+		}
+
+		// Same transform as the pixel shaders, giving the UVs in the undistorted image of the eye.
+		float u = std::clamp(vertex.uvCoords.x / w * -0.5f + 0.5f, 0.0f, 0.5f);
+		float v = std::clamp(vertex.uvCoords.y / w * -0.5f + 0.5f, 0.0f, 1.0f);
+
+		float sourceX = u * m_frameWidth;
+		float sourceY = v * m_frameHeight;
+		DistortPoint(params, u * m_frameWidth, v * m_frameHeight, sourceX, sourceY);
+
+		// Encode the raw frame UVs so the pixel shader transform passes them through unchanged.
+		vertex.uvCoords = Vector3(1.0f - 2.0f * sourceX / m_frameWidth, 1.0f - 2.0f * sourceY / m_frameHeight, 1.0f);
+	}
+}
+
+
+void FrameUndistorter::Undistort(const uint8_t* source, uint8_t* dest, const FrameRect* regions, const uint32_t numRegions)
+{
+	if (m_remapTable.empty()) { return; }
+
+	LARGE_INTEGER perfFrequency;
+	LARGE_INTEGER startTime;
+	QueryPerformanceFrequency(&perfFrequency);
+	QueryPerformanceCounter(&startTime);
+
+	m_tiles.clear();
+	uint32_t numPixels = 0;
+
+	for (uint32_t i = 0; i < numRegions; i++)
+	{
+		uint32_t right = std::min(regions[i].right, m_frameWidth);
+		uint32_t bottom = std::min(regions[i].bottom, m_frameHeight);
+
+		for (uint32_t tileY = regions[i].top; tileY < bottom; tileY += UNDISTORT_TILE_HEIGHT)
+		{
+			for (uint32_t tileX = regions[i].left; tileX < right; tileX += UNDISTORT_TILE_WIDTH)
+			{
+				FrameRect tile;
+				tile.left = tileX;
+				tile.top = tileY;
+				tile.right = std::min(tileX + UNDISTORT_TILE_WIDTH, right);
+				tile.bottom = std::min(tileY + UNDISTORT_TILE_HEIGHT, bottom);
+				m_tiles.push_back(tile);
+
+				numPixels += (tile.right - tile.left) * (tile.bottom - tile.top);
+			}
+		}
+	}
+
+	m_workerPool.ParallelFor((uint32_t)m_tiles.size(), [&](uint32_t job)
+	{
+		RemapTile(source, dest, m_tiles[job]);
+	});
+
+	LARGE_INTEGER endTime;
+	QueryPerformanceCounter(&endTime);
+
+	float remapTime = (float)(endTime.QuadPart - startTime.QuadPart);
+	remapTime *= 1000.0f;
+	remapTime /= perfFrequency.QuadPart;
+	m_lastRemapTimeMS = remapTime;
+	m_lastRemappedPixels = numPixels;
+}
+
+
+// Bilinear filters one RGBA pixel per iteration, with both source texels of a row in one register.
+void FrameUndistorter::RemapTile(const uint8_t* source, uint8_t* dest, const FrameRect& tile)
+{
+	const uint32_t sourcePitch = m_frameWidth * 4;
+	const __m128i zero = _mm_setzero_si128();
+
+	for (uint32_t y = tile.top; y < tile.bottom; y++)
+	{
+		const RemapEntry* entry = &m_remapTable[y * m_frameWidth + tile.left];
+		uint32_t* outPixel = (uint32_t*)(dest + (y * m_frameWidth + tile.left) * 4);
+
+		for (uint32_t x = tile.left; x < tile.right; x++, entry++, outPixel++)
+		{
+			if (entry->sourceOffset == UNDISTORT_INVALID_OFFSET)
+			{
+				*outPixel = 0;
+				continue;
+			}
+
+			const uint8_t* sourcePixel = source + entry->sourceOffset;
+
+			__m128i top = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)sourcePixel), zero);
+			__m128i bottom = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(sourcePixel + sourcePitch)), zero);
+
+			__m128i weightY = _mm_set1_epi16((short)entry->fractionY);
+			__m128i column = _mm_add_epi16(top, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(bottom, top), weightY), UNDISTORT_FRACTION_BITS));
+
+			__m128i columnRight = _mm_srli_si128(column, 8);
+			__m128i weightX = _mm_set1_epi16((short)entry->fractionX);
+			__m128i result = _mm_add_epi16(column, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(columnRight, column), weightX), UNDISTORT_FRACTION_BITS));
+
+			*outPixel = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(result, result));
+		}
+	}
+}
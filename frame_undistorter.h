@@ -0,0 +1,84 @@
+
+#pragma once
+
+#include "shared_structs.h"
+#include "worker_pool.h"
+
+
+#define UNDISTORT_TILE_WIDTH 64
+#define UNDISTORT_TILE_HEIGHT 32
+
+// Fractional bits of the bilinear weights, chosen so the 16 bit SIMD products can't overflow.
+#define UNDISTORT_FRACTION_BITS 7
+#define UNDISTORT_INVALID_OFFSET UINT32_MAX
+
+
+struct CameraDistortionParameters
+{
+	vr::EVRDistortionFunctionType function = vr::VRDistortionFunctionType_None;
+	float coefficients[vr::k_unMaxDistortionFunctionParameters] = {};
+
+	// Intrinsics in pixels of a single camera image, for the distorted source and undistorted output.
+	vr::HmdVector2_t sourceFocalLength = {};
+	vr::HmdVector2_t sourceCenter = {};
+	vr::HmdVector2_t targetFocalLength = {};
+	vr::HmdVector2_t targetCenter = {};
+};
+
+
+// Pixel rectangle in a full frame, right and bottom exclusive.
+struct FrameRect
+{
+	uint32_t left = 0;
+	uint32_t top = 0;
+	uint32_t right = 0;
+	uint32_t bottom = 0;
+};
+
+
+struct RemapEntry
+{
+	// Byte offset of the top left source pixel of the bilinear footprint.
+	uint32_t sourceOffset;
+	uint16_t fractionX;
+	uint16_t fractionY;
+};
+
+
+// Undistorts raw RGBA camera frames on the CPU using a precomputed remap table,
+// producing the same image SteamVR outputs for the undistorted frame type.
+class FrameUndistorter
+{
+public:
+
+	FrameUndistorter(const uint32_t numThreads);
+
+	bool BuildRemapTable(const uint32_t frameWidth, const uint32_t frameHeight, const EStereoFrameLayout layout, const CameraDistortionParameters cameraParams[2]);
+
+	// Remaps the given regions of the frame, leaving the rest of the destination untouched.
+	void Undistort(const uint8_t* source, uint8_t* dest, const FrameRect* regions, const uint32_t numRegions);
+
+	// Moves the warp mesh UVs from the undistorted to the raw frame, so that the frame is only resampled once.
+	void DistortWarpMesh(std::vector<WarpMeshVertex>& mesh, const ERenderEye eye);
+
+	float GetLastRemapTimeMS() const { return m_lastRemapTimeMS; }
+	uint32_t GetLastRemappedPixels() const { return m_lastRemappedPixels; }
+
+	// Maps an undistorted output pixel to the distorted source image of the same camera.
+	static bool DistortPoint(const CameraDistortionParameters& params, const float x, const float y, float& outX, float& outY);
+
+private:
+
+	void RemapTile(const uint8_t* source, uint8_t* dest, const FrameRect& tile);
+
+	WorkerPool m_workerPool;
+
+	uint32_t m_frameWidth = 0;
+	uint32_t m_frameHeight = 0;
+	CameraDistortionParameters m_cameraParams[2];
+	std::vector<RemapEntry> m_remapTable;
+	std::vector<FrameRect> m_tiles;
+
+	float m_lastRemapTimeMS = 0.0f;
+	uint32_t m_lastRemappedPixels = 0;
+};
@@ -0,0 +1,253 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "frame_undistorter.h"
+#include "warp_mesh.h"
+
+
+// Size of each eye of the synthetic fisheye frames, in the horizontal stereo layout.
+#define SELF_TEST_FISHEYE_WIDTH 960
+#define SELF_TEST_FISHEYE_HEIGHT 960
+
+#define SELF_TEST_UNDISTORT_ITERATIONS 20
+#define SELF_TEST_UNDISTORT_SAMPLES 100000
+
+// Sizes of the eyes for the fused undistortion check, of the raw frame and the rendered output.
+#define SELF_TEST_FUSED_EYE_SIZE 320
+#define SELF_TEST_FUSED_OUTPUT_SIZE 256
+
+// The fused mesh interpolates the distorted UVs linearly within the cells, while the two pass render
+// resamples the image twice, so they may differ by this many levels away from the image edges.
+#define SELF_TEST_FUSED_MAX_ERROR 3.0f
+
+// The two fixed point interpolations of the remap each truncate up to a level, on top of the rounded weights.
+#define SELF_TEST_UNDISTORT_MAX_ERROR 2.5f
+
+
+// FTheta fisheye camera with a wider source image than the undistorted target, for an eye of the given size.
+static void GetSelfTestFisheyeParams(const uint32_t eyeWidth, const uint32_t eyeHeight, CameraDistortionParameters outParams[2])
+{
+	for (int eye = 0; eye < 2; eye++)
+	{
+		CameraDistortionParameters& params = outParams[eye];
+		params.function = vr::VRDistortionFunctionType_FTheta;
+		params.coefficients[0] = 0.05f;
+		params.coefficients[1] = -0.02f;
+		params.coefficients[2] = 0.003f;
+		params.coefficients[3] = 0.0f;
+
+		params.sourceFocalLength.v[0] = params.sourceFocalLength.v[1] = eyeWidth * 0.35f;
+		params.sourceCenter.v[0] = eyeWidth * (0.5f + (eye ? -0.01f : 0.01f));
+		params.sourceCenter.v[1] = eyeHeight * 0.49f;
+		params.targetFocalLength.v[0] = params.targetFocalLength.v[1] = eyeWidth * 0.45f;
+		params.targetCenter.v[0] = eyeWidth * 0.5f;
+		params.targetCenter.v[1] = eyeHeight * 0.5f;
+	}
+}
+
+
+// Smooth RGBA pattern over the raw frame, with each channel at its own frequency.
+static void RenderSelfTestRawFrame(std::vector<uint8_t>& outFrame, const uint32_t width, const uint32_t height)
+{
+	outFrame.resize(width * height * 4);
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			uint8_t* pixel = &outFrame[(y * width + x) * 4];
+			pixel[0] = (uint8_t)(128.0f + 100.0f * sinf(x * 0.031f) * cosf(y * 0.023f) + 0.5f);
+			pixel[1] = (uint8_t)(128.0f + 100.0f * sinf(x * 0.017f + y * 0.029f) + 0.5f);
+			pixel[2] = (uint8_t)(128.0f + 100.0f * cosf(x * 0.041f - y * 0.013f) + 0.5f);
+			pixel[3] = 255;
+		}
+	}
+}
+
+
+// Bilinear sample of one channel of the raw frame in floating point, within the eye starting at the offset.
+static float SampleRawFrame(const std::vector<uint8_t>& frame, const uint32_t frameWidth, const uint32_t offsetX, const uint32_t eyeWidth, const uint32_t eyeHeight, const float x, const float y, const int channel)
+{
+	float sampleX = std::clamp(x - 0.5f, 0.0f, eyeWidth - 1.0f);
+	float sampleY = std::clamp(y - 0.5f, 0.0f, eyeHeight - 1.0f);
+	uint32_t x0 = std::min((uint32_t)sampleX, eyeWidth - 2);
+	uint32_t y0 = std::min((uint32_t)sampleY, eyeHeight - 2);
+	float fx = sampleX - x0;
+	float fy = sampleY - y0;
+
+	const uint8_t* top = &frame[(y0 * frameWidth + offsetX + x0) * 4 + channel];
+	const uint8_t* bottom = top + frameWidth * 4;
+
+	float upper = top[0] + (top[4] - top[0]) * fx;
+	float lower = bottom[0] + (bottom[4] - bottom[0]) * fx;
+	return upper + (lower - upper) * fy;
+}
+
+
+// Times building the remap table and undistorting full frames, and checks the undistorted pixels
+// against bilinear samples of the raw frame at the points DistortPoint maps them to.
+bool BenchmarkFrameUndistortion()
+{
+	const uint32_t frameWidth = SELF_TEST_FISHEYE_WIDTH * 2;
+	const uint32_t frameHeight = SELF_TEST_FISHEYE_HEIGHT;
+
+	CameraDistortionParameters params[2];
+	GetSelfTestFisheyeParams(SELF_TEST_FISHEYE_WIDTH, SELF_TEST_FISHEYE_HEIGHT, params);
+
+	std::vector<uint8_t> rawFrame;
+	RenderSelfTestRawFrame(rawFrame, frameWidth, frameHeight);
+	std::vector<uint8_t> undistortedFrame(rawFrame.size());
+
+	FrameUndistorter undistorter(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+
+	if (!undistorter.BuildRemapTable(frameWidth, frameHeight, StereoHorizontalLayout, params))
+	{
+		Log("Frame undistortion: failed to build the remap table\n");
+		return false;
+	}
+
+	float buildTimeMS = GetElapsedMS(startTime);
+
+	FrameRect fullFrame;
+	fullFrame.right = frameWidth;
+	fullFrame.bottom = frameHeight;
+
+	float minRemapTimeMS = FLT_MAX;
+	double remapTimeSumMS = 0.0;
+
+	for (int i = 0; i < SELF_TEST_UNDISTORT_ITERATIONS; i++)
+	{
+		undistorter.Undistort(rawFrame.data(), undistortedFrame.data(), &fullFrame, 1);
+		minRemapTimeMS = std::min(minRemapTimeMS, undistorter.GetLastRemapTimeMS());
+		remapTimeSumMS += undistorter.GetLastRemapTimeMS();
+	}
+
+	uint32_t seed = 1;
+	uint32_t numChecked = 0;
+	uint32_t numInvalidErrors = 0;
+	float maxError = 0.0f;
+
+	for (uint32_t i = 0; i < SELF_TEST_UNDISTORT_SAMPLES; i++)
+	{
+		uint32_t x = NextRandom(seed) % frameWidth;
+		uint32_t y = NextRandom(seed) % frameHeight;
+		uint32_t eye = x / SELF_TEST_FISHEYE_WIDTH;
+		uint32_t eyeX = x - eye * SELF_TEST_FISHEYE_WIDTH;
+		const uint8_t* pixel = &undistortedFrame[(y * frameWidth + x) * 4];
+
+		float sourceX, sourceY;
+		bool bValid = FrameUndistorter::DistortPoint(params[eye], eyeX + 0.5f, y + 0.5f, sourceX, sourceY) &&
+			sourceX >= 0.0f && sourceY >= 0.0f && sourceX <= SELF_TEST_FISHEYE_WIDTH && sourceY <= SELF_TEST_FISHEYE_HEIGHT;
+
+		if (!bValid)
+		{
+			if (pixel[3] != 0)
+			{
+				numInvalidErrors++;
+			}
+			continue;
+		}
+
+		for (int c = 0; c < 4; c++)
+		{
+			float expected = SampleRawFrame(rawFrame, frameWidth, eye * SELF_TEST_FISHEYE_WIDTH, SELF_TEST_FISHEYE_WIDTH, SELF_TEST_FISHEYE_HEIGHT, sourceX, sourceY, c);
+			maxError = std::max(maxError, fabsf(pixel[c] - expected));
+		}
+
+		numChecked++;
+	}
+
+	float remapTimeMS = (float)(remapTimeSumMS / SELF_TEST_UNDISTORT_ITERATIONS);
+
+	Log("Frame undistortion %ux%u: remap table built in %.1f ms, undistorted in %.2f ms average, %.2f ms best, %.1f Mpixels/s, max error %.2f levels over %u samples, %u invalid pixels written\n",
+		frameWidth, frameHeight, buildTimeMS, remapTimeMS, minRemapTimeMS, frameWidth * frameHeight / (remapTimeMS * 1000.0f), maxError, numChecked, numInvalidErrors);
+
+	return maxError <= SELF_TEST_UNDISTORT_MAX_ERROR && numInvalidErrors == 0 && numChecked > SELF_TEST_UNDISTORT_SAMPLES / 2;
+}
+
+
+// Renders a synthetic FTheta frame through the warp mesh both ways, once from the raw frame with the mesh
+// moved by DistortWarpMesh, and once from the CPU undistorted frame with the plain mesh, and compares them.
+// Pixels sampling outside the undistorted image or next to its invalid border are skipped.
+bool TestFusedUndistortion()
+{
+	const uint32_t frameWidth = SELF_TEST_FUSED_EYE_SIZE * 2;
+	const uint32_t frameHeight = SELF_TEST_FUSED_EYE_SIZE;
+	const uint32_t outputSize = SELF_TEST_FUSED_OUTPUT_SIZE;
+	const Vector2 uvOffset(0.0f, 0.0f);
+
+	CameraDistortionParameters params[2];
+	GetSelfTestFisheyeParams(SELF_TEST_FUSED_EYE_SIZE, SELF_TEST_FUSED_EYE_SIZE, params);
+
+	std::vector<uint8_t> rawFrame;
+	RenderSelfTestRawFrame(rawFrame, frameWidth, frameHeight);
+	std::vector<uint8_t> undistortedFrame(rawFrame.size());
+
+	FrameUndistorter undistorter(1);
+	if (!undistorter.BuildRemapTable(frameWidth, frameHeight, StereoHorizontalLayout, params))
+	{
+		Log("Fused undistortion: failed to build the remap table\n");
+		return false;
+	}
+
+	FrameRect fullFrame;
+	fullFrame.right = frameWidth;
+	fullFrame.bottom = frameHeight;
+	undistorter.Undistort(rawFrame.data(), undistortedFrame.data(), &fullFrame, 1);
+
+	// The HMD view covers the middle 80% of the undistorted eye image.
+	WarpMeshParams meshParams;
+	meshParams.uvProjectionFar[0] = -0.4f;
+	meshParams.uvProjectionFar[5] = 0.8f;
+	meshParams.uvProjectionFar[12] = 0.5f;
+	meshParams.uvProjectionNear = meshParams.uvProjectionFar;
+
+	std::vector<WarpMeshVertex> mesh;
+	GenerateWarpMesh(mesh, meshParams);
+
+	std::vector<WarpMeshVertex> fusedMesh = mesh;
+	undistorter.DistortWarpMesh(fusedMesh, LEFT_EYE);
+
+	std::vector<uint8_t> twoPassImage(outputSize * outputSize * 4);
+	std::vector<uint8_t> fusedImage(outputSize * outputSize * 4);
+	std::vector<uint8_t> coverage(outputSize * outputSize);
+
+	RenderWarpMeshReference(mesh, undistortedFrame.data(), frameWidth, frameHeight, uvOffset, twoPassImage.data(), outputSize, outputSize, coverage.data());
+	RenderWarpMeshReference(fusedMesh, rawFrame.data(), frameWidth, frameHeight, uvOffset, fusedImage.data(), outputSize, outputSize);
+
+	float maxError = 0.0f;
+	double errorSum = 0.0;
+	uint32_t numCompared = 0;
+
+	for (uint32_t i = 0; i < outputSize * outputSize; i++)
+	{
+		// Invalid remap entries are black and transparent, and bleed into the filtered pixels next to them.
+		if (!coverage[i] || twoPassImage[i * 4 + 3] != 255)
+		{
+			continue;
+		}
+
+		for (int c = 0; c < 3; c++)
+		{
+			float error = fabsf((float)twoPassImage[i * 4 + c] - (float)fusedImage[i * 4 + c]);
+			maxError = std::max(maxError, error);
+			errorSum += error;
+		}
+
+		numCompared++;
+	}
+
+	float meanError = numCompared ? (float)(errorSum / (numCompared * 3)) : 0.0f;
+
+	Log("Fused undistortion: max difference %.0f levels, mean %.3f levels from the two pass render over %u pixels\n", maxError, meanError, numCompared);
+
+	return numCompared > outputSize * outputSize / 2 && maxError <= SELF_TEST_FUSED_MAX_ERROR;
+}
+
+#endif
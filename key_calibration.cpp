@@ -0,0 +1,433 @@
+
+#include "pch.h"
+#include "key_calibration.h"
+#include "key_mask.h"
+#include "logging.h"
+#include <emmintrin.h>
+
+
+// Chroma histogram for seeding the clusters, covering -128 to 128 on both axes.
+#define HISTOGRAM_BINS 32
+#define HISTOGRAM_BIN_SIZE (256.0f / HISTOGRAM_BINS)
+
+
+// Cube root starting from x^(21/64), which only takes square roots, refined with two Newton iterations.
+// Only used above the linear segment of the LAB curve, where the error is below 1e-6.
+static inline __m128 CubeRootSIMD(const __m128 x)
+{
+	__m128 root4 = _mm_sqrt_ps(_mm_sqrt_ps(x));
+	__m128 root16 = _mm_sqrt_ps(_mm_sqrt_ps(root4));
+	__m128 root64 = _mm_sqrt_ps(_mm_sqrt_ps(root16));
+	__m128 y = _mm_mul_ps(_mm_mul_ps(root4, root16), root64);
+
+	const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+	for (int i = 0; i < 2; i++)
+	{
+		y = _mm_mul_ps(_mm_add_ps(_mm_add_ps(y, y), _mm_div_ps(x, _mm_mul_ps(y, y))), third);
+	}
+	return y;
+}
+
+
+static inline __m128 LABCurveSIMD(const __m128 value)
+{
+	const __m128 threshold = _mm_set1_ps(0.008856f);
+	__m128 mask = _mm_cmpgt_ps(value, threshold);
+	__m128 curve = CubeRootSIMD(_mm_max_ps(value, threshold));
+	__m128 linear = _mm_add_ps(_mm_mul_ps(value, _mm_set1_ps(7.787f)), _mm_set1_ps(16.0f / 116.0f));
+	return _mm_or_ps(_mm_and_ps(mask, curve), _mm_andnot_ps(mask, linear));
+}
+
+
+void ConvertToLABSIMD(const float* red, const float* green, const float* blue, float* outL, float* outA, float* outB, const uint32_t count)
+{
+	uint32_t i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 r = _mm_loadu_ps(red + i);
+		__m128 g = _mm_loadu_ps(green + i);
+		__m128 b = _mm_loadu_ps(blue + i);
+
+		// The D65 reference white is folded into the X and Z rows.
+		__m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.4124564f / 0.95047f)), _mm_mul_ps(g, _mm_set1_ps(0.3575761f / 0.95047f))), _mm_mul_ps(b, _mm_set1_ps(0.1804375f / 0.95047f)));
+		__m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126729f)), _mm_mul_ps(g, _mm_set1_ps(0.7151522f))), _mm_mul_ps(b, _mm_set1_ps(0.0721750f)));
+		__m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.0193339f / 1.08883f)), _mm_mul_ps(g, _mm_set1_ps(0.1191920f / 1.08883f))), _mm_mul_ps(b, _mm_set1_ps(0.9503041f / 1.08883f)));
+
+		x = LABCurveSIMD(x);
+		y = LABCurveSIMD(y);
+		z = LABCurveSIMD(z);
+
+		_mm_storeu_ps(outL + i, _mm_sub_ps(_mm_mul_ps(y, _mm_set1_ps(116.0f)), _mm_set1_ps(16.0f)));
+		_mm_storeu_ps(outA + i, _mm_mul_ps(_mm_sub_ps(x, y), _mm_set1_ps(500.0f)));
+		_mm_storeu_ps(outB + i, _mm_mul_ps(_mm_sub_ps(y, z), _mm_set1_ps(200.0f)));
+	}
+
+	for (; i < count; i++)
+	{
+		float rgb[3] = { red[i], green[i], blue[i] };
+		float lab[3];
+		LinearRGBToLAB(rgb, lab);
+		outL[i] = lab[0];
+		outA[i] = lab[1];
+		outB[i] = lab[2];
+	}
+}
+
+
+static float GetPercentile(std::vector<float>& values, const float percentile)
+{
+	if (values.empty()) { return 0.0f; }
+
+	size_t index = std::min((size_t)(values.size() * percentile), values.size() - 1);
+	std::nth_element(values.begin(), values.begin() + index, values.end());
+	return values[index];
+}
+
+
+bool CalibrateKeyColor(const KeyCalibrationImage& image, KeyCalibrationResult& outResult)
+{
+	LARGE_INTEGER perfFrequency;
+	LARGE_INTEGER startTime;
+	QueryPerformanceFrequency(&perfFrequency);
+	QueryPerformanceCounter(&startTime);
+
+	outResult = KeyCalibrationResult();
+
+	if (image.width == 0 || image.height == 0 || image.rowPitch < image.width * 4 || image.pixels.size() < (size_t)image.rowPitch * (image.height - 1) + image.width * 4)
+	{
+		return false;
+	}
+
+	uint32_t step = std::max((uint32_t)ceilf(sqrtf((float)image.width * image.height / KEY_CALIBRATION_MAX_SAMPLES)), 1u);
+	while ((image.width / step) * (image.height / step) > KEY_CALIBRATION_MAX_SAMPLES)
+	{
+		step++;
+	}
+
+	const uint32_t samplesX = image.width / step;
+	const uint32_t samplesY = image.height / step;
+	const uint32_t numSamples = samplesX * samplesY;
+
+	if (numSamples == 0)
+	{
+		return false;
+	}
+
+	std::vector<float> red(numSamples);
+	std::vector<float> green(numSamples);
+	std::vector<float> blue(numSamples);
+
+	const float* toLinear = GetSRGBToLinearTable();
+	const int redIndex = image.bBGRA ? 2 : 0;
+	const int blueIndex = image.bBGRA ? 0 : 2;
+
+	for (uint32_t y = 0; y < samplesY; y++)
+	{
+		const uint8_t* row = image.pixels.data() + (size_t)(y * step + step / 2) * image.rowPitch;
+
+		for (uint32_t x = 0; x < samplesX; x++)
+		{
+			const uint8_t* pixel = row + (x * step + step / 2) * 4;
+			uint32_t index = y * samplesX + x;
+
+			red[index] = image.bSRGB ? toLinear[pixel[redIndex]] : pixel[redIndex] / 255.0f;
+			green[index] = image.bSRGB ? toLinear[pixel[1]] : pixel[1] / 255.0f;
+			blue[index] = image.bSRGB ? toLinear[pixel[blueIndex]] : pixel[blueIndex] / 255.0f;
+		}
+	}
+
+	std::vector<float> labL(numSamples);
+	std::vector<float> labA(numSamples);
+	std::vector<float> labB(numSamples);
+	ConvertToLABSIMD(red.data(), green.data(), blue.data(), labL.data(), labA.data(), labB.data(), numSamples);
+
+
+	// Seed the clusters from the local maxima of the chroma histogram, most populated first.
+	std::vector<uint32_t> binCounts(HISTOGRAM_BINS * HISTOGRAM_BINS, 0);
+	std::vector<float> binSums(HISTOGRAM_BINS * HISTOGRAM_BINS * 3, 0.0f);
+
+	for (uint32_t i = 0; i < numSamples; i++)
+	{
+		int binA = std::clamp((int)((labA[i] + 128.0f) / HISTOGRAM_BIN_SIZE), 0, HISTOGRAM_BINS - 1);
+		int binB = std::clamp((int)((labB[i] + 128.0f) / HISTOGRAM_BIN_SIZE), 0, HISTOGRAM_BINS - 1);
+		int bin = binB * HISTOGRAM_BINS + binA;
+
+		binCounts[bin]++;
+		binSums[bin * 3 + 0] += labL[i];
+		binSums[bin * 3 + 1] += labA[i];
+		binSums[bin * 3 + 2] += labB[i];
+	}
+
+	std::vector<int> peaks;
+	for (int bin = 0; bin < HISTOGRAM_BINS * HISTOGRAM_BINS; bin++)
+	{
+		if (binCounts[bin] == 0) { continue; }
+
+		int binA = bin % HISTOGRAM_BINS;
+		int binB = bin / HISTOGRAM_BINS;
+		bool bIsPeak = true;
+
+		for (int dy = -1; dy <= 1 && bIsPeak; dy++)
+		{
+			for (int dx = -1; dx <= 1; dx++)
+			{
+				int neighborA = binA + dx;
+				int neighborB = binB + dy;
+				if ((dx == 0 && dy == 0) || neighborA < 0 || neighborB < 0 || neighborA >= HISTOGRAM_BINS || neighborB >= HISTOGRAM_BINS) { continue; }
+
+				// Ties go to the lower bin, so flat plateaus give a single peak.
+				int neighbor = neighborB * HISTOGRAM_BINS + neighborA;
+				if (binCounts[neighbor] > binCounts[bin] || (binCounts[neighbor] == binCounts[bin] && neighbor < bin))
+				{
+					bIsPeak = false;
+					break;
+				}
+			}
+		}
+
+		if (bIsPeak)
+		{
+			peaks.push_back(bin);
+		}
+	}
+
+	std::sort(peaks.begin(), peaks.end(), [&binCounts](int a, int b) { return binCounts[a] > binCounts[b]; });
+
+	const uint32_t numClusters = std::min((uint32_t)peaks.size(), (uint32_t)KEY_CALIBRATION_CLUSTERS);
+	float centers[KEY_CALIBRATION_CLUSTERS][3] = {};
+
+	for (uint32_t k = 0; k < numClusters; k++)
+	{
+		int bin = peaks[k];
+		for (int c = 0; c < 3; c++)
+		{
+			centers[k][c] = binSums[bin * 3 + c] / binCounts[bin];
+		}
+	}
+
+
+	std::vector<uint8_t> labels(numSamples, 0);
+	uint32_t clusterCounts[KEY_CALIBRATION_CLUSTERS] = {};
+	const float lumaWeightSqr = KEY_CALIBRATION_LUMA_WEIGHT * KEY_CALIBRATION_LUMA_WEIGHT;
+
+	for (int iteration = 0; iteration < KEY_CALIBRATION_ITERATIONS; iteration++)
+	{
+		double sums[KEY_CALIBRATION_CLUSTERS][3] = {};
+		memset(clusterCounts, 0, sizeof(clusterCounts));
+
+		for (uint32_t i = 0; i < numSamples; i++)
+		{
+			uint32_t nearest = 0;
+			float nearestDistSqr = FLT_MAX;
+
+			for (uint32_t k = 0; k < numClusters; k++)
+			{
+				float diffL = labL[i] - centers[k][0];
+				float diffA = labA[i] - centers[k][1];
+				float diffB = labB[i] - centers[k][2];
+				float distSqr = diffL * diffL * lumaWeightSqr + diffA * diffA + diffB * diffB;
+
+				if (distSqr < nearestDistSqr)
+				{
+					nearestDistSqr = distSqr;
+					nearest = k;
+				}
+			}
+
+			labels[i] = (uint8_t)nearest;
+			clusterCounts[nearest]++;
+			sums[nearest][0] += labL[i];
+			sums[nearest][1] += labA[i];
+			sums[nearest][2] += labB[i];
+		}
+
+		// Empty clusters keep their previous center.
+		for (uint32_t k = 0; k < numClusters; k++)
+		{
+			if (clusterCounts[k] == 0) { continue; }
+
+			for (int c = 0; c < 3; c++)
+			{
+				centers[k][c] = (float)(sums[k][c] / clusterCounts[k]);
+			}
+		}
+	}
+
+
+	// The key is the largest cluster with enough chroma, or the largest one if none has.
+	auto getChroma = [&centers](const uint32_t k) { return sqrtf(centers[k][1] * centers[k][1] + centers[k][2] * centers[k][2]); };
+
+	int keyCluster = -1;
+	for (uint32_t k = 0; k < numClusters; k++)
+	{
+		if (getChroma(k) >= KEY_CALIBRATION_MIN_CHROMA && (keyCluster < 0 || clusterCounts[k] > clusterCounts[keyCluster]))
+		{
+			keyCluster = k;
+		}
+	}
+
+	bool bHasChroma = keyCluster >= 0;
+	if (!bHasChroma)
+	{
+		for (uint32_t k = 0; k < numClusters; k++)
+		{
+			if (keyCluster < 0 || clusterCounts[k] > clusterCounts[keyCluster])
+			{
+				keyCluster = k;
+			}
+		}
+	}
+
+	if (keyCluster < 0)
+	{
+		return false;
+	}
+
+	bool bMerged[KEY_CALIBRATION_CLUSTERS] = {};
+	for (uint32_t k = 0; k < numClusters; k++)
+	{
+		float diffA = centers[k][1] - centers[keyCluster][1];
+		float diffB = centers[k][2] - centers[keyCluster][2];
+		bool bCloseChroma = sqrtf(diffA * diffA + diffB * diffB) <= KEY_CALIBRATION_MERGE_DISTANCE;
+
+		bMerged[k] = (k == (uint32_t)keyCluster) || (bCloseChroma && (!bHasChroma || getChroma(k) >= KEY_CALIBRATION_MIN_CHROMA));
+	}
+
+
+	// The key color is averaged in linear space, which is what the key is compared in before the conversion.
+	double keySum[3] = {};
+	uint32_t keyCount = 0;
+
+	for (uint32_t i = 0; i < numSamples; i++)
+	{
+		if (!bMerged[labels[i]]) { continue; }
+
+		keySum[0] += red[i];
+		keySum[1] += green[i];
+		keySum[2] += blue[i];
+		keyCount++;
+	}
+
+	float keyLinear[3] = { (float)(keySum[0] / keyCount), (float)(keySum[1] / keyCount), (float)(keySum[2] / keyCount) };
+	float keyLAB[3];
+	LinearRGBToLAB(keyLinear, keyLAB);
+
+	std::vector<float> chromaDistances;
+	std::vector<float> lumaDistances;
+	chromaDistances.reserve(keyCount);
+	lumaDistances.reserve(keyCount);
+
+	for (uint32_t i = 0; i < numSamples; i++)
+	{
+		if (!bMerged[labels[i]]) { continue; }
+
+		float diffA = labA[i] - keyLAB[1];
+		float diffB = labB[i] - keyLAB[2];
+		chromaDistances.push_back(sqrtf(diffA * diffA + diffB * diffB));
+		lumaDistances.push_back(fabsf(labL[i] - keyLAB[0]));
+	}
+
+	float chromaRange = GetPercentile(chromaDistances, KEY_CALIBRATION_RANGE_PERCENTILE) + KEY_CALIBRATION_CHROMA_MARGIN;
+	float lumaRange = GetPercentile(lumaDistances, KEY_CALIBRATION_RANGE_PERCENTILE) + KEY_CALIBRATION_LUMA_MARGIN;
+
+	// Inverse of the conversion in FillMaskedConstants.
+	for (int c = 0; c < 3; c++)
+	{
+		outResult.keyColor[c] = std::clamp(powf(keyLinear[c], 1.0f / 2.2f), 0.0f, 1.0f);
+	}
+
+	outResult.fractionChroma = std::clamp(chromaRange / 100.0f, 0.01f, 1.0f);
+	outResult.fractionLuma = std::clamp(lumaRange / 100.0f, 0.01f, 1.0f);
+	outResult.keyCoverage = (float)keyCount / numSamples;
+	outResult.bSuccess = true;
+
+	LARGE_INTEGER endTime;
+	QueryPerformanceCounter(&endTime);
+	outResult.timeMS = (float)((endTime.QuadPart - startTime.QuadPart) * 1000.0 / perfFrequency.QuadPart);
+
+	return true;
+}
+
+
+
+KeyCalibrator::KeyCalibrator()
+{
+	m_thread = std::thread(&KeyCalibrator::RunThread, this);
+}
+
+KeyCalibrator::~KeyCalibrator()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_bRunThread = false;
+	}
+	m_threadCondition.notify_all();
+
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+
+void KeyCalibrator::Calibrate(KeyCalibrationImage&& image)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_image = std::move(image);
+		m_bImagePending = true;
+		m_bCalibrating = true;
+	}
+	m_threadCondition.notify_all();
+}
+
+
+bool KeyCalibrator::GetResult(KeyCalibrationResult& outResult)
+{
+	std::lock_guard<std::mutex> lock(m_threadMutex);
+
+	if (!m_bResultPending)
+	{
+		return false;
+	}
+
+	outResult = m_result;
+	m_bResultPending = false;
+	return true;
+}
+
+
+void KeyCalibrator::RunThread()
+{
+	std::unique_lock<std::mutex> lock(m_threadMutex);
+
+	while (true)
+	{
+		m_threadCondition.wait(lock, [this] { return !m_bRunThread || m_bImagePending; });
+
+		if (!m_bRunThread) { return; }
+
+		KeyCalibrationImage image = std::move(m_image);
+		m_bImagePending = false;
+
+		lock.unlock();
+
+		KeyCalibrationResult result;
+		if (CalibrateKeyColor(image, result))
+		{
+			Log("Key calibrated in %.1fms: color (%.3f, %.3f, %.3f), chroma range %.2f, luma range %.2f, %.0f%% of the frame\n",
+				result.timeMS, result.keyColor[0], result.keyColor[1], result.keyColor[2], result.fractionChroma, result.fractionLuma, result.keyCoverage * 100.0f);
+		}
+		else
+		{
+			ErrorLog("Key calibration failed, the frame is empty\n");
+		}
+
+		lock.lock();
+
+		m_result = result;
+		m_bResultPending = true;
+		m_bCalibrating = false;
+	}
+}
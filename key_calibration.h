@@ -0,0 +1,100 @@
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+
+// Upper limit of the pixels sampled from the frame, taken on an even grid.
+#define KEY_CALIBRATION_MAX_SAMPLES 65536
+
+#define KEY_CALIBRATION_CLUSTERS 6
+#define KEY_CALIBRATION_ITERATIONS 10
+
+// Lightness is weighted down in the clustering, so unevenly lit parts of a screen stay together.
+#define KEY_CALIBRATION_LUMA_WEIGHT 0.5f
+
+// Clusters with less chroma than this are not considered as the key, unless there are no others.
+#define KEY_CALIBRATION_MIN_CHROMA 12.0f
+
+// Clusters within this chroma distance of the key cluster are merged into it, covering the shades of the screen.
+#define KEY_CALIBRATION_MERGE_DISTANCE 15.0f
+
+// The suggested ranges cover this fraction of the key samples, with an added margin in LAB units.
+#define KEY_CALIBRATION_RANGE_PERCENTILE 0.95f
+#define KEY_CALIBRATION_CHROMA_MARGIN 3.0f
+#define KEY_CALIBRATION_LUMA_MARGIN 5.0f
+
+
+// RGBA8 copy of the texture the key is evaluated on.
+struct KeyCalibrationImage
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t rowPitch = 0;
+	// The texture view decodes the values from sRGB, the key then sees them in linear space.
+	bool bSRGB = false;
+	bool bBGRA = false;
+	std::vector<uint8_t> pixels;
+};
+
+
+struct KeyCalibrationResult
+{
+	bool bSuccess = false;
+	// In the gamma space of the MaskedKeyColor setting.
+	float keyColor[3] = { 0.0f, 0.0f, 0.0f };
+	float fractionChroma = 0.0f;
+	float fractionLuma = 0.0f;
+	// Share of the sampled pixels in the key cluster.
+	float keyCoverage = 0.0f;
+	float timeMS = 0.0f;
+};
+
+
+// Converts linear RGB samples to CIELAB four at a time, with the same constants as util.hlsl.
+void ConvertToLABSIMD(const float* red, const float* green, const float* blue, float* outL, float* outA, float* outB, const uint32_t count);
+
+// Finds the dominant chromatic cluster of the image with k-means in CIELAB, and suggests the key color and
+// ranges covering it. Seeded from the peaks of a chroma histogram, so the result is deterministic.
+bool CalibrateKeyColor(const KeyCalibrationImage& image, KeyCalibrationResult& outResult);
+
+
+// Runs the calibration in a background thread. The dashboard requests it, the render loop
+// supplies the frame, and the dashboard applies the result to the config.
+class KeyCalibrator
+{
+public:
+
+	KeyCalibrator();
+	~KeyCalibrator();
+
+	void RequestCalibration() { m_bFrameRequested = true; }
+	bool IsCalibrating() const { return m_bFrameRequested || m_bCalibrating; }
+
+	// Returns true once per request, for the render loop to start copying a frame.
+	bool TakeFrameRequest() { return m_bFrameRequested.exchange(false); }
+	void Calibrate(KeyCalibrationImage&& image);
+
+	// Returns true once for each finished calibration.
+	bool GetResult(KeyCalibrationResult& outResult);
+
+private:
+
+	void RunThread();
+
+	std::thread m_thread;
+	std::mutex m_threadMutex;
+	std::condition_variable m_threadCondition;
+	bool m_bRunThread = true;
+	bool m_bImagePending = false;
+	bool m_bResultPending = false;
+
+	std::atomic_bool m_bFrameRequested = false;
+	std::atomic_bool m_bCalibrating = false;
+
+	KeyCalibrationImage m_image;
+	KeyCalibrationResult m_result;
+};
@@ -0,0 +1,64 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "key_calibration.h"
+#include "synthetic_frames.h"
+
+
+// Calibrates the key on synthetic frames with green, blue and dark green screens, and keys the frames with
+// the calibrated color and ranges, checking that the uncovered screen is keyed and the foreground isn't.
+bool TestKeyCalibration()
+{
+	const float keyColors[3][3] = { { 0.15f, 0.7f, 0.25f }, { 0.1f, 0.25f, 0.75f }, { 0.1f, 0.35f, 0.12f } };
+	WorkerPool workerPool(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+	bool bPassed = true;
+
+	for (const float* keyColor : keyColors)
+	{
+		SyntheticSceneParams sceneParams = GetKeySceneParams();
+		memcpy(sceneParams.keyColor, keyColor, sizeof(sceneParams.keyColor));
+		SyntheticScene scene(sceneParams);
+
+		SyntheticFrame frame;
+		scene.Render(workerPool, 0, frame);
+
+		KeyCalibrationResult result;
+		if (!CalibrateKeyColor(GetFrameCalibrationImage(frame), result))
+		{
+			Log("Key calibration (%.2f, %.2f, %.2f): no key found\n", keyColor[0], keyColor[1], keyColor[2]);
+			bPassed = false;
+			continue;
+		}
+
+		KeyMaskParams keyParams = GetKeySceneMaskParams(sceneParams);
+		KeyMaskParams calibratedParams;
+		for (int c = 0; c < 3; c++)
+		{
+			calibratedParams.keyColor[c] = powf(result.keyColor[c], 2.2f);
+		}
+		calibratedParams.fracChroma = result.fractionChroma * 100.0f;
+		calibratedParams.fracLuma = result.fractionLuma * 100.0f;
+
+		float keyLAB[3];
+		float calibratedLAB[3];
+		LinearRGBToLAB(keyParams.keyColor, keyLAB);
+		LinearRGBToLAB(calibratedParams.keyColor, calibratedLAB);
+		float colorError = sqrtf((keyLAB[0] - calibratedLAB[0]) * (keyLAB[0] - calibratedLAB[0]) + (keyLAB[1] - calibratedLAB[1]) * (keyLAB[1] - calibratedLAB[1]) + (keyLAB[2] - calibratedLAB[2]) * (keyLAB[2] - calibratedLAB[2]));
+
+		float screenKeyed;
+		float foregroundKeyed;
+		GetKeyedFractions(frame, calibratedParams, screenKeyed, foregroundKeyed);
+
+		Log("Key calibration (%.2f, %.2f, %.2f): color error %.2f dE, ranges %.2f / %.2f, %.2f%% of the screen and %.2f%% of the foreground keyed, %.1f ms\n",
+			keyColor[0], keyColor[1], keyColor[2], colorError, result.fractionChroma, result.fractionLuma, screenKeyed * 100.0f, foregroundKeyed * 100.0f, result.timeMS);
+
+		bPassed = bPassed && colorError < 2.0f && screenKeyed > 0.98f && foregroundKeyed < 0.01f;
+	}
+
+	return bPassed;
+}
+
+#endif
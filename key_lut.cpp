@@ -0,0 +1,543 @@
+
+#include "pch.h"
+#include "key_lut.h"
+#include "key_mask.h"
+#include "key_calibration.h"
+#include <emmintrin.h>
+
+
+// Keys don't reach further than this margin, it also marks colors when no keys are defined.
+#define KEY_LUT_MAX_MARGIN 1000.0f
+
+// Keys with less chroma than this have no hue to remove.
+#define KEY_LUT_MIN_DESPILL_CHROMA 1.0f
+
+
+static inline float SmoothStep01(const float value)
+{
+	float t = std::clamp(value, 0.0f, 1.0f);
+	return t * t * (3.0f - 2.0f * t);
+}
+
+
+KeyLUTBaker::KeyLUTBaker()
+{
+	const uint32_t numEntries = KEY_LUT_SIZE * KEY_LUT_SIZE * KEY_LUT_SIZE;
+
+	std::vector<float> red(numEntries);
+	std::vector<float> green(numEntries);
+	std::vector<float> blue(numEntries);
+
+	for (uint32_t i = 0; i < numEntries; i++)
+	{
+		float r = (float)(i % KEY_LUT_SIZE) / (KEY_LUT_SIZE - 1);
+		float g = (float)((i / KEY_LUT_SIZE) % KEY_LUT_SIZE) / (KEY_LUT_SIZE - 1);
+		float b = (float)(i / (KEY_LUT_SIZE * KEY_LUT_SIZE)) / (KEY_LUT_SIZE - 1);
+
+		red[i] = r * r;
+		green[i] = g * g;
+		blue[i] = b * b;
+	}
+
+	m_entryL.resize(numEntries);
+	m_entryA.resize(numEntries);
+	m_entryB.resize(numEntries);
+	ConvertToLABSIMD(red.data(), green.data(), blue.data(), m_entryL.data(), m_entryA.data(), m_entryB.data(), numEntries);
+}
+
+
+// Converts to half floats, rounding to nearest even. The values are clamped to the half range,
+// and values below the smallest normal half are flushed to zero.
+static inline __m128i FloatToHalfSIMD(const __m128 value)
+{
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+	__m128i bits = _mm_castps_si128(value);
+	__m128i sign = _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(0x8000));
+	__m128i absBits = _mm_castps_si128(_mm_min_ps(_mm_and_ps(value, absMask), _mm_set1_ps(65504.0f)));
+
+	__m128i roundBias = _mm_add_epi32(_mm_set1_epi32(0xFFF), _mm_and_si128(_mm_srli_epi32(absBits, 13), _mm_set1_epi32(1)));
+	__m128i half = _mm_sub_epi32(_mm_srli_epi32(_mm_add_epi32(absBits, roundBias), 13), _mm_set1_epi32((127 - 15) << 10));
+	__m128i bNormal = _mm_cmpgt_epi32(absBits, _mm_set1_epi32(0x387FFFFF));
+
+	return _mm_or_si128(_mm_and_si128(half, bNormal), sign);
+}
+
+
+// The baker flushes values below the normal range to zero, so there are no subnormals to decode.
+static float HalfToFloat(const uint16_t half)
+{
+	uint32_t exponent = (half >> 10) & 0x1F;
+	uint32_t bits = (uint32_t)(half & 0x8000) << 16;
+
+	if (exponent != 0)
+	{
+		bits |= ((exponent + 127 - 15) << 23) | ((uint32_t)(half & 0x3FF) << 13);
+	}
+
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+
+static inline __m128 LABCurveInverseSIMD(const __m128 value)
+{
+	__m128 cube = _mm_mul_ps(_mm_mul_ps(value, value), value);
+	__m128 linear = _mm_mul_ps(_mm_sub_ps(value, _mm_set1_ps(16.0f / 116.0f)), _mm_set1_ps(1.0f / 7.787f));
+	__m128 bCube = _mm_cmpgt_ps(value, _mm_set1_ps(0.206897f));
+
+	return _mm_or_ps(_mm_and_ps(bCube, cube), _mm_andnot_ps(bCube, linear));
+}
+
+
+// Y'CbCr and HSV of four square root encoded colors, in the units of LinearRGBToYCbCr and LinearRGBToHSV.
+static inline void ConvertToYCbCrSIMD(const __m128 red, const __m128 green, const __m128 blue, __m128& outY, __m128& outCb, __m128& outCr)
+{
+	__m128 luma = _mm_add_ps(_mm_add_ps(_mm_mul_ps(red, _mm_set1_ps(0.2126f)), _mm_mul_ps(green, _mm_set1_ps(0.7152f))), _mm_mul_ps(blue, _mm_set1_ps(0.0722f)));
+
+	outY = _mm_mul_ps(luma, _mm_set1_ps(100.0f));
+	outCb = _mm_mul_ps(_mm_sub_ps(blue, luma), _mm_set1_ps(KEY_YCBCR_CHROMA_SCALE / 1.8556f));
+	outCr = _mm_mul_ps(_mm_sub_ps(red, luma), _mm_set1_ps(KEY_YCBCR_CHROMA_SCALE / 1.5748f));
+}
+
+
+static inline void ConvertToHSVSIMD(const __m128 red, const __m128 green, const __m128 blue, __m128& outH, __m128& outS, __m128& outV)
+{
+	__m128 maxValue = _mm_max_ps(red, _mm_max_ps(green, blue));
+	__m128 chroma = _mm_sub_ps(maxValue, _mm_min_ps(red, _mm_min_ps(green, blue)));
+	__m128 invChroma = _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(chroma, _mm_set1_ps(1e-6f)));
+
+	__m128 hueRed = _mm_mul_ps(_mm_sub_ps(green, blue), invChroma);
+	__m128 hueGreen = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(blue, red), invChroma), _mm_set1_ps(2.0f));
+	__m128 hueBlue = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(red, green), invChroma), _mm_set1_ps(4.0f));
+
+	// Red takes precedence over green and green over blue, like the scalar version.
+	__m128 bMaxRed = _mm_cmpeq_ps(maxValue, red);
+	__m128 bMaxGreen = _mm_andnot_ps(bMaxRed, _mm_cmpeq_ps(maxValue, green));
+	__m128 hue = _mm_or_ps(_mm_and_ps(bMaxGreen, hueGreen), _mm_andnot_ps(bMaxGreen, hueBlue));
+	hue = _mm_mul_ps(_mm_or_ps(_mm_and_ps(bMaxRed, hueRed), _mm_andnot_ps(bMaxRed, hue)), _mm_set1_ps(60.0f));
+
+	outH = _mm_add_ps(hue, _mm_and_ps(_mm_cmplt_ps(hue, _mm_setzero_ps()), _mm_set1_ps(360.0f)));
+	outS = _mm_mul_ps(_mm_div_ps(chroma, _mm_max_ps(maxValue, _mm_set1_ps(1e-6f))), _mm_set1_ps(100.0f));
+	outV = _mm_mul_ps(maxValue, _mm_set1_ps(100.0f));
+}
+
+
+// Each key's alpha is 1 - max(smoothstep(chroma), smoothstep(luma)), which is 1 - smoothstep(0, 1, m) with m the
+// larger of the two distances normalized to their smoothing edges. The smoothstep is monotonic, so the union
+// of the keys is 1 - smoothstep(0, 1, min(m)) and only the smallest margin needs to be stored.
+// The HSV keys measure the hue difference instead of the chroma distance, and add the saturation floor.
+//
+// The despill only moves a and b, so the lightness and Y stay the same, and the offset is the change of X and Z
+// taken through the XYZ to RGB matrix. Taking the difference of the two inverse curves rather than converting
+// the entry back to RGB keeps the offsets exactly zero for the colors the despill leaves alone.
+void KeyLUTBaker::Bake(const KeyLUTParams& params, std::vector<uint16_t>& outLUT) const
+{
+	const uint32_t numEntries = KEY_LUT_SIZE * KEY_LUT_SIZE * KEY_LUT_SIZE;
+	const uint32_t numKeys = std::min(params.numKeys, (uint32_t)KEY_LUT_MAX_KEYS);
+
+	outLUT.resize(numEntries * KEY_LUT_CHANNELS);
+
+	struct KeyConstants
+	{
+		__m128 key0, key1, key2;
+		__m128 chromaEdge, chromaInvWidth;
+		__m128 lumaEdge, lumaInvWidth;
+		__m128 keyA, keyB;
+		__m128 hueA, hueB;
+		bool bDespill;
+	};
+
+	// The smoothing is kept above zero, where smoothstep is undefined.
+	float smooth = std::max(params.smooth, 0.001f);
+	const bool bHSV = params.colorSpace == KeyColorSpace_HSV;
+	KeyConstants constants[KEY_LUT_MAX_KEYS];
+	bool bAnyDespill = false;
+
+	for (uint32_t k = 0; k < numKeys; k++)
+	{
+		const KeyLUTKey& key = params.keys[k];
+		float keyLAB[3];
+		float keyCoords[3];
+		LinearRGBToLAB(key.keyColor, keyLAB);
+
+		switch (params.colorSpace)
+		{
+		case KeyColorSpace_YCbCr:
+			LinearRGBToYCbCr(key.keyColor, keyCoords);
+			break;
+		case KeyColorSpace_HSV:
+			// Stored as value, hue, saturation to line up with the luma and chroma of the other spaces.
+			LinearRGBToHSV(key.keyColor, keyCoords);
+			std::swap(keyCoords[0], keyCoords[2]);
+			std::swap(keyCoords[1], keyCoords[2]);
+			break;
+		default:
+			memcpy(keyCoords, keyLAB, sizeof(keyCoords));
+			break;
+		}
+
+		float keyChroma = sqrtf(keyLAB[1] * keyLAB[1] + keyLAB[2] * keyLAB[2]);
+
+		constants[k].key0 = _mm_set1_ps(keyCoords[0]);
+		constants[k].key1 = _mm_set1_ps(keyCoords[1]);
+		constants[k].key2 = _mm_set1_ps(keyCoords[2]);
+		constants[k].chromaEdge = _mm_set1_ps(bHSV ? key.fracChroma : key.fracChroma * key.fracChroma);
+		constants[k].chromaInvWidth = _mm_set1_ps(bHSV ? 1.0f / smooth : 1.0f / (smooth * smooth));
+		constants[k].lumaEdge = _mm_set1_ps(key.fracLuma);
+		constants[k].lumaInvWidth = _mm_set1_ps(1.0f / smooth);
+		constants[k].keyA = _mm_set1_ps(keyLAB[1]);
+		constants[k].keyB = _mm_set1_ps(keyLAB[2]);
+		constants[k].bDespill = params.despillStrength > 0.0f && keyChroma >= KEY_LUT_MIN_DESPILL_CHROMA;
+		constants[k].hueA = _mm_set1_ps(constants[k].bDespill ? keyLAB[1] / keyChroma : 0.0f);
+		constants[k].hueB = _mm_set1_ps(constants[k].bDespill ? keyLAB[2] / keyChroma : 0.0f);
+
+		bAnyDespill |= constants[k].bDespill;
+	}
+
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 invSmooth = _mm_set1_ps(1.0f / smooth);
+	const __m128 entryOffsets = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+	const __m128 entryScale = _mm_set1_ps(1.0f / (KEY_LUT_SIZE - 1));
+	const __m128 despillStrength = _mm_set1_ps(params.despillStrength);
+	const __m128 despillInvRange = _mm_set1_ps(1.0f / std::max(params.despillRange, KEY_LUT_MIN_DESPILL_CHROMA));
+	const __m128i halfBias = _mm_set1_epi32(0x8000);
+	const __m128i packedHalfBias = _mm_set1_epi16((short)0x8000);
+
+	for (uint32_t i = 0; i < numEntries; i += 4)
+	{
+		__m128 entryL = _mm_loadu_ps(m_entryL.data() + i);
+		__m128 entryA = _mm_loadu_ps(m_entryA.data() + i);
+		__m128 entryB = _mm_loadu_ps(m_entryB.data() + i);
+
+		// The four entries are consecutive in red, so they share green and blue.
+		__m128 entryRed = _mm_mul_ps(_mm_add_ps(_mm_set1_ps((float)(i % KEY_LUT_SIZE)), entryOffsets), entryScale);
+		__m128 entryGreen = _mm_set1_ps((float)((i / KEY_LUT_SIZE) % KEY_LUT_SIZE) / (KEY_LUT_SIZE - 1));
+		__m128 entryBlue = _mm_set1_ps((float)(i / (KEY_LUT_SIZE * KEY_LUT_SIZE)) / (KEY_LUT_SIZE - 1));
+
+		__m128 coord0 = entryL;
+		__m128 coord1 = entryA;
+		__m128 coord2 = entryB;
+		__m128 marginSaturation = _mm_set1_ps(-KEY_LUT_MAX_MARGIN);
+
+		if (params.colorSpace == KeyColorSpace_YCbCr)
+		{
+			ConvertToYCbCrSIMD(entryRed, entryGreen, entryBlue, coord0, coord1, coord2);
+		}
+		else if (bHSV)
+		{
+			ConvertToHSVSIMD(entryRed, entryGreen, entryBlue, coord1, coord2, coord0);
+			marginSaturation = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(KEY_HSV_MIN_SATURATION), coord2), invSmooth);
+		}
+
+		__m128 margin = _mm_set1_ps(KEY_LUT_MAX_MARGIN);
+
+		for (uint32_t k = 0; k < numKeys; k++)
+		{
+			const KeyConstants& key = constants[k];
+			__m128 distChroma;
+
+			if (bHSV)
+			{
+				__m128 diffHue = _mm_and_ps(_mm_sub_ps(coord1, key.key1), absMask);
+				distChroma = _mm_mul_ps(_mm_min_ps(diffHue, _mm_sub_ps(_mm_set1_ps(360.0f), diffHue)), _mm_set1_ps(KEY_HSV_HUE_SCALE));
+			}
+			else
+			{
+				__m128 diff1 = _mm_sub_ps(coord1, key.key1);
+				__m128 diff2 = _mm_sub_ps(coord2, key.key2);
+				distChroma = _mm_add_ps(_mm_mul_ps(diff1, diff1), _mm_mul_ps(diff2, diff2));
+			}
+
+			__m128 diffLuma = _mm_and_ps(_mm_sub_ps(coord0, key.key0), absMask);
+
+			__m128 marginChroma = _mm_mul_ps(_mm_sub_ps(distChroma, key.chromaEdge), key.chromaInvWidth);
+			__m128 marginLuma = _mm_mul_ps(_mm_sub_ps(diffLuma, key.lumaEdge), key.lumaInvWidth);
+
+			margin = _mm_min_ps(margin, _mm_max_ps(_mm_max_ps(marginChroma, marginLuma), marginSaturation));
+		}
+
+		__m128 despillA = entryA;
+		__m128 despillB = entryB;
+
+		for (uint32_t k = 0; k < numKeys; k++)
+		{
+			const KeyConstants& key = constants[k];
+
+			if (key.bDespill)
+			{
+				__m128 diffA = _mm_sub_ps(entryA, key.keyA);
+				__m128 diffB = _mm_sub_ps(entryB, key.keyB);
+				__m128 distChroma = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(diffA, diffA), _mm_mul_ps(diffB, diffB)));
+
+				__m128 t = _mm_min_ps(_mm_mul_ps(distChroma, despillInvRange), one);
+				__m128 weight = _mm_mul_ps(despillStrength, _mm_sub_ps(one, _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_add_ps(t, t)))));
+				__m128 hue = _mm_max_ps(_mm_add_ps(_mm_mul_ps(despillA, key.hueA), _mm_mul_ps(despillB, key.hueB)), zero);
+
+				despillA = _mm_sub_ps(despillA, _mm_mul_ps(key.hueA, _mm_mul_ps(hue, weight)));
+				despillB = _mm_sub_ps(despillB, _mm_mul_ps(key.hueB, _mm_mul_ps(hue, weight)));
+			}
+		}
+
+		__m128 offsetR = zero;
+		__m128 offsetG = zero;
+		__m128 offsetB = zero;
+
+		if (bAnyDespill)
+		{
+			__m128 curveY = _mm_mul_ps(_mm_add_ps(entryL, _mm_set1_ps(16.0f)), _mm_set1_ps(1.0f / 116.0f));
+			__m128 curveX = _mm_add_ps(_mm_mul_ps(entryA, _mm_set1_ps(1.0f / 500.0f)), curveY);
+			__m128 curveZ = _mm_sub_ps(curveY, _mm_mul_ps(entryB, _mm_set1_ps(1.0f / 200.0f)));
+			__m128 despillCurveX = _mm_add_ps(_mm_mul_ps(despillA, _mm_set1_ps(1.0f / 500.0f)), curveY);
+			__m128 despillCurveZ = _mm_sub_ps(curveY, _mm_mul_ps(despillB, _mm_set1_ps(1.0f / 200.0f)));
+
+			__m128 offsetX = _mm_mul_ps(_mm_sub_ps(LABCurveInverseSIMD(despillCurveX), LABCurveInverseSIMD(curveX)), _mm_set1_ps(0.95047f));
+			__m128 offsetZ = _mm_mul_ps(_mm_sub_ps(LABCurveInverseSIMD(despillCurveZ), LABCurveInverseSIMD(curveZ)), _mm_set1_ps(1.08883f));
+
+			offsetR = _mm_add_ps(_mm_mul_ps(offsetX, _mm_set1_ps(3.2404542f)), _mm_mul_ps(offsetZ, _mm_set1_ps(-0.4985314f)));
+			offsetG = _mm_add_ps(_mm_mul_ps(offsetX, _mm_set1_ps(-0.9692660f)), _mm_mul_ps(offsetZ, _mm_set1_ps(0.0415560f)));
+			offsetB = _mm_add_ps(_mm_mul_ps(offsetX, _mm_set1_ps(0.0556434f)), _mm_mul_ps(offsetZ, _mm_set1_ps(1.0572252f)));
+		}
+
+		// Interleave the channels into four entries, and pack the halves two entries at a time.
+		// The bias keeps the halves within the signed range of the saturating pack.
+		_MM_TRANSPOSE4_PS(margin, offsetR, offsetG, offsetB);
+
+		__m128i halves01 = _mm_packs_epi32(_mm_sub_epi32(FloatToHalfSIMD(margin), halfBias), _mm_sub_epi32(FloatToHalfSIMD(offsetR), halfBias));
+		__m128i halves23 = _mm_packs_epi32(_mm_sub_epi32(FloatToHalfSIMD(offsetG), halfBias), _mm_sub_epi32(FloatToHalfSIMD(offsetB), halfBias));
+
+		_mm_storeu_si128((__m128i*)(outLUT.data() + i * KEY_LUT_CHANNELS), _mm_add_epi16(halves01, packedHalfBias));
+		_mm_storeu_si128((__m128i*)(outLUT.data() + i * KEY_LUT_CHANNELS + 8), _mm_add_epi16(halves23, packedHalfBias));
+	}
+}
+
+
+
+KeyLUTBakeThread::KeyLUTBakeThread()
+{
+	m_thread = std::thread(&KeyLUTBakeThread::RunThread, this);
+}
+
+KeyLUTBakeThread::~KeyLUTBakeThread()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_bRunThread = false;
+	}
+	m_threadCondition.notify_all();
+
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+
+void KeyLUTBakeThread::RequestBake(const KeyLUTParams& params)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_requestParams = params;
+		m_bBakePending = true;
+	}
+	m_threadCondition.notify_all();
+}
+
+
+// Requests for a table that is already queued are dropped.
+void KeyLUTBakeThread::RequestProfileBake(const KeyLUTParams& params)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+
+		if (std::find(m_profileRequests.begin(), m_profileRequests.end(), params) != m_profileRequests.end())
+		{
+			return;
+		}
+
+		m_profileRequests.push_back(params);
+	}
+	m_threadCondition.notify_all();
+}
+
+
+bool KeyLUTBakeThread::GetResult(KeyLUTParams& outParams, std::vector<uint16_t>& inOutLUT)
+{
+	std::lock_guard<std::mutex> lock(m_threadMutex);
+
+	if (!m_bResultPending)
+	{
+		return false;
+	}
+
+	outParams = m_resultParams;
+	inOutLUT.swap(m_result);
+	m_bResultPending = false;
+	return true;
+}
+
+
+bool KeyLUTBakeThread::GetProfileResult(KeyLUTParams& outParams, std::vector<uint16_t>& outLUT)
+{
+	std::lock_guard<std::mutex> lock(m_threadMutex);
+
+	if (m_profileResults.empty())
+	{
+		return false;
+	}
+
+	outParams = m_profileResults.front().first;
+	outLUT.swap(m_profileResults.front().second);
+	m_profileResults.pop_front();
+	return true;
+}
+
+
+void KeyLUTBakeThread::RunThread()
+{
+	std::vector<uint16_t> lut;
+	std::unique_lock<std::mutex> lock(m_threadMutex);
+
+	while (true)
+	{
+		m_threadCondition.wait(lock, [this] { return !m_bRunThread || m_bBakePending || !m_profileRequests.empty(); });
+
+		if (!m_bRunThread) { return; }
+
+		// The live table is being edited, so it goes before the profiles.
+		bool bLiveBake = m_bBakePending;
+		KeyLUTParams params;
+
+		if (bLiveBake)
+		{
+			params = m_requestParams;
+			m_bBakePending = false;
+		}
+		else
+		{
+			params = m_profileRequests.front();
+			m_profileRequests.pop_front();
+		}
+
+		lock.unlock();
+
+		m_baker.Bake(params, lut);
+
+		lock.lock();
+
+		if (bLiveBake)
+		{
+			// Replaces any older result that wasn't taken yet.
+			m_resultParams = params;
+			m_result.swap(lut);
+			m_bResultPending = true;
+		}
+		else
+		{
+			m_profileResults.emplace_back(params, std::move(lut));
+			lut.clear();
+		}
+	}
+}
+
+float EvaluateKeyLUTAlpha(const float rgb[3], const KeyLUTParams& params)
+{
+	float alpha = 0.0f;
+
+	for (uint32_t k = 0; k < std::min(params.numKeys, (uint32_t)KEY_LUT_MAX_KEYS); k++)
+	{
+		KeyMaskParams keyParams;
+		memcpy(keyParams.keyColor, params.keys[k].keyColor, sizeof(keyParams.keyColor));
+		keyParams.fracChroma = params.keys[k].fracChroma;
+		keyParams.fracLuma = params.keys[k].fracLuma;
+		keyParams.smooth = params.smooth;
+		keyParams.colorSpace = params.colorSpace;
+
+		alpha = std::max(alpha, EvaluateKeyAlpha(rgb, keyParams));
+	}
+
+	return alpha;
+}
+
+
+void DespillKeyColor(const float rgb[3], const KeyLUTParams& params, float outRGB[3])
+{
+	float lab[3];
+	LinearRGBToLAB(rgb, lab);
+	float despilled[3] = { lab[0], lab[1], lab[2] };
+
+	for (uint32_t k = 0; k < std::min(params.numKeys, (uint32_t)KEY_LUT_MAX_KEYS); k++)
+	{
+		float keyLAB[3];
+		LinearRGBToLAB(params.keys[k].keyColor, keyLAB);
+		float keyChroma = sqrtf(keyLAB[1] * keyLAB[1] + keyLAB[2] * keyLAB[2]);
+
+		if (params.despillStrength <= 0.0f || keyChroma < KEY_LUT_MIN_DESPILL_CHROMA)
+		{
+			continue;
+		}
+
+		float hueA = keyLAB[1] / keyChroma;
+		float hueB = keyLAB[2] / keyChroma;
+
+		// The weight is from the distance of the original color, as the baker computes it.
+		float distChroma = sqrtf((lab[1] - keyLAB[1]) * (lab[1] - keyLAB[1]) + (lab[2] - keyLAB[2]) * (lab[2] - keyLAB[2]));
+		float weight = params.despillStrength * (1.0f - SmoothStep01(distChroma / std::max(params.despillRange, KEY_LUT_MIN_DESPILL_CHROMA)));
+		float hue = std::max(despilled[1] * hueA + despilled[2] * hueB, 0.0f);
+
+		despilled[1] -= hueA * hue * weight;
+		despilled[2] -= hueB * hue * weight;
+	}
+
+	float original[3];
+	float shifted[3];
+	LABToLinearRGB(lab, original);
+	LABToLinearRGB(despilled, shifted);
+
+	// Applied as an offset like the LUT does, so the round trip error of the conversions cancels out.
+	for (int c = 0; c < 3; c++)
+	{
+		outRGB[c] = rgb[c] + shifted[c] - original[c];
+	}
+}
+
+
+float SampleKeyLUTReference(const std::vector<uint16_t>& lut, const float rgb[3], float outDespilled[3])
+{
+	int base[3];
+	float frac[3];
+
+	for (int c = 0; c < 3; c++)
+	{
+		float coord = sqrtf(std::clamp(rgb[c], 0.0f, 1.0f)) * (KEY_LUT_SIZE - 1);
+		base[c] = std::min((int)coord, KEY_LUT_SIZE - 2);
+		frac[c] = coord - base[c];
+	}
+
+	float result[KEY_LUT_CHANNELS] = {};
+
+	for (int corner = 0; corner < 8; corner++)
+	{
+		int x = base[0] + (corner & 1);
+		int y = base[1] + ((corner >> 1) & 1);
+		int z = base[2] + ((corner >> 2) & 1);
+
+		float weight = ((corner & 1) ? frac[0] : 1.0f - frac[0]) * (((corner >> 1) & 1) ? frac[1] : 1.0f - frac[1]) * (((corner >> 2) & 1) ? frac[2] : 1.0f - frac[2]);
+		const uint16_t* entry = lut.data() + ((z * KEY_LUT_SIZE + y) * KEY_LUT_SIZE + x) * KEY_LUT_CHANNELS;
+
+		for (int c = 0; c < KEY_LUT_CHANNELS; c++)
+		{
+			result[c] += weight * HalfToFloat(entry[c]);
+		}
+	}
+
+	for (int c = 0; c < 3; c++)
+	{
+		outDespilled[c] = std::max(rgb[c] + result[c + 1], 0.0f);
+	}
+
+	return 1.0f - SmoothStep01(result[0]);
+}
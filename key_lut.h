@@ -0,0 +1,129 @@
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "shared_structs.h"
+
+
+// Edge length of the key LUT. Matches KEY_LUT_SIZE in util.hlsl.
+#define KEY_LUT_SIZE 64
+
+// Covers MaskedKeyColor and the CONFIG_MAX_EXTRA_KEYS extra keys.
+#define KEY_LUT_MAX_KEYS 4
+
+// Half float channels of each entry: the key margin and the despill offset.
+#define KEY_LUT_CHANNELS 4
+
+
+// Key color with its ranges, in the units used by the masked shaders.
+struct KeyLUTKey
+{
+	float keyColor[3] = { 0.0f, 0.0f, 0.0f };
+	float fracChroma = 20.0f;
+	float fracLuma = 40.0f;
+
+	bool operator==(const KeyLUTKey&) const = default;
+};
+
+
+struct KeyLUTParams
+{
+	KeyLUTKey keys[KEY_LUT_MAX_KEYS];
+	uint32_t numKeys = 0;
+	float smooth = 1.0f;
+	// Space the key distances are measured in. The despill always works in CIELAB.
+	EKeyColorSpace colorSpace = KeyColorSpace_CIELAB;
+	// Share of the key hue removed from colors at the key, and the chroma distance in LAB units it fades out over.
+	float despillStrength = 0.0f;
+	float despillRange = 50.0f;
+
+	bool operator==(const KeyLUTParams&) const = default;
+};
+
+
+// Bakes the union of the keys into a 3D table, so the shaders take a single filtered lookup
+// for any number of keys. The table is indexed by the square root of the linear color,
+// which spends more of the entries on the dark colors.
+//
+// Rather than alpha, the table holds the key margin: the distance past the nearest key's ranges
+// in units of the smoothing, which the shaders pass through the smoothstep. The margin is
+// smooth across the range edges, so the filtering keeps the edges as sharp as the smoothing
+// sets them, where filtered alpha would blur them over a table entry.
+//
+// The other three channels hold the despill offset, the linear RGB change that removes the spilled
+// key hue from the entry color. Keying the camera image already samples the table at the camera
+// color, so the despill comes with the same lookup.
+class KeyLUTBaker
+{
+public:
+
+	KeyLUTBaker();
+
+	// Fills the table with RGBA16F entries in red, green, blue order, blue changing slowest.
+	void Bake(const KeyLUTParams& params, std::vector<uint16_t>& outLUT) const;
+
+private:
+
+	// The LAB values of the table entries never change, so they are converted once.
+	std::vector<float> m_entryL;
+	std::vector<float> m_entryA;
+	std::vector<float> m_entryB;
+};
+
+
+// Bakes the tables on a background thread, so the renderer keeps the previous table
+// while the key settings are changing. Only the latest live request is baked, while
+// the profile requests are all baked in order, after any pending live request.
+class KeyLUTBakeThread
+{
+public:
+
+	KeyLUTBakeThread();
+	~KeyLUTBakeThread();
+
+	void RequestBake(const KeyLUTParams& params);
+	void RequestProfileBake(const KeyLUTParams& params);
+
+	// Swaps the finished table into the given buffer, reusing the buffer for a later bake.
+	bool GetResult(KeyLUTParams& outParams, std::vector<uint16_t>& inOutLUT);
+
+	// Takes the oldest finished profile table.
+	bool GetProfileResult(KeyLUTParams& outParams, std::vector<uint16_t>& outLUT);
+
+	// Baking is const, so the baker can also be used on other threads while the thread runs.
+	const KeyLUTBaker& GetBaker() const { return m_baker; }
+
+private:
+
+	void RunThread();
+
+	KeyLUTBaker m_baker;
+
+	std::thread m_thread;
+	std::mutex m_threadMutex;
+	std::condition_variable m_threadCondition;
+	bool m_bRunThread = true;
+	bool m_bBakePending = false;
+	bool m_bResultPending = false;
+
+	KeyLUTParams m_requestParams;
+	KeyLUTParams m_resultParams;
+	std::vector<uint16_t> m_result;
+
+	std::deque<KeyLUTParams> m_profileRequests;
+	std::deque<std::pair<KeyLUTParams, std::vector<uint16_t>>> m_profileResults;
+};
+
+
+// Alpha of the keys combined by union, each evaluated like EvaluateKeyAlpha.
+float EvaluateKeyLUTAlpha(const float rgb[3], const KeyLUTParams& params);
+
+// Removes the hue of each key in turn from a linear color, shifting the LAB chroma away from the key hue
+// by the strength, faded out with the chroma distance to the key. Lightness is kept.
+void DespillKeyColor(const float rgb[3], const KeyLUTParams& params, float outRGB[3]);
+
+// Alpha and despilled color from a trilinear lookup of a linear color, like SampleKeyLUT in util.hlsl.
+float SampleKeyLUTReference(const std::vector<uint16_t>& lut, const float rgb[3], float outDespilled[3]);
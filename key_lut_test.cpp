@@ -0,0 +1,480 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "key_lut.h"
+#include "key_mask.h"
+#include "synthetic_frames.h"
+
+
+// Colors compared between the key LUT and the analytic key, and the spread of the colors around the keys in linear units.
+#define SELF_TEST_LUT_SAMPLES 200000
+#define SELF_TEST_LUT_KEY_SPREAD 0.15f
+#define SELF_TEST_LUT_BAKES 10
+
+// Fractions of the key light mixed into the foreground colors of the despill check.
+#define SELF_TEST_DESPILL_LEVELS 3
+static const float g_despillLevels[SELF_TEST_DESPILL_LEVELS] = { 0.1f, 0.2f, 0.35f };
+
+// Largest linear RGB error of the LAB round trip.
+#define SELF_TEST_LAB_ROUND_TRIP_ERROR 0.0001f
+
+
+// Green and blue screen keys at the default ranges and smoothing, like FillKeyLUTParams sets them.
+static KeyLUTParams GetSelfTestKeyLUTParams(const EKeyColorSpace colorSpace)
+{
+	const float keyColors[2][3] = { { 0.15f, 0.7f, 0.25f }, { 0.1f, 0.25f, 0.75f } };
+
+	KeyLUTParams params;
+	params.numKeys = 2;
+	params.colorSpace = colorSpace;
+
+	for (uint32_t k = 0; k < params.numKeys; k++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			params.keys[k].keyColor[c] = powf(keyColors[k][c], 2.2f);
+		}
+	}
+	return params;
+}
+
+
+// Random linear color, around one of the keys for half of the colors, where the ranges end.
+static void GetSelfTestLUTColor(const KeyLUTParams& params, uint32_t& randomState, float outRGB[3])
+{
+	uint32_t choice = NextRandom(randomState) % (params.numKeys * 2);
+
+	for (int c = 0; c < 3; c++)
+	{
+		float random = (float)NextRandom(randomState) / (1 << 24);
+
+		if (choice < params.numKeys)
+		{
+			outRGB[c] = std::clamp(params.keys[choice].keyColor[c] + (random * 2.0f - 1.0f) * SELF_TEST_LUT_KEY_SPREAD, 0.0f, 1.0f);
+		}
+		else
+		{
+			outRGB[c] = random;
+		}
+	}
+}
+
+
+// Compares the alpha of the baked table against the analytic key at the entries, where only the
+// half float rounding differs, and between them, where the trilinear filtering does.
+// Also checks that the background baker returns the latest live request and every profile request.
+bool TestKeyLUTBake()
+{
+	KeyLUTParams params = GetSelfTestKeyLUTParams(KeyColorSpace_CIELAB);
+	KeyLUTBaker baker;
+	std::vector<uint16_t> lut;
+
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+	for (int i = 0; i < SELF_TEST_LUT_BAKES; i++)
+	{
+		baker.Bake(params, lut);
+	}
+	float bakeTimeMS = GetElapsedMS(startTime) / SELF_TEST_LUT_BAKES;
+
+	float entryMaxError = 0.0f;
+	float despilled[3];
+
+	for (int z = 0; z < KEY_LUT_SIZE; z++)
+	{
+		for (int y = 0; y < KEY_LUT_SIZE; y++)
+		{
+			for (int x = 0; x < KEY_LUT_SIZE; x++)
+			{
+				const int index[3] = { x, y, z };
+				float rgb[3];
+				for (int c = 0; c < 3; c++)
+				{
+					float coord = (float)index[c] / (KEY_LUT_SIZE - 1);
+					rgb[c] = coord * coord;
+				}
+
+				float error = fabsf(SampleKeyLUTReference(lut, rgb, despilled) - EvaluateKeyLUTAlpha(rgb, params));
+				entryMaxError = std::max(entryMaxError, error);
+			}
+		}
+	}
+
+	uint32_t randomState = 1;
+	double sampleError = 0.0;
+	uint32_t numFlipped = 0;
+	uint32_t numEdge = 0;
+
+	for (uint32_t i = 0; i < SELF_TEST_LUT_SAMPLES; i++)
+	{
+		float rgb[3];
+		GetSelfTestLUTColor(params, randomState, rgb);
+
+		float lutAlpha = SampleKeyLUTReference(lut, rgb, despilled);
+		float alpha = EvaluateKeyLUTAlpha(rgb, params);
+
+		sampleError += fabsf(lutAlpha - alpha);
+
+		if (alpha > 0.0f && alpha < 1.0f)
+		{
+			numEdge++;
+		}
+		if ((lutAlpha >= 0.5f) != (alpha >= 0.5f))
+		{
+			numFlipped++;
+		}
+	}
+
+	float meanError = (float)(sampleError / SELF_TEST_LUT_SAMPLES);
+	float flippedFraction = (float)numFlipped / SELF_TEST_LUT_SAMPLES;
+
+	// The first request is replaced by the second if the thread hasn't started on it yet.
+	KeyLUTParams requestParams = GetSelfTestKeyLUTParams(KeyColorSpace_CIELAB);
+	requestParams.keys[0].fracChroma = 30.0f;
+
+	KeyLUTBakeThread bakeThread;
+	bakeThread.RequestBake(params);
+	bakeThread.RequestBake(requestParams);
+
+	KeyLUTParams resultParams;
+	std::vector<uint16_t> resultLUT;
+	QueryPerformanceCounter(&startTime);
+	bool bGotResult = false;
+
+	while (GetElapsedMS(startTime) < 5000.0f)
+	{
+		if (bakeThread.GetResult(resultParams, resultLUT) && resultParams == requestParams)
+		{
+			bGotResult = true;
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	float requestTimeMS = GetElapsedMS(startTime);
+
+	baker.Bake(requestParams, lut);
+	bool bResultMatches = bGotResult && resultLUT == lut;
+
+	// Profile requests are all baked in order, with the repeated one dropped while it is queued,
+	// and a live request made meanwhile is baked as well.
+	KeyLUTParams profileParams[2] = { params, requestParams };
+	profileParams[1].keys[0].fracLuma = 0.2f;
+	KeyLUTParams liveParams = profileParams[1];
+	liveParams.smooth = 0.05f;
+
+	bakeThread.RequestProfileBake(profileParams[0]);
+	bakeThread.RequestProfileBake(profileParams[1]);
+	bakeThread.RequestProfileBake(profileParams[1]);
+	bakeThread.RequestBake(liveParams);
+
+	std::vector<KeyLUTParams> profileResults;
+	bool bProfileResultsMatch = true;
+	bool bGotLiveResult = false;
+	QueryPerformanceCounter(&startTime);
+
+	while (GetElapsedMS(startTime) < 5000.0f && (profileResults.size() < 2 || !bGotLiveResult))
+	{
+		std::vector<uint16_t> profileLUT;
+		if (bakeThread.GetProfileResult(resultParams, profileLUT))
+		{
+			baker.Bake(resultParams, lut);
+			bProfileResultsMatch &= profileLUT == lut;
+			profileResults.push_back(resultParams);
+		}
+
+		bGotLiveResult |= bakeThread.GetResult(resultParams, resultLUT) && resultParams == liveParams;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	std::vector<uint16_t> profileLUT;
+	bool bExtraProfileResult = bakeThread.GetProfileResult(resultParams, profileLUT);
+
+	bool bProfilesMatch = bProfileResultsMatch && bGotLiveResult && !bExtraProfileResult && profileResults.size() == 2 &&
+		profileResults[0] == profileParams[0] && profileResults[1] == profileParams[1];
+
+	Log("Key LUT bake: %.2f ms per bake, entry alpha error %.5f, mean error %.5f between the entries, %.2f%% of %u colors flipped (%u at the range edges), background bake %s in %.1f ms, profile bakes %s\n",
+		bakeTimeMS, entryMaxError, meanError, flippedFraction * 100.0f, SELF_TEST_LUT_SAMPLES, numEdge, bResultMatches ? "matched" : "DIFFERED", requestTimeMS, bProfilesMatch ? "matched" : "DIFFERED");
+
+	return entryMaxError < 0.004f && meanError < 0.01f && flippedFraction < 0.01f && bResultMatches && bProfilesMatch;
+}
+
+
+static float GetLABDistance(const float rgb0[3], const float rgb1[3])
+{
+	float lab0[3];
+	float lab1[3];
+	LinearRGBToLAB(rgb0, lab0);
+	LinearRGBToLAB(rgb1, lab1);
+
+	return sqrtf((lab0[0] - lab1[0]) * (lab0[0] - lab1[0]) + (lab0[1] - lab1[1]) * (lab0[1] - lab1[1]) + (lab0[2] - lab1[2]) * (lab0[2] - lab1[2]));
+}
+
+
+// LAB chroma component of a color along the key hue, and its chroma distance to another color.
+static float GetKeyHueComponent(const float rgb[3], const float keyRGB[3])
+{
+	float lab[3];
+	float keyLAB[3];
+	LinearRGBToLAB(rgb, lab);
+	LinearRGBToLAB(keyRGB, keyLAB);
+
+	float keyChroma = sqrtf(keyLAB[1] * keyLAB[1] + keyLAB[2] * keyLAB[2]);
+	return std::max((lab[1] * keyLAB[1] + lab[2] * keyLAB[2]) / keyChroma, 0.0f);
+}
+
+static float GetChromaDistance(const float rgb0[3], const float rgb1[3])
+{
+	float lab0[3];
+	float lab1[3];
+	LinearRGBToLAB(rgb0, lab0);
+	LinearRGBToLAB(rgb1, lab1);
+
+	return sqrtf((lab0[1] - lab1[1]) * (lab0[1] - lab1[1]) + (lab0[2] - lab1[2]) * (lab0[2] - lab1[2]));
+}
+
+
+// Mixes the green key light into foreground colors and checks that the despill takes the key hue
+// back out without changing the lightness, leaving the unspilled colors and the colors on the
+// other side of the key hue alone. Also compares the despill of the key LUT against the reference,
+// and the cost of a LUT sample against evaluating the key and the despill directly.
+bool TestKeyDespill()
+{
+	KeyLUTParams params = GetSelfTestKeyLUTParams(KeyColorSpace_CIELAB);
+	params.numKeys = 1;
+	params.despillStrength = 1.0f;
+	params.despillRange = 150.0f;
+	const float* keyColor = params.keys[0].keyColor;
+
+	// Skin, grey, a red shirt and blue jeans, in gamma space.
+	const float foregroundColors[4][3] = { { 0.8f, 0.6f, 0.5f }, { 0.5f, 0.5f, 0.5f }, { 0.7f, 0.15f, 0.15f }, { 0.2f, 0.25f, 0.45f } };
+
+	float spilledHue = 0.0f;
+	float despilledHue = 0.0f;
+	float spilledError = 0.0f;
+	float despilledError = 0.0f;
+	float maxUnspilledMove = 0.0f;
+	float maxLightnessChange = 0.0f;
+	bool bHueReduced = true;
+
+	for (int f = 0; f < 4; f++)
+	{
+		float foreground[3];
+		for (int c = 0; c < 3; c++)
+		{
+			foreground[c] = powf(foregroundColors[f][c], 2.2f);
+		}
+
+		float despilled[3];
+		DespillKeyColor(foreground, params, despilled);
+		maxUnspilledMove = std::max(maxUnspilledMove, GetLABDistance(foreground, despilled));
+
+		float hueComponents[SELF_TEST_DESPILL_LEVELS][2];
+		float chromaErrors[SELF_TEST_DESPILL_LEVELS][2];
+
+		for (int level = 0; level < SELF_TEST_DESPILL_LEVELS; level++)
+		{
+			float spilled[3];
+			for (int c = 0; c < 3; c++)
+			{
+				spilled[c] = foreground[c] * (1.0f - g_despillLevels[level]) + keyColor[c] * g_despillLevels[level];
+			}
+
+			DespillKeyColor(spilled, params, despilled);
+
+			float spilledLAB[3];
+			float despilledLAB[3];
+			LinearRGBToLAB(spilled, spilledLAB);
+			LinearRGBToLAB(despilled, despilledLAB);
+			maxLightnessChange = std::max(maxLightnessChange, fabsf(despilledLAB[0] - spilledLAB[0]));
+
+			hueComponents[level][0] = GetKeyHueComponent(spilled, keyColor);
+			hueComponents[level][1] = GetKeyHueComponent(despilled, keyColor);
+			bHueReduced = bHueReduced && (hueComponents[level][0] <= 0.0f || hueComponents[level][1] < hueComponents[level][0]);
+			spilledHue += hueComponents[level][0];
+			despilledHue += hueComponents[level][1];
+
+			chromaErrors[level][0] = GetChromaDistance(spilled, foreground);
+			chromaErrors[level][1] = GetChromaDistance(despilled, foreground);
+			spilledError += chromaErrors[level][0];
+			despilledError += chromaErrors[level][1];
+		}
+
+		Log("Key despill: foreground %d with %.0f / %.0f / %.0f%% spill, key hue component %.1f -> %.1f / %.1f -> %.1f / %.1f -> %.1f, chroma error %.1f -> %.1f / %.1f -> %.1f / %.1f -> %.1f\n",
+			f, g_despillLevels[0] * 100.0f, g_despillLevels[1] * 100.0f, g_despillLevels[2] * 100.0f,
+			hueComponents[0][0], hueComponents[0][1], hueComponents[1][0], hueComponents[1][1], hueComponents[2][0], hueComponents[2][1],
+			chromaErrors[0][0], chromaErrors[0][1], chromaErrors[1][0], chromaErrors[1][1], chromaErrors[2][0], chromaErrors[2][1]);
+	}
+
+	// Magenta has a negative component along the green key hue.
+	float magenta[3] = { 0.6f, 0.05f, 0.6f };
+	float despilledMagenta[3];
+	DespillKeyColor(magenta, params, despilledMagenta);
+	float magentaMove = GetLABDistance(magenta, despilledMagenta);
+
+	std::vector<uint16_t> lut;
+	KeyLUTBaker baker;
+	baker.Bake(params, lut);
+
+	uint32_t randomState = 1;
+	double lutError = 0.0;
+	float lutMaxError = 0.0f;
+	std::vector<float> colors(SELF_TEST_LUT_SAMPLES * 3);
+
+	for (uint32_t i = 0; i < SELF_TEST_LUT_SAMPLES; i++)
+	{
+		float* rgb = &colors[i * 3];
+		GetSelfTestLUTColor(params, randomState, rgb);
+
+		float lutDespilled[3];
+		float despilled[3];
+		SampleKeyLUTReference(lut, rgb, lutDespilled);
+		DespillKeyColor(rgb, params, despilled);
+
+		// The LUT clamps the despilled color, the reference doesn't.
+		for (int c = 0; c < 3; c++)
+		{
+			despilled[c] = std::max(despilled[c], 0.0f);
+		}
+
+		float error = GetLABDistance(lutDespilled, despilled);
+		lutError += error;
+		lutMaxError = std::max(lutMaxError, error);
+	}
+
+	float lutMeanError = (float)(lutError / SELF_TEST_LUT_SAMPLES);
+
+	float sum = 0.0f;
+	float despilled[3];
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+	for (uint32_t i = 0; i < SELF_TEST_LUT_SAMPLES; i++)
+	{
+		sum += SampleKeyLUTReference(lut, &colors[i * 3], despilled) + despilled[0];
+	}
+	float lutTimeNS = GetElapsedMS(startTime) * 1000000.0f / SELF_TEST_LUT_SAMPLES;
+
+	QueryPerformanceCounter(&startTime);
+	for (uint32_t i = 0; i < SELF_TEST_LUT_SAMPLES; i++)
+	{
+		DespillKeyColor(&colors[i * 3], params, despilled);
+		sum += EvaluateKeyLUTAlpha(&colors[i * 3], params) + despilled[0];
+	}
+	float directTimeNS = GetElapsedMS(startTime) * 1000000.0f / SELF_TEST_LUT_SAMPLES;
+
+	Log("Key despill: key hue component %.1f -> %.1f and chroma error %.1f -> %.1f on average, unspilled colors move up to %.2f dE, magenta %.3f dE, lightness change %.3f, LUT error mean %.3f dE max %.2f dE, %.0f ns per pixel with the LUT and %.0f ns direct\n",
+		spilledHue / (4 * SELF_TEST_DESPILL_LEVELS), despilledHue / (4 * SELF_TEST_DESPILL_LEVELS), spilledError / (4 * SELF_TEST_DESPILL_LEVELS), despilledError / (4 * SELF_TEST_DESPILL_LEVELS), maxUnspilledMove, magentaMove, maxLightnessChange, lutMeanError, lutMaxError, lutTimeNS, directTimeNS);
+
+	// The spill also cancels some of the red and blue chroma, which the despill doesn't bring back.
+	return bHueReduced && despilledHue < spilledHue * 0.5f && despilledError < spilledError && maxUnspilledMove < 2.0f && magentaMove < 0.01f && maxLightnessChange < 0.1f && lutMeanError < 0.05f && lutMaxError < 1.0f && sum > 0.0f;
+}
+
+
+// Checks the color conversions the key spaces are built on, and for each space compares the baked key LUT
+// against the scalar reference and keys a synthetic frame against its exact alpha. Since the masked shaders
+// key with a single LUT fetch in any space, the spaces differ in the bake time rather than the GPU cost.
+bool TestKeyColorSpaces()
+{
+	uint32_t randomState = 1;
+	float roundTripError = 0.0f;
+
+	for (uint32_t i = 0; i < SELF_TEST_LUT_SAMPLES; i++)
+	{
+		float rgb[3];
+		for (int c = 0; c < 3; c++)
+		{
+			rgb[c] = (float)NextRandom(randomState) / (1 << 24);
+		}
+
+		float lab[3];
+		float roundTrip[3];
+		LinearRGBToLAB(rgb, lab);
+		LABToLinearRGB(lab, roundTrip);
+
+		for (int c = 0; c < 3; c++)
+		{
+			roundTripError = std::max(roundTripError, fabsf(roundTrip[c] - rgb[c]));
+		}
+	}
+
+	// Grey has no chroma or saturation, and the primaries sit at their hues.
+	const float grey[3] = { 0.3f, 0.3f, 0.3f };
+	const float primaries[3][3] = { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } };
+	float greyLAB[3];
+	float greyYCbCr[3];
+	float greyHSV[3];
+	LinearRGBToLAB(grey, greyLAB);
+	LinearRGBToYCbCr(grey, greyYCbCr);
+	LinearRGBToHSV(grey, greyHSV);
+
+	bool bConversionsPassed = fabsf(greyLAB[1]) < 0.01f && fabsf(greyLAB[2]) < 0.01f && fabsf(greyYCbCr[1]) < 0.01f && fabsf(greyYCbCr[2]) < 0.01f && greyHSV[1] < 0.01f;
+
+	for (int p = 0; p < 3; p++)
+	{
+		float hsv[3];
+		LinearRGBToHSV(primaries[p], hsv);
+		bConversionsPassed = bConversionsPassed && fabsf(hsv[0] - p * 120.0f) < 0.01f;
+	}
+
+	Log("Key color spaces: LAB round trip error %.6f, conversions %s\n", roundTripError, bConversionsPassed ? "matched" : "DIFFERED");
+
+	WorkerPool workerPool(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+	SyntheticSceneParams sceneParams = GetKeySceneParams();
+	SyntheticScene scene(sceneParams);
+	SyntheticFrame frame;
+	scene.Render(workerPool, 0, frame);
+
+	const char* spaceNames[3] = { "CIELAB", "Y'CbCr", "HSV" };
+	const EKeyColorSpace spaces[3] = { KeyColorSpace_CIELAB, KeyColorSpace_YCbCr, KeyColorSpace_HSV };
+	KeyLUTBaker baker;
+	std::vector<uint16_t> lut;
+	bool bSpacesPassed = true;
+
+	for (int space = 0; space < 3; space++)
+	{
+		KeyLUTParams params = GetSelfTestKeyLUTParams(spaces[space]);
+
+		LARGE_INTEGER startTime;
+		QueryPerformanceCounter(&startTime);
+		for (int i = 0; i < SELF_TEST_LUT_BAKES; i++)
+		{
+			baker.Bake(params, lut);
+		}
+		float bakeTimeMS = GetElapsedMS(startTime) / SELF_TEST_LUT_BAKES;
+
+		randomState = 1;
+		double lutError = 0.0;
+
+		for (uint32_t i = 0; i < SELF_TEST_LUT_SAMPLES; i++)
+		{
+			float rgb[3];
+			float despilled[3];
+			GetSelfTestLUTColor(params, randomState, rgb);
+			lutError += fabsf(SampleKeyLUTReference(lut, rgb, despilled) - EvaluateKeyLUTAlpha(rgb, params));
+		}
+
+		float lutMeanError = (float)(lutError / SELF_TEST_LUT_SAMPLES);
+
+		KeyMaskParams keyParams = GetKeySceneMaskParams(sceneParams);
+		keyParams.colorSpace = spaces[space];
+		KeyMaskImage mask;
+
+		QueryPerformanceCounter(&startTime);
+		GenerateKeyMaskReference(frame.image.data(), frame.width, frame.height, keyParams, 1, mask);
+		float keyTimeMS = GetElapsedMS(startTime);
+
+		float iou = GetKeyIoU(frame, mask.alpha);
+
+		Log("Key color spaces: %s bake %.2f ms, LUT mean alpha error %.5f, key IoU %.3f against the exact alpha, reference keying %.1f Mpix/s\n",
+			spaceNames[space], bakeTimeMS, lutMeanError, iou, (float)frame.width * frame.height / (keyTimeMS * 1000.0f));
+
+		bSpacesPassed = bSpacesPassed && lutMeanError < 0.005f && iou > 0.8f;
+	}
+
+	return roundTripError < SELF_TEST_LAB_ROUND_TRIP_ERROR && bConversionsPassed && bSpacesPassed;
+}
+
+#endif
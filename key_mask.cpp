@@ -0,0 +1,481 @@
+
+#include "pch.h"
+#include "key_mask.h"
+#include <emmintrin.h>
+
+
+struct SRGBToLinearTable
+{
+	float values[256];
+
+	SRGBToLinearTable()
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			float value = i / 255.0f;
+			values[i] = (value > 0.04045f) ? powf((value + 0.055f) / 1.055f, 2.4f) : value / 12.92f;
+		}
+	}
+};
+
+static const SRGBToLinearTable g_sRGBToLinear;
+
+
+const float* GetSRGBToLinearTable()
+{
+	return g_sRGBToLinear.values;
+}
+
+
+static inline float LABCurve(const float value)
+{
+	return (value > 0.008856f) ? cbrtf(value) : (7.787f * value) + (16.0f / 116.0f);
+}
+
+
+void LinearRGBToLAB(const float rgb[3], float outLAB[3])
+{
+	// Same matrix and D65 reference as util.hlsl.
+	float x = (0.4124564f * rgb[0] + 0.3575761f * rgb[1] + 0.1804375f * rgb[2]) / 0.95047f;
+	float y = (0.2126729f * rgb[0] + 0.7151522f * rgb[1] + 0.0721750f * rgb[2]);
+	float z = (0.0193339f * rgb[0] + 0.1191920f * rgb[1] + 0.9503041f * rgb[2]) / 1.08883f;
+
+	x = LABCurve(x);
+	y = LABCurve(y);
+	z = LABCurve(z);
+
+	outLAB[0] = 116.0f * y - 16.0f;
+	outLAB[1] = 500.0f * (x - y);
+	outLAB[2] = 200.0f * (y - z);
+}
+
+
+static inline float LABCurveInverse(const float value)
+{
+	return (value > 0.206897f) ? value * value * value : (value - 16.0f / 116.0f) / 7.787f;
+}
+
+
+void LABToLinearRGB(const float lab[3], float outRGB[3])
+{
+	float y = (lab[0] + 16.0f) / 116.0f;
+	float x = LABCurveInverse(lab[1] / 500.0f + y) * 0.95047f;
+	float z = LABCurveInverse(y - lab[2] / 200.0f) * 1.08883f;
+	y = LABCurveInverse(y);
+
+	outRGB[0] = 3.2404542f * x - 1.5371385f * y - 0.4985314f * z;
+	outRGB[1] = -0.9692660f * x + 1.8760108f * y + 0.0415560f * z;
+	outRGB[2] = 0.0556434f * x - 0.2040259f * y + 1.0572252f * z;
+}
+
+
+void LinearRGBToYCbCr(const float rgb[3], float outYCbCr[3])
+{
+	float r = sqrtf(std::max(rgb[0], 0.0f));
+	float g = sqrtf(std::max(rgb[1], 0.0f));
+	float b = sqrtf(std::max(rgb[2], 0.0f));
+	float y = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+
+	outYCbCr[0] = y * 100.0f;
+	outYCbCr[1] = (b - y) / 1.8556f * KEY_YCBCR_CHROMA_SCALE;
+	outYCbCr[2] = (r - y) / 1.5748f * KEY_YCBCR_CHROMA_SCALE;
+}
+
+
+void LinearRGBToHSV(const float rgb[3], float outHSV[3])
+{
+	float r = sqrtf(std::max(rgb[0], 0.0f));
+	float g = sqrtf(std::max(rgb[1], 0.0f));
+	float b = sqrtf(std::max(rgb[2], 0.0f));
+
+	float maxValue = std::max(r, std::max(g, b));
+	float chroma = maxValue - std::min(r, std::min(g, b));
+	float invChroma = 1.0f / std::max(chroma, 1e-6f);
+
+	float hue;
+	if (maxValue == r)
+	{
+		hue = (g - b) * invChroma;
+	}
+	else if (maxValue == g)
+	{
+		hue = (b - r) * invChroma + 2.0f;
+	}
+	else
+	{
+		hue = (r - g) * invChroma + 4.0f;
+	}
+
+	hue *= 60.0f;
+	outHSV[0] = (hue < 0.0f) ? hue + 360.0f : hue;
+	outHSV[1] = chroma / std::max(maxValue, 1e-6f) * 100.0f;
+	outHSV[2] = maxValue * 100.0f;
+}
+
+
+static inline float SmoothStep(const float edge0, const float edge1, const float value)
+{
+	float t = std::clamp((value - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+	return t * t * (3.0f - 2.0f * t);
+}
+
+
+float EvaluateKeyAlpha(const float rgb[3], const KeyMaskParams& params)
+{
+	if (params.colorSpace == KeyColorSpace_HSV)
+	{
+		float hsv[3];
+		float keyHSV[3];
+		LinearRGBToHSV(rgb, hsv);
+		LinearRGBToHSV(params.keyColor, keyHSV);
+
+		float diffHue = fabsf(hsv[0] - keyHSV[0]);
+		diffHue = std::min(diffHue, 360.0f - diffHue) * KEY_HSV_HUE_SCALE;
+
+		float distHue = SmoothStep(params.fracChroma, params.fracChroma + params.smooth, diffHue);
+		float distValue = SmoothStep(params.fracLuma, params.fracLuma + params.smooth, fabsf(hsv[2] - keyHSV[2]));
+		float distSaturation = SmoothStep(0.0f, params.smooth, KEY_HSV_MIN_SATURATION - hsv[1]);
+
+		return 1.0f - std::max(std::max(distHue, distValue), distSaturation);
+	}
+
+	float color[3];
+	float key[3];
+
+	if (params.colorSpace == KeyColorSpace_YCbCr)
+	{
+		LinearRGBToYCbCr(rgb, color);
+		LinearRGBToYCbCr(params.keyColor, key);
+	}
+	else
+	{
+		LinearRGBToLAB(rgb, color);
+		LinearRGBToLAB(params.keyColor, key);
+	}
+
+	float diffL = color[0] - key[0];
+	float diffA = color[1] - key[1];
+	float diffB = color[2] - key[2];
+
+	float fracChromaSqr = params.fracChroma * params.fracChroma;
+	float distChroma = SmoothStep(fracChromaSqr, fracChromaSqr + params.smooth * params.smooth, diffA * diffA + diffB * diffB);
+	float distLuma = SmoothStep(params.fracLuma, params.fracLuma + params.smooth, fabsf(diffL));
+
+	return 1.0f - std::max(distChroma, distLuma);
+}
+
+
+// Bilinear sample in linear space, like the sampler does for the sRGB textures.
+static void SampleImage(const uint8_t* image, const uint32_t width, const uint32_t height, const float x, const float y, float outRGB[3])
+{
+	const float* toLinear = GetSRGBToLinearTable();
+
+	float sampleX = std::clamp(x, 0.0f, width - 1.0f);
+	float sampleY = std::clamp(y, 0.0f, height - 1.0f);
+	uint32_t x0 = (uint32_t)sampleX;
+	uint32_t y0 = (uint32_t)sampleY;
+	uint32_t x1 = std::min(x0 + 1, width - 1);
+	uint32_t y1 = std::min(y0 + 1, height - 1);
+	float fx = sampleX - x0;
+	float fy = sampleY - y0;
+
+	for (int c = 0; c < 3; c++)
+	{
+		float top = toLinear[image[(y0 * width + x0) * 4 + c]] * (1.0f - fx) + toLinear[image[(y0 * width + x1) * 4 + c]] * fx;
+		float bottom = toLinear[image[(y1 * width + x0) * 4 + c]] * (1.0f - fx) + toLinear[image[(y1 * width + x1) * 4 + c]] * fx;
+		outRGB[c] = top * (1.0f - fy) + bottom * fy;
+	}
+}
+
+
+void GenerateKeyMaskReference(const uint8_t* image, const uint32_t width, const uint32_t height, const KeyMaskParams& params, const uint32_t divisor, KeyMaskImage& outMask)
+{
+	const uint32_t scale = std::clamp(divisor, 1u, (uint32_t)KEY_MASK_MAX_DIVISOR);
+
+	outMask.width = (width + scale - 1) / scale;
+	outMask.height = (height + scale - 1) / scale;
+	outMask.alpha.resize(outMask.width * outMask.height);
+	outMask.guide.resize(outMask.width * outMask.height * 3);
+
+	for (uint32_t y = 0; y < outMask.height; y++)
+	{
+		for (uint32_t x = 0; x < outMask.width; x++)
+		{
+			// The mask texel centers land between the image pixels for even divisors.
+			float rgb[3];
+			SampleImage(image, width, height, (x + 0.5f) * width / outMask.width - 0.5f, (y + 0.5f) * height / outMask.height - 0.5f, rgb);
+
+			uint32_t index = y * outMask.width + x;
+			outMask.alpha[index] = EvaluateKeyAlpha(rgb, params);
+
+			for (int c = 0; c < 3; c++)
+			{
+				outMask.guide[index * 3 + c] = sqrtf(rgb[c]);
+			}
+		}
+	}
+}
+
+
+void UpsampleKeyMaskReference(const uint8_t* image, const uint32_t width, const uint32_t height, const KeyMaskImage& mask, std::vector<float>& outAlpha)
+{
+	const float* toLinear = GetSRGBToLinearTable();
+
+	outAlpha.resize(width * height);
+
+	if (mask.width == 0 || mask.height == 0) { return; }
+
+	// The mask size is rounded up, so the scale is taken from the sizes rather than the divisor.
+	const float maskScaleX = (float)mask.width / width;
+	const float maskScaleY = (float)mask.height / height;
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		float maskY = (y + 0.5f) * maskScaleY - 0.5f;
+		int baseY = (int)floorf(maskY);
+		float fy = maskY - baseY;
+
+		for (uint32_t x = 0; x < width; x++)
+		{
+			float maskX = (x + 0.5f) * maskScaleX - 0.5f;
+			int baseX = (int)floorf(maskX);
+			float fx = maskX - baseX;
+
+			const uint8_t* pixel = image + (y * width + x) * 4;
+			float guide[3] = { sqrtf(toLinear[pixel[0]]), sqrtf(toLinear[pixel[1]]), sqrtf(toLinear[pixel[2]]) };
+
+			float alphaSum = 0.0f;
+			float weightSum = 0.0f;
+
+			for (int tap = 0; tap < 4; tap++)
+			{
+				int tapX = std::clamp(baseX + (tap & 1), 0, (int)mask.width - 1);
+				int tapY = std::clamp(baseY + (tap >> 1), 0, (int)mask.height - 1);
+				uint32_t index = tapY * mask.width + tapX;
+
+				float spatial = ((tap & 1) ? fx : 1.0f - fx) * ((tap >> 1) ? fy : 1.0f - fy);
+
+				float distSqr = 0.0f;
+				for (int c = 0; c < 3; c++)
+				{
+					float diff = guide[c] - mask.guide[index * 3 + c];
+					distSqr += diff * diff;
+				}
+
+				// The small bilinear term keeps the result defined when no tap matches the pixel.
+				float weight = spatial * (expf(-distSqr * KEY_MASK_RANGE_FACTOR) + 0.001f);
+
+				alphaSum += mask.alpha[index] * weight;
+				weightSum += weight;
+			}
+
+			outAlpha[y * width + x] = (weightSum > 0.0f) ? alphaSum / weightSum : 0.0f;
+		}
+	}
+}
+
+
+void StabilizeKeyMaskReference(KeyMaskImage& mask, const KeyMaskImage& history, const float smoothing)
+{
+	if (history.width != mask.width || history.height != mask.height) { return; }
+
+	for (uint32_t i = 0; i < mask.width * mask.height; i++)
+	{
+		float distSqr = 0.0f;
+		for (int c = 0; c < 3; c++)
+		{
+			float diff = mask.guide[i * 3 + c] - history.guide[i * 3 + c];
+			distSqr += diff * diff;
+		}
+
+		if (distSqr >= KEY_MASK_MOTION_THRESHOLD)
+		{
+			continue;
+		}
+
+		float target = (fabsf(mask.alpha[i] - history.alpha[i]) < KEY_MASK_HYSTERESIS_BAND) ? history.alpha[i] : mask.alpha[i];
+		mask.alpha[i] = target + (history.alpha[i] - target) * smoothing;
+	}
+}
+
+
+template<bool bDilate>
+inline __m128 CombineMorphology(const __m128 a, const __m128 b)
+{
+	return bDilate ? _mm_max_ps(a, b) : _mm_min_ps(a, b);
+}
+
+
+// Erodes or dilates four lines at once with the van Herk/Gil-Werman algorithm. The line is padded by the radius
+// on both sides and split into blocks of the window size. The running extremes from the start and the end of each
+// block are stored, and each window spans at most two blocks, so it only needs one value from each.
+template<bool bDilate>
+static void FilterMorphologyLines(std::vector<__m128>& line, const uint32_t radius, std::vector<__m128>& prefix, std::vector<__m128>& suffix)
+{
+	const uint32_t length = (uint32_t)line.size();
+	const uint32_t window = radius * 2 + 1;
+	const uint32_t paddedLength = length + radius * 2;
+	const __m128 pad = _mm_set1_ps(bDilate ? 0.0f : 1.0f);
+
+	prefix.resize(paddedLength);
+	suffix.resize(paddedLength);
+
+	auto loadPadded = [&](const uint32_t index)
+	{
+		return (index < radius || index >= radius + length) ? pad : line[index - radius];
+	};
+
+	for (uint32_t blockStart = 0; blockStart < paddedLength; blockStart += window)
+	{
+		uint32_t blockEnd = std::min(blockStart + window, paddedLength);
+
+		prefix[blockStart] = loadPadded(blockStart);
+		for (uint32_t i = blockStart + 1; i < blockEnd; i++)
+		{
+			prefix[i] = CombineMorphology<bDilate>(prefix[i - 1], loadPadded(i));
+		}
+
+		suffix[blockEnd - 1] = loadPadded(blockEnd - 1);
+		for (uint32_t i = blockEnd - 1; i > blockStart; i--)
+		{
+			suffix[i - 1] = CombineMorphology<bDilate>(suffix[i], loadPadded(i - 1));
+		}
+	}
+
+	for (uint32_t i = 0; i < length; i++)
+	{
+		line[i] = CombineMorphology<bDilate>(suffix[i], prefix[i + radius * 2]);
+	}
+}
+
+
+// Filters the rows four at a time, or the columns four at a time, with the lanes past the image edge duplicating the last line.
+template<bool bDilate>
+static void ApplyMorphologyPass(std::vector<float>& alpha, const uint32_t width, const uint32_t height, const uint32_t radius, const bool bVertical)
+{
+	const uint32_t numLines = bVertical ? width : height;
+	const uint32_t length = bVertical ? height : width;
+	const uint32_t lineStride = bVertical ? 1 : width;
+	const uint32_t elementStride = bVertical ? width : 1;
+
+	std::vector<__m128> line(length);
+	std::vector<__m128> prefix;
+	std::vector<__m128> suffix;
+
+	for (uint32_t firstLine = 0; firstLine < numLines; firstLine += 4)
+	{
+		uint32_t lineOffsets[4];
+		for (int lane = 0; lane < 4; lane++)
+		{
+			lineOffsets[lane] = std::min(firstLine + lane, numLines - 1) * lineStride;
+		}
+
+		for (uint32_t i = 0; i < length; i++)
+		{
+			const float* element = alpha.data() + i * elementStride;
+			line[i] = _mm_setr_ps(element[lineOffsets[0]], element[lineOffsets[1]], element[lineOffsets[2]], element[lineOffsets[3]]);
+		}
+
+		FilterMorphologyLines<bDilate>(line, radius, prefix, suffix);
+
+		for (uint32_t i = 0; i < length; i++)
+		{
+			float values[4];
+			_mm_storeu_ps(values, line[i]);
+
+			float* element = alpha.data() + i * elementStride;
+			for (uint32_t lane = 0; lane < 4 && firstLine + lane < numLines; lane++)
+			{
+				element[lineOffsets[lane]] = values[lane];
+			}
+		}
+	}
+}
+
+
+template<bool bDilate>
+static void ApplyMorphology(std::vector<float>& alpha, const uint32_t width, const uint32_t height, const uint32_t radius)
+{
+	ApplyMorphologyPass<bDilate>(alpha, width, height, radius, false);
+	ApplyMorphologyPass<bDilate>(alpha, width, height, radius, true);
+}
+
+
+void CleanupKeyMaskReference(std::vector<float>& alpha, const uint32_t width, const uint32_t height, const uint32_t radius)
+{
+	if (radius == 0 || width == 0 || height == 0 || alpha.size() < width * height) { return; }
+
+	const uint32_t clampedRadius = std::min(radius, (uint32_t)KEY_MASK_MAX_CLEANUP_RADIUS);
+
+	// Opening removes small specks of high alpha.
+	ApplyMorphology<false>(alpha, width, height, clampedRadius);
+	ApplyMorphology<true>(alpha, width, height, clampedRadius);
+
+	// Closing fills small holes of low alpha.
+	ApplyMorphology<true>(alpha, width, height, clampedRadius);
+	ApplyMorphology<false>(alpha, width, height, clampedRadius);
+}
+
+
+float GetMeanAlphaChange(const std::vector<float>& alphaA, const std::vector<float>& alphaB)
+{
+	size_t count = std::min(alphaA.size(), alphaB.size());
+	double sum = 0.0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		sum += fabsf(alphaA[i] - alphaB[i]);
+	}
+
+	return (count > 0) ? (float)(sum / count) : 0.0f;
+}
+
+
+// Marks pixels where the thresholded mask changes within the 3x3 neighborhood.
+static void FindMaskEdges(const std::vector<float>& alpha, const uint32_t width, const uint32_t height, std::vector<uint8_t>& outEdges)
+{
+	outEdges.assign(width * height, 0);
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			bool bCenter = alpha[y * width + x] >= 0.5f;
+
+			for (int dy = -1; dy <= 1 && !outEdges[y * width + x]; dy++)
+			{
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					int nx = std::clamp((int)x + dx, 0, (int)width - 1);
+					int ny = std::clamp((int)y + dy, 0, (int)height - 1);
+
+					if ((alpha[ny * width + nx] >= 0.5f) != bCenter)
+					{
+						outEdges[y * width + x] = 1;
+						break;
+					}
+				}
+			}
+		}
+	}
+}
+
+
+float GetMaskEdgeIoU(const std::vector<float>& alphaA, const std::vector<float>& alphaB, const uint32_t width, const uint32_t height)
+{
+	std::vector<uint8_t> edgesA;
+	std::vector<uint8_t> edgesB;
+	FindMaskEdges(alphaA, width, height, edgesA);
+	FindMaskEdges(alphaB, width, height, edgesB);
+
+	uint32_t intersection = 0;
+	uint32_t combined = 0;
+
+	for (uint32_t i = 0; i < width * height; i++)
+	{
+		intersection += edgesA[i] & edgesB[i];
+		combined += edgesA[i] | edgesB[i];
+	}
+
+	return (combined > 0) ? (float)intersection / combined : 1.0f;
+}
@@ -0,0 +1,96 @@
+
+#pragma once
+
+#include "shared_structs.h"
+
+
+// Weight falloff of the guide color difference when upsampling the key mask.
+// Matches MASK_UPSAMPLE_RANGE_FACTOR in passthrough_masked_upsample_ps.hlsl.
+#define KEY_MASK_RANGE_FACTOR 50.0f
+
+// Highest supported ratio between the render target and the key mask resolution.
+#define KEY_MASK_MAX_DIVISOR 4
+
+// Alpha changes smaller than the band are held at the history value. Matches MASK_HYSTERESIS_BAND in mask_key_ps.hlsl.
+#define KEY_MASK_HYSTERESIS_BAND 0.1f
+
+// Squared difference of the keyed color to the history above which a pixel is treated as moving and its
+// history discarded. Matches MASK_MOTION_THRESHOLD in mask_key_ps.hlsl.
+#define KEY_MASK_MOTION_THRESHOLD 0.01f
+
+// Largest radius of the mask cleanup, in mask texels.
+#define KEY_MASK_MAX_CLEANUP_RADIUS 15
+
+// The Y'CbCr and HSV keys compare the square root encoded color the key LUT is indexed by.
+// Cb and Cr are scaled to about the extent of the LAB chroma, and Y', saturation and value to 0-100.
+#define KEY_YCBCR_CHROMA_SCALE 200.0f
+
+// Hue difference of the HSV keys in the units of the range settings, 100 is the opposite hue.
+#define KEY_HSV_HUE_SCALE (100.0f / 180.0f)
+
+// Colors less saturated than this don't match the HSV keys, their hue being mostly noise.
+#define KEY_HSV_MIN_SATURATION 20.0f
+
+// Longest mask row or column the GPU cleanup can filter including the padding on both sides.
+// Matches MORPHOLOGY_MAX_LINE in mask_morphology_cs.hlsl.
+#define KEY_MASK_MAX_MORPHOLOGY_LINE 4096
+
+
+// Chroma key constants in the units used by the masked shaders.
+struct KeyMaskParams
+{
+	float keyColor[3] = { 0.0f, 0.0f, 0.0f };
+	float fracChroma = 20.0f;
+	float fracLuma = 40.0f;
+	float smooth = 1.0f;
+	EKeyColorSpace colorSpace = KeyColorSpace_CIELAB;
+};
+
+
+// Key mask with the keyed colors stored along the alpha, like the mask render targets.
+// The colors are kept in the gamma corrected space the range weights are computed in.
+struct KeyMaskImage
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<float> alpha;
+	std::vector<float> guide;
+};
+
+
+// CPU references of the masked shaders, for checking the mask stages without a GPU.
+// The images are sRGB encoded RGBA8, and are keyed directly without the warp mesh.
+
+// Decoded values of the sRGB encoded bytes, like the sampler returns for the sRGB textures.
+const float* GetSRGBToLinearTable();
+
+void LinearRGBToLAB(const float rgb[3], float outLAB[3]);
+void LABToLinearRGB(const float lab[3], float outRGB[3]);
+
+// Y'CbCr with the BT.709 weights, and HSV with the hue in degrees.
+void LinearRGBToYCbCr(const float rgb[3], float outYCbCr[3]);
+void LinearRGBToHSV(const float rgb[3], float outHSV[3]);
+
+// Same as a single key baked into the key LUT, returns the alpha before opacity.
+float EvaluateKeyAlpha(const float rgb[3], const KeyMaskParams& params);
+
+// Keys the image at a resolution reduced by the divisor, a divisor of 1 gives the full resolution mask.
+void GenerateKeyMaskReference(const uint8_t* image, const uint32_t width, const uint32_t height, const KeyMaskParams& params, const uint32_t divisor, KeyMaskImage& outMask);
+
+// Joint bilateral upsampling of a reduced mask, weighting the taps by their guide color difference to the image pixel.
+void UpsampleKeyMaskReference(const uint8_t* image, const uint32_t width, const uint32_t height, const KeyMaskImage& mask, std::vector<float>& outAlpha);
+
+// Blends the mask with the history of the previous frames like mask_key_ps.hlsl, with the history
+// already aligned to the mask. The mask then becomes the history of the next frame.
+void StabilizeKeyMaskReference(KeyMaskImage& mask, const KeyMaskImage& history, const float smoothing);
+
+// Removes specks and fills holes smaller than the radius, with a morphological opening followed by a closing
+// of the alpha. Like mask_morphology_cs.hlsl, the erosions and dilations are separable van Herk/Gil-Werman passes
+// that take the same time for any radius. Four lines are filtered at a time with SSE.
+void CleanupKeyMaskReference(std::vector<float>& alpha, const uint32_t width, const uint32_t height, const uint32_t radius);
+
+// Mean absolute alpha difference between two masks, the flicker between frames of a static scene.
+float GetMeanAlphaChange(const std::vector<float>& alphaA, const std::vector<float>& alphaB);
+
+// Intersection over union of the pixels within a pixel of a mask edge, for comparing a mask against the full resolution one.
+float GetMaskEdgeIoU(const std::vector<float>& alphaA, const std::vector<float>& alphaB, const uint32_t width, const uint32_t height);
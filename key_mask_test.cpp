@@ -0,0 +1,279 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "key_mask.h"
+#include "synthetic_frames.h"
+
+
+// Frames of the static scene for the flicker, with sensor noise in 8-bit units, and the later frame the scene jumps to.
+#define SELF_TEST_KEY_STATIC_FRAMES 16
+#define SELF_TEST_KEY_NOISE_SIGMA 4.0f
+#define SELF_TEST_KEY_MOVED_FRAME 30
+
+// Luma range crossed by the lighting gradient of the screen, leaving a band of partial alpha that the noise flickers.
+#define SELF_TEST_KEY_NARROW_LUMA 8.0f
+
+// Odd sized mask for comparing the cleanup against the brute force filter, and the fraction of texels flipped in the cleanup check.
+#define SELF_TEST_CLEANUP_WIDTH 67
+#define SELF_TEST_CLEANUP_HEIGHT 45
+#define SELF_TEST_CLEANUP_FLIP_FRACTION 0.02f
+
+
+// Compares the upsampled reduced resolution masks against the full resolution mask around the edges,
+// with plain bilinear upsampling as the baseline. With guide colors far from every pixel, the range
+// weights of the joint bilateral upsampling vanish and only the bilinear term is left.
+bool TestKeyMaskUpsampling()
+{
+	SyntheticSceneParams sceneParams = GetKeySceneParams();
+	SyntheticScene scene(sceneParams);
+	WorkerPool workerPool(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+
+	SyntheticFrame frame;
+	scene.Render(workerPool, 0, frame);
+
+	KeyMaskParams keyParams = GetKeySceneMaskParams(sceneParams);
+	KeyMaskImage fullMask;
+	GenerateKeyMaskReference(frame.image.data(), frame.width, frame.height, keyParams, 1, fullMask);
+
+	bool bPassed = true;
+
+	for (uint32_t divisor = 2; divisor <= KEY_MASK_MAX_DIVISOR; divisor++)
+	{
+		KeyMaskImage mask;
+		GenerateKeyMaskReference(frame.image.data(), frame.width, frame.height, keyParams, divisor, mask);
+
+		std::vector<float> upsampled;
+		UpsampleKeyMaskReference(frame.image.data(), frame.width, frame.height, mask, upsampled);
+
+		std::fill(mask.guide.begin(), mask.guide.end(), 100.0f);
+		std::vector<float> bilinear;
+		UpsampleKeyMaskReference(frame.image.data(), frame.width, frame.height, mask, bilinear);
+
+		float edgeIoU = GetMaskEdgeIoU(upsampled, fullMask.alpha, frame.width, frame.height);
+		float bilinearIoU = GetMaskEdgeIoU(bilinear, fullMask.alpha, frame.width, frame.height);
+		float meanError = GetMeanAlphaChange(upsampled, fullMask.alpha);
+
+		Log("Key mask upsampling: divisor %u, edge IoU %.3f (bilinear %.3f), mean alpha error %.4f\n", divisor, edgeIoU, bilinearIoU, meanError);
+
+		bPassed = bPassed && edgeIoU > 0.8f && edgeIoU > bilinearIoU + 0.1f && meanError < 0.005f;
+	}
+
+	return bPassed;
+}
+
+
+// Adds sensor noise with about the given standard deviation in 8-bit units, summing four uniform values.
+static void AddImageNoise(std::vector<uint8_t>& image, const float sigma, uint32_t& randomState)
+{
+	const float scale = sigma * sqrtf(3.0f) / 16777216.0f;
+
+	for (size_t i = 0; i < image.size(); i++)
+	{
+		if ((i & 3) == 3) { continue; }
+
+		float noise = ((float)NextRandom(randomState) + NextRandom(randomState) + NextRandom(randomState) + NextRandom(randomState) - 2.0f * 16777216.0f) * scale;
+		image[i] = (uint8_t)std::clamp(image[i] + noise + 0.5f, 0.0f, 255.0f);
+	}
+}
+
+
+// Measures the flicker of the half resolution mask of a static noisy scene with the temporal stabilization,
+// then jumps to a later frame of the scene, where the texels that moved have to take the new key directly.
+bool TestKeyMaskStabilization()
+{
+	SyntheticSceneParams sceneParams = GetKeySceneParams();
+	sceneParams.noiseSigma = 0.0f;
+	SyntheticScene scene(sceneParams);
+	WorkerPool workerPool(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+
+	SyntheticFrame staticFrame;
+	SyntheticFrame movedFrame;
+	scene.Render(workerPool, 0, staticFrame);
+	scene.Render(workerPool, SELF_TEST_KEY_MOVED_FRAME, movedFrame);
+
+	KeyMaskParams keyParams = GetKeySceneMaskParams(sceneParams);
+	keyParams.fracLuma = SELF_TEST_KEY_NARROW_LUMA;
+	const float smoothings[3] = { 0.0f, 0.5f, 0.8f };
+	float flicker[3];
+	bool bPassed = true;
+
+	for (int i = 0; i < 3; i++)
+	{
+		uint32_t randomState = 1;
+		KeyMaskImage history;
+		float changeSum = 0.0f;
+
+		for (uint32_t frame = 0; frame < SELF_TEST_KEY_STATIC_FRAMES; frame++)
+		{
+			std::vector<uint8_t> image = staticFrame.image;
+			AddImageNoise(image, SELF_TEST_KEY_NOISE_SIGMA, randomState);
+
+			KeyMaskImage mask;
+			GenerateKeyMaskReference(image.data(), staticFrame.width, staticFrame.height, keyParams, 2, mask);
+
+			if (frame > 0)
+			{
+				StabilizeKeyMaskReference(mask, history, smoothings[i]);
+				changeSum += GetMeanAlphaChange(mask.alpha, history.alpha);
+			}
+
+			history = std::move(mask);
+		}
+
+		flicker[i] = changeSum / (SELF_TEST_KEY_STATIC_FRAMES - 1);
+
+		std::vector<uint8_t> image = movedFrame.image;
+		AddImageNoise(image, SELF_TEST_KEY_NOISE_SIGMA, randomState);
+
+		KeyMaskImage movedMask;
+		GenerateKeyMaskReference(image.data(), movedFrame.width, movedFrame.height, keyParams, 2, movedMask);
+		std::vector<float> movedKey = movedMask.alpha;
+
+		StabilizeKeyMaskReference(movedMask, history, smoothings[i]);
+
+		// The texels the motion covered or uncovered are found from the exact alpha of both frames.
+		uint32_t numMoved = 0;
+		uint32_t numFollowed = 0;
+
+		for (uint32_t y = 0; y < movedMask.height; y++)
+		{
+			for (uint32_t x = 0; x < movedMask.width; x++)
+			{
+				float alphaChange = 0.0f;
+				for (uint32_t pixel = 0; pixel < 4; pixel++)
+				{
+					uint32_t index = (y * 2 + (pixel >> 1)) * movedFrame.width + x * 2 + (pixel & 1);
+					alphaChange += (movedFrame.alpha[index] - staticFrame.alpha[index]) * 0.25f;
+				}
+
+				if (fabsf(alphaChange) < 0.5f) { continue; }
+
+				uint32_t index = y * movedMask.width + x;
+				numMoved++;
+				numFollowed += (movedMask.alpha[index] >= 0.5f) == (movedKey[index] >= 0.5f);
+			}
+		}
+
+		float followedFraction = (float)numFollowed / std::max(numMoved, 1u);
+
+		Log("Key mask stabilization %.1f: mean alpha change per frame %.4f, %.1f%% of %u moved texels follow the key\n", smoothings[i], flicker[i], followedFraction * 100.0f, numMoved);
+
+		bPassed = bPassed && numMoved > 0 && followedFraction > 0.99f;
+	}
+
+	return bPassed && flicker[1] < flicker[0] * 0.6f && flicker[2] < flicker[1];
+}
+
+
+// Minimum or maximum over the square window around each texel, ignoring the texels past the edges.
+static void ApplyMorphologyBruteForce(std::vector<float>& alpha, const uint32_t width, const uint32_t height, const int radius, const bool bDilate)
+{
+	std::vector<float> source = alpha;
+
+	for (int y = 0; y < (int)height; y++)
+	{
+		for (int x = 0; x < (int)width; x++)
+		{
+			float value = bDilate ? 0.0f : 1.0f;
+
+			for (int windowY = std::max(y - radius, 0); windowY <= std::min(y + radius, (int)height - 1); windowY++)
+			{
+				for (int windowX = std::max(x - radius, 0); windowX <= std::min(x + radius, (int)width - 1); windowX++)
+				{
+					float sample = source[windowY * width + windowX];
+					value = bDilate ? std::max(value, sample) : std::min(value, sample);
+				}
+			}
+
+			alpha[y * width + x] = value;
+		}
+	}
+}
+
+
+static uint32_t CountWrongTexels(const std::vector<float>& alpha, const std::vector<float>& reference)
+{
+	uint32_t numWrong = 0;
+	for (size_t i = 0; i < alpha.size(); i++)
+	{
+		numWrong += (alpha[i] >= 0.5f) != (reference[i] >= 0.5f);
+	}
+	return numWrong;
+}
+
+
+// Compares the mask cleanup against a brute force opening and closing for every radius, checks that it
+// removes flipped texels from the exact alpha of a synthetic frame, and times it for a few radii.
+bool TestKeyMaskCleanup()
+{
+	uint32_t randomState = 1;
+	std::vector<float> randomAlpha(SELF_TEST_CLEANUP_WIDTH * SELF_TEST_CLEANUP_HEIGHT);
+	for (float& value : randomAlpha)
+	{
+		value = NextRandom(randomState) / 16777216.0f;
+	}
+
+	uint32_t numMismatched = 0;
+
+	for (uint32_t radius = 1; radius <= KEY_MASK_MAX_CLEANUP_RADIUS; radius++)
+	{
+		std::vector<float> alpha = randomAlpha;
+		CleanupKeyMaskReference(alpha, SELF_TEST_CLEANUP_WIDTH, SELF_TEST_CLEANUP_HEIGHT, radius);
+
+		std::vector<float> reference = randomAlpha;
+		const bool bDilateSteps[4] = { false, true, true, false };
+		for (bool bDilate : bDilateSteps)
+		{
+			ApplyMorphologyBruteForce(reference, SELF_TEST_CLEANUP_WIDTH, SELF_TEST_CLEANUP_HEIGHT, radius, bDilate);
+		}
+
+		if (alpha != reference)
+		{
+			numMismatched++;
+		}
+	}
+
+	SyntheticSceneParams sceneParams = GetKeySceneParams();
+	SyntheticScene scene(sceneParams);
+	WorkerPool workerPool(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+
+	SyntheticFrame frame;
+	scene.Render(workerPool, 0, frame);
+
+	std::vector<float> noisyAlpha = frame.alpha;
+	for (float& value : noisyAlpha)
+	{
+		if (NextRandom(randomState) < SELF_TEST_CLEANUP_FLIP_FRACTION * 16777216.0f)
+		{
+			value = 1.0f - value;
+		}
+	}
+
+	std::vector<float> cleanedAlpha = noisyAlpha;
+	CleanupKeyMaskReference(cleanedAlpha, frame.width, frame.height, 2);
+
+	uint32_t numWrongNoisy = CountWrongTexels(noisyAlpha, frame.alpha);
+	uint32_t numWrongCleaned = CountWrongTexels(cleanedAlpha, frame.alpha);
+
+	Log("Key mask cleanup: %u of %u radii differ from the brute force filter, %u wrong texels cleaned up to %u at radius 2\n",
+		numMismatched, KEY_MASK_MAX_CLEANUP_RADIUS, numWrongNoisy, numWrongCleaned);
+
+	const uint32_t timedRadii[3] = { 1, 4, KEY_MASK_MAX_CLEANUP_RADIUS };
+	for (uint32_t radius : timedRadii)
+	{
+		std::vector<float> alpha = noisyAlpha;
+
+		LARGE_INTEGER startTime;
+		QueryPerformanceCounter(&startTime);
+		CleanupKeyMaskReference(alpha, frame.width, frame.height, radius);
+
+		Log("Key mask cleanup %ux%u radius %u: %.2f ms\n", frame.width, frame.height, radius, GetElapsedMS(startTime));
+	}
+
+	return numMismatched == 0 && numWrongCleaned * 10 < numWrongNoisy;
+}
+
+#endif
@@ -0,0 +1,449 @@
+
+#include "pch.h"
+#include "key_threshold_tuner.h"
+#include "key_mask.h"
+#include "logging.h"
+#include <emmintrin.h>
+
+
+// Box filter width of the histograms when searching for the valley, in bins.
+#define VALLEY_FILTER_RADIUS 2
+
+
+static float GetSmoothedCount(const std::vector<uint64_t>& counts, const int bin)
+{
+	uint64_t sum = 0;
+	for (int i = bin - VALLEY_FILTER_RADIUS; i <= bin + VALLEY_FILTER_RADIUS; i++)
+	{
+		if (i >= 0 && i < (int)counts.size()) { sum += counts[i]; }
+	}
+	return (float)sum / (VALLEY_FILTER_RADIUS * 2 + 1);
+}
+
+
+// Splits the histogram into two classes with Otsu's method, and returns the lowest bin of the smoothed
+// histogram between the class means. Fails if the classes aren't clearly separated.
+static bool FindValleySplit(const std::vector<uint64_t>& counts, uint32_t& outBin)
+{
+	double total = 0.0;
+	double sum = 0.0;
+	double sumSqr = 0.0;
+
+	for (uint32_t i = 0; i < counts.size(); i++)
+	{
+		total += (double)counts[i];
+		sum += (double)counts[i] * i;
+		sumSqr += (double)counts[i] * i * i;
+	}
+
+	if (total == 0.0) { return false; }
+
+	double mean = sum / total;
+	double totalVariance = sumSqr / total - mean * mean;
+
+	if (totalVariance <= 0.0) { return false; }
+
+	double lowerWeight = 0.0;
+	double lowerSum = 0.0;
+	double bestVariance = 0.0;
+	double lowerMean = 0.0;
+	double upperMean = 0.0;
+	uint32_t splitBin = 0;
+
+	for (uint32_t i = 0; i + 1 < counts.size(); i++)
+	{
+		lowerWeight += (double)counts[i];
+		lowerSum += (double)counts[i] * i;
+
+		if (lowerWeight == 0.0 || lowerWeight == total) { continue; }
+
+		double meanA = lowerSum / lowerWeight;
+		double meanB = (sum - lowerSum) / (total - lowerWeight);
+		double betweenVariance = lowerWeight * (total - lowerWeight) * (meanA - meanB) * (meanA - meanB) / (total * total);
+
+		if (betweenVariance > bestVariance)
+		{
+			bestVariance = betweenVariance;
+			lowerMean = meanA;
+			upperMean = meanB;
+			splitBin = i;
+		}
+	}
+
+	if (bestVariance / totalVariance < KEY_THRESHOLD_MIN_SEPARABILITY) { return false; }
+
+	// The last bin collects all the distances past the range, and would pull the upper class mean past the gaps
+	// within the class. The valley search ends at the mean of the other upper bins, unless the class has none.
+	double upperWeight = 0.0;
+	double upperSum = 0.0;
+
+	for (uint32_t i = splitBin + 1; i + 1 < counts.size(); i++)
+	{
+		upperWeight += (double)counts[i];
+		upperSum += (double)counts[i] * i;
+	}
+
+	if (upperWeight > 0.0)
+	{
+		upperMean = upperSum / upperWeight;
+	}
+
+	int valleyStart = (int)lowerMean;
+	int valleyEnd = (int)ceil(upperMean);
+
+	int valleyBin = valleyStart;
+	float valleyCount = GetSmoothedCount(counts, valleyStart);
+
+	for (int i = valleyStart + 1; i <= valleyEnd; i++)
+	{
+		float count = GetSmoothedCount(counts, i);
+		if (count < valleyCount)
+		{
+			valleyCount = count;
+			valleyBin = i;
+		}
+	}
+
+	// Empty gaps between the classes are split in the middle, where mixed edge pixels are half keyed.
+	int valleyEndBin = valleyBin;
+	while (valleyEndBin + 1 <= valleyEnd && GetSmoothedCount(counts, valleyEndBin + 1) == valleyCount)
+	{
+		valleyEndBin++;
+	}
+	valleyBin = (valleyBin + valleyEndBin) / 2;
+
+	float lowerPeak = 0.0f;
+	float upperPeak = 0.0f;
+
+	for (int i = 0; i < (int)counts.size(); i++)
+	{
+		float count = GetSmoothedCount(counts, i);
+		if (i < valleyBin) { lowerPeak = std::max(lowerPeak, count); }
+		else { upperPeak = std::max(upperPeak, count); }
+	}
+
+	if (valleyCount > KEY_THRESHOLD_MAX_VALLEY_RATIO * std::min(lowerPeak, upperPeak)) { return false; }
+
+	outBin = (uint32_t)valleyBin;
+	return true;
+}
+
+
+void BuildKeyDistanceHistogram(WorkerPool& workerPool, const KeyCalibrationImage& image, const float keyLinear[3], std::vector<uint32_t>& outHistogram)
+{
+	const uint32_t histogramSize = KEY_THRESHOLD_CHROMA_BINS * KEY_THRESHOLD_LUMA_BINS;
+	outHistogram.assign(histogramSize, 0);
+
+	if (image.width == 0 || image.height == 0 || image.rowPitch < image.width * 4 || image.pixels.size() < (size_t)image.rowPitch * (image.height - 1) + image.width * 4)
+	{
+		return;
+	}
+
+	uint32_t step = std::max((uint32_t)ceilf(sqrtf((float)image.width * image.height / KEY_THRESHOLD_MAX_SAMPLES)), 1u);
+	while ((image.width / step) * (image.height / step) > KEY_THRESHOLD_MAX_SAMPLES)
+	{
+		step++;
+	}
+
+	const uint32_t samplesX = image.width / step;
+	const uint32_t samplesY = image.height / step;
+
+	if (samplesX == 0 || samplesY == 0)
+	{
+		return;
+	}
+
+	float keyLAB[3];
+	LinearRGBToLAB(keyLinear, keyLAB);
+
+	const float* toLinear = GetSRGBToLinearTable();
+	const int redIndex = image.bBGRA ? 2 : 0;
+	const int blueIndex = image.bBGRA ? 0 : 2;
+
+	const uint32_t numJobs = std::min(workerPool.GetNumThreads(), samplesY);
+	const uint32_t rowsPerJob = (samplesY + numJobs - 1) / numJobs;
+	std::vector<std::vector<uint32_t>> jobHistograms(numJobs);
+
+	workerPool.ParallelFor(numJobs, [&](uint32_t job)
+	{
+		std::vector<uint32_t>& histogram = jobHistograms[job];
+		histogram.assign(histogramSize, 0);
+
+		uint32_t startRow = job * rowsPerJob;
+		uint32_t endRow = std::min(startRow + rowsPerJob, samplesY);
+		if (startRow >= endRow) { return; }
+
+		// Padded to whole vectors, the padding is converted but not counted.
+		uint32_t count = (endRow - startRow) * samplesX;
+		uint32_t paddedCount = (count + 3) & ~3u;
+
+		std::vector<float> channels(paddedCount * 6, 0.0f);
+		float* red = channels.data();
+		float* green = red + paddedCount;
+		float* blue = green + paddedCount;
+		float* labL = blue + paddedCount;
+		float* labA = labL + paddedCount;
+		float* labB = labA + paddedCount;
+
+		for (uint32_t y = startRow; y < endRow; y++)
+		{
+			const uint8_t* row = image.pixels.data() + (size_t)(y * step + step / 2) * image.rowPitch;
+
+			for (uint32_t x = 0; x < samplesX; x++)
+			{
+				const uint8_t* pixel = row + (x * step + step / 2) * 4;
+				uint32_t index = (y - startRow) * samplesX + x;
+
+				red[index] = image.bSRGB ? toLinear[pixel[redIndex]] : pixel[redIndex] / 255.0f;
+				green[index] = image.bSRGB ? toLinear[pixel[1]] : pixel[1] / 255.0f;
+				blue[index] = image.bSRGB ? toLinear[pixel[blueIndex]] : pixel[blueIndex] / 255.0f;
+			}
+		}
+
+		ConvertToLABSIMD(red, green, blue, labL, labA, labB, paddedCount);
+
+		const __m128 keyL = _mm_set1_ps(keyLAB[0]);
+		const __m128 keyA = _mm_set1_ps(keyLAB[1]);
+		const __m128 keyB = _mm_set1_ps(keyLAB[2]);
+		const __m128 chromaScale = _mm_set1_ps(KEY_THRESHOLD_CHROMA_BINS / KEY_THRESHOLD_CHROMA_RANGE);
+		const __m128 chromaMaxBin = _mm_set1_ps(KEY_THRESHOLD_CHROMA_BINS - 1.0f);
+		const __m128 lumaScale = _mm_set1_ps(KEY_THRESHOLD_LUMA_BINS / KEY_THRESHOLD_LUMA_RANGE);
+		const __m128 lumaMaxBin = _mm_set1_ps(KEY_THRESHOLD_LUMA_BINS - 1.0f);
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+		alignas(16) uint32_t indices[4];
+
+		for (uint32_t i = 0; i < paddedCount; i += 4)
+		{
+			__m128 diffA = _mm_sub_ps(_mm_loadu_ps(labA + i), keyA);
+			__m128 diffB = _mm_sub_ps(_mm_loadu_ps(labB + i), keyB);
+			__m128 chroma = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(diffA, diffA), _mm_mul_ps(diffB, diffB)));
+			__m128 luma = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(labL + i), keyL), absMask);
+
+			__m128i chromaBin = _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(chroma, chromaScale), chromaMaxBin));
+			__m128i lumaBin = _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(luma, lumaScale), lumaMaxBin));
+			_mm_store_si128((__m128i*)indices, _mm_add_epi32(_mm_slli_epi32(chromaBin, KEY_THRESHOLD_LUMA_BIN_SHIFT), lumaBin));
+
+			uint32_t lanes = std::min(count - i, 4u);
+			for (uint32_t lane = 0; lane < lanes; lane++)
+			{
+				histogram[indices[lane]]++;
+			}
+		}
+	});
+
+	for (const std::vector<uint32_t>& histogram : jobHistograms)
+	{
+		if (histogram.empty()) { continue; }
+
+		for (uint32_t i = 0; i < histogramSize; i += 4)
+		{
+			__m128i sum = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(outHistogram.data() + i)), _mm_loadu_si128((const __m128i*)(histogram.data() + i)));
+			_mm_storeu_si128((__m128i*)(outHistogram.data() + i), sum);
+		}
+	}
+}
+
+
+bool SelectKeyThresholds(const std::vector<uint32_t>& histogram, KeyThresholdResult& outResult)
+{
+	outResult.bValid = false;
+
+	if (histogram.size() != KEY_THRESHOLD_CHROMA_BINS * KEY_THRESHOLD_LUMA_BINS) { return false; }
+
+	std::vector<uint64_t> chromaCounts(KEY_THRESHOLD_CHROMA_BINS, 0);
+	uint64_t total = 0;
+
+	for (uint32_t c = 0; c < KEY_THRESHOLD_CHROMA_BINS; c++)
+	{
+		for (uint32_t l = 0; l < KEY_THRESHOLD_LUMA_BINS; l++)
+		{
+			chromaCounts[c] += histogram[(c << KEY_THRESHOLD_LUMA_BIN_SHIFT) + l];
+		}
+		total += chromaCounts[c];
+	}
+
+	uint32_t chromaBin;
+	if (total == 0 || !FindValleySplit(chromaCounts, chromaBin))
+	{
+		return false;
+	}
+
+	std::vector<uint64_t> lumaCounts(KEY_THRESHOLD_LUMA_BINS, 0);
+	uint64_t keyTotal = 0;
+
+	for (uint32_t c = 0; c <= chromaBin; c++)
+	{
+		for (uint32_t l = 0; l < KEY_THRESHOLD_LUMA_BINS; l++)
+		{
+			lumaCounts[l] += histogram[(c << KEY_THRESHOLD_LUMA_BIN_SHIFT) + l];
+		}
+		keyTotal += chromaCounts[c];
+	}
+
+	outResult.keyFraction = (float)keyTotal / total;
+
+	if (outResult.keyFraction < KEY_THRESHOLD_MIN_KEY_FRACTION)
+	{
+		return false;
+	}
+
+	const float chromaBinSize = KEY_THRESHOLD_CHROMA_RANGE / KEY_THRESHOLD_CHROMA_BINS;
+	const float lumaBinSize = KEY_THRESHOLD_LUMA_RANGE / KEY_THRESHOLD_LUMA_BINS;
+
+	float chromaRange = (chromaBin + 0.5f) * chromaBinSize;
+	float lumaRange;
+
+	uint32_t lumaBin;
+	if (FindValleySplit(lumaCounts, lumaBin))
+	{
+		lumaRange = (lumaBin + 0.5f) * lumaBinSize;
+	}
+	else
+	{
+		uint64_t percentileCount = (uint64_t)(keyTotal * KEY_THRESHOLD_LUMA_PERCENTILE);
+		uint64_t cumulative = 0;
+		lumaBin = 0;
+
+		while (lumaBin + 1 < KEY_THRESHOLD_LUMA_BINS && cumulative + lumaCounts[lumaBin] < percentileCount)
+		{
+			cumulative += lumaCounts[lumaBin];
+			lumaBin++;
+		}
+
+		lumaRange = (lumaBin + 1) * lumaBinSize + KEY_THRESHOLD_LUMA_MARGIN;
+	}
+
+	// Same units as the calibration, the masked constants are the settings scaled by 100.
+	outResult.fractionChroma = std::clamp(chromaRange / 100.0f, 0.01f, 1.0f);
+	outResult.fractionLuma = std::clamp(lumaRange / 100.0f, 0.01f, 1.0f);
+	outResult.bValid = true;
+
+	return true;
+}
+
+
+bool StepKeyThreshold(float& value, const float target)
+{
+	float difference = target - value;
+
+	if (fabsf(difference) < KEY_THRESHOLD_DEADBAND)
+	{
+		return false;
+	}
+
+	value += std::clamp(difference, -KEY_THRESHOLD_MAX_STEP, KEY_THRESHOLD_MAX_STEP);
+	return true;
+}
+
+
+
+KeyThresholdTuner::KeyThresholdTuner(const uint32_t numThreads)
+	: m_workerPool(numThreads)
+{
+	m_thread = std::thread(&KeyThresholdTuner::RunThread, this);
+}
+
+KeyThresholdTuner::~KeyThresholdTuner()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_bRunThread = false;
+	}
+	m_threadCondition.notify_all();
+
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+
+bool KeyThresholdTuner::TakeFrameRequest()
+{
+	if (m_bAnalyzing)
+	{
+		return false;
+	}
+
+	if (++m_framesSinceRequest < KEY_THRESHOLD_UPDATE_INTERVAL)
+	{
+		return false;
+	}
+
+	m_framesSinceRequest = 0;
+	m_bAnalyzing = true;
+	return true;
+}
+
+
+void KeyThresholdTuner::Analyze(KeyCalibrationImage&& image, const float keyColor[3])
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_image = std::move(image);
+
+		// Same conversion as FillMaskedConstants.
+		for (int c = 0; c < 3; c++)
+		{
+			m_keyLinear[c] = powf(keyColor[c], 2.2f);
+		}
+
+		m_bImagePending = true;
+	}
+	m_threadCondition.notify_all();
+}
+
+
+bool KeyThresholdTuner::GetResult(KeyThresholdResult& outResult)
+{
+	std::lock_guard<std::mutex> lock(m_threadMutex);
+
+	if (!m_bResultPending)
+	{
+		return false;
+	}
+
+	outResult = m_result;
+	m_bResultPending = false;
+	return true;
+}
+
+
+void KeyThresholdTuner::RunThread()
+{
+	std::unique_lock<std::mutex> lock(m_threadMutex);
+
+	while (true)
+	{
+		m_threadCondition.wait(lock, [this] { return !m_bRunThread || m_bImagePending; });
+
+		if (!m_bRunThread) { return; }
+
+		KeyCalibrationImage image = std::move(m_image);
+		float keyLinear[3] = { m_keyLinear[0], m_keyLinear[1], m_keyLinear[2] };
+		m_bImagePending = false;
+
+		lock.unlock();
+
+		LARGE_INTEGER perfFrequency;
+		LARGE_INTEGER startTime;
+		LARGE_INTEGER endTime;
+		QueryPerformanceFrequency(&perfFrequency);
+		QueryPerformanceCounter(&startTime);
+
+		BuildKeyDistanceHistogram(m_workerPool, image, keyLinear, m_histogram);
+
+		QueryPerformanceCounter(&endTime);
+
+		KeyThresholdResult result;
+		SelectKeyThresholds(m_histogram, result);
+		result.histogramTimeMS = (float)((endTime.QuadPart - startTime.QuadPart) * 1000.0 / perfFrequency.QuadPart);
+
+		lock.lock();
+
+		m_result = result;
+		m_bResultPending = true;
+		m_bAnalyzing = false;
+	}
+}
@@ -0,0 +1,106 @@
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "key_calibration.h"
+#include "worker_pool.h"
+
+
+// Upper limit of the pixels sampled from the frame for each update, taken on an even grid.
+#define KEY_THRESHOLD_MAX_SAMPLES 16384
+
+// Frames between the analysed frames.
+#define KEY_THRESHOLD_UPDATE_INTERVAL 45
+
+// Joint histogram of the chroma and luma distances to the key, in LAB units.
+// The chroma distance covers 0-128 and the luma distance 0-100, with the last bins collecting the rest.
+#define KEY_THRESHOLD_CHROMA_BINS 128
+#define KEY_THRESHOLD_CHROMA_RANGE 128.0f
+#define KEY_THRESHOLD_LUMA_BIN_SHIFT 7
+#define KEY_THRESHOLD_LUMA_BINS (1 << KEY_THRESHOLD_LUMA_BIN_SHIFT)
+#define KEY_THRESHOLD_LUMA_RANGE 100.0f
+
+// A distance histogram is only split where Otsu's between class variance explains at least this share
+// of the total variance, and the valley between the classes is at most this fraction of the lower peak.
+// A single evenly or unevenly lit screen fails one or the other, so its ranges aren't cut in half.
+#define KEY_THRESHOLD_MIN_SEPARABILITY 0.7f
+#define KEY_THRESHOLD_MAX_VALLEY_RATIO 0.5f
+
+// Frames with less of the key visible are skipped, there isn't enough of the screen to tune on.
+#define KEY_THRESHOLD_MIN_KEY_FRACTION 0.05f
+
+// Without a separate class to split from, the luma range covers this fraction of the key samples with a margin.
+#define KEY_THRESHOLD_LUMA_PERCENTILE 0.99f
+#define KEY_THRESHOLD_LUMA_MARGIN 5.0f
+
+// Largest change of the range settings for each applied update, and the smallest change that is applied.
+#define KEY_THRESHOLD_MAX_STEP 0.01f
+#define KEY_THRESHOLD_DEADBAND 0.005f
+
+
+struct KeyThresholdResult
+{
+	bool bValid = false;
+	float fractionChroma = 0.0f;
+	float fractionLuma = 0.0f;
+	// Share of the samples within the chroma range.
+	float keyFraction = 0.0f;
+	float histogramTimeMS = 0.0f;
+};
+
+
+// Builds the joint distance histogram of a subsampled frame, with the rows split between the workers.
+// The key is in linear RGB, like the image values the shader compares it to.
+void BuildKeyDistanceHistogram(WorkerPool& workerPool, const KeyCalibrationImage& image, const float keyLinear[3], std::vector<uint32_t>& outHistogram);
+
+// Picks the ranges separating the key from the rest of the frame. The chroma range is placed in the valley
+// between the Otsu classes of the chroma distances. The luma range is picked the same way from the samples
+// within the chroma range, falling back to a percentile if they don't separate.
+bool SelectKeyThresholds(const std::vector<uint32_t>& histogram, KeyThresholdResult& outResult);
+
+// Moves a range setting towards the target at the rate limit, returns false if the change is within the deadband.
+bool StepKeyThreshold(float& value, const float target);
+
+
+// Retunes the key ranges in a background thread as the lighting changes. The render loop supplies
+// a frame every few frames, and the dashboard applies the results to the config.
+class KeyThresholdTuner
+{
+public:
+
+	KeyThresholdTuner(const uint32_t numThreads);
+	~KeyThresholdTuner();
+
+	// Called by the render loop each frame, returns true when a new frame should be copied.
+	bool TakeFrameRequest();
+
+	// The key color is in the gamma space of the MaskedKeyColor setting.
+	void Analyze(KeyCalibrationImage&& image, const float keyColor[3]);
+
+	// Returns true once for each finished analysis.
+	bool GetResult(KeyThresholdResult& outResult);
+
+private:
+
+	void RunThread();
+
+	WorkerPool m_workerPool;
+
+	std::thread m_thread;
+	std::mutex m_threadMutex;
+	std::condition_variable m_threadCondition;
+	bool m_bRunThread = true;
+	bool m_bImagePending = false;
+	bool m_bResultPending = false;
+
+	std::atomic_bool m_bAnalyzing = false;
+	uint32_t m_framesSinceRequest = 0;
+
+	KeyCalibrationImage m_image;
+	float m_keyLinear[3] = {};
+	KeyThresholdResult m_result;
+	std::vector<uint32_t> m_histogram;
+};
@@ -0,0 +1,87 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "key_threshold_tuner.h"
+#include "synthetic_frames.h"
+
+
+// Brightness of the dimmed screen for the range retuning, as a fraction of the key in linear space.
+#define SELF_TEST_TUNER_DIMMING 0.25f
+
+
+// Dims the screen of a synthetic frame below the luma range of the configured key, and checks that the ranges
+// selected from the distance histogram key the screen again without the foreground. A frame of only the screen,
+// and a frame with a grey wall in place of the screen, have to leave the ranges unchanged.
+bool TestKeyThresholdTuning()
+{
+	WorkerPool workerPool(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+	SyntheticSceneParams sceneParams = GetKeySceneParams();
+	KeyMaskParams keyParams = GetKeySceneMaskParams(sceneParams);
+
+	SyntheticSceneParams dimmedParams = sceneParams;
+	for (int c = 0; c < 3; c++)
+	{
+		dimmedParams.keyColor[c] *= powf(SELF_TEST_TUNER_DIMMING, 1.0f / 2.2f);
+	}
+
+	SyntheticScene dimmedScene(dimmedParams);
+	SyntheticFrame dimmedFrame;
+	dimmedScene.Render(workerPool, 0, dimmedFrame);
+
+	std::vector<uint32_t> histogram;
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+	BuildKeyDistanceHistogram(workerPool, GetFrameCalibrationImage(dimmedFrame), keyParams.keyColor, histogram);
+	float histogramTimeMS = GetElapsedMS(startTime);
+
+	KeyThresholdResult result;
+	bool bTuned = SelectKeyThresholds(histogram, result);
+
+	float fixedScreenKeyed;
+	float fixedForegroundKeyed;
+	GetKeyedFractions(dimmedFrame, keyParams, fixedScreenKeyed, fixedForegroundKeyed);
+
+	KeyMaskParams tunedParams = keyParams;
+	tunedParams.fracChroma = result.fractionChroma * 100.0f;
+	tunedParams.fracLuma = result.fractionLuma * 100.0f;
+
+	float tunedScreenKeyed;
+	float tunedForegroundKeyed;
+	GetKeyedFractions(dimmedFrame, tunedParams, tunedScreenKeyed, tunedForegroundKeyed);
+
+	Log("Key range tuning: screen dimmed to %.0f%%, ranges %.2f / %.2f in %.2f ms, screen keyed %.1f%% fixed and %.1f%% tuned, foreground keyed %.1f%% fixed and %.1f%% tuned\n",
+		SELF_TEST_TUNER_DIMMING * 100.0f, result.fractionChroma, result.fractionLuma, histogramTimeMS, fixedScreenKeyed * 100.0f, tunedScreenKeyed * 100.0f, fixedForegroundKeyed * 100.0f, tunedForegroundKeyed * 100.0f);
+
+	SyntheticSceneParams screenParams = sceneParams;
+	screenParams.numObjects = 0;
+	SyntheticScene screenScene(screenParams);
+	SyntheticFrame screenFrame;
+	screenScene.Render(workerPool, 0, screenFrame);
+
+	KeyThresholdResult screenResult;
+	BuildKeyDistanceHistogram(workerPool, GetFrameCalibrationImage(screenFrame), keyParams.keyColor, histogram);
+	bool bScreenTuned = SelectKeyThresholds(histogram, screenResult);
+
+	// A grey wall in place of the screen.
+	SyntheticSceneParams wallParams = sceneParams;
+	wallParams.keyColor[0] = 0.5f;
+	wallParams.keyColor[1] = 0.5f;
+	wallParams.keyColor[2] = 0.5f;
+	SyntheticScene wallScene(wallParams);
+	SyntheticFrame wallFrame;
+	wallScene.Render(workerPool, 0, wallFrame);
+
+	KeyThresholdResult wallResult;
+	BuildKeyDistanceHistogram(workerPool, GetFrameCalibrationImage(wallFrame), keyParams.keyColor, histogram);
+	bool bWallTuned = SelectKeyThresholds(histogram, wallResult);
+
+	Log("Key range tuning: ranges %s for a frame of only the screen, %s for a frame without the screen (%.2f / %.2f, %.1f%% in range)\n",
+		bScreenTuned ? "changed" : "unchanged", bWallTuned ? "changed" : "unchanged", wallResult.fractionChroma, wallResult.fractionLuma, wallResult.keyFraction * 100.0f);
+
+	return bTuned && tunedScreenKeyed > 0.98f && tunedForegroundKeyed < 0.01f && tunedScreenKeyed > fixedScreenKeyed && !bScreenTuned && !bWallTuned;
+}
+
+#endif
@@ -1,14 +1,531 @@
 
 #include "pch.h"
 #include "logging.h"
+#include "flight_recorder.h"
 
-#define LOG_MAX_ERROR_MESSAGES 100
+// Records are enqueued lock-free by any thread and formatted by a writer thread,
+// so the arguments are copied into the record and the format string must be a literal.
+#define LOG_QUEUE_SIZE 1024
+#define LOG_RECORD_PAYLOAD_SIZE 232
+#define LOG_WRITER_INTERVAL (std::chrono::milliseconds(10))
+
+// Each call site may log this many messages per window, further messages are counted and reported later.
+#define LOG_RATE_LIMIT_MESSAGES 10
+#define LOG_RATE_LIMIT_WINDOW_MS 1000
+#define LOG_CALL_SITE_SLOTS 512
+#define LOG_CALL_SITE_PROBES 8
+
+
+struct LogRecord
+{
+	std::atomic<uint64_t> sequence;
+	const char* format;
+	uint32_t suppressedCount;
+	uint32_t payloadSize;
+	uint8_t payload[LOG_RECORD_PAYLOAD_SIZE];
+};
+
+struct LogCallSite
+{
+	std::atomic<const char*> format;
+	std::atomic<uint64_t> windowStart;
+	std::atomic<uint32_t> windowCount;
+	std::atomic<uint32_t> suppressedCount;
+};
+
+enum ELogArgType
+{
+	LogArg_None,
+	LogArg_Int,
+	LogArg_Unsigned,
+	LogArg_Double,
+	LogArg_String,
+	LogArg_Pointer,
+	LogArg_Unsupported
+};
+
+struct LogFormatSpec
+{
+	size_t length;
+	ELogArgType type;
+	int numStarArgs;
+	// Number of 'l' modifiers, or -1 for 'z'.
+	int longModifiers;
+};
+
+
+static LogRecord g_logQueue[LOG_QUEUE_SIZE];
+static std::atomic<uint64_t> g_enqueuePos = 0;
+static uint64_t g_dequeuePos = 0;
+
+static LogCallSite g_callSites[LOG_CALL_SITE_SLOTS];
+
+static std::atomic<uint64_t> g_numMessages = 0;
+static std::atomic<uint64_t> g_numDropped = 0;
+static std::atomic<uint64_t> g_numSuppressed = 0;
+static std::atomic<uint64_t> g_enqueueTicks = 0;
+
+static std::ofstream stream;
+static std::thread g_writerThread;
+static std::atomic_bool g_bRunWriter = false;
+
+
+// Parses the conversion specification starting at the '%'.
+static LogFormatSpec ParseFormatSpec(const char* spec)
+{
+	LogFormatSpec result = {};
+	const char* c = spec + 1;
+
+	while (*c && strchr("-+ #0", *c)) { c++; }
+	while (*c && (isdigit((unsigned char)*c) || *c == '*' || *c == '.'))
+	{
+		if (*c == '*') { result.numStarArgs++; }
+		c++;
+	}
+
+	while (*c && strchr("hlzLjt", *c))
+	{
+		if (*c == 'l') { result.longModifiers++; }
+		else if (*c == 'z') { result.longModifiers = -1; }
+		c++;
+	}
+
+	switch (*c)
+	{
+	case 'd': case 'i': case 'c':
+		result.type = LogArg_Int;
+		break;
+	case 'u': case 'x': case 'X': case 'o':
+		result.type = LogArg_Unsigned;
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		result.type = LogArg_Double;
+		break;
+	case 's':
+		result.type = (result.longModifiers > 0) ? LogArg_Unsupported : LogArg_String;
+		break;
+	case 'p':
+		result.type = LogArg_Pointer;
+		break;
+	case '%':
+		result.type = LogArg_None;
+		break;
+	default:
+		result.type = LogArg_Unsupported;
+		break;
+	}
+
+	result.length = (*c) ? (c - spec + 1) : (c - spec);
+	return result;
+}
+
+
+static bool PackValue(LogRecord& record, const void* value, const uint32_t size)
+{
+	if (record.payloadSize + size > LOG_RECORD_PAYLOAD_SIZE) { return false; }
+
+	memcpy(record.payload + record.payloadSize, value, size);
+	record.payloadSize += size;
+	return true;
+}
+
+// Copies the arguments into the record in format order, stopping at the first one that doesn't fit.
+static void PackArguments(LogRecord& record, const char* format, va_list args)
+{
+	for (const char* c = format; *c; c++)
+	{
+		if (*c != '%') { continue; }
+
+		LogFormatSpec spec = ParseFormatSpec(c);
+		c += spec.length - 1;
+
+		if (spec.type == LogArg_None) { continue; }
+		if (spec.type == LogArg_Unsupported) { return; }
+
+		for (int i = 0; i < spec.numStarArgs; i++)
+		{
+			int star = va_arg(args, int);
+			if (!PackValue(record, &star, sizeof(star))) { return; }
+		}
+
+		bool bPacked = true;
+
+		switch (spec.type)
+		{
+		case LogArg_Int:
+		{
+			int64_t value = (spec.longModifiers >= 2) ? va_arg(args, long long) : (spec.longModifiers == 1) ? va_arg(args, long) : (spec.longModifiers < 0) ? (int64_t)va_arg(args, size_t) : va_arg(args, int);
+			bPacked = PackValue(record, &value, sizeof(value));
+			break;
+		}
+		case LogArg_Unsigned:
+		{
+			uint64_t value = (spec.longModifiers >= 2) ? va_arg(args, unsigned long long) : (spec.longModifiers == 1) ? va_arg(args, unsigned long) : (spec.longModifiers < 0) ? va_arg(args, size_t) : va_arg(args, unsigned int);
+			bPacked = PackValue(record, &value, sizeof(value));
+			break;
+		}
+		case LogArg_Double:
+		{
+			double value = va_arg(args, double);
+			bPacked = PackValue(record, &value, sizeof(value));
+			break;
+		}
+		case LogArg_Pointer:
+		{
+			void* value = va_arg(args, void*);
+			bPacked = PackValue(record, &value, sizeof(value));
+			break;
+		}
+		case LogArg_String:
+		{
+			const char* value = va_arg(args, const char*);
+			if (!value) { value = "(null)"; }
+
+			uint32_t available = LOG_RECORD_PAYLOAD_SIZE - record.payloadSize;
+			if (available == 0) { return; }
+
+			// Long strings are truncated, keeping the terminator.
+			uint32_t length = (uint32_t)strnlen(value, available - 1);
+			memcpy(record.payload + record.payloadSize, value, length);
+			record.payload[record.payloadSize + length] = '\0';
+			record.payloadSize += length + 1;
+			break;
+		}
+		default:
+			break;
+		}
+
+		if (!bPacked) { return; }
+	}
+}
+
+
+template<typename T>
+static int FormatValue(char* out, const size_t size, const char* spec, const int* stars, const int numStars, T value)
+{
+	switch (numStars)
+	{
+	case 0:
+		return snprintf(out, size, spec, value);
+	case 1:
+		return snprintf(out, size, spec, stars[0], value);
+	default:
+		return snprintf(out, size, spec, stars[0], stars[1], value);
+	}
+}
+
+static bool UnpackValue(const LogRecord& record, uint32_t& offset, void* value, const uint32_t size)
+{
+	if (offset + size > record.payloadSize) { return false; }
+
+	memcpy(value, record.payload + offset, size);
+	offset += size;
+	return true;
+}
+
+// Formats the record the same way printf would have, marking where arguments ran out of space.
+static void FormatRecord(const LogRecord& record, char* buffer, const size_t bufferSize)
+{
+	size_t written = 0;
+	uint32_t offset = 0;
+
+	for (const char* c = record.format; *c && written < bufferSize - 1; c++)
+	{
+		if (*c != '%')
+		{
+			buffer[written++] = *c;
+			continue;
+		}
+
+		LogFormatSpec spec = ParseFormatSpec(c);
+
+		char specString[32];
+		size_t specLength = std::min(spec.length, sizeof(specString) - 1);
+		memcpy(specString, c, specLength);
+		specString[specLength] = '\0';
+		c += spec.length - 1;
+
+		if (spec.type == LogArg_None)
+		{
+			buffer[written++] = '%';
+			continue;
+		}
+
+		int stars[2] = {};
+		bool bValid = spec.type != LogArg_Unsupported && spec.numStarArgs <= 2;
+
+		for (int i = 0; bValid && i < spec.numStarArgs; i++)
+		{
+			bValid = UnpackValue(record, offset, &stars[i], sizeof(int));
+		}
+
+		char* out = buffer + written;
+		size_t outSize = bufferSize - written;
+		int result = 0;
+
+		if (bValid)
+		{
+			switch (spec.type)
+			{
+			case LogArg_Int:
+			{
+				int64_t value;
+				if (!(bValid = UnpackValue(record, offset, &value, sizeof(value)))) { break; }
+				if (spec.longModifiers >= 2) { result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, (long long)value); }
+				else if (spec.longModifiers == 1) { result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, (long)value); }
+				else if (spec.longModifiers < 0) { result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, (size_t)value); }
+				else { result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, (int)value); }
+				break;
+			}
+			case LogArg_Unsigned:
+			{
+				uint64_t value;
+				if (!(bValid = UnpackValue(record, offset, &value, sizeof(value)))) { break; }
+				if (spec.longModifiers >= 2) { result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, (unsigned long long)value); }
+				else if (spec.longModifiers == 1) { result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, (unsigned long)value); }
+				else if (spec.longModifiers < 0) { result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, (size_t)value); }
+				else { result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, (unsigned int)value); }
+				break;
+			}
+			case LogArg_Double:
+			{
+				double value;
+				if (!(bValid = UnpackValue(record, offset, &value, sizeof(value)))) { break; }
+				result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, value);
+				break;
+			}
+			case LogArg_Pointer:
+			{
+				void* value;
+				if (!(bValid = UnpackValue(record, offset, &value, sizeof(value)))) { break; }
+				result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, value);
+				break;
+			}
+			case LogArg_String:
+			{
+				if (!(bValid = offset < record.payloadSize)) { break; }
+				const char* value = (const char*)record.payload + offset;
+				offset += (uint32_t)strlen(value) + 1;
+				result = FormatValue(out, outSize, specString, stars, spec.numStarArgs, value);
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		if (!bValid)
+		{
+			result = snprintf(out, outSize, "[truncated]\n");
+			written += std::min((size_t)std::max(result, 0), outSize - 1);
+			break;
+		}
+
+		written += std::min((size_t)std::max(result, 0), outSize - 1);
+	}
+
+	buffer[written] = '\0';
+}
+
+
+// Returns false if the call site has used up its messages for the current window.
+static bool CheckRateLimit(const char* format, uint32_t& outSuppressedCount)
+{
+	outSuppressedCount = 0;
+
+	size_t hash = std::hash<const void*>()(format);
+	LogCallSite* site = nullptr;
+
+	for (uint32_t i = 0; i < LOG_CALL_SITE_PROBES; i++)
+	{
+		LogCallSite& slot = g_callSites[(hash + i) % LOG_CALL_SITE_SLOTS];
+		const char* slotFormat = slot.format.load(std::memory_order_acquire);
+
+		if (slotFormat == nullptr && slot.format.compare_exchange_strong(slotFormat, format, std::memory_order_acq_rel))
+		{
+			site = &slot;
+			break;
+		}
+		if (slotFormat == format)
+		{
+			site = &slot;
+			break;
+		}
+	}
+
+	// Call sites that don't fit in the table aren't limited.
+	if (!site) { return true; }
+
+	uint64_t now = GetTickCount64();
+	uint64_t windowStart = site->windowStart.load(std::memory_order_relaxed);
+
+	if (now - windowStart >= LOG_RATE_LIMIT_WINDOW_MS && site->windowStart.compare_exchange_strong(windowStart, now, std::memory_order_relaxed))
+	{
+		site->windowCount.store(0, std::memory_order_relaxed);
+	}
+
+	if (site->windowCount.fetch_add(1, std::memory_order_relaxed) >= LOG_RATE_LIMIT_MESSAGES)
+	{
+		site->suppressedCount.fetch_add(1, std::memory_order_relaxed);
+		g_numSuppressed.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	outSuppressedCount = site->suppressedCount.exchange(0, std::memory_order_relaxed);
+	return true;
+}
+
+
+// Bounded MPSC queue with a sequence number per slot. Producers never wait, a full queue drops the message.
+// Returns false if the message was suppressed by the rate limit.
+static bool EnqueueMessage(const char* format, va_list args)
+{
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+
+	uint32_t suppressedCount;
+	if (!CheckRateLimit(format, suppressedCount))
+	{
+		return false;
+	}
+
+	uint64_t pos = g_enqueuePos.load(std::memory_order_relaxed);
+	LogRecord* record;
+
+	while (true)
+	{
+		record = &g_logQueue[pos % LOG_QUEUE_SIZE];
+		uint64_t sequence = record->sequence.load(std::memory_order_acquire);
+		int64_t diff = (int64_t)sequence - (int64_t)pos;
+
+		if (diff == 0)
+		{
+			if (g_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			g_numDropped.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+		else
+		{
+			pos = g_enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	record->format = format;
+	record->suppressedCount = suppressedCount;
+	record->payloadSize = 0;
+	PackArguments(*record, format, args);
+	record->sequence.store(pos + 1, std::memory_order_release);
+
+	LARGE_INTEGER endTime;
+	QueryPerformanceCounter(&endTime);
+	g_numMessages.fetch_add(1, std::memory_order_relaxed);
+	g_enqueueTicks.fetch_add(endTime.QuadPart - startTime.QuadPart, std::memory_order_relaxed);
+	return true;
+}
+
+
+static void WriteMessage(const char* message)
+{
+	OutputDebugStringA(message);
+
+	if (stream.is_open())
+	{
+		stream << message;
+	}
+}
+
+static void DrainQueue()
+{
+	static uint64_t reportedDropped = 0;
+	char buffer[1024];
+	bool bWritten = false;
+
+	while (true)
+	{
+		LogRecord& record = g_logQueue[g_dequeuePos % LOG_QUEUE_SIZE];
+		if (record.sequence.load(std::memory_order_acquire) != g_dequeuePos + 1)
+		{
+			break;
+		}
+
+		if (record.suppressedCount > 0)
+		{
+			snprintf(buffer, sizeof(buffer), "[%u similar messages suppressed]\n", record.suppressedCount);
+			WriteMessage(buffer);
+		}
+
+		FormatRecord(record, buffer, sizeof(buffer));
+		WriteMessage(buffer);
+
+		record.sequence.store(g_dequeuePos + LOG_QUEUE_SIZE, std::memory_order_release);
+		g_dequeuePos++;
+		bWritten = true;
+	}
+
+	uint64_t numDropped = g_numDropped.load(std::memory_order_relaxed);
+	if (numDropped != reportedDropped)
+	{
+		snprintf(buffer, sizeof(buffer), "[%llu log messages dropped, queue full]\n", (unsigned long long)(numDropped - reportedDropped));
+		WriteMessage(buffer);
+		reportedDropped = numDropped;
+		bWritten = true;
+	}
+
+	if (bWritten && stream.is_open())
+	{
+		stream.flush();
+	}
+}
+
+static void WriterThread()
+{
+	while (g_bRunWriter)
+	{
+		DrainQueue();
+		std::this_thread::sleep_for(LOG_WRITER_INTERVAL);
+	}
+
+	DrainQueue();
+}
+
+static void StopWriter()
+{
+	g_bRunWriter = false;
+
+	if (g_writerThread.joinable())
+	{
+		g_writerThread.join();
+	}
+}
+
+// Writes out the remaining messages when the process exits.
+static struct LogShutdown
+{
+	LogShutdown()
+	{
+		for (uint64_t i = 0; i < LOG_QUEUE_SIZE; i++)
+		{
+			g_logQueue[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	~LogShutdown()
+	{
+		StopWriter();
+	}
+} g_logShutdown;
 
-std::ofstream stream;
-int errorMessageCount = 0;
 
 void InitLogging(std::wstring fileName)
 {
+	StopWriter();
+
 	if (stream.is_open())
 	{
 		stream.close();
@@ -19,46 +536,52 @@ void InitLogging(std::wstring fileName)
 
 	std::filesystem::path filePath = std::filesystem::path(appdataPath) / fileName;
 	stream.open(filePath.wstring(), std::ios_base::ate);
+
+	g_bRunWriter = true;
+	g_writerThread = std::thread(WriterThread);
 }
 
-void ErrorLog(const char* format, ...)
+void GetLogStats(LogStats& outStats)
 {
-	if (errorMessageCount++ > LOG_MAX_ERROR_MESSAGES)
+	LARGE_INTEGER perfFrequency;
+	QueryPerformanceFrequency(&perfFrequency);
+
+	uint64_t numMessages = g_numMessages.load(std::memory_order_relaxed);
+
+	outStats.numMessages = numMessages;
+	outStats.numDropped = g_numDropped.load(std::memory_order_relaxed);
+	outStats.numSuppressed = g_numSuppressed.load(std::memory_order_relaxed);
+	outStats.averageEnqueueUS = numMessages ? (g_enqueueTicks.load(std::memory_order_relaxed) * 1000000.0f / perfFrequency.QuadPart / numMessages) : 0.0f;
+}
+
+// Errors are recorded in the flight recorder timeline, keyed by a hash of the format to tell them apart.
+// Only the errors that pass the rate limit request a dump, so a repeating error doesn't keep dumping.
+void ErrorLog(LogFormat format, ...)
+{
+	uint32_t formatHash = 2166136261u;
+	for (const char* c = format.string; *c; c++)
 	{
-		return;
+		formatHash = (formatHash ^ (uint8_t)*c) * 16777619u;
 	}
 
+	RecordFlightEvent(FlightEvent_ErrorLogged, formatHash);
+
 	va_list varArgs;
 	va_start(varArgs, format);
+	bool bLogged = EnqueueMessage(format.string, varArgs);
+	va_end(varArgs);
 
-	char buffer[1024];
-
-	vsnprintf_s(buffer, sizeof(buffer), _TRUNCATE, format, varArgs);
-	OutputDebugStringA(buffer);
-
-	if (stream.is_open())
+	if (bLogged)
 	{
-		stream << buffer;
-		stream.flush();
+		RequestFlightRecorderDump(FlightDump_Error);
 	}
-	va_end(varArgs);
 }
 
 
-void Log(const char* format, ...)
+void Log(LogFormat format, ...)
 {
 	va_list varArgs;
 	va_start(varArgs, format);
-
-	char buffer[1024];
-
-	vsnprintf_s(buffer, sizeof(buffer), _TRUNCATE, format, varArgs);
-	OutputDebugStringA(buffer);
-
-	if (stream.is_open())
-	{
-		stream << buffer;
-		stream.flush();
-	}
+	EnqueueMessage(format.string, varArgs);
 	va_end(varArgs);
-}
\ No newline at end of file
+}
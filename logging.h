@@ -3,8 +3,26 @@
 
 #include "pch.h"
 
+struct LogStats
+{
+	uint64_t numMessages;
+	uint64_t numDropped;
+	uint64_t numSuppressed;
+	float averageEnqueueUS;
+};
+
 void InitLogging(std::wstring fileName);
+void GetLogStats(LogStats& outStats);
+
+// The format is formatted later on the writer thread, so only the pointer is kept in the record.
+// The consteval constructor rejects formats that aren't compile time constants, like string buffers.
+struct LogFormat
+{
+	template<size_t N>
+	consteval LogFormat(const char (&format)[N]) : string(format) {}
 
-void ErrorLog(const char* format, ...);
-void Log(const char* format, ...);
+	const char* string;
+};
 
+void ErrorLog(LogFormat format, ...);
+void Log(LogFormat format, ...);
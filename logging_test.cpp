@@ -0,0 +1,90 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+
+
+// The enqueued messages are spread over separate call sites to stay under the rate limit of each.
+#define SELF_TEST_LOG_THREADS 4
+#define SELF_TEST_LOG_MESSAGES 40
+#define SELF_TEST_LOG_SUPPRESSED_MESSAGES 100000
+#define SELF_TEST_LOG_FORMAT(site) "Log enqueue benchmark site " #site ": thread %u, message %u, %.3f ms\n"
+
+
+// Measures the cost of logging on the calling thread, for messages that are enqueued from
+// several threads at once and for messages that are suppressed by the rate limit.
+bool BenchmarkLogEnqueue()
+{
+	static constexpr LogFormat logFormats[] =
+	{
+		SELF_TEST_LOG_FORMAT(0), SELF_TEST_LOG_FORMAT(1), SELF_TEST_LOG_FORMAT(2), SELF_TEST_LOG_FORMAT(3),
+		SELF_TEST_LOG_FORMAT(4), SELF_TEST_LOG_FORMAT(5), SELF_TEST_LOG_FORMAT(6), SELF_TEST_LOG_FORMAT(7),
+		SELF_TEST_LOG_FORMAT(8), SELF_TEST_LOG_FORMAT(9), SELF_TEST_LOG_FORMAT(10), SELF_TEST_LOG_FORMAT(11),
+		SELF_TEST_LOG_FORMAT(12), SELF_TEST_LOG_FORMAT(13), SELF_TEST_LOG_FORMAT(14), SELF_TEST_LOG_FORMAT(15),
+	};
+
+	LARGE_INTEGER perfFrequency;
+	QueryPerformanceFrequency(&perfFrequency);
+
+	LogStats startStats;
+	GetLogStats(startStats);
+
+	std::atomic<bool> bStart = false;
+	std::vector<std::thread> threads;
+
+	for (uint32_t thread = 0; thread < SELF_TEST_LOG_THREADS; thread++)
+	{
+		threads.emplace_back([&, thread]()
+		{
+			while (!bStart) { std::this_thread::yield(); }
+
+			for (uint32_t i = 0; i < SELF_TEST_LOG_MESSAGES; i++)
+			{
+				uint32_t message = thread * SELF_TEST_LOG_MESSAGES + i;
+				Log(logFormats[message % std::size(logFormats)], thread, i, message * 0.125f);
+			}
+		});
+	}
+
+	bStart = true;
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	LogStats enqueueStats;
+	GetLogStats(enqueueStats);
+
+	LARGE_INTEGER startTime;
+	QueryPerformanceCounter(&startTime);
+
+	for (uint32_t i = 0; i < SELF_TEST_LOG_SUPPRESSED_MESSAGES; i++)
+	{
+		Log("Log suppression benchmark: message %u\n", i);
+	}
+
+	float suppressedTimeMS = GetElapsedMS(startTime);
+
+	LogStats endStats;
+	GetLogStats(endStats);
+
+	uint64_t numEnqueued = enqueueStats.numMessages - startStats.numMessages;
+	uint64_t numDropped = enqueueStats.numDropped - startStats.numDropped;
+	uint64_t numLimited = enqueueStats.numSuppressed - startStats.numSuppressed;
+	float enqueueUS = numEnqueued ? (enqueueStats.averageEnqueueUS * enqueueStats.numMessages - startStats.averageEnqueueUS * startStats.numMessages) / numEnqueued : 0.0f;
+
+	uint64_t numSuppressed = endStats.numSuppressed - enqueueStats.numSuppressed;
+	uint64_t numPassed = (endStats.numMessages + endStats.numDropped) - (enqueueStats.numMessages + enqueueStats.numDropped);
+
+	Log("Log enqueue: %llu messages from %u threads, %.3f us per message, %llu dropped, %llu rate limited\n",
+		(unsigned long long)numEnqueued, SELF_TEST_LOG_THREADS, enqueueUS, (unsigned long long)numDropped, (unsigned long long)numLimited);
+	Log("Log suppression: %llu of %u messages suppressed, %.0f ns per message\n",
+		(unsigned long long)numSuppressed, SELF_TEST_LOG_SUPPRESSED_MESSAGES, suppressedTimeMS * 1000000.0f / SELF_TEST_LOG_SUPPRESSED_MESSAGES);
+
+	return numEnqueued == SELF_TEST_LOG_THREADS * SELF_TEST_LOG_MESSAGES && numDropped == 0 && numLimited == 0 &&
+		numSuppressed + numPassed == SELF_TEST_LOG_SUPPRESSED_MESSAGES && numSuppressed > numPassed;
+}
+
+#endif
@@ -2,18 +2,24 @@
 #include "pch.h"
 #include "shared_structs.h"
 #include "logging.h"
+#include "flight_recorder.h"
 #include "passthrough_renderer.h"
 #include "camera_manager.h"
 #include "config_manager.h"
 #include "dashboard_menu.h"
 #include "openvr_manager.h"
 #include "passthrough_overlay.h"
+#include "watchdog.h"
+#include "key_calibration.h"
+#include "key_threshold_tuner.h"
+#include "self_test.h"
 
 #include "renderdoc_app.h"
 
 #define CONFIG_FILE_DIR L"\\SteamVR Chroma Key Passthrough\\"
 #define CONFIG_FILE_NAME L"config.ini"
 #define LOG_FILE_NAME L"SteamVR Chroma Key Passthrough.log"
+#define FLIGHT_RECORDER_FILE_PREFIX L"SteamVR Chroma Key Passthrough flight_"
 
 #define PERF_TIME_AVERAGE_VALUES 20
 
@@ -43,6 +49,15 @@ float UpdateAveragePerfTime(std::deque<float>& times, float newTime)
 int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _In_ LPWSTR lpCmdLine, _In_ int nCmdShow)
 {
 	InitLogging(LOG_FILE_NAME);
+	InitFlightRecorder(FLIGHT_RECORDER_FILE_PREFIX);
+
+#ifdef _DEBUG
+	if (wcsstr(lpCmdLine, L"--self-test"))
+	{
+		Log("Running self tests...\n");
+		return RunSelfTests() ? 0 : 1;
+	}
+#endif
 
 	Log("Starting passthrough system...\n");
 
@@ -74,7 +89,10 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 	configManager->ReadConfigFile();
 
 	std::shared_ptr<OpenVRManager> openVRManager = std::make_shared<OpenVRManager>();
-	std::unique_ptr<DashboardMenu> dashboardMenu = std::make_unique<DashboardMenu>(configManager, openVRManager);
+	std::shared_ptr<Watchdog> watchdog = std::make_shared<Watchdog>();
+	std::shared_ptr<KeyCalibrator> keyCalibrator = std::make_shared<KeyCalibrator>();
+	std::shared_ptr<KeyThresholdTuner> keyThresholdTuner = std::make_shared<KeyThresholdTuner>(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+	std::unique_ptr<DashboardMenu> dashboardMenu = std::make_unique<DashboardMenu>(configManager, openVRManager, watchdog, keyCalibrator, keyThresholdTuner);
 
 	
 	vr::IVRSystem* vrSystem = openVRManager->GetVRSystem();
@@ -91,7 +109,7 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 	vrSystem->GetDXGIOutputInfo(&adapterIndex);
 
 	std::shared_ptr<PassthroughRenderer> renderer = std::make_shared<PassthroughRenderer>(configManager, openVRManager, adapterIndex);
-	std::unique_ptr<CameraManager> cameraManager = std::make_unique<CameraManager>(renderer, configManager, openVRManager);
+	std::unique_ptr<CameraManager> cameraManager = std::make_unique<CameraManager>(renderer, configManager, openVRManager, watchdog);
 
 	if (!cameraManager->InitCamera())
 	{
@@ -103,6 +121,10 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 		uint32_t cameraTextureWidth, cameraTextureHeight, cameraFrameBufferSize;
 		cameraManager->GetFrameSize(cameraTextureWidth, cameraTextureHeight, cameraFrameBufferSize);
 		renderer->SetFrameSize(cameraTextureWidth, cameraTextureHeight, cameraFrameBufferSize);
+
+		uint32_t renderTargetWidth, renderTargetHeight;
+		cameraManager->GetRenderTargetSize(renderTargetWidth, renderTargetHeight);
+		renderer->SetRenderTargetSize(renderTargetWidth, renderTargetHeight);
 		if (!renderer->InitRenderer())
 		{
 			ErrorLog("Error: Failed to initialize renderer!\n");
@@ -124,9 +146,25 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 	std::deque<float> m_frameToRenderTimes;
 	std::deque<float> m_frameToPhotonTimes;
 	std::deque<float> m_passthroughRenderTimes;
+	std::deque<float> m_gpuRenderTimes;
+	std::deque<float> m_warpMeshTimes;
+	std::deque<float> m_depthEstimateTimes;
+	std::deque<float> m_undistortTimes;
+	std::deque<float> m_configSwitchTimes;
+	std::deque<float> m_steadyProcessingTimes;
 
 	int hmdDeviceId = openVRManager->GetHMDDeviceId();
 
+	// Counts the frames while reprojecting, to skip rendering every other one.
+	uint32_t reprojectFrameCount = 0;
+
+	std::shared_ptr<const Config_Main> mainConfig;
+	uint64_t configGeneration = 0;
+
+	// The calibration and the threshold tuning share the frame copy, with the calibration served first.
+	bool bCalibrationFrameRequested = false;
+	bool bThresholdFrameRequested = false;
+
 	while (bRun)
 	{
 		
@@ -148,6 +186,7 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 
 		if (!dashboardMenu->IsPassthroughEnabled())
 		{
+			watchdog->SetSourceInactive(WatchdogSource_Render);
 			passthroughOverlayLeft->SetOverlayVisible(false);
 			passthroughOverlayRight->SetOverlayVisible(false);
 			continue;
@@ -156,6 +195,21 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 		passthroughOverlayLeft->SetOverlayVisible(true);
 		passthroughOverlayRight->SetOverlayVisible(true);
 
+		bool bConfigChanged = configManager->UpdateConfigSnapshot(mainConfig, configGeneration);
+
+		if (keyCalibrator->TakeFrameRequest())
+		{
+			renderer->RequestKeyCalibrationFrame();
+			bCalibrationFrameRequested = true;
+		}
+
+		// The tuner measures the ranges in CIELAB.
+		if (mainConfig->MaskedAutoThresholds && mainConfig->PassthroughMode == Masked && mainConfig->MaskedKeyColorSpace == KeyColorSpace_CIELAB && keyThresholdTuner->TakeFrameRequest())
+		{
+			renderer->RequestKeyCalibrationFrame();
+			bThresholdFrameRequested = true;
+		}
+
 		std::shared_ptr<CameraFrame> frame;
 
 		if (!cameraManager->GetCameraFrame(frame))
@@ -163,6 +217,18 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 			continue;
 		}
 
+		EQualityTier qualityTier = watchdog->GetQualityTier();
+		renderer->SetQualityTier(qualityTier);
+		cameraManager->SetQualityTier(qualityTier);
+
+		// The overlays keep the previous frame, which the compositor reprojects to the current pose.
+		if (qualityTier >= QualityTier_ReprojectOnly && (reprojectFrameCount++ & 1))
+		{
+			watchdog->Heartbeat(WatchdogSource_Render);
+			vrOverlay->WaitFrameSync(1000 / (unsigned int)displayFrequency);
+			continue;
+		}
+
 
 		LARGE_INTEGER perfFrequency;
 		LARGE_INTEGER preRenderTime;
@@ -170,6 +236,9 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 		QueryPerformanceFrequency(&perfFrequency);
 		QueryPerformanceCounter(&preRenderTime);
 
+		RecordFlightEvent(FlightEvent_RenderStart, frame->header.nFrameSequence, frame->header.ulFrameExposureTime);
+		watchdog->Heartbeat(WatchdogSource_Render);
+
 		double frameToRenderTime = (float)(preRenderTime.QuadPart - frame->header.ulFrameExposureTime);
 		frameToRenderTime *= 1000.0f;
 		frameToRenderTime /= perfFrequency.QuadPart;
@@ -186,13 +255,83 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 		dashboardMenu->GetDisplayValues().frameToPhotonsLatencyMS = UpdateAveragePerfTime(m_frameToPhotonTimes, displayTime);
 
 		cameraManager->CalculateFrameProjection(frame, renderFrame);
+		dashboardMenu->GetDisplayValues().frameBufferWidth = renderFrame.targetWidth;
+		dashboardMenu->GetDisplayValues().frameBufferHeight = renderFrame.targetHeight;
+		dashboardMenu->GetDisplayValues().renderPixelsPerDegree = cameraManager->GetRenderPixelsPerDegree();
+		dashboardMenu->GetDisplayValues().renderTargetPixelFraction = cameraManager->GetRenderTargetPixelFraction();
+		dashboardMenu->GetDisplayValues().warpMeshTimeMS = UpdateAveragePerfTime(m_warpMeshTimes, cameraManager->GetWarpMeshTimeMS());
+		dashboardMenu->GetDisplayValues().scissorSkippedFraction = cameraManager->GetScissorSkippedFraction();
+		dashboardMenu->GetDisplayValues().depthEstimateTimeMS = UpdateAveragePerfTime(m_depthEstimateTimes, cameraManager->GetDepthEstimateTimeMS());
+		dashboardMenu->GetDisplayValues().depthFramesSkipped = cameraManager->GetDepthFramesSkipped();
+		dashboardMenu->GetDisplayValues().projectionDistance = cameraManager->GetProjectionDistanceFar();
+		dashboardMenu->GetDisplayValues().projectionEstimateTimeMS = cameraManager->GetProjectionEstimateTimeMS();
+		dashboardMenu->GetDisplayValues().projectionEstimateMatches = cameraManager->GetProjectionEstimateMatches();
+		dashboardMenu->GetDisplayValues().undistortTimeMS = UpdateAveragePerfTime(m_undistortTimes, cameraManager->GetUndistortTimeMS());
+		dashboardMenu->GetDisplayValues().undistortedMegapixels = cameraManager->GetUndistortedPixels() / 1000000.0f;
+		dashboardMenu->GetDisplayValues().undistortSavedMB = cameraManager->GetUndistortBytesSaved() / (1024.0f * 1024.0f);
 
 		renderer->RenderPassthroughFrame(frame, renderFrame);
 
+		KeyCalibrationImage calibrationImage;
+		if (renderer->ReadKeyCalibrationFrame(calibrationImage))
+		{
+			if (bCalibrationFrameRequested)
+			{
+				keyCalibrator->Calibrate(std::move(calibrationImage));
+				bCalibrationFrameRequested = false;
+			}
+			else if (bThresholdFrameRequested)
+			{
+				keyThresholdTuner->Analyze(std::move(calibrationImage), mainConfig->MaskedKeyColor);
+				bThresholdFrameRequested = false;
+			}
+
+			if (bThresholdFrameRequested)
+			{
+				renderer->RequestKeyCalibrationFrame();
+			}
+		}
+		dashboardMenu->GetDisplayValues().gpuRenderTimeMS = UpdateAveragePerfTime(m_gpuRenderTimes, renderer->GetGPUTimeMS());
+		dashboardMenu->GetDisplayValues().resolutionScale = renderer->GetResolutionScale();
+
+		float simulatedLoadMS = dashboardMenu->GetSimulatedRenderLoadMS();
+		if (simulatedLoadMS > 0.0f)
+		{
+			LARGE_INTEGER loadStartTime;
+			LARGE_INTEGER loadTime;
+			QueryPerformanceCounter(&loadStartTime);
+			do
+			{
+				QueryPerformanceCounter(&loadTime);
+			} while ((loadTime.QuadPart - loadStartTime.QuadPart) * 1000.0f / perfFrequency.QuadPart < simulatedLoadMS);
+		}
+
+		LARGE_INTEGER processedTime;
+		QueryPerformanceCounter(&processedTime);
+
+		float processingTime = (float)(processedTime.QuadPart - preRenderTime.QuadPart);
+		processingTime *= 1000.0f;
+		processingTime /= perfFrequency.QuadPart;
+		watchdog->ReportFrame(processingTime, 1000.0f / displayFrequency, renderer->DidLastFrameMissFence());
+
+		// Separates the cost of applying config changes, for the profile cycling stress test.
+		if (bConfigChanged)
+		{
+			MenuDisplayValues& displayValues = dashboardMenu->GetDisplayValues();
+			displayValues.configSwitchFrames++;
+			displayValues.configSwitchProcessingTimeMS = UpdateAveragePerfTime(m_configSwitchTimes, processingTime);
+			displayValues.configSwitchMaxProcessingTimeMS = std::max(displayValues.configSwitchMaxProcessingTimeMS, processingTime);
+		}
+		else
+		{
+			dashboardMenu->GetDisplayValues().steadyProcessingTimeMS = UpdateAveragePerfTime(m_steadyProcessingTimes, processingTime);
+		}
+
 		vrOverlay->WaitFrameSync(1000 / (unsigned int)displayFrequency);
 
 		passthroughOverlayLeft->SubmitOverlay(renderFrame);
 		passthroughOverlayRight->SubmitOverlay(renderFrame);
+		RecordFlightEvent(FlightEvent_FrameSubmitted, frame->header.nFrameSequence);
 
 		if (bDoCapture)
 		{
@@ -205,6 +344,8 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 		LARGE_INTEGER postRenderTime;
 		QueryPerformanceCounter(&postRenderTime);
 
+		RecordFlightEvent(FlightEvent_RenderEnd, frame->header.nFrameSequence, postRenderTime.QuadPart - preRenderTime.QuadPart);
+
 		float renderTime = (float)(postRenderTime.QuadPart - preRenderTime.QuadPart);
 		renderTime *= 1000.0f;
 		renderTime /= perfFrequency.QuadPart;
@@ -217,6 +358,8 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 
 	Log("Stopping passthrough system...\n");
 
+	ShutdownFlightRecorder();
+
 
 	return 0;
 }
\ No newline at end of file
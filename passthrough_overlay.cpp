@@ -1,6 +1,7 @@
 
 #include "pch.h"
 #include "passthrough_overlay.h"
+#include "flight_recorder.h"
 
 
 PassthroughOverlay::PassthroughOverlay(std::shared_ptr<ConfigManager> configManager, std::shared_ptr<OpenVRManager> openVRManager, ERenderEye eye)
@@ -8,6 +9,7 @@ PassthroughOverlay::PassthroughOverlay(std::shared_ptr<ConfigManager> configMana
 	, m_openVRManager(openVRManager)
 	, m_overlayHandle(vr::k_ulOverlayHandleInvalid)
 	, m_eye(eye)
+	, m_textureBounds{ 0.0f, 0.0f, 1.0f, 1.0f }
 {
 	vr::IVROverlay* vrOverlay = m_openVRManager->GetVROverlay();
 
@@ -41,14 +43,7 @@ PassthroughOverlay::PassthroughOverlay(std::shared_ptr<ConfigManager> configMana
 		vrOverlay->SetOverlayFlag(m_overlayHandle, vr::VROverlayFlags_IsPremultiplied, true);
 		vrOverlay->SetOverlayFlag(m_overlayHandle, vr::VROverlayFlags_SortWithNonSceneOverlays, true);
 
-		vr::VRTextureBounds_t bounds;
-	
-		bounds.uMin = 0.0f;
-		bounds.uMax = 1.0f;
-		bounds.vMin = 0.0f;
-		bounds.vMax = 1.0f;
-
-		vrOverlay->SetOverlayTextureBounds(m_overlayHandle, &bounds);
+		vrOverlay->SetOverlayTextureBounds(m_overlayHandle, &m_textureBounds);
 	}
 
 }
@@ -101,16 +96,30 @@ void PassthroughOverlay::SubmitOverlay(RenderFrame& frame)
 	renderTarget->QueryInterface(IID_PPV_ARGS(&DXGIResource));
 	DXGIResource->GetSharedHandle(&texture.handle);
 
+	if (frame.textureBoundsU != m_textureBounds.uMax || frame.textureBoundsV != m_textureBounds.vMax)
+	{
+		m_textureBounds.uMax = frame.textureBoundsU;
+		m_textureBounds.vMax = frame.textureBoundsV;
+		vrOverlay->SetOverlayTextureBounds(m_overlayHandle, &m_textureBounds);
+	}
+
 	vr::EVROverlayError error = vrOverlay->SetOverlayTexture(m_overlayHandle, &texture);
 	if (error != vr::VROverlayError_None)
 	{
+		RecordFlightEvent(FlightEvent_OpenVRError, error, FlightSource_OverlaySubmit);
 		ErrorLog("SteamVR had an error on updating the passthrough overlay (%d)\n", error);
 	}
 
 	vr::EVREye vrEye = (m_eye == LEFT_EYE) ? vr::Eye_Left : vr::Eye_Right;
 
+	// The render targets only cover the part of the display frustum seen by the camera.
+	const FrustumTangents& frustum = (m_eye == LEFT_EYE) ? frame.renderFrustumLeft : frame.renderFrustumRight;
+
 	vr::VROverlayProjection_t projection;
-	vr::VRSystem()->GetProjectionRaw(vrEye, &projection.fLeft, &projection.fRight, &projection.fTop, &projection.fBottom);
+	projection.fLeft = frustum.left;
+	projection.fRight = frustum.right;
+	projection.fTop = frustum.top;
+	projection.fBottom = frustum.bottom;
 
 	Matrix4 mat = (m_eye == LEFT_EYE) ? frame.hmdTrackingToViewLeft : frame.hmdTrackingToViewRight;
 	vr::HmdMatrix34_t eyePose;
@@ -25,4 +25,6 @@ private:
 
 	vr::VROverlayHandle_t m_overlayHandle;
 	ERenderEye m_eye;
+	// Matches the area of the render target rendered to at the current resolution scale.
+	vr::VRTextureBounds_t m_textureBounds;
 };
\ No newline at end of file
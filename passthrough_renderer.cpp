@@ -3,6 +3,9 @@
 #include "pch.h"
 #include "passthrough_renderer.h"
 #include "logging.h"
+#include "flight_recorder.h"
+#include "warp_mesh.h"
+#include "key_mask.h"
 #include <PathCch.h>
 
 #include "lodepng.h"
@@ -14,17 +17,13 @@
 #include "shaders\alpha_prepass_masked_ps.h"
 #include "shaders\passthrough_ps.h"
 #include "shaders\passthrough_masked_ps.h"
+#include "shaders\mask_key_ps.h"
+#include "shaders\passthrough_masked_upsample_ps.h"
+#include "shaders\mask_morphology_cs.h"
 
 
 
 
-struct VSConstantBuffer
-{
-	Matrix4 cameraUVProjectionFar;
-	Matrix4 cameraUVProjectionNear;
-};
-
-
 struct PSPassConstantBuffer
 {
 	float opacity;
@@ -48,9 +47,81 @@ struct PSMaskedConstantBuffer
 	float maskedFracChroma;
 	float maskedFracLuma;
 	float maskedSmooth;
+	uint32_t bMaskedDespill;
 	bool bMaskedUseCamera;
 };
 
+struct PSMaskConstantBuffer
+{
+	Vector2 maskScale;
+	uint32_t maskMaxCoord[2];
+	bool bUseCleanedAlpha;
+};
+
+struct PSTemporalConstantBuffer
+{
+	float historyProjection[3][4];
+	Vector2 historyUVScale;
+	float temporalSmoothing;
+	bool bHistoryValid;
+};
+
+struct CSMorphologyConstantBuffer
+{
+	uint32_t origin[2];
+	uint32_t lineStep[2];
+	uint32_t lineLength;
+	uint32_t radius;
+	uint32_t bDilate;
+	uint32_t bReadMaskAlpha;
+};
+
+
+static void FillPassConstants(const Config_Main& config, PSPassConstantBuffer& buffer)
+{
+	buffer.opacity = config.PassthroughOpacity;
+	buffer.brightness = config.Brightness;
+	buffer.contrast = config.Contrast;
+	buffer.saturation = config.Saturation;
+	buffer.bDoColorAdjustment = fabsf(config.Brightness) > 0.01f || fabsf(config.Contrast - 1.0f) > 0.01f || fabsf(config.Saturation - 1.0f) > 0.01f;
+}
+
+static void FillMaskedConstants(const Config_Main& config, PSMaskedConstantBuffer& buffer)
+{
+	buffer.maskedKey[0] = powf(config.MaskedKeyColor[0], 2.2f);
+	buffer.maskedKey[1] = powf(config.MaskedKeyColor[1], 2.2f);
+	buffer.maskedKey[2] = powf(config.MaskedKeyColor[2], 2.2f);
+	buffer.maskedFracChroma = config.MaskedFractionChroma * 100.0f;
+	buffer.maskedFracLuma = config.MaskedFractionLuma * 100.0f;
+	buffer.maskedSmooth = config.MaskedSmoothing * 100.0f;
+	buffer.bMaskedDespill = config.MaskedDespillStrength > 0.0f;
+	buffer.bMaskedUseCamera = config.MaskedUseCameraImage;
+}
+
+static void FillKeyLUTParams(const Config_Main& config, KeyLUTParams& params)
+{
+	params.numKeys = 1 + (uint32_t)std::clamp(config.MaskedExtraKeyCount, 0, CONFIG_MAX_EXTRA_KEYS);
+	params.smooth = config.MaskedSmoothing * 100.0f;
+	params.colorSpace = config.MaskedKeyColorSpace;
+
+	// The despill offsets are only applied to the camera image, so the table is left without them otherwise.
+	params.despillStrength = config.MaskedUseCameraImage ? config.MaskedDespillStrength : 0.0f;
+	params.despillRange = config.MaskedDespillRange * 100.0f;
+
+	for (uint32_t k = 0; k < params.numKeys; k++)
+	{
+		const float* keyColor = (k == 0) ? config.MaskedKeyColor : config.MaskedExtraKeyColor[k - 1];
+
+		// Same conversions as FillMaskedConstants.
+		for (int c = 0; c < 3; c++)
+		{
+			params.keys[k].keyColor[c] = powf(keyColor[c], 2.2f);
+		}
+		params.keys[k].fracChroma = ((k == 0) ? config.MaskedFractionChroma : config.MaskedExtraKeyFractionChroma[k - 1]) * 100.0f;
+		params.keys[k].fracLuma = ((k == 0) ? config.MaskedFractionLuma : config.MaskedExtraKeyFractionLuma[k - 1]) * 100.0f;
+	}
+}
+
 
 
 PassthroughRenderer::PassthroughRenderer(std::shared_ptr<ConfigManager> configManager, std::shared_ptr<OpenVRManager> openVRManager, int32_t adapterIndex)
@@ -62,13 +133,15 @@ PassthroughRenderer::PassthroughRenderer(std::shared_ptr<ConfigManager> configMa
 	, m_cameraFrameBufferSize(0)
 	, m_mirrorSRVLeft(nullptr)
 	, m_mirrorSRVRight(nullptr)
+	, m_fenceEvent(NULL)
 	, m_fenceValue(0)
 {
 }
 
 PassthroughRenderer::~PassthroughRenderer()
 {
-	vr::IVRCompositor* vrCompositor = m_openVRManager->GetVRCompositor();
+	// The runtime is only needed if mirror textures were taken, the self tests run without it.
+	vr::IVRCompositor* vrCompositor = (m_mirrorSRVLeft || m_mirrorSRVRight) ? m_openVRManager->GetVRCompositor() : nullptr;
 
 	if (vrCompositor)
 	{
@@ -81,6 +154,11 @@ PassthroughRenderer::~PassthroughRenderer()
 			vrCompositor->ReleaseMirrorTextureD3D11(m_mirrorSRVRight);
 		}
 	}
+
+	if (m_fenceEvent)
+	{
+		CloseHandle(m_fenceEvent);
+	}
 }
 
 
@@ -118,11 +196,19 @@ bool PassthroughRenderer::InitRenderer()
 
 	//m_d3dDevice->GetImmediateContext(&m_deviceContext);
 
+	m_renderContext = m_deviceContext;
+
 	if (FAILED(m_d3dDevice->CreateFence(m_fenceValue, D3D11_FENCE_FLAG_NONE, IID_PPV_ARGS(&m_fence))))
 	{
 		return false;
 	}
 
+	m_fenceEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	if (!m_fenceEvent)
+	{
+		return false;
+	}
+
 
 	if (FAILED(m_d3dDevice->CreateVertexShader(g_FullscreenQuadShaderVS, sizeof(g_FullscreenQuadShaderVS), nullptr, &m_quadShader)))
 	{
@@ -154,17 +240,48 @@ bool PassthroughRenderer::InitRenderer()
 		return false;
 	}
 
-	D3D11_BUFFER_DESC bufferDesc = {};
-	bufferDesc.ByteWidth = sizeof(Matrix4) * 2;
-	bufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-	for (int i = 0; i < NUM_SWAPCHAINS * 2; i++) 
+	if (FAILED(m_d3dDevice->CreatePixelShader(g_MaskKeyShaderPS, sizeof(g_MaskKeyShaderPS), nullptr, &m_maskKeyShader)))
+	{
+		return false;
+	}
+
+	if (FAILED(m_d3dDevice->CreatePixelShader(g_PassthroughMaskedUpsampleShaderPS, sizeof(g_PassthroughMaskedUpsampleShaderPS), nullptr, &m_maskedUpsampleShader)))
+	{
+		return false;
+	}
+
+	if (FAILED(m_d3dDevice->CreateComputeShader(g_MaskMorphologyShaderCS, sizeof(g_MaskMorphologyShaderCS), nullptr, &m_maskMorphologyShader)))
+	{
+		return false;
+	}
+
+	D3D11_INPUT_ELEMENT_DESC inputElements[2] =
+	{
+		{ "POSITION", 0, DXGI_FORMAT_R32G32_FLOAT, 0, offsetof(WarpMeshVertex, position), D3D11_INPUT_PER_VERTEX_DATA, 0 },
+		{ "TEXCOORD", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, offsetof(WarpMeshVertex, uvCoords), D3D11_INPUT_PER_VERTEX_DATA, 0 }
+	};
+
+	if (FAILED(m_d3dDevice->CreateInputLayout(inputElements, 2, g_PassthroughShaderVS, sizeof(g_PassthroughShaderVS), &m_inputLayout)))
+	{
+		return false;
+	}
+
+	D3D11_BUFFER_DESC vertexBufferDesc = {};
+	vertexBufferDesc.ByteWidth = sizeof(WarpMeshVertex) * WARP_MESH_MAX_VERTICES;
+	vertexBufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	vertexBufferDesc.Usage = D3D11_USAGE_DYNAMIC;
+	vertexBufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	for (int i = 0; i < NUM_SWAPCHAINS * 2; i++)
 	{
-		if (FAILED(m_d3dDevice->CreateBuffer(&bufferDesc, nullptr,  &m_vsConstantBuffer[i])))
+		if (FAILED(m_d3dDevice->CreateBuffer(&vertexBufferDesc, nullptr, &m_warpMeshVertexBuffer[i])))
 		{
 			return false;
 		}
 	}
 
+	D3D11_BUFFER_DESC bufferDesc = {};
+	bufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+
 	bufferDesc.ByteWidth = 32;
 	if (FAILED(m_d3dDevice->CreateBuffer(&bufferDesc, nullptr, &m_psPassConstantBuffer)))
 	{
@@ -183,6 +300,39 @@ bool PassthroughRenderer::InitRenderer()
 		return false;
 	}
 
+	bufferDesc.ByteWidth = 32;
+	if (FAILED(m_d3dDevice->CreateBuffer(&bufferDesc, nullptr, &m_psMaskConstantBuffer)))
+	{
+		return false;
+	}
+
+	bufferDesc.ByteWidth = 64;
+	if (FAILED(m_d3dDevice->CreateBuffer(&bufferDesc, nullptr, &m_psTemporalConstantBuffer)))
+	{
+		return false;
+	}
+
+	bufferDesc.ByteWidth = 32;
+	if (FAILED(m_d3dDevice->CreateBuffer(&bufferDesc, nullptr, &m_csMorphologyConstantBuffer)))
+	{
+		return false;
+	}
+
+
+	D3D11_TEXTURE3D_DESC keyLUTDesc = {};
+	keyLUTDesc.Width = KEY_LUT_SIZE;
+	keyLUTDesc.Height = KEY_LUT_SIZE;
+	keyLUTDesc.Depth = KEY_LUT_SIZE;
+	keyLUTDesc.MipLevels = 1;
+	keyLUTDesc.Format = DXGI_FORMAT_R16G16B16A16_FLOAT;
+	keyLUTDesc.Usage = D3D11_USAGE_DEFAULT;
+	keyLUTDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	if (FAILED(m_d3dDevice->CreateTexture3D(&keyLUTDesc, nullptr, &m_keyLUTTexture)) ||
+		FAILED(m_d3dDevice->CreateShaderResourceView(m_keyLUTTexture.Get(), nullptr, &m_keyLUTSRV)))
+	{
+		return false;
+	}
+
 
 	D3D11_SAMPLER_DESC sampler = {};
 	sampler.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
@@ -263,6 +413,23 @@ bool PassthroughRenderer::InitRenderer()
 		InitRenderTarget(i);
 	}
 
+	InitMaskTargets();
+
+	D3D11_QUERY_DESC disjointQueryDesc = {};
+	disjointQueryDesc.Query = D3D11_QUERY_TIMESTAMP_DISJOINT;
+	D3D11_QUERY_DESC timestampQueryDesc = {};
+	timestampQueryDesc.Query = D3D11_QUERY_TIMESTAMP;
+
+	for (int i = 0; i < NUM_SWAPCHAINS; i++)
+	{
+		if (FAILED(m_d3dDevice->CreateQuery(&disjointQueryDesc, &m_gpuDisjointQueries[i])) ||
+			FAILED(m_d3dDevice->CreateQuery(&timestampQueryDesc, &m_gpuStartQueries[i])) ||
+			FAILED(m_d3dDevice->CreateQuery(&timestampQueryDesc, &m_gpuEndQueries[i])))
+		{
+			return false;
+		}
+	}
+
 	return true;
 }
 
@@ -376,8 +543,8 @@ void PassthroughRenderer::InitRenderTarget(const uint32_t index)
 	D3D11_TEXTURE2D_DESC textureDesc = {};
 	textureDesc.MipLevels = 1;
 	textureDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
-	textureDesc.Width = m_cameraTextureWidth / 2; //TODO
-	textureDesc.Height = m_cameraTextureHeight;
+	textureDesc.Width = m_renderTargetWidth;
+	textureDesc.Height = m_renderTargetHeight;
 	textureDesc.ArraySize = 1;
 	textureDesc.SampleDesc.Count = 1;
 	textureDesc.SampleDesc.Quality = 0;
@@ -406,6 +573,64 @@ void PassthroughRenderer::InitRenderTarget(const uint32_t index)
 }
 
 
+// Each eye has two key masks, written to in alternating frames so the other one holds the history.
+// They are allocated at the render target size, and rendered to at the reduced mask resolution.
+void PassthroughRenderer::InitMaskTargets()
+{
+	D3D11_TEXTURE2D_DESC textureDesc = {};
+	textureDesc.MipLevels = 1;
+	textureDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+	textureDesc.Width = m_renderTargetWidth;
+	textureDesc.Height = m_renderTargetHeight;
+	textureDesc.ArraySize = 1;
+	textureDesc.SampleDesc.Count = 1;
+	textureDesc.SampleDesc.Quality = 0;
+	textureDesc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+	textureDesc.Usage = D3D11_USAGE_DEFAULT;
+	textureDesc.CPUAccessFlags = 0;
+
+	m_bMaskHistoryValid = false;
+
+	for (int i = 0; i < 4; i++)
+	{
+		m_maskTargets[i].Reset();
+		m_maskTargetViews[i].Reset();
+		m_maskTargetSRVs[i].Reset();
+
+		if (FAILED(m_d3dDevice->CreateTexture2D(&textureDesc, nullptr, &m_maskTargets[i])) ||
+			FAILED(m_d3dDevice->CreateRenderTargetView(m_maskTargets[i].Get(), nullptr, &m_maskTargetViews[i])) ||
+			FAILED(m_d3dDevice->CreateShaderResourceView(m_maskTargets[i].Get(), nullptr, &m_maskTargetSRVs[i])))
+		{
+			ErrorLog("Failed to create key mask target\n");
+			m_maskTargets[i].Reset();
+			m_maskTargetViews[i].Reset();
+			m_maskTargetSRVs[i].Reset();
+		}
+	}
+
+	// The cleanup passes only filter the alpha, alternating between the two targets.
+	textureDesc.Format = DXGI_FORMAT_R8_UNORM;
+	textureDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE;
+
+	for (int i = 0; i < 2; i++)
+	{
+		m_maskCleanupTargets[i].Reset();
+		m_maskCleanupUAVs[i].Reset();
+		m_maskCleanupSRVs[i].Reset();
+
+		if (FAILED(m_d3dDevice->CreateTexture2D(&textureDesc, nullptr, &m_maskCleanupTargets[i])) ||
+			FAILED(m_d3dDevice->CreateUnorderedAccessView(m_maskCleanupTargets[i].Get(), nullptr, &m_maskCleanupUAVs[i])) ||
+			FAILED(m_d3dDevice->CreateShaderResourceView(m_maskCleanupTargets[i].Get(), nullptr, &m_maskCleanupSRVs[i])))
+		{
+			ErrorLog("Failed to create key mask cleanup target\n");
+			m_maskCleanupTargets[i].Reset();
+			m_maskCleanupUAVs[i].Reset();
+			m_maskCleanupSRVs[i].Reset();
+		}
+	}
+}
+
+
 void PassthroughRenderer::SetFrameSize(const uint32_t width, const uint32_t height, const uint32_t bufferSize)
 {
 	m_cameraTextureWidth = width;
@@ -414,13 +639,263 @@ void PassthroughRenderer::SetFrameSize(const uint32_t width, const uint32_t heig
 }
 
 
-void PassthroughRenderer::RenderPassthroughFrame(std::shared_ptr<CameraFrame> frame, RenderFrame& renderFrame)
+// Reallocates the render targets if the renderer is already initialized.
+void PassthroughRenderer::SetRenderTargetSize(const uint32_t width, const uint32_t height)
 {
-	Config_Main& mainConf = m_configManager->GetConfig_Main();
+	if (width == m_renderTargetWidth && height == m_renderTargetHeight)
+	{
+		return;
+	}
 
-	renderFrame.textureLeft = m_renderTargets[m_frameIndex];
-	renderFrame.textureRight = m_renderTargets[m_frameIndex + NUM_SWAPCHAINS];
+	m_renderTargetWidth = width;
+	m_renderTargetHeight = height;
+	m_viewportWidth = width;
+	m_viewportHeight = height;
+
+	if (!m_d3dDevice)
+	{
+		return;
+	}
+
+	for (int i = 0; i < NUM_SWAPCHAINS * 2; i++)
+	{
+		m_renderTargets[i].Reset();
+		m_renderTargetViews[i].Reset();
+		InitRenderTarget(i);
+	}
+
+	InitMaskTargets();
+
+	// The timings of the previous size no longer apply.
+	m_resolutionGovernor.Reset();
+}
+
+
+// Reads back the GPU time of the last frame rendered to the current swapchain image, and
+// picks the viewport size for the next frame. The fence wait normally leaves the results ready.
+void PassthroughRenderer::UpdateResolutionScale()
+{
+	if (m_bGPUQueryPending[m_frameIndex])
+	{
+		D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjointData;
+		UINT64 startTime;
+		UINT64 endTime;
+
+		if (m_deviceContext->GetData(m_gpuDisjointQueries[m_frameIndex].Get(), &disjointData, sizeof(disjointData), D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK &&
+			m_deviceContext->GetData(m_gpuStartQueries[m_frameIndex].Get(), &startTime, sizeof(startTime), D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK &&
+			m_deviceContext->GetData(m_gpuEndQueries[m_frameIndex].Get(), &endTime, sizeof(endTime), D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK)
+		{
+			m_bGPUQueryPending[m_frameIndex] = false;
+
+			if (!disjointData.Disjoint && endTime > startTime)
+			{
+				m_gpuTimeMS = (float)((endTime - startTime) * 1000.0 / disjointData.Frequency);
+
+				if (m_config->DynamicResolution)
+				{
+					m_resolutionGovernor.Update(m_gpuTimeMS);
+				}
+			}
+		}
+	}
+
+	if (m_config->DynamicResolution)
+	{
+		m_resolutionGovernor.SetLimits(m_config->GPUFrameBudgetMS, m_config->MinResolutionScale);
+	}
+	else
+	{
+		m_resolutionGovernor.Reset();
+	}
+
+	float scale = m_resolutionGovernor.GetScale();
+	m_viewportWidth = std::clamp((uint32_t)(m_renderTargetWidth * scale + 0.5f), 1u, m_renderTargetWidth);
+	m_viewportHeight = std::clamp((uint32_t)(m_renderTargetHeight * scale + 0.5f), 1u, m_renderTargetHeight);
+}
+
+
+bool PassthroughRenderer::CreateConstantBuffer(const void* data, const uint32_t size, ComPtr<ID3D11Buffer>& outBuffer)
+{
+	// Constant buffers are created 32 bytes wide, larger than the packed structs.
+	uint8_t bufferData[32] = {};
+	memcpy(bufferData, data, std::min(size, (uint32_t)sizeof(bufferData)));
+
+	D3D11_BUFFER_DESC bufferDesc = {};
+	bufferDesc.ByteWidth = sizeof(bufferData);
+	bufferDesc.Usage = D3D11_USAGE_IMMUTABLE;
+	bufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+
+	D3D11_SUBRESOURCE_DATA initData = {};
+	initData.pSysMem = bufferData;
+
+	return SUCCEEDED(m_d3dDevice->CreateBuffer(&bufferDesc, &initData, &outBuffer));
+}
+
+
+bool PassthroughRenderer::CreateKeyLUT(const std::vector<uint16_t>& data, ComPtr<ID3D11Texture3D>& outTexture, ComPtr<ID3D11ShaderResourceView>& outSRV)
+{
+	D3D11_TEXTURE3D_DESC textureDesc = {};
+	textureDesc.Width = KEY_LUT_SIZE;
+	textureDesc.Height = KEY_LUT_SIZE;
+	textureDesc.Depth = KEY_LUT_SIZE;
+	textureDesc.MipLevels = 1;
+	textureDesc.Format = DXGI_FORMAT_R16G16B16A16_FLOAT;
+	textureDesc.Usage = D3D11_USAGE_IMMUTABLE;
+	textureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+	D3D11_SUBRESOURCE_DATA initData = {};
+	initData.pSysMem = data.data();
+	initData.SysMemPitch = KEY_LUT_SIZE * KEY_LUT_CHANNELS * sizeof(uint16_t);
+	initData.SysMemSlicePitch = KEY_LUT_SIZE * KEY_LUT_SIZE * KEY_LUT_CHANNELS * sizeof(uint16_t);
+
+	return SUCCEEDED(m_d3dDevice->CreateTexture3D(&textureDesc, &initData, &outTexture)) &&
+		SUCCEEDED(m_d3dDevice->CreateShaderResourceView(outTexture.Get(), nullptr, &outSRV));
+}
+
+
+// Builds the constant buffers and key LUTs of any new profiles, keeping the ones for unchanged profiles.
+void PassthroughRenderer::UpdateProfileRenderStates()
+{
+	std::vector<ProfileRenderState> states;
+
+	for (const ConfigProfile& profile : m_profileList->profiles)
+	{
+		auto it = std::find_if(m_profileRenderStates.begin(), m_profileRenderStates.end(), [&profile](const ProfileRenderState& state) { return state.config == profile.config; });
+
+		if (it != m_profileRenderStates.end())
+		{
+			states.push_back(*it);
+			continue;
+		}
+
+		ProfileRenderState state;
+		state.config = profile.config;
+
+		PSPassConstantBuffer passBuffer = {};
+		FillPassConstants(*profile.config, passBuffer);
+
+		PSMaskedConstantBuffer maskedBuffer = {};
+		FillMaskedConstants(*profile.config, maskedBuffer);
+
+		if (!CreateConstantBuffer(&passBuffer, sizeof(passBuffer), state.passConstantBuffer) ||
+			!CreateConstantBuffer(&maskedBuffer, sizeof(maskedBuffer), state.maskedConstantBuffer))
+		{
+			ErrorLog("Failed to create constant buffers for profile %s\n", profile.name.c_str());
+			continue;
+		}
+
+		FillKeyLUTParams(*profile.config, state.keyLUTParams);
+
+		// Profiles with the same keys share a table. A profile saved from the current settings
+		// takes the live table data, the others are baked in the background and picked up by UpdateKeyLUT.
+		auto sameKeys = std::find_if(states.begin(), states.end(), [&state](const ProfileRenderState& other) { return other.keyLUTParams == state.keyLUTParams; });
+
+		if (sameKeys != states.end())
+		{
+			state.keyLUTTexture = sameKeys->keyLUTTexture;
+			state.keyLUTSRV = sameKeys->keyLUTSRV;
+		}
+		else if (m_bKeyLUTBaked && m_keyLUTParams == state.keyLUTParams)
+		{
+			if (!CreateKeyLUT(m_keyLUTData, state.keyLUTTexture, state.keyLUTSRV))
+			{
+				ErrorLog("Failed to create key LUT for profile %s\n", profile.name.c_str());
+			}
+		}
+		else
+		{
+			m_keyLUTBakeThread.RequestProfileBake(state.keyLUTParams);
+		}
+
+		states.push_back(state);
+	}
+
+	m_profileRenderStates = std::move(states);
+}
+
+
+// Switching to a saved profile only swaps the bound buffers. Otherwise the live buffers are
+// updated for the fields that changed, or fully if a profile was bound since their last update.
+// The profile buffers are only used at full quality, since the lower tiers modify the constants.
+void PassthroughRenderer::ApplyConfigConstants(uint32_t changedDependencies)
+{
+	for (const ProfileRenderState& state : m_profileRenderStates)
+	{
+		if (state.config == m_config && m_qualityTier == QualityTier_Full)
+		{
+			m_activePassConstantBuffer = state.passConstantBuffer.Get();
+			m_activeMaskedConstantBuffer = state.maskedConstantBuffer.Get();
+			m_bLiveConstantsStale = true;
+			return;
+		}
+	}
+
+	if (m_bLiveConstantsStale)
+	{
+		changedDependencies = UINT32_MAX;
+		m_bLiveConstantsStale = false;
+	}
+
+	if (changedDependencies & ConfigDep_PassConstants)
+	{
+		PSPassConstantBuffer buffer = {};
+		FillPassConstants(*m_config, buffer);
+		if (m_qualityTier >= QualityTier_NoColorAdjustment)
+		{
+			buffer.bDoColorAdjustment = false;
+		}
+		m_renderContext->UpdateSubresource(m_psPassConstantBuffer.Get(), 0, nullptr, &buffer, 0, 0);
+	}
+
+	// Updated regardless of the blend mode, since switching modes doesn't invalidate the buffer.
+	if (changedDependencies & ConfigDep_MaskedConstants)
+	{
+		PSMaskedConstantBuffer maskedBuffer = {};
+		FillMaskedConstants(*m_config, maskedBuffer);
+		m_renderContext->UpdateSubresource(m_psMaskedConstantBuffer.Get(), 0, nullptr, &maskedBuffer, 0, 0);
+	}
+
+	m_activePassConstantBuffer = m_psPassConstantBuffer.Get();
+	m_activeMaskedConstantBuffer = m_psMaskedConstantBuffer.Get();
+}
+
+
+void PassthroughRenderer::UpdateConfig()
+{
+	uint32_t changedDependencies = ConfigDep_None;
+	bool bConfigChanged = m_configManager->UpdateConfigSnapshot(m_config, m_configGeneration, &changedDependencies);
+
+	if (m_configManager->UpdateProfileListSnapshot(m_profileList, m_profileListGeneration))
+	{
+		UpdateProfileRenderStates();
+		bConfigChanged = true;
+	}
+
+	if (m_bQualityTierChanged)
+	{
+		m_bQualityTierChanged = false;
+		m_bLiveConstantsStale = true;
+		// Drop the mask history, so a mask keyed at the previous tier doesn't linger.
+		m_bMaskHistoryValid = false;
+		bConfigChanged = true;
+	}
+
+	if (bConfigChanged)
+	{
+		RecordFlightEvent(FlightEvent_ConfigGeneration, FlightSource_RenderThread, m_configGeneration);
+		ApplyConfigConstants(changedDependencies);
+	}
 
+	// Polled every masked frame, since the bakes finish between config changes.
+	if (m_config->PassthroughMode == Masked)
+	{
+		UpdateKeyLUT();
+	}
+}
+
+
+void PassthroughRenderer::RenderPassthroughFrame(std::shared_ptr<CameraFrame> frame, RenderFrame& renderFrame)
+{
 	/*if(SUCCEEDED(m_d3dDevice->CreateDeferredContext(0, &m_renderContext)))
 	{
 		m_bUsingDeferredContext = true;
@@ -432,6 +907,30 @@ void PassthroughRenderer::RenderPassthroughFrame(std::shared_ptr<CameraFrame> fr
 		m_renderContext = m_deviceContext;
 	}
 
+	UpdateConfig();
+
+	const Config_Main& mainConf = *m_config;
+
+	if (renderFrame.targetWidth > 0 && renderFrame.targetHeight > 0)
+	{
+		SetRenderTargetSize(renderFrame.targetWidth, renderFrame.targetHeight);
+	}
+
+	UpdateResolutionScale();
+
+	renderFrame.textureLeft = m_renderTargets[m_frameIndex];
+	renderFrame.textureRight = m_renderTargets[m_frameIndex + NUM_SWAPCHAINS];
+	renderFrame.textureBoundsU = (float)m_viewportWidth / m_renderTargetWidth;
+	renderFrame.textureBoundsV = (float)m_viewportHeight / m_renderTargetHeight;
+	m_displayUVTransforms[0] = renderFrame.displayUVTransformLeft;
+	m_displayUVTransforms[1] = renderFrame.displayUVTransformRight;
+	m_maskHistoryProjections[0] = renderFrame.maskHistoryProjectionLeft;
+	m_maskHistoryProjections[1] = renderFrame.maskHistoryProjectionRight;
+	m_bMaskHistoryValid = m_bMaskHistoryValid && renderFrame.bHasMaskHistoryProjection;
+
+	m_renderContext->Begin(m_gpuDisjointQueries[m_frameIndex].Get());
+	m_renderContext->End(m_gpuStartQueries[m_frameIndex].Get());
+
 	if (mainConf.ShowTestImage)
 	{
 		m_renderContext->PSSetShaderResources(0, 1, m_testPatternSRV.GetAddressOf());
@@ -474,47 +973,39 @@ void PassthroughRenderer::RenderPassthroughFrame(std::shared_ptr<CameraFrame> fr
 		vrCompositor->GetMirrorTextureD3D11(vr::Eye_Right, m_d3dDevice.Get(), (void**)&m_mirrorSRVRight);
 	}
 
-	m_renderContext->IASetInputLayout(nullptr);
-	m_renderContext->IASetVertexBuffers(0, 0, nullptr, 0, 0);
-	m_renderContext->IASetIndexBuffer(nullptr, DXGI_FORMAT_UNKNOWN, 0);
-	m_renderContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
+	m_renderContext->IASetInputLayout(m_inputLayout.Get());
+	m_renderContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 
 	m_renderContext->RSSetState(m_rasterizerState.Get());
 
 	m_renderContext->PSSetSamplers(0, 1, m_defaultSampler.GetAddressOf());
 
-	PSPassConstantBuffer buffer = {};
-	buffer.opacity = mainConf.PassthroughOpacity;
-	buffer.brightness = mainConf.Brightness;
-	buffer.contrast = mainConf.Contrast;
-	buffer.saturation = mainConf.Saturation;
-	buffer.bDoColorAdjustment = fabsf(mainConf.Brightness) > 0.01f || fabsf(mainConf.Contrast - 1.0f) > 0.01f || fabsf(mainConf.Saturation - 1.0f) > 0.01f;
-
-	m_renderContext->UpdateSubresource(m_psPassConstantBuffer.Get(), 0, nullptr, &buffer, 0, 0);
-
 	if (mainConf.PassthroughMode == Masked)
 	{
-		PSMaskedConstantBuffer maskedBuffer = {};
-		maskedBuffer.maskedKey[0] = powf(mainConf.MaskedKeyColor[0], 2.2f);
-		maskedBuffer.maskedKey[1] = powf(mainConf.MaskedKeyColor[1], 2.2f);
-		maskedBuffer.maskedKey[2] = powf(mainConf.MaskedKeyColor[2], 2.2f);
-		maskedBuffer.maskedFracChroma = mainConf.MaskedFractionChroma * 100.0f;
-		maskedBuffer.maskedFracLuma = mainConf.MaskedFractionLuma * 100.0f;
-		maskedBuffer.maskedSmooth = mainConf.MaskedSmoothing * 100.0f;
-		maskedBuffer.bMaskedUseCamera = mainConf.MaskedUseCameraImage;
-
-		m_renderContext->UpdateSubresource(m_psMaskedConstantBuffer.Get(), 0, nullptr, &maskedBuffer, 0, 0);
+		m_renderContext->PSSetShaderResources(5, 1, m_activeKeyLUTSRV.GetAddressOf());
 
 		RenderPassthroughViewMasked(LEFT_EYE, frame);
 		RenderPassthroughViewMasked(RIGHT_EYE, frame);
+
+		// The masks just written become the history of the next frame.
+		uint32_t divisor = GetMaskDivisor();
+		m_maskHistoryUVScale.x = (float)((m_viewportWidth + divisor - 1) / divisor) / m_renderTargetWidth;
+		m_maskHistoryUVScale.y = (float)((m_viewportHeight + divisor - 1) / divisor) / m_renderTargetHeight;
+		m_bMaskHistoryValid = UseKeyMaskPass();
+		m_maskWriteIndex ^= 1;
 	}
 	else
 	{
+		m_bMaskHistoryValid = false;
 		RenderPassthroughView(LEFT_EYE, frame, mainConf.PassthroughMode);
 		RenderPassthroughView(RIGHT_EYE, frame, mainConf.PassthroughMode);
 	}
 	
-	RenderFrameFinish();
+	m_renderContext->End(m_gpuEndQueries[m_frameIndex].Get());
+	m_renderContext->End(m_gpuDisjointQueries[m_frameIndex].Get());
+	m_bGPUQueryPending[m_frameIndex] = true;
+
+	m_bLastFrameMissedFence = !RenderFrameFinish();
 }
 
 
@@ -528,8 +1019,8 @@ void PassthroughRenderer::RenderPassthroughView(const ERenderEye eye, std::share
 
 	m_renderContext->OMSetRenderTargets(1, m_renderTargetViews[bufferIndex].GetAddressOf(), nullptr);
 
-	D3D11_VIEWPORT viewport = { 0.0f, 0.0f, (float)m_cameraTextureWidth / 2, (float)m_cameraTextureHeight, 0.0f, 1.0f };
-	D3D11_RECT scissor = { 0, 0, m_cameraTextureWidth / 2, m_cameraTextureHeight };
+	D3D11_VIEWPORT viewport = { 0.0f, 0.0f, (float)m_viewportWidth, (float)m_viewportHeight, 0.0f, 1.0f };
+	D3D11_RECT scissor = GetWarpMeshScissor(eye, frame, m_viewportWidth, m_viewportHeight);
 
 	/*XrRect2Di rect = layer->views[viewIndex].subImage.imageRect;
 
@@ -539,20 +1030,18 @@ void PassthroughRenderer::RenderPassthroughView(const ERenderEye eye, std::share
 	m_renderContext->RSSetViewports(1, &viewport);
 	m_renderContext->RSSetScissorRects(1, &scissor);
 
-	VSConstantBuffer buffer = {};
-	buffer.cameraUVProjectionFar = (eye == LEFT_EYE) ? frame->frameUVProjectionLeft : frame->frameUVProjectionRight;
-	
-	m_renderContext->UpdateSubresource(m_vsConstantBuffer[bufferIndex].Get(), 0, nullptr, &buffer, 0, 0);
+	SetupWarpMesh(eye, bufferIndex, frame);
 
-	m_renderContext->VSSetConstantBuffers(0, 1, m_vsConstantBuffer[bufferIndex].GetAddressOf());
 	m_renderContext->VSSetShader(m_vertexShader.Get(), nullptr, 0);
 	
 	PSViewConstantBuffer viewBuffer = {};
 	viewBuffer.frameUVOffset = GetFrameUVOffset(eye, frame->frameLayout);
+	viewBuffer.prepassUVFactor = Vector2(m_displayUVTransforms[viewIndex].x, m_displayUVTransforms[viewIndex].y);
+	viewBuffer.prepassUVOffset = Vector2(m_displayUVTransforms[viewIndex].z, m_displayUVTransforms[viewIndex].w);
 
 	m_renderContext->UpdateSubresource(m_psViewConstantBuffer.Get(), 0, nullptr, &viewBuffer, 0, 0);
 
-	ID3D11Buffer* psBuffers[2] = { m_psPassConstantBuffer.Get(), m_psViewConstantBuffer.Get() };
+	ID3D11Buffer* psBuffers[2] = { m_activePassConstantBuffer, m_psViewConstantBuffer.Get() };
 	m_renderContext->PSSetConstantBuffers(0, 2, psBuffers);
 
 	/*if (blendMode == Additive)
@@ -566,7 +1055,7 @@ void PassthroughRenderer::RenderPassthroughView(const ERenderEye eye, std::share
 
 	m_renderContext->PSSetShader(m_pixelShader.Get(), nullptr, 0);
 	
-	m_renderContext->Draw(3, 0);
+	m_renderContext->DrawIndexed(GetWarpMeshIndexCount(m_warpMeshCells), 0, 0);
 }
 
 
@@ -578,26 +1067,14 @@ void PassthroughRenderer::RenderPassthroughViewMasked(const ERenderEye eye, std:
 	float clearColor[4] = { 0 };
 	m_renderContext->ClearRenderTargetView(m_renderTargetViews[bufferIndex].Get(), clearColor);
 
-
-	D3D11_VIEWPORT viewport = { 0.0f, 0.0f, (float)m_cameraTextureWidth / 2, (float)m_cameraTextureHeight, 0.0f, 1.0f };
-	D3D11_RECT scissor = { 0, 0, m_cameraTextureWidth  / 2, m_cameraTextureHeight };
-
-	m_renderContext->RSSetViewports(1, &viewport);
-	m_renderContext->RSSetScissorRects(1, &scissor);
-
-	VSConstantBuffer buffer = {};
-	buffer.cameraUVProjectionFar = (eye == LEFT_EYE) ? frame->frameUVProjectionLeft : frame->frameUVProjectionRight;
-
-	m_renderContext->UpdateSubresource(m_vsConstantBuffer[bufferIndex].Get(), 0, nullptr, &buffer, 0, 0);
-
-	m_renderContext->VSSetConstantBuffers(0, 1, m_vsConstantBuffer[bufferIndex].GetAddressOf());
+	SetupWarpMesh(eye, bufferIndex, frame);
 
 	m_renderContext->VSSetShader(m_vertexShader.Get(), nullptr, 0);
 
 
 	ID3D11ShaderResourceView* cameraFrameSRV = nullptr;
 
-	if (m_configManager->GetConfig_Main().ShowTestImage)
+	if (m_config->ShowTestImage)
 	{
 		cameraFrameSRV = m_testPatternSRV.Get();
 	}
@@ -611,7 +1088,12 @@ void PassthroughRenderer::RenderPassthroughViewMasked(const ERenderEye eye, std:
 	}
 
 
-	if (m_configManager->GetConfig_Main().MaskedUseCameraImage)
+	if (eye == LEFT_EYE && m_bKeyCalibrationRequested)
+	{
+		CopyKeyCalibrationFrame(m_config->MaskedUseCameraImage ? cameraFrameSRV : m_mirrorSRVLeft);
+	}
+
+	if (m_config->MaskedUseCameraImage)
 	{
 		m_renderContext->PSSetShaderResources(0, 1, &cameraFrameSRV);
 	}
@@ -623,27 +1105,478 @@ void PassthroughRenderer::RenderPassthroughViewMasked(const ERenderEye eye, std:
 
 	PSViewConstantBuffer viewBuffer = {};
 	viewBuffer.frameUVOffset = GetFrameUVOffset(eye, frame->frameLayout);
+	viewBuffer.prepassUVFactor = Vector2(m_displayUVTransforms[viewIndex].x, m_displayUVTransforms[viewIndex].y);
+	viewBuffer.prepassUVOffset = Vector2(m_displayUVTransforms[viewIndex].z, m_displayUVTransforms[viewIndex].w);
 
 	m_renderContext->UpdateSubresource(m_psViewConstantBuffer.Get(), 0, nullptr, &viewBuffer, 0, 0);
 
-	ID3D11Buffer* psBuffers[3] = { m_psPassConstantBuffer.Get(), m_psViewConstantBuffer.Get(), m_psMaskedConstantBuffer.Get() };
-	m_renderContext->PSSetConstantBuffers(0, 3, psBuffers);
+	ID3D11Buffer* psBuffers[4] = { m_activePassConstantBuffer, m_psViewConstantBuffer.Get(), m_activeMaskedConstantBuffer, m_psMaskConstantBuffer.Get() };
+	m_renderContext->PSSetConstantBuffers(0, 4, psBuffers);
 
-	m_renderContext->PSSetShader(m_maskedPixelShader.Get(), nullptr, 0);
-	
-	m_renderContext->OMSetRenderTargets(1, m_renderTargetViews[bufferIndex].GetAddressOf(), nullptr);
 	m_renderContext->OMSetBlendState(m_blendStateBase.Get(), nullptr, UINT_MAX);
 
-	m_renderContext->Draw(3, 0);
+	int maskIndex = viewIndex * 2 + m_maskWriteIndex;
+	bool bUseKeyMaskPass = UseKeyMaskPass();
+
+	if (bUseKeyMaskPass)
+	{
+		RenderKeyMask(eye, frame);
+	}
+
+	D3D11_VIEWPORT viewport = { 0.0f, 0.0f, (float)m_viewportWidth, (float)m_viewportHeight, 0.0f, 1.0f };
+	D3D11_RECT scissor = GetWarpMeshScissor(eye, frame, m_viewportWidth, m_viewportHeight);
+
+	m_renderContext->RSSetViewports(1, &viewport);
+	m_renderContext->RSSetScissorRects(1, &scissor);
+
+	m_renderContext->OMSetRenderTargets(1, m_renderTargetViews[bufferIndex].GetAddressOf(), nullptr);
+
+	if (bUseKeyMaskPass)
+	{
+		m_renderContext->PSSetShaderResources(2, 1, m_maskTargetSRVs[maskIndex].GetAddressOf());
+		m_renderContext->PSSetShaderResources(4, 1, m_maskCleanupSRVs[1].GetAddressOf());
+		m_renderContext->PSSetShader(m_maskedUpsampleShader.Get(), nullptr, 0);
+	}
+	else
+	{
+		m_renderContext->PSSetShader(m_maskedPixelShader.Get(), nullptr, 0);
+	}
+
+	m_renderContext->DrawIndexed(GetWarpMeshIndexCount(m_warpMeshCells), 0, 0);
+
+	if (bUseKeyMaskPass)
+	{
+		// Unbind the masks so they can be rendered to for the next eye.
+		ID3D11ShaderResourceView* nullSRVs[3] = { nullptr, nullptr, nullptr };
+		m_renderContext->PSSetShaderResources(2, 3, nullSRVs);
+	}
+}
+
+
+// Binds a table holding the current keys, from the live table or a profile. When none holds them
+// the live table is rebaked, unless a profile table with them is already being baked, and the
+// table bound so far stays bound until then. Compared against the baked keys rather than the
+// config dependencies, so switching profiles and editing the keys after a switch both rebind.
+void PassthroughRenderer::UpdateKeyLUT()
+{
+	KeyLUTParams bakedParams;
+	if (m_keyLUTBakeThread.GetResult(bakedParams, m_keyLUTData))
+	{
+		m_renderContext->UpdateSubresource(m_keyLUTTexture.Get(), 0, nullptr, m_keyLUTData.data(), KEY_LUT_SIZE * KEY_LUT_CHANNELS * sizeof(uint16_t), KEY_LUT_SIZE * KEY_LUT_SIZE * KEY_LUT_CHANNELS * sizeof(uint16_t));
+		m_keyLUTParams = bakedParams;
+		m_bKeyLUTBaked = true;
+	}
+
+	// One texture is shared by all the profiles with the same keys.
+	std::vector<uint16_t> profileLUT;
+	while (m_keyLUTBakeThread.GetProfileResult(bakedParams, profileLUT))
+	{
+		ComPtr<ID3D11Texture3D> texture;
+		ComPtr<ID3D11ShaderResourceView> srv;
+
+		for (ProfileRenderState& state : m_profileRenderStates)
+		{
+			if (state.keyLUTSRV || !(state.keyLUTParams == bakedParams))
+			{
+				continue;
+			}
+
+			if (!srv && !CreateKeyLUT(profileLUT, texture, srv))
+			{
+				ErrorLog("Failed to create key LUT for profile\n");
+				break;
+			}
+
+			state.keyLUTTexture = texture;
+			state.keyLUTSRV = srv;
+		}
+	}
+
+	KeyLUTParams params;
+	FillKeyLUTParams(*m_config, params);
+
+	if (m_bKeyLUTBaked && params == m_keyLUTParams)
+	{
+		m_activeKeyLUTSRV = m_keyLUTSRV;
+		return;
+	}
+
+	bool bProfileBakePending = false;
+
+	for (const ProfileRenderState& state : m_profileRenderStates)
+	{
+		if (state.keyLUTParams == params)
+		{
+			if (state.keyLUTSRV)
+			{
+				m_activeKeyLUTSRV = state.keyLUTSRV;
+				return;
+			}
+
+			bProfileBakePending = true;
+		}
+	}
+
+	// There is no previous table to keep showing on the first frame, so it is baked in place.
+	if (!m_bKeyLUTBaked)
+	{
+		m_keyLUTBakeThread.GetBaker().Bake(params, m_keyLUTData);
+		m_renderContext->UpdateSubresource(m_keyLUTTexture.Get(), 0, nullptr, m_keyLUTData.data(), KEY_LUT_SIZE * KEY_LUT_CHANNELS * sizeof(uint16_t), KEY_LUT_SIZE * KEY_LUT_SIZE * KEY_LUT_CHANNELS * sizeof(uint16_t));
+		m_keyLUTParams = params;
+		m_bKeyLUTBaked = true;
+		m_activeKeyLUTSRV = m_keyLUTSRV;
+		return;
+	}
+
+	// The previous table stays bound until the bake finishes, a few frames later while the sliders are dragged.
+	if (!bProfileBakePending && (!m_bKeyLUTBakeRequested || !(params == m_keyLUTRequestedParams)))
+	{
+		m_keyLUTBakeThread.RequestBake(params);
+		m_keyLUTRequestedParams = params;
+		m_bKeyLUTBakeRequested = true;
+	}
+}
+
+
+// The key is evaluated in a separate pass when the mask is upsampled, blended with the history or cleaned up.
+bool PassthroughRenderer::UseKeyMaskPass() const
+{
+	if (!m_maskTargetViews[0] || !m_maskTargetViews[1] || !m_maskTargetViews[2] || !m_maskTargetViews[3])
+	{
+		return false;
+	}
+
+	return GetMaskDivisor() > 1 || m_config->MaskedTemporalSmoothing > 0.0f || m_config->MaskedCleanupRadius > 0;
 }
 
 
-void PassthroughRenderer::RenderFrameFinish()
+uint32_t PassthroughRenderer::GetMaskDivisor() const
 {
-	HANDLE fenceEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	uint32_t divisor = (uint32_t)std::clamp(m_config->MaskedResolutionDivisor, 1, KEY_MASK_MAX_DIVISOR);
+
+	// The reduced detail tier keys at no more than half resolution.
+	if (m_qualityTier >= QualityTier_ReducedDetail)
+	{
+		divisor = std::max(divisor, 2u);
+	}
+
+	return divisor;
+}
+
+
+// Evaluates the chroma key into the mask target at the reduced resolution, with the keyed colors for
+// the upsampling, and blends in the reprojected mask of the previous frame.
+// Expects the warp mesh, inputs and constants to be bound.
+void PassthroughRenderer::RenderKeyMask(const ERenderEye eye, std::shared_ptr<CameraFrame> frame)
+{
+	int viewIndex = (eye == LEFT_EYE) ? 0 : 1;
+	int maskIndex = viewIndex * 2 + m_maskWriteIndex;
+	int historyIndex = viewIndex * 2 + (m_maskWriteIndex ^ 1);
+	uint32_t divisor = GetMaskDivisor();
+	uint32_t maskWidth = (m_viewportWidth + divisor - 1) / divisor;
+	uint32_t maskHeight = (m_viewportHeight + divisor - 1) / divisor;
+
+	PSTemporalConstantBuffer temporalBuffer = {};
+	const float* projection = m_maskHistoryProjections[viewIndex].get();
+	for (int i = 0; i < 3; i++)
+	{
+		temporalBuffer.historyProjection[i][0] = projection[i];
+		temporalBuffer.historyProjection[i][1] = projection[4 + i];
+		temporalBuffer.historyProjection[i][2] = projection[8 + i] + projection[12 + i];
+	}
+	temporalBuffer.historyUVScale = m_maskHistoryUVScale;
+	temporalBuffer.temporalSmoothing = std::clamp(m_config->MaskedTemporalSmoothing, 0.0f, 0.9f);
+	temporalBuffer.bHistoryValid = m_bMaskHistoryValid && m_config->MaskedTemporalSmoothing > 0.0f;
+
+	m_renderContext->UpdateSubresource(m_psTemporalConstantBuffer.Get(), 0, nullptr, &temporalBuffer, 0, 0);
+	m_renderContext->PSSetConstantBuffers(4, 1, m_psTemporalConstantBuffer.GetAddressOf());
+
+	float clearColor[4] = { 0 };
+	m_renderContext->ClearRenderTargetView(m_maskTargetViews[maskIndex].Get(), clearColor);
+	m_renderContext->OMSetRenderTargets(1, m_maskTargetViews[maskIndex].GetAddressOf(), nullptr);
+	m_renderContext->PSSetShaderResources(3, 1, m_maskTargetSRVs[historyIndex].GetAddressOf());
+
+	// The upsampling reads one texel past the pixels it covers, so the mask covers a texel more on each side.
+	D3D11_VIEWPORT viewport = { 0.0f, 0.0f, (float)maskWidth, (float)maskHeight, 0.0f, 1.0f };
+	D3D11_RECT scissor = GetWarpMeshScissor(eye, frame, maskWidth, maskHeight);
+	scissor.left = std::max(scissor.left - 1, 0L);
+	scissor.top = std::max(scissor.top - 1, 0L);
+	scissor.right = std::min(scissor.right + 1, (LONG)maskWidth);
+	scissor.bottom = std::min(scissor.bottom + 1, (LONG)maskHeight);
+
+	m_renderContext->RSSetViewports(1, &viewport);
+	m_renderContext->RSSetScissorRects(1, &scissor);
+
+	m_renderContext->PSSetShader(m_maskKeyShader.Get(), nullptr, 0);
+	m_renderContext->DrawIndexed(GetWarpMeshIndexCount(m_warpMeshCells), 0, 0);
+
+	// Unbind the history so it can be rendered to in the next frame.
+	ID3D11ShaderResourceView* nullSRV = nullptr;
+	m_renderContext->PSSetShaderResources(3, 1, &nullSRV);
+
+	PSMaskConstantBuffer maskBuffer = {};
+	maskBuffer.maskScale = Vector2((float)maskWidth / m_viewportWidth, (float)maskHeight / m_viewportHeight);
+	maskBuffer.maskMaxCoord[0] = maskWidth - 1;
+	maskBuffer.maskMaxCoord[1] = maskHeight - 1;
+	maskBuffer.bUseCleanedAlpha = RenderMaskCleanup(maskIndex, scissor);
+
+	m_renderContext->UpdateSubresource(m_psMaskConstantBuffer.Get(), 0, nullptr, &maskBuffer, 0, 0);
+}
+
 
+// Opens and then closes the alpha of the key mask within the area, removing specks and holes smaller than the
+// cleanup radius. Each erosion and dilation is split into a row and a column pass, with the result left in the
+// second cleanup target. Returns false if the cleanup is disabled or the area is too large to filter.
+bool PassthroughRenderer::RenderMaskCleanup(const int maskIndex, const D3D11_RECT& area)
+{
+	uint32_t radius = (uint32_t)std::clamp(m_config->MaskedCleanupRadius, 0, KEY_MASK_MAX_CLEANUP_RADIUS);
+	uint32_t areaWidth = (uint32_t)std::max(area.right - area.left, 0L);
+	uint32_t areaHeight = (uint32_t)std::max(area.bottom - area.top, 0L);
+
+	if (radius == 0 || areaWidth == 0 || areaHeight == 0 || !m_maskCleanupUAVs[0] || !m_maskCleanupUAVs[1])
+	{
+		return false;
+	}
+
+	if (std::max(areaWidth, areaHeight) + radius * 2 > KEY_MASK_MAX_MORPHOLOGY_LINE)
+	{
+		return false;
+	}
+
+	// The mask can't be read while bound as a render target.
+	m_renderContext->OMSetRenderTargets(0, nullptr, nullptr);
+
+	m_renderContext->CSSetShader(m_maskMorphologyShader.Get(), nullptr, 0);
+	m_renderContext->CSSetConstantBuffers(0, 1, m_csMorphologyConstantBuffer.GetAddressOf());
+
+	// Erode and dilate for the opening, then dilate and erode for the closing.
+	const bool passDilate[4] = { false, true, true, false };
+
+	for (int pass = 0; pass < 8; pass++)
+	{
+		bool bVertical = (pass & 1) != 0;
+		int outputIndex = bVertical ? 1 : 0;
+
+		CSMorphologyConstantBuffer morphologyBuffer = {};
+		morphologyBuffer.origin[0] = (uint32_t)area.left;
+		morphologyBuffer.origin[1] = (uint32_t)area.top;
+		morphologyBuffer.lineStep[0] = bVertical ? 0 : 1;
+		morphologyBuffer.lineStep[1] = bVertical ? 1 : 0;
+		morphologyBuffer.lineLength = bVertical ? areaHeight : areaWidth;
+		morphologyBuffer.radius = radius;
+		morphologyBuffer.bDilate = passDilate[pass / 2];
+		morphologyBuffer.bReadMaskAlpha = (pass == 0);
+
+		m_renderContext->UpdateSubresource(m_csMorphologyConstantBuffer.Get(), 0, nullptr, &morphologyBuffer, 0, 0);
+
+		// Unbind the output from the previous pass before binding it for writing.
+		ID3D11ShaderResourceView* nullSRV = nullptr;
+		m_renderContext->CSSetShaderResources(0, 1, &nullSRV);
+
+		m_renderContext->CSSetUnorderedAccessViews(0, 1, m_maskCleanupUAVs[outputIndex].GetAddressOf(), nullptr);
+		m_renderContext->CSSetShaderResources(0, 1, (pass == 0) ? m_maskTargetSRVs[maskIndex].GetAddressOf() : m_maskCleanupSRVs[outputIndex ^ 1].GetAddressOf());
+
+		m_renderContext->Dispatch(bVertical ? areaWidth : areaHeight, 1, 1);
+	}
+
+	ID3D11ShaderResourceView* nullSRV = nullptr;
+	ID3D11UnorderedAccessView* nullUAV = nullptr;
+	m_renderContext->CSSetShaderResources(0, 1, &nullSRV);
+	m_renderContext->CSSetUnorderedAccessViews(0, 1, &nullUAV, nullptr);
+	m_renderContext->CSSetShader(nullptr, nullptr, 0);
+
+	return true;
+}
+
+
+// Copies the first mip of the texture to a staging texture, recreated when the size or format changes.
+// Only 8 bit RGBA and BGRA textures are supported, which covers the camera frames and the compositor mirrors.
+void PassthroughRenderer::CopyKeyCalibrationFrame(ID3D11ShaderResourceView* source)
+{
+	m_bKeyCalibrationRequested = false;
+
+	if (!source)
+	{
+		ErrorLog("Key calibration failed, no frame available\n");
+		return;
+	}
+
+	ComPtr<ID3D11Resource> sourceResource;
+	ComPtr<ID3D11Texture2D> sourceTexture;
+	source->GetResource(&sourceResource);
+
+	if (FAILED(sourceResource.As(&sourceTexture)))
+	{
+		ErrorLog("Key calibration failed, the frame is not a 2D texture\n");
+		return;
+	}
+
+	D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc;
+	source->GetDesc(&viewDesc);
+
+	// The view format decides how the key sees the values.
+	switch (viewDesc.Format)
+	{
+	case DXGI_FORMAT_R8G8B8A8_UNORM:
+	case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+		m_bKeyCalibrationBGRA = false;
+		break;
+
+	case DXGI_FORMAT_B8G8R8A8_UNORM:
+	case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+	case DXGI_FORMAT_B8G8R8X8_UNORM:
+	case DXGI_FORMAT_B8G8R8X8_UNORM_SRGB:
+		m_bKeyCalibrationBGRA = true;
+		break;
+
+	default:
+		ErrorLog("Key calibration failed, unsupported frame format %i\n", viewDesc.Format);
+		return;
+	}
+
+	m_bKeyCalibrationSRGB = viewDesc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB || viewDesc.Format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB || viewDesc.Format == DXGI_FORMAT_B8G8R8X8_UNORM_SRGB;
+
+	D3D11_TEXTURE2D_DESC sourceDesc;
+	sourceTexture->GetDesc(&sourceDesc);
+
+	D3D11_TEXTURE2D_DESC stagingDesc = {};
+	if (m_keyCalibrationStagingTexture)
+	{
+		m_keyCalibrationStagingTexture->GetDesc(&stagingDesc);
+	}
+
+	if (!m_keyCalibrationStagingTexture || stagingDesc.Width != sourceDesc.Width || stagingDesc.Height != sourceDesc.Height || stagingDesc.Format != sourceDesc.Format)
+	{
+		stagingDesc = {};
+		stagingDesc.Width = sourceDesc.Width;
+		stagingDesc.Height = sourceDesc.Height;
+		stagingDesc.MipLevels = 1;
+		stagingDesc.ArraySize = 1;
+		stagingDesc.Format = sourceDesc.Format;
+		stagingDesc.SampleDesc.Count = 1;
+		stagingDesc.Usage = D3D11_USAGE_STAGING;
+		stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+
+		m_keyCalibrationStagingTexture.Reset();
+		if (FAILED(m_d3dDevice->CreateTexture2D(&stagingDesc, nullptr, &m_keyCalibrationStagingTexture)))
+		{
+			ErrorLog("Key calibration failed, could not create the staging texture\n");
+			return;
+		}
+	}
+
+	m_renderContext->CopySubresourceRegion(m_keyCalibrationStagingTexture.Get(), 0, 0, 0, 0, sourceTexture.Get(), 0, nullptr);
+	m_bKeyCalibrationCopyPending = true;
+}
+
+
+bool PassthroughRenderer::ReadKeyCalibrationFrame(KeyCalibrationImage& outImage)
+{
+	if (!m_bKeyCalibrationCopyPending)
+	{
+		return false;
+	}
+
+	D3D11_MAPPED_SUBRESOURCE mapped = {};
+	if (FAILED(m_deviceContext->Map(m_keyCalibrationStagingTexture.Get(), 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped)))
+	{
+		return false;
+	}
+
+	D3D11_TEXTURE2D_DESC desc;
+	m_keyCalibrationStagingTexture->GetDesc(&desc);
+
+	outImage.width = desc.Width;
+	outImage.height = desc.Height;
+	outImage.rowPitch = desc.Width * 4;
+	outImage.bSRGB = m_bKeyCalibrationSRGB;
+	outImage.bBGRA = m_bKeyCalibrationBGRA;
+	outImage.pixels.resize((size_t)outImage.rowPitch * desc.Height);
+
+	for (uint32_t y = 0; y < desc.Height; y++)
+	{
+		memcpy(outImage.pixels.data() + (size_t)y * outImage.rowPitch, (uint8_t*)mapped.pData + (size_t)y * mapped.RowPitch, outImage.rowPitch);
+	}
+
+	m_deviceContext->Unmap(m_keyCalibrationStagingTexture.Get(), 0);
+	m_bKeyCalibrationCopyPending = false;
+
+	return true;
+}
+
+
+// Restricts the draw to the part of the viewport where the warp mesh samples the camera image.
+D3D11_RECT PassthroughRenderer::GetWarpMeshScissor(const ERenderEye eye, std::shared_ptr<CameraFrame> frame, const uint32_t width, const uint32_t height)
+{
+	const TargetRect& coverage = (eye == LEFT_EYE) ? frame->warpMeshCoverageLeft : frame->warpMeshCoverageRight;
+	ScissorRect rect = GetCoverageScissor(coverage, width, height);
+
+	D3D11_RECT scissor;
+	scissor.left = (LONG)rect.left;
+	scissor.top = (LONG)rect.top;
+	scissor.right = (LONG)rect.right;
+	scissor.bottom = (LONG)rect.bottom;
+
+	return scissor;
+}
+
+
+void PassthroughRenderer::SetupWarpMesh(const ERenderEye eye, const int bufferIndex, std::shared_ptr<CameraFrame> frame)
+{
+	std::vector<WarpMeshVertex>& mesh = (eye == LEFT_EYE) ? frame->warpMeshLeft : frame->warpMeshRight;
+	ID3D11Buffer* vertexBuffer = m_warpMeshVertexBuffer[bufferIndex].Get();
+
+	if (mesh.empty() || mesh.size() > WARP_MESH_MAX_VERTICES)
+	{
+		return;
+	}
+
+	uint32_t cells = GetWarpMeshCells(mesh.size());
+
+	if (cells != m_warpMeshCells)
+	{
+		std::vector<uint16_t> indices;
+		GenerateWarpMeshIndices(indices, cells);
+
+		D3D11_BUFFER_DESC indexBufferDesc = {};
+		indexBufferDesc.ByteWidth = (UINT)(sizeof(uint16_t) * indices.size());
+		indexBufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+		indexBufferDesc.Usage = D3D11_USAGE_IMMUTABLE;
+
+		D3D11_SUBRESOURCE_DATA indexData = {};
+		indexData.pSysMem = indices.data();
+
+		m_warpMeshIndexBuffer.Reset();
+		if (FAILED(m_d3dDevice->CreateBuffer(&indexBufferDesc, &indexData, &m_warpMeshIndexBuffer)))
+		{
+			ErrorLog("Failed to create warp mesh index buffer\n");
+			m_warpMeshCells = 0;
+			return;
+		}
+		m_warpMeshCells = cells;
+	}
+
+	m_renderContext->IASetIndexBuffer(m_warpMeshIndexBuffer.Get(), DXGI_FORMAT_R16_UINT, 0);
+
+	D3D11_MAPPED_SUBRESOURCE res = {};
+	if (SUCCEEDED(m_renderContext->Map(vertexBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &res)))
+	{
+		memcpy(res.pData, mesh.data(), sizeof(WarpMeshVertex) * mesh.size());
+		m_renderContext->Unmap(vertexBuffer, 0);
+	}
+
+	UINT stride = sizeof(WarpMeshVertex);
+	UINT offset = 0;
+	m_renderContext->IASetVertexBuffers(0, 1, &vertexBuffer, &stride, &offset);
+}
+
+
+// Returns false if the GPU didn't finish the frame within the timeout.
+bool PassthroughRenderer::RenderFrameFinish()
+{
 	m_renderContext->Signal(m_fence.Get(), ++m_fenceValue);
-	m_fence->SetEventOnCompletion(m_fenceValue, &fenceEvent);
+	ResetEvent(m_fenceEvent);
+	m_fence->SetEventOnCompletion(m_fenceValue, m_fenceEvent);
 
 	m_renderContext->Flush();
 
@@ -655,13 +1588,44 @@ void PassthroughRenderer::RenderFrameFinish()
 		m_renderContext.Reset();
 	}
 
-	WaitForSingleObject(fenceEvent, 11);
+	// The completion of a frame whose wait timed out still signals the auto-reset event later,
+	// so a wake is only trusted once the fence has reached the value of this frame.
+	LARGE_INTEGER perfFrequency, waitStart, now;
+	QueryPerformanceFrequency(&perfFrequency);
+	QueryPerformanceCounter(&waitStart);
+
+	bool bFrameFinished = m_fence->GetCompletedValue() >= m_fenceValue;
+
+	while (!bFrameFinished)
+	{
+		QueryPerformanceCounter(&now);
+		LONGLONG waitedMS = (now.QuadPart - waitStart.QuadPart) * 1000 / perfFrequency.QuadPart;
+
+		if (waitedMS >= FRAME_FENCE_TIMEOUT_MS || WaitForSingleObject(m_fenceEvent, (DWORD)(FRAME_FENCE_TIMEOUT_MS - waitedMS)) != WAIT_OBJECT_0)
+		{
+			break;
+		}
+
+		bFrameFinished = m_fence->GetCompletedValue() >= m_fenceValue;
+	}
 
 	m_frameIndex = (m_frameIndex + 1) % NUM_SWAPCHAINS;
+
+	return bFrameFinished;
 }
 
 
 void* PassthroughRenderer::GetRenderDevice()
 {
 	return m_d3dDevice.Get();
+}
+
+
+void PassthroughRenderer::SetQualityTier(const EQualityTier tier)
+{
+	if (tier != m_qualityTier)
+	{
+		m_qualityTier = tier;
+		m_bQualityTierChanged = true;
+	}
 }
\ No newline at end of file
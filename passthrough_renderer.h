@@ -8,12 +8,19 @@
 #include "config_manager.h"
 #include "openvr_manager.h"
 #include "shared_structs.h"
+#include "watchdog.h"
+#include "resolution_governor.h"
+#include "key_calibration.h"
+#include "key_lut.h"
 
 
 using Microsoft::WRL::ComPtr;
 
 #define NUM_SWAPCHAINS 3
 
+// Maximum time to wait for the GPU to finish a frame.
+#define FRAME_FENCE_TIMEOUT_MS 11
+
 
 
 
@@ -62,6 +69,18 @@ inline Vector2 GetFrameUVOffset(const ERenderEye eye, const EStereoFrameLayout l
 
 
 
+// Constant buffers precompiled for a saved profile, bound as they are while the profile is active.
+struct ProfileRenderState
+{
+	std::shared_ptr<const Config_Main> config;
+	ComPtr<ID3D11Buffer> passConstantBuffer;
+	ComPtr<ID3D11Buffer> maskedConstantBuffer;
+	KeyLUTParams keyLUTParams;
+	ComPtr<ID3D11Texture3D> keyLUTTexture;
+	ComPtr<ID3D11ShaderResourceView> keyLUTSRV;
+};
+
+
 class PassthroughRenderer
 {
 public:
@@ -72,21 +91,55 @@ public:
 	bool InitRenderer();
 	
 	void SetFrameSize(const uint32_t width, const uint32_t height, const uint32_t bufferSize);
+	void SetRenderTargetSize(const uint32_t width, const uint32_t height);
 
+	// Takes the latest config and profile snapshots, and applies them to the bound constant buffers and key LUT.
+	// Called at the start of every frame, and by the self tests without rendering.
+	void UpdateConfig();
 	void RenderPassthroughFrame(std::shared_ptr<CameraFrame> frame, RenderFrame& renderFrame);
 	void* GetRenderDevice();
 
+	void SetQualityTier(const EQualityTier tier);
+	bool DidLastFrameMissFence() const { return m_bLastFrameMissedFence; }
+
+	float GetGPUTimeMS() const { return m_gpuTimeMS; }
+
+	// Copies the texture the key is evaluated on in the next masked frame, for reading back with ReadKeyCalibrationFrame.
+	void RequestKeyCalibrationFrame() { m_bKeyCalibrationRequested = true; }
+	// Returns true once the requested copy is available, without waiting for the GPU.
+	bool ReadKeyCalibrationFrame(KeyCalibrationImage& outImage);
+	float GetResolutionScale() const { return m_resolutionGovernor.GetScale(); }
+
 private:
 
 	void SetupTestImage();
 	void SetupFrameResource();
 	void InitRenderTarget(const uint32_t imageIndex);
+	void InitMaskTargets();
 
 	void RenderPassthroughView(const ERenderEye eye, std::shared_ptr<CameraFrame>  frame, EPassthroughBlendMode blendMode);
 	void RenderPassthroughViewMasked(const ERenderEye eye, std::shared_ptr<CameraFrame> frame);
-	void RenderFrameFinish();
+	void RenderKeyMask(const ERenderEye eye, std::shared_ptr<CameraFrame> frame);
+	bool RenderMaskCleanup(const int maskIndex, const D3D11_RECT& area);
+	void CopyKeyCalibrationFrame(ID3D11ShaderResourceView* source);
+	void UpdateKeyLUT();
+	bool UseKeyMaskPass() const;
+	uint32_t GetMaskDivisor() const;
+	D3D11_RECT GetWarpMeshScissor(const ERenderEye eye, std::shared_ptr<CameraFrame> frame, const uint32_t width, const uint32_t height);
+	void SetupWarpMesh(const ERenderEye eye, const int bufferIndex, std::shared_ptr<CameraFrame> frame);
+	bool RenderFrameFinish();
+	void UpdateProfileRenderStates();
+	void ApplyConfigConstants(uint32_t changedDependencies);
+	bool CreateConstantBuffer(const void* data, const uint32_t size, ComPtr<ID3D11Buffer>& outBuffer);
+	bool CreateKeyLUT(const std::vector<uint16_t>& data, ComPtr<ID3D11Texture3D>& outTexture, ComPtr<ID3D11ShaderResourceView>& outSRV);
+	void UpdateResolutionScale();
 
 	std::shared_ptr<ConfigManager> m_configManager;
+	std::shared_ptr<const Config_Main> m_config;
+	uint64_t m_configGeneration = 0;
+	std::shared_ptr<const ConfigProfileList> m_profileList;
+	uint64_t m_profileListGeneration = 0;
+	std::vector<ProfileRenderState> m_profileRenderStates;
 	std::shared_ptr<OpenVRManager> m_openVRManager;
 	int32_t m_adapterIndex;
 
@@ -98,21 +151,74 @@ private:
 	ComPtr<ID3D11DeviceContext4> m_renderContext;
 	
 
+	// The render targets are allocated at the full size, and rendered to at the resolution scale.
+	uint32_t m_renderTargetWidth = 0;
+	uint32_t m_renderTargetHeight = 0;
+	uint32_t m_viewportWidth = 0;
+	uint32_t m_viewportHeight = 0;
+	ResolutionGovernor m_resolutionGovernor;
+	// Maps the UVs of the rendered frustum to the compositor mirror textures.
+	Vector4 m_displayUVTransforms[2];
+
 	ComPtr<ID3D11Texture2D> m_renderTargets[NUM_SWAPCHAINS * 2];
 	ComPtr<ID3D11RenderTargetView> m_renderTargetViews[NUM_SWAPCHAINS * 2];
 	ComPtr<ID3D11ShaderResourceView> m_renderTargetSRVs[NUM_SWAPCHAINS * 2];
 
+	// Chroma key masks at the reduced resolution, with the keyed colors for guiding the upsampling.
+	// Indexed by eye * 2 + m_maskWriteIndex, the other mask of the eye holds the previous frame.
+	ComPtr<ID3D11Texture2D> m_maskTargets[4];
+	ComPtr<ID3D11RenderTargetView> m_maskTargetViews[4];
+	ComPtr<ID3D11ShaderResourceView> m_maskTargetSRVs[4];
+	int m_maskWriteIndex = 0;
+	bool m_bMaskHistoryValid = false;
+	// Size of the previous masks relative to the targets.
+	Vector2 m_maskHistoryUVScale;
+	// Maps the clip space of this frame to the previous one, for reprojecting the mask history.
+	Matrix4 m_maskHistoryProjections[2];
+	// Alpha of the key mask after the morphological cleanup, shared by the eyes.
+	ComPtr<ID3D11Texture2D> m_maskCleanupTargets[2];
+	ComPtr<ID3D11UnorderedAccessView> m_maskCleanupUAVs[2];
+	ComPtr<ID3D11ShaderResourceView> m_maskCleanupSRVs[2];
+	// All the keys combined, baked in the background when their settings change.
+	// The previous table stays bound until the new one is uploaded. The tables of
+	// the profiles are baked on the same thread, and are empty until they finish.
+	KeyLUTBakeThread m_keyLUTBakeThread;
+	KeyLUTParams m_keyLUTParams;
+	bool m_bKeyLUTBaked = false;
+	KeyLUTParams m_keyLUTRequestedParams;
+	bool m_bKeyLUTBakeRequested = false;
+	std::vector<uint16_t> m_keyLUTData;
+	ComPtr<ID3D11Texture3D> m_keyLUTTexture;
+	ComPtr<ID3D11ShaderResourceView> m_keyLUTSRV;
+
 	ComPtr<ID3D11VertexShader> m_quadShader;
 	ComPtr<ID3D11VertexShader> m_vertexShader;
 	ComPtr<ID3D11PixelShader> m_pixelShader;
 	ComPtr<ID3D11PixelShader> m_prepassShader;
 	ComPtr<ID3D11PixelShader> m_maskedPrepassShader;
 	ComPtr<ID3D11PixelShader> m_maskedPixelShader;
-
-	ComPtr<ID3D11Buffer> m_vsConstantBuffer[NUM_SWAPCHAINS * 2];
+	ComPtr<ID3D11PixelShader> m_maskKeyShader;
+	ComPtr<ID3D11PixelShader> m_maskedUpsampleShader;
+	ComPtr<ID3D11ComputeShader> m_maskMorphologyShader;
+
+	ComPtr<ID3D11InputLayout> m_inputLayout;
+	ComPtr<ID3D11Buffer> m_warpMeshVertexBuffer[NUM_SWAPCHAINS * 2];
+	ComPtr<ID3D11Buffer> m_warpMeshIndexBuffer;
+	uint32_t m_warpMeshCells = 0;
 	ComPtr<ID3D11Buffer> m_psPassConstantBuffer;
 	ComPtr<ID3D11Buffer> m_psMaskedConstantBuffer;
 	ComPtr<ID3D11Buffer> m_psViewConstantBuffer;
+	ComPtr<ID3D11Buffer> m_psMaskConstantBuffer;
+	ComPtr<ID3D11Buffer> m_psTemporalConstantBuffer;
+	ComPtr<ID3D11Buffer> m_csMorphologyConstantBuffer;
+	// Either the live buffers above or the precompiled buffers of the active profile.
+	ID3D11Buffer* m_activePassConstantBuffer = nullptr;
+	ID3D11Buffer* m_activeMaskedConstantBuffer = nullptr;
+	// Chosen by the keys it holds rather than by the profile, and kept bound until a table with the current keys is ready.
+	ComPtr<ID3D11ShaderResourceView> m_activeKeyLUTSRV;
+	bool m_bLiveConstantsStale = true;
+	EQualityTier m_qualityTier = QualityTier_Full;
+	bool m_bQualityTierChanged = false;
 	ComPtr<ID3D11SamplerState> m_defaultSampler;
 	ComPtr<ID3D11RasterizerState> m_rasterizerState;
 
@@ -137,5 +243,20 @@ private:
 	uint32_t m_cameraFrameBufferSize;
 
 	ComPtr<ID3D11Fence> m_fence;
+	HANDLE m_fenceEvent;
 	int m_fenceValue;
+	bool m_bLastFrameMissedFence = false;
+
+	// GPU timestamps for each swapchain image, read back when the image is rendered to again.
+	ComPtr<ID3D11Query> m_gpuDisjointQueries[NUM_SWAPCHAINS];
+	ComPtr<ID3D11Query> m_gpuStartQueries[NUM_SWAPCHAINS];
+	ComPtr<ID3D11Query> m_gpuEndQueries[NUM_SWAPCHAINS];
+	bool m_bGPUQueryPending[NUM_SWAPCHAINS] = {};
+	float m_gpuTimeMS = 0.0f;
+
+	ComPtr<ID3D11Texture2D> m_keyCalibrationStagingTexture;
+	bool m_bKeyCalibrationRequested = false;
+	bool m_bKeyCalibrationCopyPending = false;
+	bool m_bKeyCalibrationSRGB = false;
+	bool m_bKeyCalibrationBGRA = false;
 };
@@ -0,0 +1,102 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "passthrough_renderer.h"
+
+
+#define SELF_TEST_PROFILES 4
+#define SELF_TEST_PROFILE_WARMUP_CYCLES 3
+#define SELF_TEST_PROFILE_SWITCHES 200
+
+// The slowest profile switch may take this many times the average live edit, with a floor
+// on the edit time so that timer resolution and scheduling don't decide the result.
+#define SELF_TEST_PROFILE_SWITCH_FACTOR 4.0f
+#define SELF_TEST_PROFILE_MIN_EDIT_MS 0.05f
+
+
+// Switches profiles every iteration through the config path of the renderer in the masked mode,
+// and compares the slowest switch against the live edits of a single field. The profiles differ in
+// the pass and masked constants and the keys, so every switch rebinds the buffers and the key LUT.
+bool TestProfileCycling()
+{
+	ScratchConfigManager scratchConfig;
+	std::shared_ptr<ConfigManager> configManager(&*scratchConfig, [](ConfigManager*) {});
+
+	Config_Main& config = configManager->GetConfig_Main();
+	config.PassthroughMode = Masked;
+
+	for (uint32_t i = 0; i < SELF_TEST_PROFILES; i++)
+	{
+		config.Brightness = i * 5.0f;
+		config.MaskedFractionChroma = 0.1f + i * 0.05f;
+
+		std::string name = "Self Test " + std::to_string(i);
+		configManager->SaveProfile(name.c_str());
+	}
+
+	PassthroughRenderer renderer(configManager, nullptr, 0);
+	renderer.SetFrameSize(SELF_TEST_KEY_SCENE_SIZE * 2, SELF_TEST_KEY_SCENE_SIZE, SELF_TEST_KEY_SCENE_SIZE * SELF_TEST_KEY_SCENE_SIZE * 2 * 4);
+	renderer.SetRenderTargetSize(SELF_TEST_KEY_SCENE_SIZE, SELF_TEST_KEY_SCENE_SIZE);
+
+	if (!renderer.InitRenderer())
+	{
+		Log("Profile cycling: failed to initialize the renderer\n");
+		return false;
+	}
+
+	// The first update bakes the live key LUT in place, and the profile tables finish in the background.
+	renderer.UpdateConfig();
+
+	for (uint32_t i = 0; i < SELF_TEST_PROFILE_WARMUP_CYCLES * SELF_TEST_PROFILES; i++)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		configManager->ActivateNextProfile();
+		renderer.UpdateConfig();
+	}
+
+	float maxSwitchMS = 0.0f;
+	double switchSumMS = 0.0;
+
+	for (uint32_t i = 0; i < SELF_TEST_PROFILE_SWITCHES; i++)
+	{
+		configManager->ActivateNextProfile();
+
+		LARGE_INTEGER startTime;
+		QueryPerformanceCounter(&startTime);
+		renderer.UpdateConfig();
+		float switchMS = GetElapsedMS(startTime);
+
+		maxSwitchMS = std::max(maxSwitchMS, switchMS);
+		switchSumMS += switchMS;
+	}
+
+	// Live edits of a field outside the keys, which update the constant buffers in place.
+	double editSumMS = 0.0;
+
+	for (uint32_t i = 0; i < SELF_TEST_PROFILE_SWITCHES; i++)
+	{
+		configManager->GetConfig_Main().Brightness = (float)(i % 20);
+		configManager->ConfigUpdated();
+
+		LARGE_INTEGER startTime;
+		QueryPerformanceCounter(&startTime);
+		renderer.UpdateConfig();
+		editSumMS += GetElapsedMS(startTime);
+	}
+
+	configManager->DispatchUpdate();
+
+	float meanSwitchMS = (float)(switchSumMS / SELF_TEST_PROFILE_SWITCHES);
+	float meanEditMS = (float)(editSumMS / SELF_TEST_PROFILE_SWITCHES);
+	float allowedMS = std::max(meanEditMS, SELF_TEST_PROFILE_MIN_EDIT_MS) * SELF_TEST_PROFILE_SWITCH_FACTOR;
+
+	Log("Profile cycling: %u switches between %u profiles, %.4f ms average, %.4f ms max, live edits %.4f ms average, %.4f ms allowed\n",
+		SELF_TEST_PROFILE_SWITCHES, SELF_TEST_PROFILES, meanSwitchMS, maxSwitchMS, meanEditMS, allowedMS);
+
+	return maxSwitchMS <= allowedMS;
+}
+
+#endif
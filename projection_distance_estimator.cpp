@@ -0,0 +1,398 @@
+
+#include "pch.h"
+#include "projection_distance_estimator.h"
+#include "logging.h"
+#include <bit>
+
+
+#define FAST_THRESHOLD 20
+#define FAST_BORDER 16
+#define BRIEF_PATCH_RADIUS 12
+#define MATCH_MAX_HAMMING 60
+#define MATCH_MAX_ROW_OFFSET 2
+#define MATCH_MAX_DISPARITY 128
+
+
+// Bresenham circle of radius 3 used by the FAST detector.
+static const int g_fastCircle[16][2] =
+{
+	{ 0, -3 }, { 1, -3 }, { 2, -2 }, { 3, -1 }, { 3, 0 }, { 3, 1 }, { 2, 2 }, { 1, 3 },
+	{ 0, 3 }, { -1, 3 }, { -2, 2 }, { -3, 1 }, { -3, 0 }, { -3, -1 }, { -2, -2 }, { -1, -3 }
+};
+
+
+// Fixed pseudo-random point pairs for the 256 bit BRIEF descriptors.
+struct BriefPattern
+{
+	int8_t points[256][4];
+
+	BriefPattern()
+	{
+		uint32_t seed = 0x9E3779B9;
+		for (int i = 0; i < 256; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				seed = seed * 1664525 + 1013904223;
+				points[i][j] = (int8_t)((int)((seed >> 16) % (2 * BRIEF_PATCH_RADIUS + 1)) - BRIEF_PATCH_RADIUS);
+			}
+		}
+	}
+};
+
+static const BriefPattern g_briefPattern;
+
+
+ProjectionDistanceEstimator::ProjectionDistanceEstimator(std::shared_ptr<OpenVRManager> openVRManager)
+	: m_openVRManager(openVRManager)
+{
+}
+
+ProjectionDistanceEstimator::~ProjectionDistanceEstimator()
+{
+	Stop();
+}
+
+void ProjectionDistanceEstimator::Start(const vr::TrackedCameraHandle_t cameraHandle, const vr::EVRTrackedCameraFrameType frameType, const uint32_t frameBufferSize, const EStereoFrameLayout layout, const StereoCameraParameters& cameraParams)
+{
+	Stop();
+
+	if (layout == Mono || cameraParams.focalLength <= 0.0f || cameraParams.baseline <= 0.0f)
+	{
+		Log("Automatic projection distance requires a stereo camera\n");
+		return;
+	}
+
+	m_cameraHandle = cameraHandle;
+	m_frameType = frameType;
+	m_frameLayout = layout;
+	m_cameraParams = cameraParams;
+	m_frameBuffer.resize(frameBufferSize);
+	m_filteredDistance = -1.0f;
+	m_projectionDistance = -1.0f;
+
+	m_bRunThread = true;
+	m_thread = std::thread(&ProjectionDistanceEstimator::RunThread, this);
+}
+
+void ProjectionDistanceEstimator::Stop()
+{
+	m_bRunThread = false;
+
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+void ProjectionDistanceEstimator::RunThread()
+{
+	while (m_bRunThread)
+	{
+		std::this_thread::sleep_for(PROJECTION_ESTIMATE_INTERVAL);
+
+		if (!m_bRunThread) { return; }
+		if (!m_bEnabled) { continue; }
+
+		vr::IVRTrackedCamera* trackedCamera = m_openVRManager->GetVRTrackedCamera();
+		if (!trackedCamera) { continue; }
+
+		vr::CameraVideoStreamFrameHeader_t header;
+		vr::EVRTrackedCameraError error = trackedCamera->GetVideoStreamFrameBuffer(m_cameraHandle, m_frameType, m_frameBuffer.data(), (uint32_t)m_frameBuffer.size(), &header, sizeof(vr::CameraVideoStreamFrameHeader_t));
+
+		if (error != vr::VRTrackedCameraError_None || (size_t)header.nWidth * header.nHeight * header.nBytesPerPixel > m_frameBuffer.size() || header.nBytesPerPixel < 3)
+		{
+			continue;
+		}
+
+		LARGE_INTEGER perfFrequency;
+		LARGE_INTEGER startTime;
+		QueryPerformanceFrequency(&perfFrequency);
+		QueryPerformanceCounter(&startTime);
+
+		float distance;
+		if (EstimateDistance(m_frameBuffer.data(), header, m_frameLayout, m_cameraParams, distance))
+		{
+			UpdateProjectionDistance(distance);
+		}
+
+		LARGE_INTEGER endTime;
+		QueryPerformanceCounter(&endTime);
+
+		float updateTime = (float)(endTime.QuadPart - startTime.QuadPart);
+		updateTime *= 1000.0f;
+		updateTime /= perfFrequency.QuadPart;
+		m_lastUpdateTimeMS = updateTime;
+	}
+}
+
+void ProjectionDistanceEstimator::UpdateProjectionDistance(const float distance)
+{
+	float clampedDistance = std::clamp(distance, PROJECTION_DISTANCE_MIN, PROJECTION_DISTANCE_MAX);
+
+	// Smooth in inverse depth to match the projection error, and only
+	// publish when the filtered value has moved far enough from the current one.
+	if (m_filteredDistance < 0.0f)
+	{
+		m_filteredDistance = clampedDistance;
+	}
+	else
+	{
+		float invDistance = 1.0f / m_filteredDistance + (1.0f / clampedDistance - 1.0f / m_filteredDistance) * PROJECTION_ESTIMATE_SMOOTHING;
+		m_filteredDistance = 1.0f / invDistance;
+	}
+
+	float currentDistance = m_projectionDistance;
+	if (currentDistance < 0.0f || fabsf(m_filteredDistance - currentDistance) > currentDistance * PROJECTION_ESTIMATE_HYSTERESIS)
+	{
+		m_projectionDistance = m_filteredDistance;
+	}
+}
+
+bool ProjectionDistanceEstimator::EstimateDistance(const uint8_t* frameData, const vr::CameraVideoStreamFrameHeader_t& header, const EStereoFrameLayout layout, const StereoCameraParameters& cameraParams, float& outDistance)
+{
+	if (!frameData || layout == Mono || header.nBytesPerPixel < 3 || cameraParams.focalLength <= 0.0f || cameraParams.baseline <= 0.0f)
+	{
+		return false;
+	}
+
+	uint32_t eyeWidth = (layout == StereoHorizontalLayout) ? header.nWidth / 2 : header.nWidth;
+	uint32_t eyeHeight = (layout == StereoVerticalLayout) ? header.nHeight / 2 : header.nHeight;
+
+	m_imageWidth = eyeWidth / PROJECTION_ESTIMATE_DOWNSCALE;
+	m_imageHeight = eyeHeight / PROJECTION_ESTIMATE_DOWNSCALE;
+
+	if (m_imageWidth <= 2 * FAST_BORDER || m_imageHeight <= 2 * FAST_BORDER)
+	{
+		return false;
+	}
+
+	// The vertical layout has the left camera at the bottom.
+	DownscaleEye(frameData, header, 0, (layout == StereoVerticalLayout) ? eyeHeight : 0, m_leftImage);
+	DownscaleEye(frameData, header, (layout == StereoHorizontalLayout) ? eyeWidth : 0, 0, m_rightImage);
+
+	DetectFeatures(m_leftImage, m_leftFeatures);
+	DetectFeatures(m_rightImage, m_rightFeatures);
+	ComputeDescriptors(m_leftImage, m_leftFeatures);
+	ComputeDescriptors(m_rightImage, m_rightFeatures);
+
+	m_matchDistances.clear();
+	float scaledFocalLength = cameraParams.focalLength / PROJECTION_ESTIMATE_DOWNSCALE;
+
+	for (const FeaturePoint& left : m_leftFeatures)
+	{
+		int bestHamming = INT_MAX;
+		int secondHamming = INT_MAX;
+		const FeaturePoint* bestMatch = nullptr;
+
+		for (const FeaturePoint& right : m_rightFeatures)
+		{
+			int disparity = left.x - right.x;
+			if (abs(left.y - right.y) > MATCH_MAX_ROW_OFFSET || disparity <= 0 || disparity > MATCH_MAX_DISPARITY)
+			{
+				continue;
+			}
+
+			int hamming = 0;
+			for (int i = 0; i < 4; i++)
+			{
+				hamming += std::popcount(left.descriptor[i] ^ right.descriptor[i]);
+			}
+
+			if (hamming < bestHamming)
+			{
+				secondHamming = bestHamming;
+				bestHamming = hamming;
+				bestMatch = &right;
+			}
+			else if (hamming < secondHamming)
+			{
+				secondHamming = hamming;
+			}
+		}
+
+		if (!bestMatch || bestHamming > MATCH_MAX_HAMMING || bestHamming * 5 > secondHamming * 4)
+		{
+			continue;
+		}
+
+		m_matchDistances.push_back(scaledFocalLength * cameraParams.baseline / (left.x - bestMatch->x));
+	}
+
+	m_lastNumMatches = (int)m_matchDistances.size();
+
+	if (m_matchDistances.size() < PROJECTION_ESTIMATE_MIN_MATCHES)
+	{
+		return false;
+	}
+
+	// The median is robust against the remaining mismatches.
+	auto median = m_matchDistances.begin() + m_matchDistances.size() / 2;
+	std::nth_element(m_matchDistances.begin(), median, m_matchDistances.end());
+	outDistance = *median;
+
+	return true;
+}
+
+void ProjectionDistanceEstimator::DownscaleEye(const uint8_t* frameData, const vr::CameraVideoStreamFrameHeader_t& header, const uint32_t offsetX, const uint32_t offsetY, std::vector<uint8_t>& outImage)
+{
+	const uint32_t pixelSize = header.nBytesPerPixel;
+	const uint32_t rowPitch = header.nWidth * pixelSize;
+
+	outImage.resize(m_imageWidth * m_imageHeight);
+
+	for (uint32_t y = 0; y < m_imageHeight; y++)
+	{
+		for (uint32_t x = 0; x < m_imageWidth; x++)
+		{
+			uint32_t sum = 0;
+
+			for (uint32_t blockY = 0; blockY < PROJECTION_ESTIMATE_DOWNSCALE; blockY++)
+			{
+				const uint8_t* pixel = frameData + (offsetY + y * PROJECTION_ESTIMATE_DOWNSCALE + blockY) * rowPitch + (offsetX + x * PROJECTION_ESTIMATE_DOWNSCALE) * pixelSize;
+
+				for (uint32_t blockX = 0; blockX < PROJECTION_ESTIMATE_DOWNSCALE; blockX++)
+				{
+					sum += pixel[0] + 2 * pixel[1] + pixel[2];
+					pixel += pixelSize;
+				}
+			}
+
+			outImage[y * m_imageWidth + x] = (uint8_t)(sum / (4 * PROJECTION_ESTIMATE_DOWNSCALE * PROJECTION_ESTIMATE_DOWNSCALE));
+		}
+	}
+}
+
+// FAST-9 corner detector with 3x3 non-maximum suppression, keeping the strongest corners.
+void ProjectionDistanceEstimator::DetectFeatures(const std::vector<uint8_t>& image, std::vector<FeaturePoint>& outFeatures)
+{
+	const int width = (int)m_imageWidth;
+	const int height = (int)m_imageHeight;
+
+	std::vector<int> scores(width * height, 0);
+	int circleOffsets[16];
+	for (int i = 0; i < 16; i++)
+	{
+		circleOffsets[i] = g_fastCircle[i][1] * width + g_fastCircle[i][0];
+	}
+
+	for (int y = FAST_BORDER; y < height - FAST_BORDER; y++)
+	{
+		for (int x = FAST_BORDER; x < width - FAST_BORDER; x++)
+		{
+			const uint8_t* center = &image[y * width + x];
+			int brighter = *center + FAST_THRESHOLD;
+			int darker = *center - FAST_THRESHOLD;
+
+			// At least two of the compass points must pass for any 9 long arc.
+			int numCompass = 0;
+			for (int i = 0; i < 16; i += 4)
+			{
+				int value = center[circleOffsets[i]];
+				numCompass += (value > brighter || value < darker) ? 1 : 0;
+			}
+			if (numCompass < 2) { continue; }
+
+			int brightRun = 0, darkRun = 0, maxBrightRun = 0, maxDarkRun = 0, score = 0;
+
+			// Walk the circle twice to handle arcs wrapping around.
+			for (int i = 0; i < 32; i++)
+			{
+				int value = center[circleOffsets[i % 16]];
+
+				brightRun = (value > brighter) ? brightRun + 1 : 0;
+				darkRun = (value < darker) ? darkRun + 1 : 0;
+				maxBrightRun = std::max(maxBrightRun, brightRun);
+				maxDarkRun = std::max(maxDarkRun, darkRun);
+
+				if (i < 16)
+				{
+					score += std::max(abs(value - *center) - FAST_THRESHOLD, 0);
+				}
+			}
+
+			if (maxBrightRun >= 9 || maxDarkRun >= 9)
+			{
+				scores[y * width + x] = score;
+			}
+		}
+	}
+
+	outFeatures.clear();
+
+	for (int y = FAST_BORDER; y < height - FAST_BORDER; y++)
+	{
+		for (int x = FAST_BORDER; x < width - FAST_BORDER; x++)
+		{
+			int score = scores[y * width + x];
+			if (score == 0) { continue; }
+
+			bool bIsMax = true;
+			for (int offsetY = -1; offsetY <= 1 && bIsMax; offsetY++)
+			{
+				for (int offsetX = -1; offsetX <= 1; offsetX++)
+				{
+					if ((offsetX || offsetY) && scores[(y + offsetY) * width + x + offsetX] > score)
+					{
+						bIsMax = false;
+						break;
+					}
+				}
+			}
+
+			if (bIsMax)
+			{
+				outFeatures.push_back({ x, y, score, {} });
+			}
+		}
+	}
+
+	if (outFeatures.size() > PROJECTION_ESTIMATE_MAX_FEATURES)
+	{
+		std::nth_element(outFeatures.begin(), outFeatures.begin() + PROJECTION_ESTIMATE_MAX_FEATURES, outFeatures.end(),
+			[](const FeaturePoint& a, const FeaturePoint& b) { return a.score > b.score; });
+		outFeatures.resize(PROJECTION_ESTIMATE_MAX_FEATURES);
+	}
+}
+
+// BRIEF descriptors on a box blurred image.
+void ProjectionDistanceEstimator::ComputeDescriptors(const std::vector<uint8_t>& image, std::vector<FeaturePoint>& features)
+{
+	const int width = (int)m_imageWidth;
+	const int height = (int)m_imageHeight;
+
+	m_blurImage.resize(image.size());
+
+	for (int y = 1; y < height - 1; y++)
+	{
+		for (int x = 1; x < width - 1; x++)
+		{
+			int sum = 0;
+			for (int offsetY = -1; offsetY <= 1; offsetY++)
+			{
+				const uint8_t* row = &image[(y + offsetY) * width + x];
+				sum += row[-1] + row[0] + row[1];
+			}
+			m_blurImage[y * width + x] = (uint8_t)(sum / 9);
+		}
+	}
+
+	for (FeaturePoint& feature : features)
+	{
+		const uint8_t* center = &m_blurImage[feature.y * width + feature.x];
+
+		for (int i = 0; i < 4; i++)
+		{
+			uint64_t bits = 0;
+			for (int bit = 0; bit < 64; bit++)
+			{
+				const int8_t* pair = g_briefPattern.points[i * 64 + bit];
+				if (center[pair[1] * width + pair[0]] < center[pair[3] * width + pair[2]])
+				{
+					bits |= 1ull << bit;
+				}
+			}
+			feature.descriptor[i] = bits;
+		}
+	}
+}
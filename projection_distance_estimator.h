@@ -0,0 +1,90 @@
+
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include "shared_structs.h"
+#include "stereo_depth.h"
+#include "openvr_manager.h"
+
+
+#define PROJECTION_ESTIMATE_INTERVAL (std::chrono::milliseconds(250))
+#define PROJECTION_ESTIMATE_DOWNSCALE 2
+#define PROJECTION_ESTIMATE_MAX_FEATURES 400
+#define PROJECTION_ESTIMATE_MIN_MATCHES 12
+
+// Relative change in the estimated distance required before the projection is updated.
+#define PROJECTION_ESTIMATE_HYSTERESIS 0.15f
+#define PROJECTION_ESTIMATE_SMOOTHING 0.3f
+
+#define PROJECTION_DISTANCE_MIN 0.5f
+#define PROJECTION_DISTANCE_MAX 20.0f
+
+
+struct FeaturePoint
+{
+	int x;
+	int y;
+	int score;
+	uint64_t descriptor[4];
+};
+
+
+// Estimates the dominant scene distance in a background thread from sparse feature matches
+// between the stereo camera views, for automatically setting the far projection distance.
+class ProjectionDistanceEstimator
+{
+public:
+
+	ProjectionDistanceEstimator(std::shared_ptr<OpenVRManager> openVRManager);
+	~ProjectionDistanceEstimator();
+
+	void Start(const vr::TrackedCameraHandle_t cameraHandle, const vr::EVRTrackedCameraFrameType frameType, const uint32_t frameBufferSize, const EStereoFrameLayout layout, const StereoCameraParameters& cameraParams);
+	void Stop();
+	void SetEnabled(const bool bEnabled) { m_bEnabled = bEnabled; }
+
+	// Returns the filtered distance, or a negative value if no estimate is available yet.
+	float GetProjectionDistance() const { return m_projectionDistance; }
+	float GetLastUpdateTimeMS() const { return m_lastUpdateTimeMS; }
+	int GetLastNumMatches() const { return m_lastNumMatches; }
+
+	// Median distance of the feature matches in a single frame. Called from the thread, and directly by the self tests.
+	bool EstimateDistance(const uint8_t* frameData, const vr::CameraVideoStreamFrameHeader_t& header, const EStereoFrameLayout layout, const StereoCameraParameters& cameraParams, float& outDistance);
+
+	// Filters in a new estimate, and publishes the filtered distance once it has moved past the hysteresis.
+	void UpdateProjectionDistance(const float distance);
+
+private:
+
+	void RunThread();
+
+	void DownscaleEye(const uint8_t* frameData, const vr::CameraVideoStreamFrameHeader_t& header, const uint32_t offsetX, const uint32_t offsetY, std::vector<uint8_t>& outImage);
+	void DetectFeatures(const std::vector<uint8_t>& image, std::vector<FeaturePoint>& outFeatures);
+	void ComputeDescriptors(const std::vector<uint8_t>& image, std::vector<FeaturePoint>& features);
+
+	std::shared_ptr<OpenVRManager> m_openVRManager;
+
+	std::thread m_thread;
+	std::atomic_bool m_bRunThread = false;
+	std::atomic_bool m_bEnabled = false;
+
+	vr::TrackedCameraHandle_t m_cameraHandle = INVALID_TRACKED_CAMERA_HANDLE;
+	vr::EVRTrackedCameraFrameType m_frameType = vr::VRTrackedCameraFrameType_MaximumUndistorted;
+	EStereoFrameLayout m_frameLayout = Mono;
+	StereoCameraParameters m_cameraParams;
+
+	std::vector<uint8_t> m_frameBuffer;
+	uint32_t m_imageWidth = 0;
+	uint32_t m_imageHeight = 0;
+	std::vector<uint8_t> m_leftImage;
+	std::vector<uint8_t> m_rightImage;
+	std::vector<uint8_t> m_blurImage;
+	std::vector<FeaturePoint> m_leftFeatures;
+	std::vector<FeaturePoint> m_rightFeatures;
+	std::vector<float> m_matchDistances;
+
+	float m_filteredDistance = -1.0f;
+	std::atomic<float> m_projectionDistance = -1.0f;
+	std::atomic<float> m_lastUpdateTimeMS = 0.0f;
+	std::atomic<int> m_lastNumMatches = 0;
+};
@@ -0,0 +1,135 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "projection_distance_estimator.h"
+
+
+// Stereo camera of the distance estimation check, with a focal length in pixels and a baseline in meters.
+#define SELF_TEST_PROJECTION_EYE_WIDTH 640
+#define SELF_TEST_PROJECTION_EYE_HEIGHT 480
+#define SELF_TEST_PROJECTION_FOCAL_LENGTH 400.0f
+#define SELF_TEST_PROJECTION_BASELINE 0.064f
+
+// The features are on whole pixels of the downscaled images, so the median disparity
+// of a plane at a fractional disparity may be off by up to this many pixels.
+#define SELF_TEST_PROJECTION_MAX_DISPARITY_ERROR 0.75f
+
+// Estimates allowed for the published distance to follow a step in the scene distance.
+#define SELF_TEST_PROJECTION_STEP_UPDATES 8
+
+
+// Horizontal stereo frame of a textured plane facing the cameras, shifted between the views
+// by the given disparity in full resolution pixels, with sensor noise in both views.
+static void RenderSelfTestPlaneFrame(std::vector<uint8_t>& outFrame, const LatticeTexture& texture, const float disparity, uint32_t seed)
+{
+	const uint32_t eyeWidth = SELF_TEST_PROJECTION_EYE_WIDTH;
+	const uint32_t frameWidth = eyeWidth * 2;
+
+	outFrame.resize(frameWidth * SELF_TEST_PROJECTION_EYE_HEIGHT * 4);
+
+	for (uint32_t y = 0; y < SELF_TEST_PROJECTION_EYE_HEIGHT; y++)
+	{
+		for (uint32_t x = 0; x < frameWidth; x++)
+		{
+			float planeX = (float)(x % eyeWidth) + ((x < eyeWidth) ? 0.0f : disparity) + 0.5f;
+			float noise = (float)(NextRandom(seed) % 5) - 2.0f;
+			uint8_t value = (uint8_t)std::clamp(texture.Sample(planeX, y + 0.5f) + noise, 0.0f, 255.0f);
+
+			uint8_t* pixel = &outFrame[(y * frameWidth + x) * 4];
+			pixel[0] = pixel[1] = pixel[2] = value;
+			pixel[3] = 255;
+		}
+	}
+}
+
+
+// Estimates the distance of planes over the disparity range of the matcher, and checks that the
+// published distance holds under noisy estimates and follows a step in the scene distance.
+bool TestProjectionDistanceEstimation()
+{
+	const float disparities[] = { 9.3f, 17.7f, 35.2f, 70.5f, 141.9f };
+
+	vr::CameraVideoStreamFrameHeader_t header = {};
+	header.nWidth = SELF_TEST_PROJECTION_EYE_WIDTH * 2;
+	header.nHeight = SELF_TEST_PROJECTION_EYE_HEIGHT;
+	header.nBytesPerPixel = 4;
+
+	StereoCameraParameters cameraParams;
+	cameraParams.focalLength = SELF_TEST_PROJECTION_FOCAL_LENGTH;
+	cameraParams.baseline = SELF_TEST_PROJECTION_BASELINE;
+
+	const float scaledFocalBaseline = SELF_TEST_PROJECTION_FOCAL_LENGTH * SELF_TEST_PROJECTION_BASELINE / PROJECTION_ESTIMATE_DOWNSCALE;
+
+	LatticeTexture texture(SELF_TEST_PROJECTION_EYE_WIDTH * 2, SELF_TEST_PROJECTION_EYE_HEIGHT, 6, 1);
+	std::vector<uint8_t> frame;
+	bool bPassed = true;
+
+	for (uint32_t i = 0; i < sizeof(disparities) / sizeof(disparities[0]); i++)
+	{
+		const float disparity = disparities[i];
+		ProjectionDistanceEstimator estimator(nullptr);
+		RenderSelfTestPlaneFrame(frame, texture, disparity, i + 1);
+
+		LARGE_INTEGER startTime;
+		QueryPerformanceCounter(&startTime);
+
+		float distance = -1.0f;
+		bool bEstimated = estimator.EstimateDistance(frame.data(), header, StereoHorizontalLayout, cameraParams, distance);
+		float estimateTimeMS = GetElapsedMS(startTime);
+
+		float expectedDistance = SELF_TEST_PROJECTION_FOCAL_LENGTH * SELF_TEST_PROJECTION_BASELINE / disparity;
+		float disparityError = bEstimated ? fabsf(scaledFocalBaseline / distance - disparity / PROJECTION_ESTIMATE_DOWNSCALE) : FLT_MAX;
+
+		Log("Projection distance: plane at %.3f m estimated at %.3f m from %d matches, %.2f pixel disparity error, %.2f ms\n",
+			expectedDistance, distance, estimator.GetLastNumMatches(), disparityError, estimateTimeMS);
+
+		bPassed &= bEstimated && disparityError <= SELF_TEST_PROJECTION_MAX_DISPARITY_ERROR;
+	}
+
+	// Estimates scattered by 10% around the published distance stay within the hysteresis.
+	ProjectionDistanceEstimator estimator(nullptr);
+	uint32_t seed = 1;
+	uint32_t numNoiseChanges = 0;
+
+	estimator.UpdateProjectionDistance(2.0f);
+	float publishedDistance = estimator.GetProjectionDistance();
+
+	for (uint32_t i = 0; i < 200; i++)
+	{
+		float noise = (NextRandom(seed) / (float)(1 << 24)) * 2.0f - 1.0f;
+		estimator.UpdateProjectionDistance(2.0f * (1.0f + noise * 0.1f));
+
+		if (estimator.GetProjectionDistance() != publishedDistance)
+		{
+			publishedDistance = estimator.GetProjectionDistance();
+			numNoiseChanges++;
+		}
+	}
+
+	// A step to twice the distance is published within a bounded number of estimates.
+	uint32_t stepUpdates = 0;
+
+	while (stepUpdates < 100 && fabsf(estimator.GetProjectionDistance() - 4.0f) > 4.0f * PROJECTION_ESTIMATE_HYSTERESIS)
+	{
+		estimator.UpdateProjectionDistance(4.0f);
+		stepUpdates++;
+	}
+
+	// Estimates out of range are clamped.
+	for (uint32_t i = 0; i < 100; i++)
+	{
+		estimator.UpdateProjectionDistance(1000.0f);
+	}
+
+	float clampedDistance = estimator.GetProjectionDistance();
+
+	Log("Projection distance filter: %u changes under noise, step published after %u estimates, far estimates published at %.2f m\n",
+		numNoiseChanges, stepUpdates, clampedDistance);
+
+	return bPassed && numNoiseChanges == 0 && stepUpdates <= SELF_TEST_PROJECTION_STEP_UPDATES && clampedDistance <= PROJECTION_DISTANCE_MAX;
+}
+
+#endif
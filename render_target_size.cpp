@@ -0,0 +1,85 @@
+
+#include "pch.h"
+#include "render_target_size.h"
+
+
+FrustumTangents IntersectFrustums(const FrustumTangents& a, const FrustumTangents& b)
+{
+	FrustumTangents result;
+	result.left = std::max(a.left, b.left);
+	result.right = std::min(a.right, b.right);
+	result.top = std::max(a.top, b.top);
+	result.bottom = std::min(a.bottom, b.bottom);
+
+	if (result.right <= result.left || result.bottom <= result.top)
+	{
+		return b;
+	}
+
+	return result;
+}
+
+FrustumTangents ExpandFrustum(const FrustumTangents& frustum, const float margin)
+{
+	FrustumTangents result;
+	result.left = frustum.left - margin;
+	result.right = frustum.right + margin;
+	result.top = frustum.top - margin;
+	result.bottom = frustum.bottom + margin;
+
+	return result;
+}
+
+
+float GetCenterPixelsPerDegree(const float tangentRange, const float pixels)
+{
+	if (tangentRange <= 0.0f) { return 0.0f; }
+
+	// The derivative of the tangent is one at the center, so a tangent unit spans one radian there.
+	return pixels / tangentRange / DEGREES_PER_RADIAN;
+}
+
+
+static uint32_t AlignTargetSize(const float size)
+{
+	uint32_t aligned = ((uint32_t)ceilf(size) + RENDER_TARGET_SIZE_ALIGNMENT - 1) / RENDER_TARGET_SIZE_ALIGNMENT * RENDER_TARGET_SIZE_ALIGNMENT;
+
+	return std::clamp(aligned, (uint32_t)RENDER_TARGET_MIN_SIZE, (uint32_t)RENDER_TARGET_MAX_SIZE);
+}
+
+void CalculateRenderTargetSize(const FrustumTangents& frustum, const float pixelsPerDegree, uint32_t& outWidth, uint32_t& outHeight)
+{
+	outWidth = AlignTargetSize((frustum.right - frustum.left) * DEGREES_PER_RADIAN * pixelsPerDegree);
+	outHeight = AlignTargetSize((frustum.bottom - frustum.top) * DEGREES_PER_RADIAN * pixelsPerDegree);
+}
+
+
+Matrix4 ComposeProjection(const FrustumTangents& frustum, const float zNear, const float zFar)
+{
+	float idx = 1.0f / (frustum.right - frustum.left);
+	float idy = 1.0f / (frustum.bottom - frustum.top);
+	float idz = (zFar > zNear) ? 1.0f / (zFar - zNear) : 0.0f;
+	float sx = frustum.right + frustum.left;
+	float sy = frustum.bottom + frustum.top;
+
+	// Column major.
+	return Matrix4(
+		2.0f * idx, 0.0f, 0.0f, 0.0f,
+		0.0f, 2.0f * idy, 0.0f, 0.0f,
+		sx * idx, sy * idy, -zFar * idz, -1.0f,
+		0.0f, 0.0f, -zFar * zNear * idz, 0.0f);
+}
+
+
+// The V coordinate runs from the bottom tangent at the top of the image to the top tangent.
+Vector4 GetFrustumUVTransform(const FrustumTangents& inner, const FrustumTangents& outer)
+{
+	float outerWidth = outer.right - outer.left;
+	float outerHeight = outer.top - outer.bottom;
+
+	return Vector4(
+		(inner.right - inner.left) / outerWidth,
+		(inner.top - inner.bottom) / outerHeight,
+		(inner.left - outer.left) / outerWidth,
+		(inner.bottom - outer.bottom) / outerHeight);
+}
@@ -0,0 +1,31 @@
+
+#pragma once
+
+#include "shared_structs.h"
+
+
+#define DEGREES_PER_RADIAN 57.2957795f
+
+#define RENDER_TARGET_MIN_SIZE 64
+#define RENDER_TARGET_MAX_SIZE 4096
+#define RENDER_TARGET_SIZE_ALIGNMENT 8
+
+// Tangents added around the camera frustum, covering the parallax of content closer than the projection distance.
+#define RENDER_FRUSTUM_MARGIN 0.05f
+
+
+// Returns the overlap of the frustums, or the second one if they don't overlap.
+FrustumTangents IntersectFrustums(const FrustumTangents& a, const FrustumTangents& b);
+FrustumTangents ExpandFrustum(const FrustumTangents& frustum, const float margin);
+
+// Pixel density at the center of an image rendered linearly over the tangent range.
+float GetCenterPixelsPerDegree(const float tangentRange, const float pixels);
+
+// Sizes a target covering the frustum with the given pixel density at the center of the view.
+void CalculateRenderTargetSize(const FrustumTangents& frustum, const float pixelsPerDegree, uint32_t& outWidth, uint32_t& outHeight);
+
+// Builds the same projection as IVRSystem::GetProjectionMatrix does from the raw projection.
+Matrix4 ComposeProjection(const FrustumTangents& frustum, const float zNear, const float zFar);
+
+// UV scale in xy and offset in zw, mapping UVs over the inner frustum to UVs over the outer one.
+Vector4 GetFrustumUVTransform(const FrustumTangents& inner, const FrustumTangents& outer);
@@ -0,0 +1,108 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "render_target_size.h"
+
+
+#define SELF_TEST_FRUSTUMS 1000
+
+
+static float GetRandomRange(uint32_t& seed, const float minValue, const float maxValue)
+{
+	return minValue + (maxValue - minValue) * (NextRandom(seed) / (float)(1 << 24));
+}
+
+
+// Checks the target sizes against the requested pixel density, the projections against the frustum corners,
+// and the UV transforms from the render frustums back to the display frustums, over random frustums.
+bool TestRenderTargetSize()
+{
+	uint32_t seed = 1;
+	uint32_t numSizeErrors = 0;
+	float maxDensityExcess = 0.0f;
+	float maxCornerError = 0.0f;
+	float maxUVError = 0.0f;
+
+	for (uint32_t i = 0; i < SELF_TEST_FRUSTUMS; i++)
+	{
+		// Display frustums like GetProjectionRaw returns, with the top tangent negative.
+		FrustumTangents display;
+		display.left = GetRandomRange(seed, -1.6f, -0.8f);
+		display.right = GetRandomRange(seed, 0.8f, 1.6f);
+		display.top = GetRandomRange(seed, -1.6f, -0.8f);
+		display.bottom = GetRandomRange(seed, 0.8f, 1.6f);
+
+		FrustumTangents camera;
+		camera.left = GetRandomRange(seed, -1.2f, 0.0f);
+		camera.right = GetRandomRange(seed, 0.2f, 1.2f);
+		camera.top = GetRandomRange(seed, -1.2f, 0.0f);
+		camera.bottom = GetRandomRange(seed, 0.2f, 1.2f);
+
+		FrustumTangents render = IntersectFrustums(ExpandFrustum(camera, RENDER_FRUSTUM_MARGIN), display);
+
+		if (render.left < display.left || render.right > display.right || render.top < display.top || render.bottom > display.bottom)
+		{
+			numSizeErrors++;
+		}
+
+		// The aligned sizes only round up, so the density is at least the requested one.
+		float pixelsPerDegree = GetRandomRange(seed, 5.0f, 25.0f);
+		uint32_t width, height;
+		CalculateRenderTargetSize(render, pixelsPerDegree, width, height);
+
+		float widthDensity = GetCenterPixelsPerDegree(render.right - render.left, (float)width);
+		float heightDensity = GetCenterPixelsPerDegree(render.bottom - render.top, (float)height);
+		float alignmentDensity = GetCenterPixelsPerDegree(std::min(render.right - render.left, render.bottom - render.top), (float)RENDER_TARGET_SIZE_ALIGNMENT);
+
+		if (width % RENDER_TARGET_SIZE_ALIGNMENT != 0 || height % RENDER_TARGET_SIZE_ALIGNMENT != 0 ||
+			widthDensity < pixelsPerDegree * 0.999f || heightDensity < pixelsPerDegree * 0.999f ||
+			widthDensity > pixelsPerDegree + alignmentDensity || heightDensity > pixelsPerDegree + alignmentDensity)
+		{
+			numSizeErrors++;
+		}
+
+		maxDensityExcess = std::max(maxDensityExcess, std::max(widthDensity, heightDensity) - pixelsPerDegree);
+
+		// The frustum corners land on the clip space corners.
+		Matrix4 projection = ComposeProjection(render, 0.1f, 10.0f);
+		const float cornerTangents[4][2] = { { render.left, render.top }, { render.right, render.top }, { render.left, render.bottom }, { render.right, render.bottom } };
+		const float cornerClip[4][2] = { { -1.0f, -1.0f }, { 1.0f, -1.0f }, { -1.0f, 1.0f }, { 1.0f, 1.0f } };
+
+		for (int corner = 0; corner < 4; corner++)
+		{
+			Vector4 clip = projection * Vector4(cornerTangents[corner][0], cornerTangents[corner][1], -1.0f, 1.0f);
+			maxCornerError = std::max(maxCornerError, fabsf(clip.x / clip.w - cornerClip[corner][0]));
+			maxCornerError = std::max(maxCornerError, fabsf(clip.y / clip.w - cornerClip[corner][1]));
+		}
+
+		// UVs over the render frustum map to the same tangents over the display frustum.
+		Vector4 transform = GetFrustumUVTransform(render, display);
+
+		for (int sample = 0; sample < 4; sample++)
+		{
+			float u = GetRandomRange(seed, 0.0f, 1.0f);
+			float v = GetRandomRange(seed, 0.0f, 1.0f);
+			float tangentX = render.left + u * (render.right - render.left);
+			float tangentY = render.bottom + v * (render.top - render.bottom);
+
+			maxUVError = std::max(maxUVError, fabsf(u * transform.x + transform.z - (tangentX - display.left) / (display.right - display.left)));
+			maxUVError = std::max(maxUVError, fabsf(v * transform.y + transform.w - (tangentY - display.bottom) / (display.top - display.bottom)));
+		}
+	}
+
+	// Frustums that don't overlap keep the display frustum.
+	FrustumTangents outside = { 2.0f, 3.0f, 2.0f, 3.0f };
+	FrustumTangents display = { -1.0f, 1.0f, -1.0f, 1.0f };
+	FrustumTangents disjoint = IntersectFrustums(outside, display);
+	bool bDisjointKept = disjoint.left == display.left && disjoint.right == display.right && disjoint.top == display.top && disjoint.bottom == display.bottom;
+
+	Log("Render target size: %u errors over %u frustums, up to %.2f pixels per degree over the requested density, corner error %.6f, UV error %.6f\n",
+		numSizeErrors, SELF_TEST_FRUSTUMS, maxDensityExcess, maxCornerError, maxUVError);
+
+	return numSizeErrors == 0 && maxCornerError < 0.0001f && maxUVError < 0.0001f && bDisjointKept;
+}
+
+#endif
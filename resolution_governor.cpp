@@ -0,0 +1,89 @@
+
+#include "pch.h"
+#include "resolution_governor.h"
+
+
+void ResolutionGovernor::SetLimits(const float budgetMS, const float minScale)
+{
+	m_budgetMS = budgetMS;
+	m_minScale = std::clamp(minScale, RESOLUTION_SCALE_STEP, 1.0f);
+	m_scale = std::clamp(m_scale, m_minScale, 1.0f);
+}
+
+void ResolutionGovernor::Reset()
+{
+	m_scale = 1.0f;
+	m_filteredTimeMS = 0.0f;
+	m_bHasSample = false;
+	m_framesSinceChange = 0;
+	m_framesOverBudget = 0;
+}
+
+
+float ResolutionGovernor::Update(const float gpuTimeMS)
+{
+	if (gpuTimeMS <= 0.0f || m_budgetMS <= 0.0f)
+	{
+		return m_scale;
+	}
+
+	if (!m_bHasSample)
+	{
+		m_filteredTimeMS = gpuTimeMS;
+		m_bHasSample = true;
+	}
+	else
+	{
+		float sample = std::min(gpuTimeMS, m_filteredTimeMS * RESOLUTION_OUTLIER_FACTOR);
+		m_filteredTimeMS += (sample - m_filteredTimeMS) * RESOLUTION_FILTER_WEIGHT;
+	}
+
+	float lowerTimeMS = m_budgetMS * RESOLUTION_LOWER_FRACTION;
+	m_framesOverBudget = (m_filteredTimeMS > lowerTimeMS) ? m_framesOverBudget + 1 : 0;
+
+	if (++m_framesSinceChange < RESOLUTION_SETTLE_FRAMES)
+	{
+		return m_scale;
+	}
+
+	if (m_filteredTimeMS > lowerTimeMS && m_framesOverBudget < RESOLUTION_OVER_BUDGET_FRAMES)
+	{
+		return m_scale;
+	}
+
+	if (m_filteredTimeMS <= lowerTimeMS && m_filteredTimeMS >= m_budgetMS * RESOLUTION_RAISE_FRACTION)
+	{
+		return m_scale;
+	}
+
+	// The time scales with the pixel count, which is the square of the scale.
+	float idealScale = m_scale * sqrtf(m_budgetMS * RESOLUTION_TARGET_FRACTION / m_filteredTimeMS);
+	float newScale = m_scale + (idealScale - m_scale) * RESOLUTION_GAIN;
+
+	newScale = roundf(newScale / RESOLUTION_SCALE_STEP) * RESOLUTION_SCALE_STEP;
+
+	// Corrections smaller than a step still move the scale by one step in the right direction.
+	if (m_filteredTimeMS > lowerTimeMS)
+	{
+		newScale = std::min(newScale, m_scale - RESOLUTION_SCALE_STEP);
+	}
+	else
+	{
+		newScale = std::max(newScale, m_scale + RESOLUTION_SCALE_STEP);
+	}
+
+	newScale = std::clamp(newScale, m_minScale, 1.0f);
+
+	if (newScale == m_scale)
+	{
+		return m_scale;
+	}
+
+	// Predict the time at the new scale, so the filter doesn't have to catch up from the old one.
+	m_filteredTimeMS *= (newScale * newScale) / (m_scale * m_scale);
+	m_scale = newScale;
+	m_framesSinceChange = 0;
+	m_numScaleChanges++;
+
+	return m_scale;
+}
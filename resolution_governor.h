@@ -0,0 +1,56 @@
+
+#pragma once
+
+
+// Weight of the newest GPU time sample in the filtered frame time.
+#define RESOLUTION_FILTER_WEIGHT 0.25f
+
+// Frames to wait after a scale change before changing it again, covering the timestamp query latency.
+#define RESOLUTION_SETTLE_FRAMES 6
+
+// The filtered GPU time is steered towards this fraction of the budget. The scale is held
+// while the time stays between the raise and lower fractions, leaving room for noise below the budget.
+#define RESOLUTION_TARGET_FRACTION 0.85f
+#define RESOLUTION_RAISE_FRACTION 0.7f
+#define RESOLUTION_LOWER_FRACTION 0.95f
+
+// Samples are limited to this multiple of the filtered time, so single slow frames don't swing the filter.
+#define RESOLUTION_OUTLIER_FACTOR 2.0f
+
+// The filtered time has to stay over the lower fraction for this many frames before the scale is lowered.
+#define RESOLUTION_OVER_BUDGET_FRAMES 3
+
+// Fraction of the estimated correction applied per change, to damp the response to noisy samples.
+#define RESOLUTION_GAIN 0.6f
+
+// The scale is kept on steps of this size, so that small corrections don't change the viewport.
+#define RESOLUTION_SCALE_STEP (1.0f / 32.0f)
+
+
+// Picks the render scale that holds the GPU time of the passthrough within a budget.
+// The GPU time is assumed to be proportional to the number of pixels rendered.
+class ResolutionGovernor
+{
+public:
+
+	void SetLimits(const float budgetMS, const float minScale);
+	void Reset();
+
+	// Takes the GPU time of a frame rendered at the current scale, and returns the scale for the next frame.
+	float Update(const float gpuTimeMS);
+
+	float GetScale() const { return m_scale; }
+	float GetFilteredTimeMS() const { return m_filteredTimeMS; }
+	uint32_t GetNumScaleChanges() const { return m_numScaleChanges; }
+
+private:
+
+	float m_budgetMS = 4.0f;
+	float m_minScale = 0.5f;
+	float m_scale = 1.0f;
+	float m_filteredTimeMS = 0.0f;
+	bool m_bHasSample = false;
+	uint32_t m_framesSinceChange = 0;
+	uint32_t m_framesOverBudget = 0;
+	uint32_t m_numScaleChanges = 0;
+};
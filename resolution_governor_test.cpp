@@ -0,0 +1,119 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include <functional>
+#include "resolution_governor.h"
+
+
+#define SELF_TEST_GOVERNOR_BUDGET_MS 4.0f
+#define SELF_TEST_GOVERNOR_MIN_SCALE 0.5f
+#define SELF_TEST_GOVERNOR_TRACE_FRAMES 1000
+
+// Frames allowed to bring the GPU time under the lower fraction of the budget after a load step.
+#define SELF_TEST_GOVERNOR_CONVERGE_FRAMES 40
+
+// Scale changes allowed over the noisy trace once it has converged.
+#define SELF_TEST_GOVERNOR_NOISE_CHANGES 4
+
+
+// Runs the governor over a trace of full resolution GPU times, with the rendered time scaling with the pixel count
+// and varied by the noise fraction. Returns the frames until the rendered time without the noise is last over
+// the lower fraction of the budget, counted from the start of the trace.
+static uint32_t RunGovernorTrace(ResolutionGovernor& governor, const std::function<float(uint32_t)>& fullScaleTimeMS, const uint32_t numFrames, const float noiseFraction = 0.0f)
+{
+	uint32_t seed = 1;
+	uint32_t lastOverFrame = 0;
+
+	for (uint32_t frame = 0; frame < numFrames; frame++)
+	{
+		float scale = governor.GetScale();
+		float timeMS = fullScaleTimeMS(frame) * scale * scale;
+
+		if (timeMS > SELF_TEST_GOVERNOR_BUDGET_MS * RESOLUTION_LOWER_FRACTION)
+		{
+			lastOverFrame = frame + 1;
+		}
+
+		float noise = (NextRandom(seed) / (float)(1 << 24)) * 2.0f - 1.0f;
+		governor.Update(timeMS * (1.0f + noise * noiseFraction));
+	}
+
+	return lastOverFrame;
+}
+
+
+// Checks that the scale converges under the budget within a bounded number of frames after a load step,
+// holds steady under noisy and spiking frame times, and returns to full resolution when the load drops.
+bool TestResolutionGovernor()
+{
+	bool bPassed = true;
+
+	// Steady load within budget never lowers the scale.
+	{
+		ResolutionGovernor governor;
+		governor.SetLimits(SELF_TEST_GOVERNOR_BUDGET_MS, SELF_TEST_GOVERNOR_MIN_SCALE);
+
+		RunGovernorTrace(governor, [](uint32_t) { return SELF_TEST_GOVERNOR_BUDGET_MS * 0.8f; }, SELF_TEST_GOVERNOR_TRACE_FRAMES);
+
+		Log("Governor steady: scale %.3f, %u changes\n", governor.GetScale(), governor.GetNumScaleChanges());
+		bPassed &= governor.GetScale() == 1.0f && governor.GetNumScaleChanges() == 0;
+	}
+
+	// A step to twice the budget converges, and the scale recovers once the load is back down.
+	{
+		ResolutionGovernor governor;
+		governor.SetLimits(SELF_TEST_GOVERNOR_BUDGET_MS, SELF_TEST_GOVERNOR_MIN_SCALE);
+
+		RunGovernorTrace(governor, [](uint32_t) { return SELF_TEST_GOVERNOR_BUDGET_MS * 0.6f; }, 100);
+		uint32_t convergeFrames = RunGovernorTrace(governor, [](uint32_t) { return SELF_TEST_GOVERNOR_BUDGET_MS * 2.0f; }, SELF_TEST_GOVERNOR_TRACE_FRAMES);
+		float stepScale = governor.GetScale();
+		uint32_t stepChanges = governor.GetNumScaleChanges();
+
+		RunGovernorTrace(governor, [](uint32_t) { return SELF_TEST_GOVERNOR_BUDGET_MS * 0.6f; }, SELF_TEST_GOVERNOR_TRACE_FRAMES);
+
+		Log("Governor step: converged in %u frames to scale %.3f with %u changes, recovered to scale %.3f\n",
+			convergeFrames, stepScale, stepChanges, governor.GetScale());
+
+		bPassed &= convergeFrames <= SELF_TEST_GOVERNOR_CONVERGE_FRAMES && governor.GetScale() == 1.0f;
+	}
+
+	// Noise of 15% around a load over budget converges without oscillating between scales.
+	{
+		ResolutionGovernor governor;
+		governor.SetLimits(SELF_TEST_GOVERNOR_BUDGET_MS, SELF_TEST_GOVERNOR_MIN_SCALE);
+
+		auto overloadTime = [](uint32_t) { return SELF_TEST_GOVERNOR_BUDGET_MS * 1.5f; };
+
+		uint32_t convergeFrames = RunGovernorTrace(governor, overloadTime, SELF_TEST_GOVERNOR_CONVERGE_FRAMES * 2, 0.15f);
+		uint32_t convergeChanges = governor.GetNumScaleChanges();
+
+		RunGovernorTrace(governor, overloadTime, SELF_TEST_GOVERNOR_TRACE_FRAMES, 0.15f);
+		uint32_t noiseChanges = governor.GetNumScaleChanges() - convergeChanges;
+
+		Log("Governor noise: converged in %u frames to scale %.3f, %u changes over %u frames after\n",
+			convergeFrames, governor.GetScale(), noiseChanges, SELF_TEST_GOVERNOR_TRACE_FRAMES);
+
+		bPassed &= convergeFrames <= SELF_TEST_GOVERNOR_CONVERGE_FRAMES && noiseChanges <= SELF_TEST_GOVERNOR_NOISE_CHANGES;
+	}
+
+	// Single frame spikes, such as a shader compile, don't change the scale.
+	{
+		ResolutionGovernor governor;
+		governor.SetLimits(SELF_TEST_GOVERNOR_BUDGET_MS, SELF_TEST_GOVERNOR_MIN_SCALE);
+
+		RunGovernorTrace(governor, [](uint32_t frame)
+		{
+			return (frame % 100 == 50) ? SELF_TEST_GOVERNOR_BUDGET_MS * 10.0f : SELF_TEST_GOVERNOR_BUDGET_MS * 0.75f;
+		}, SELF_TEST_GOVERNOR_TRACE_FRAMES);
+
+		Log("Governor spikes: scale %.3f, %u changes\n", governor.GetScale(), governor.GetNumScaleChanges());
+		bPassed &= governor.GetScale() == 1.0f && governor.GetNumScaleChanges() == 0;
+	}
+
+	return bPassed;
+}
+
+#endif
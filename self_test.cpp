@@ -0,0 +1,171 @@
+
+#include "pch.h"
+#include "self_test.h"
+
+#ifdef _DEBUG
+
+#include "self_test_util.h"
+#include "logging.h"
+
+
+struct SelfTest
+{
+	const char* name;
+	bool (*function)();
+};
+
+
+float GetElapsedMS(const LARGE_INTEGER& startTime)
+{
+	LARGE_INTEGER perfFrequency;
+	LARGE_INTEGER endTime;
+	QueryPerformanceFrequency(&perfFrequency);
+	QueryPerformanceCounter(&endTime);
+
+	return (float)(endTime.QuadPart - startTime.QuadPart) * 1000.0f / perfFrequency.QuadPart;
+}
+
+
+uint32_t NextRandom(uint32_t& state)
+{
+	state = state * 1664525u + 1013904223u;
+	return state >> 8;
+}
+
+
+SyntheticSceneParams GetKeySceneParams()
+{
+	SyntheticSceneParams params;
+	params.width = SELF_TEST_KEY_SCENE_SIZE;
+	params.height = SELF_TEST_KEY_SCENE_SIZE;
+	params.layout = Mono;
+	return params;
+}
+
+
+KeyMaskParams GetKeySceneMaskParams(const SyntheticSceneParams& sceneParams)
+{
+	KeyMaskParams params;
+	for (int c = 0; c < 3; c++)
+	{
+		params.keyColor[c] = powf(sceneParams.keyColor[c], 2.2f);
+	}
+	return params;
+}
+
+
+KeyCalibrationImage GetFrameCalibrationImage(const SyntheticFrame& frame)
+{
+	KeyCalibrationImage image;
+	image.width = frame.width;
+	image.height = frame.height;
+	image.rowPitch = frame.width * 4;
+	image.bSRGB = true;
+	image.pixels = frame.image;
+	return image;
+}
+
+
+void GetKeyedFractions(const SyntheticFrame& frame, const KeyMaskParams& params, float& outScreenKeyed, float& outForegroundKeyed)
+{
+	const float* toLinear = GetSRGBToLinearTable();
+	uint32_t numScreen = 0;
+	uint32_t numScreenKeyed = 0;
+	uint32_t numForeground = 0;
+	uint32_t numForegroundKeyed = 0;
+
+	for (size_t i = 0; i < frame.alpha.size(); i++)
+	{
+		if (frame.alpha[i] > 0.0f && frame.alpha[i] < 1.0f) { continue; }
+
+		float rgb[3] = { toLinear[frame.image[i * 4]], toLinear[frame.image[i * 4 + 1]], toLinear[frame.image[i * 4 + 2]] };
+		bool bKeyed = EvaluateKeyAlpha(rgb, params) >= 0.5f;
+
+		if (frame.alpha[i] == 1.0f)
+		{
+			numScreen++;
+			numScreenKeyed += bKeyed;
+		}
+		else
+		{
+			numForeground++;
+			numForegroundKeyed += bKeyed;
+		}
+	}
+
+	outScreenKeyed = (float)numScreenKeyed / std::max(numScreen, 1u);
+	outForegroundKeyed = (float)numForegroundKeyed / std::max(numForeground, 1u);
+}
+
+
+float GetKeyIoU(const SyntheticFrame& frame, const std::vector<float>& alpha)
+{
+	uint32_t numIntersection = 0;
+	uint32_t numUnion = 0;
+
+	for (size_t i = 0; i < frame.alpha.size(); i++)
+	{
+		bool bKeyed = alpha[i] >= 0.5f;
+		bool bScreen = frame.alpha[i] >= 0.5f;
+
+		numIntersection += bKeyed && bScreen;
+		numUnion += bKeyed || bScreen;
+	}
+
+	return (float)numIntersection / std::max(numUnion, 1u);
+}
+
+
+static const SelfTest g_selfTests[] =
+{
+	{ "Rolling shutter residual shear", TestRollingShutterShear },
+	{ "Tilted plane depth interpolation", TestTiltedPlaneDepth },
+	{ "Warp mesh benchmark", BenchmarkWarpMesh },
+	{ "Warp mesh scissor coverage", TestWarpMeshScissorCoverage },
+	{ "Stereo depth accuracy and throughput", TestStereoDepth },
+	{ "Config snapshot stress", TestConfigSnapshotStress },
+	{ "Config snapshot read benchmark", BenchmarkConfigSnapshot },
+	{ "Config schema round trip", TestConfigSchemaRoundTrip },
+	{ "Config dependency fan-out", BenchmarkConfigDependencies },
+	{ "Config debounced persistence", TestConfigPersistence },
+	{ "Log enqueue benchmark", BenchmarkLogEnqueue },
+	{ "Key mask upsampling", TestKeyMaskUpsampling },
+	{ "Key mask stabilization", TestKeyMaskStabilization },
+	{ "Key mask cleanup", TestKeyMaskCleanup },
+	{ "Key calibration", TestKeyCalibration },
+	{ "Key range tuning", TestKeyThresholdTuning },
+	{ "Key LUT bake", TestKeyLUTBake },
+	{ "Key despill", TestKeyDespill },
+	{ "Key color spaces", TestKeyColorSpaces },
+	{ "Synthetic frames", TestSyntheticFrames },
+	{ "Watchdog quality tiers", TestWatchdogQuality },
+	{ "Resolution governor traces", TestResolutionGovernor },
+	{ "Frame undistortion benchmark", BenchmarkFrameUndistortion },
+	{ "Fused undistortion", TestFusedUndistortion },
+	{ "Render target size", TestRenderTargetSize },
+	{ "Projection distance estimation", TestProjectionDistanceEstimation },
+	{ "Flight recorder", TestFlightRecorder },
+	{ "Profile cycling", TestProfileCycling },
+};
+
+
+bool RunSelfTests()
+{
+	uint32_t numFailed = 0;
+
+	for (const SelfTest& test : g_selfTests)
+	{
+		bool bPassed = test.function();
+		Log("Self test %s: %s\n", test.name, bPassed ? "passed" : "FAILED");
+
+		if (!bPassed)
+		{
+			numFailed++;
+		}
+	}
+
+	Log("Self tests finished, %u of %u failed\n", numFailed, (uint32_t)std::size(g_selfTests));
+	return numFailed == 0;
+}
+
+#endif
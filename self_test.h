@@ -0,0 +1,12 @@
+
+#pragma once
+
+
+// Checks of the CPU side processing against synthetic inputs with known results.
+// Only built into debug builds, and run with the --self-test command line argument
+// instead of starting the passthrough. The measurements are written to the log.
+#ifdef _DEBUG
+
+bool RunSelfTests();
+
+#endif
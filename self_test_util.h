@@ -0,0 +1,178 @@
+
+#pragma once
+
+#include "self_test.h"
+
+
+// Helpers shared by the self tests of each module, and the tests themselves.
+// The tests of a module are in the module's _test.cpp file.
+#ifdef _DEBUG
+
+#include "config_manager.h"
+#include "key_mask.h"
+#include "key_calibration.h"
+#include "synthetic_frames.h"
+
+
+// Size of the single view key screen scene of the key mask checks.
+#define SELF_TEST_KEY_SCENE_SIZE 512
+
+
+float GetElapsedMS(const LARGE_INTEGER& startTime);
+
+// Deterministic noise for the test images, 24 bits at a time.
+uint32_t NextRandom(uint32_t& state);
+
+
+// Config manager writing to a scratch file, removed again when done.
+class ScratchConfigManager
+{
+public:
+
+	ScratchConfigManager()
+		: m_path(std::filesystem::temp_directory_path() / L"passthrough_self_test.ini")
+	{
+		m_manager = std::make_unique<ConfigManager>(m_path.wstring());
+	}
+
+	~ScratchConfigManager()
+	{
+		m_manager.reset();
+		std::error_code error;
+		std::filesystem::remove(m_path, error);
+	}
+
+	// Writes out the pending changes and reads them back into a new manager.
+	void Reload()
+	{
+		m_manager.reset();
+		m_manager = std::make_unique<ConfigManager>(m_path.wstring());
+		m_manager->ReadConfigFile();
+	}
+
+	ConfigManager& operator*() { return *m_manager; }
+	ConfigManager* operator->() { return m_manager.get(); }
+
+private:
+
+	std::filesystem::path m_path;
+	std::unique_ptr<ConfigManager> m_manager;
+};
+
+
+// Smooth random texture from bilinear interpolated noise on a coarse lattice, for the stereo matching checks.
+class LatticeTexture
+{
+public:
+
+	LatticeTexture(const uint32_t width, const uint32_t height, const uint32_t spacing, uint32_t seed)
+		: m_width(width / spacing + 2)
+		, m_height(height / spacing + 2)
+		, m_spacing((float)spacing)
+	{
+		m_values.resize(m_width * m_height);
+		for (float& value : m_values)
+		{
+			value = (float)(NextRandom(seed) & 255);
+		}
+	}
+
+	float Sample(const float x, const float y) const
+	{
+		float latticeX = std::clamp(x / m_spacing, 0.0f, m_width - 1.001f);
+		float latticeY = std::clamp(y / m_spacing, 0.0f, m_height - 1.001f);
+		uint32_t x0 = (uint32_t)latticeX;
+		uint32_t y0 = (uint32_t)latticeY;
+		float fx = latticeX - x0;
+		float fy = latticeY - y0;
+
+		const float* top = &m_values[y0 * m_width + x0];
+		const float* bottom = top + m_width;
+		float upper = top[0] + (top[1] - top[0]) * fx;
+		float lower = bottom[0] + (bottom[1] - bottom[0]) * fx;
+		return upper + (lower - upper) * fy;
+	}
+
+private:
+
+	uint32_t m_width;
+	uint32_t m_height;
+	float m_spacing;
+	std::vector<float> m_values;
+};
+
+
+// Synthetic key screen scene and its key with the default ranges.
+SyntheticSceneParams GetKeySceneParams();
+KeyMaskParams GetKeySceneMaskParams(const SyntheticSceneParams& sceneParams);
+
+KeyCalibrationImage GetFrameCalibrationImage(const SyntheticFrame& frame);
+
+// Fractions of the fully uncovered screen and of the fully covered foreground the key matches.
+void GetKeyedFractions(const SyntheticFrame& frame, const KeyMaskParams& params, float& outScreenKeyed, float& outForegroundKeyed);
+
+// Intersection over union of the keyed pixels of a mask and the pixels mostly showing the key screen.
+float GetKeyIoU(const SyntheticFrame& frame, const std::vector<float>& alpha);
+
+
+// warp_mesh_test.cpp
+bool TestRollingShutterShear();
+bool TestTiltedPlaneDepth();
+bool BenchmarkWarpMesh();
+bool TestWarpMeshScissorCoverage();
+
+// stereo_depth_test.cpp
+bool TestStereoDepth();
+
+// config_manager_test.cpp
+bool TestConfigSnapshotStress();
+bool BenchmarkConfigSnapshot();
+bool TestConfigSchemaRoundTrip();
+bool BenchmarkConfigDependencies();
+bool TestConfigPersistence();
+
+// logging_test.cpp
+bool BenchmarkLogEnqueue();
+
+// key_mask_test.cpp
+bool TestKeyMaskUpsampling();
+bool TestKeyMaskStabilization();
+bool TestKeyMaskCleanup();
+
+// key_calibration_test.cpp
+bool TestKeyCalibration();
+
+// key_threshold_tuner_test.cpp
+bool TestKeyThresholdTuning();
+
+// key_lut_test.cpp
+bool TestKeyLUTBake();
+bool TestKeyDespill();
+bool TestKeyColorSpaces();
+
+// synthetic_frames_test.cpp
+bool TestSyntheticFrames();
+
+// watchdog_test.cpp
+bool TestWatchdogQuality();
+
+// resolution_governor_test.cpp
+bool TestResolutionGovernor();
+
+// frame_undistorter_test.cpp
+bool BenchmarkFrameUndistortion();
+bool TestFusedUndistortion();
+
+// render_target_size_test.cpp
+bool TestRenderTargetSize();
+
+// flight_recorder_test.cpp
+bool TestFlightRecorder();
+
+// projection_distance_estimator_test.cpp
+bool TestProjectionDistanceEstimation();
+
+// passthrough_renderer_test.cpp
+bool TestProfileCycling();
+
+#endif
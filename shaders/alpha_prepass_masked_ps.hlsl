@@ -30,6 +30,7 @@ cbuffer psMaskedConstantBuffer : register(b2)
 	float g_maskedFracChroma;
 	float g_maskedFracLuma;
 	float g_maskedSmooth;
+	bool g_bMaskedDespill;
 	bool g_bMaskedUseCamera;
 };
 
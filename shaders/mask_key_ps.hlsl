@@ -0,0 +1,95 @@
+#include "util.hlsl"
+
+struct VS_OUTPUT
+{
+	float4 position : SV_POSITION;
+	float3 uvCoords : TEXCOORD0;
+	float2 originalUVCoords : TEXCOORD1;
+};
+
+cbuffer psViewConstantBuffer : register(b1)
+{
+	float2 g_uvOffset;
+	float2 g_uvPrepassFactor;
+	float2 g_uvPrepassOffset;
+	uint g_arrayIndex;
+};
+
+cbuffer psMaskedConstantBuffer : register(b2)
+{
+	float3 g_maskedKey;
+	float g_maskedFracChroma;
+	float g_maskedFracLuma;
+	float g_maskedSmooth;
+	bool g_bMaskedDespill;
+	bool g_bMaskedUseCamera;
+};
+
+cbuffer psTemporalConstantBuffer : register(b4)
+{
+	// Homography rows from the current to the previous frame clip space.
+	float4 g_historyProjection[3];
+	// Scale from the previous frame UVs to the history texture UVs.
+	float2 g_historyUVScale;
+	float g_temporalSmoothing;
+	bool g_bHistoryValid;
+};
+
+SamplerState g_SamplerState : register(s0);
+Texture2D g_CameraTexture : register(t0);
+Texture2D g_CompositorTexture : register(t1);
+Texture2D g_HistoryTexture : register(t3);
+Texture3D<float4> g_KeyLUT : register(t5);
+
+// Alpha changes smaller than the band are held at the history value, matches KEY_MASK_HYSTERESIS_BAND in key_mask.h.
+#define MASK_HYSTERESIS_BAND 0.1
+
+// Squared keyed color difference to the history treated as motion, matches KEY_MASK_MOTION_THRESHOLD in key_mask.h.
+#define MASK_MOTION_THRESHOLD 0.01
+
+
+// Evaluates the chroma key at the reduced mask resolution. The keyed color is stored
+// with the mask in gamma space, to guide the upsampling in the final pass.
+// The mask of the previous frame is reprojected and blended in, to hold the key steady against camera noise.
+float4 main(VS_OUTPUT input) : SV_TARGET
+{
+	float3 maskColor;
+
+	if (g_bMaskedUseCamera)
+	{
+		float2 outUvs = input.uvCoords.xy / input.uvCoords.z;
+		outUvs = outUvs * float2(-0.5, -0.5) + float2(0.5, 0.5);
+		outUvs = clamp(outUvs, float2(0.0, 0.0), float2(0.5, 1.0)) + g_uvOffset;
+
+		maskColor = g_CameraTexture.Sample(g_SamplerState, outUvs).xyz;
+	}
+	else
+	{
+		maskColor = g_CompositorTexture.Sample(g_SamplerState, input.originalUVCoords * g_uvPrepassFactor + g_uvPrepassOffset).xyz;
+	}
+
+	float alpha = SampleKeyLUT(g_KeyLUT, g_SamplerState, maskColor).x;
+	float3 guide = sqrt(saturate(maskColor));
+
+	if (g_bHistoryValid)
+	{
+		float3 clipPos = float3(input.originalUVCoords.x * 2.0 - 1.0, 1.0 - input.originalUVCoords.y * 2.0, 1.0);
+		float3 historyPos = float3(dot(g_historyProjection[0].xyz, clipPos), dot(g_historyProjection[1].xyz, clipPos), dot(g_historyProjection[2].xyz, clipPos));
+		float2 historyUV = historyPos.xy / historyPos.z * float2(-0.5, -0.5) + float2(0.5, 0.5);
+
+		if (all(historyUV >= 0.0) && all(historyUV <= 1.0))
+		{
+			float4 history = g_HistoryTexture.SampleLevel(g_SamplerState, historyUV * g_historyUVScale, 0);
+			float3 difference = guide - history.xyz;
+
+			// A keyed color change larger than the camera noise is real motion, which discards the history.
+			if (dot(difference, difference) < MASK_MOTION_THRESHOLD)
+			{
+				float target = (abs(alpha - history.w) < MASK_HYSTERESIS_BAND) ? history.w : alpha;
+				alpha = lerp(target, history.w, g_temporalSmoothing);
+			}
+		}
+	}
+
+	return float4(guide, alpha);
+}
@@ -0,0 +1,86 @@
+
+cbuffer csMorphologyConstantBuffer : register(b0)
+{
+	// Top left of the filtered area, which is filtered as if surrounded by the padding.
+	uint2 g_origin;
+	// (1, 0) for filtering along the rows, (0, 1) along the columns.
+	uint2 g_lineStep;
+	uint g_lineLength;
+	uint g_radius;
+	uint g_bDilate;
+	uint g_bReadMaskAlpha;
+};
+
+Texture2D<float4> g_InputTexture : register(t0);
+RWTexture2D<float> g_OutputTexture : register(u0);
+
+// Longest padded line that fits the shared memory, matches KEY_MASK_MAX_MORPHOLOGY_LINE in key_mask.h.
+#define MORPHOLOGY_MAX_LINE 4096
+#define MORPHOLOGY_THREADS 256
+
+groupshared float g_prefix[MORPHOLOGY_MAX_LINE];
+groupshared float g_suffix[MORPHOLOGY_MAX_LINE];
+
+
+float Combine(float a, float b)
+{
+	return g_bDilate ? max(a, b) : min(a, b);
+}
+
+
+// Reads the line padded by the radius on both sides, the padding doesn't change the result.
+float LoadPadded(uint lineIndex, uint paddedIndex)
+{
+	if (paddedIndex < g_radius || paddedIndex >= g_radius + g_lineLength)
+	{
+		return g_bDilate ? 0.0 : 1.0;
+	}
+
+	uint2 coord = g_origin + (paddedIndex - g_radius) * g_lineStep + lineIndex * g_lineStep.yx;
+	float4 texel = g_InputTexture.Load(int3(coord, 0));
+
+	return g_bReadMaskAlpha ? texel.a : texel.r;
+}
+
+
+// One pass of a separable erosion or dilation of the key mask alpha, with one group per line.
+// Uses the van Herk/Gil-Werman algorithm: the line is split into blocks of the window size, with the
+// running extremes from the block starts and ends stored. Every window then spans at most two blocks,
+// and is the combination of one value from each, so the cost per pixel doesn't depend on the radius.
+[numthreads(MORPHOLOGY_THREADS, 1, 1)]
+void main(uint3 groupId : SV_GroupID, uint threadIndex : SV_GroupIndex)
+{
+	uint window = g_radius * 2 + 1;
+	uint paddedLength = g_lineLength + g_radius * 2;
+
+	for (uint blockStart = threadIndex * window; blockStart < paddedLength; blockStart += MORPHOLOGY_THREADS * window)
+	{
+		uint blockEnd = min(blockStart + window, paddedLength);
+
+		float value = LoadPadded(groupId.x, blockStart);
+		g_prefix[blockStart] = value;
+
+		for (uint i = blockStart + 1; i < blockEnd; i++)
+		{
+			value = Combine(value, LoadPadded(groupId.x, i));
+			g_prefix[i] = value;
+		}
+
+		value = LoadPadded(groupId.x, blockEnd - 1);
+		g_suffix[blockEnd - 1] = value;
+
+		for (uint j = blockEnd - 1; j > blockStart; j--)
+		{
+			value = Combine(value, LoadPadded(groupId.x, j - 1));
+			g_suffix[j - 1] = value;
+		}
+	}
+
+	GroupMemoryBarrierWithGroupSync();
+
+	for (uint x = threadIndex; x < g_lineLength; x += MORPHOLOGY_THREADS)
+	{
+		uint2 coord = g_origin + x * g_lineStep + groupId.x * g_lineStep.yx;
+		g_OutputTexture[coord] = Combine(g_suffix[x], g_prefix[x + g_radius * 2]);
+	}
+}
@@ -31,12 +31,14 @@ cbuffer psMaskedConstantBuffer : register(b2)
 	float g_maskedFracChroma;
 	float g_maskedFracLuma;
 	float g_maskedSmooth;
+	bool g_bMaskedDespill;
 	bool g_bMaskedUseCamera;
 };
 
 SamplerState g_SamplerState : register(s0);
 Texture2D g_CameraTexture : register(t0);
 Texture2D g_CompositorTexture : register(t1);
+Texture3D<float4> g_KeyLUT : register(t5);
 
 
 float4 main(VS_OUTPUT input) : SV_TARGET
@@ -61,19 +63,18 @@ float4 main(VS_OUTPUT input) : SV_TARGET
 	}
 	else
 	{
-		maskColor = g_CompositorTexture.Sample(g_SamplerState, input.originalUVCoords).xyz;
+		maskColor = g_CompositorTexture.Sample(g_SamplerState, input.originalUVCoords * g_uvPrepassFactor + g_uvPrepassOffset).xyz;
 	}
 
 
-	float3 difference = LinearRGBtoLAB_D65(maskColor) - LinearRGBtoLAB_D65(g_maskedKey);
+	float4 key = SampleKeyLUT(g_KeyLUT, g_SamplerState, maskColor);
+	float alpha = saturate(key.x * g_opacity);
 
-	float2 distChromaSqr = pow(difference.yz, 2);
-	float fracChromaSqr = pow(g_maskedFracChroma, 2);
-
-	float distChroma = smoothstep(fracChromaSqr, fracChromaSqr + pow(g_maskedSmooth, 2), (distChromaSqr.x + distChromaSqr.y));
-	float distLuma = smoothstep(g_maskedFracLuma, g_maskedFracLuma + g_maskedSmooth, abs(difference.x));
-
-	float alpha = saturate((1.0 - max(distChroma, distLuma)) * g_opacity);
+	// The key was sampled at the camera color, so its despill offset applies to it.
+	if (g_bMaskedUseCamera)
+	{
+		cameraColor = max(cameraColor + key.yzw, 0.0);
+	}
 
 
 	if (g_bDoColorAdjustment)
@@ -0,0 +1,135 @@
+#include "util.hlsl"
+
+struct VS_OUTPUT
+{
+	float4 position : SV_POSITION;
+	float3 uvCoords : TEXCOORD0;
+	float2 originalUVCoords : TEXCOORD1;
+};
+
+cbuffer psPassConstantBuffer : register(b0)
+{
+	float g_opacity;
+	float g_brightness;
+	float g_contrast;
+	float g_saturation;
+	bool g_bDoColorAdjustment;
+};
+
+cbuffer psViewConstantBuffer : register(b1)
+{
+	float2 g_uvOffset;
+	float2 g_uvPrepassFactor;
+	float2 g_uvPrepassOffset;
+	uint g_arrayIndex;
+};
+
+cbuffer psMaskedConstantBuffer : register(b2)
+{
+	float3 g_maskedKey;
+	float g_maskedFracChroma;
+	float g_maskedFracLuma;
+	float g_maskedSmooth;
+	bool g_bMaskedDespill;
+	bool g_bMaskedUseCamera;
+};
+
+cbuffer psMaskConstantBuffer : register(b3)
+{
+	float2 g_maskScale;
+	uint2 g_maskMaxCoord;
+	bool g_bUseCleanedAlpha;
+};
+
+SamplerState g_SamplerState : register(s0);
+Texture2D g_CameraTexture : register(t0);
+Texture2D g_CompositorTexture : register(t1);
+Texture2D g_MaskTexture : register(t2);
+Texture2D<float> g_CleanedAlphaTexture : register(t4);
+Texture3D<float4> g_KeyLUT : register(t5);
+
+// Weight falloff of the guide color difference, matches KEY_MASK_RANGE_FACTOR in key_mask.h.
+#define MASK_UPSAMPLE_RANGE_FACTOR 50.0
+
+
+float4 main(VS_OUTPUT input) : SV_TARGET
+{
+	// Divide to convert back from homogenous coordinates.
+	float2 outUvs = input.uvCoords.xy / input.uvCoords.z;
+
+	// Convert from clip space coordinates to 0-1.
+	outUvs = outUvs * float2(-0.5, -0.5) + float2(0.5, 0.5);
+
+	// Clamp to half of the frame texture and add the right eye offset.
+	outUvs = clamp(outUvs, float2(0.0, 0.0), float2(0.5, 1.0)) + g_uvOffset;
+
+
+	float3 cameraColor = g_CameraTexture.Sample(g_SamplerState, outUvs).xyz;
+
+	float3 maskColor;
+
+	if (g_bMaskedUseCamera)
+	{
+		maskColor = cameraColor;
+	}
+	else
+	{
+		maskColor = g_CompositorTexture.Sample(g_SamplerState, input.originalUVCoords * g_uvPrepassFactor + g_uvPrepassOffset).xyz;
+	}
+
+	float3 guide = sqrt(saturate(maskColor));
+
+	// Joint bilateral upsampling, the bilinear weights of the four nearest mask texels are
+	// scaled down by how much their keyed color differs from the color of this pixel.
+	float2 maskPos = input.position.xy * g_maskScale - 0.5;
+	int2 base = (int2)floor(maskPos);
+	float2 fraction = maskPos - base;
+
+	float alphaSum = 0.0;
+	float weightSum = 0.0;
+
+	[unroll]
+	for (int tap = 0; tap < 4; tap++)
+	{
+		int2 offset = int2(tap & 1, tap >> 1);
+		int2 coord = clamp(base + offset, int2(0, 0), (int2)g_maskMaxCoord);
+		float4 mask = g_MaskTexture.Load(int3(coord, 0));
+
+		if (g_bUseCleanedAlpha)
+		{
+			mask.w = g_CleanedAlphaTexture.Load(int3(coord, 0));
+		}
+
+		float2 bilinear = lerp(1.0 - fraction, fraction, (float2)offset);
+		float3 difference = guide - mask.xyz;
+
+		// The small bilinear term keeps the result defined when no tap matches the pixel.
+		float weight = bilinear.x * bilinear.y * (exp(-dot(difference, difference) * MASK_UPSAMPLE_RANGE_FACTOR) + 0.001);
+
+		alphaSum += mask.w * weight;
+		weightSum += weight;
+	}
+
+	float alpha = saturate(alphaSum / weightSum * g_opacity);
+
+	// The key was sampled at the mask resolution, so the despill takes a lookup at the full resolution camera color.
+	if (g_bMaskedUseCamera && g_bMaskedDespill)
+	{
+		cameraColor = max(cameraColor + SampleKeyLUT(g_KeyLUT, g_SamplerState, cameraColor).yzw, 0.0);
+	}
+
+
+	if (g_bDoColorAdjustment)
+	{
+		// Using CIELAB D65 to match the EXT_FB_passthrough adjustments.
+		float3 labColor = LinearRGBtoLAB_D65(cameraColor.xyz);
+		float LPrime = clamp((labColor.x - 50.0) * g_contrast + 50.0, 0.0, 100.0);
+		float LBis = clamp(LPrime + g_brightness, 0.0, 100.0);
+		float2 ab = labColor.yz * g_saturation;
+
+		cameraColor = LABtoLinearRGB_D65(float3(LBis, ab.xy));
+	}
+
+	// Premultiply alpha.
+	return float4(cameraColor * alpha, alpha);
+}
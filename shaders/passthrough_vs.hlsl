@@ -1,3 +1,8 @@
+struct VS_INPUT
+{
+	float2 position : POSITION;
+	float3 uvCoords : TEXCOORD0;
+};
 
 struct VS_OUTPUT
 {
@@ -6,29 +11,19 @@ struct VS_OUTPUT
 	float2 originalUVCoords : TEXCOORD1;
 };
 
-cbuffer vsConstantBuffer : register(b0)
-{
-	float4x4 g_cameraUVProjectionFar;
-	float4x4 g_cameraUVProjectionNear;
-};
-
-VS_OUTPUT main(uint vertexID : SV_VertexID)
+VS_OUTPUT main(VS_INPUT input)
 {
 	VS_OUTPUT output;
 
-	// Single triangle from (0, 0) to (2, 2).
-	float2 vertPos = float2((vertexID & 1) * 2, (vertexID >> 1) * 2);
-
-	float posX = (vertPos.x - 0.5) * 2.0;
-	float posY = (vertPos.y - 0.5) * 2.0;
-	output.position = float4(posX, posY, 0.0, 1.0);
+	output.position = float4(input.position, 0.0, 1.0);
 
-	// The UV transformation is non-linear in 2D space, 
+	// The UV transformation is non-linear in 2D space,
 	// so the transformation has to either be done in the pixel shader,
 	// or pass the UVs as homogenous coordinates as shown here.
-	output.uvCoords = mul(g_cameraUVProjectionFar, float4(posX, posY, 1.0, 1.0)).xyz;
+	// The warp mesh vertices are precalculated on the CPU.
+	output.uvCoords = input.uvCoords;
 
-	output.originalUVCoords = float2(vertPos.x, 1 - vertPos.y);
+	output.originalUVCoords = float2(input.position.x * 0.5 + 0.5, 0.5 - input.position.y * 0.5);
 
 	return output;
 }
@@ -93,3 +93,17 @@ float3 LABtoLinearRGB_D65(in float3 lab)
 
     return mul(XYZtoRGBMat, xyz);
 }
+
+
+// Edge length of the key LUT, matches KEY_LUT_SIZE in key_lut.h.
+#define KEY_LUT_SIZE 64
+
+// Alpha of the keys baked into the LUT for a linear color before opacity, along with the despill
+// offset of the color in yzw. The LUT holds the distance past the key ranges in units of the smoothing
+// and the linear RGB offset removing the key hue, see KeyLUTBaker.
+float4 SampleKeyLUT(Texture3D<float4> keyLUT, SamplerState samplerState, float3 color)
+{
+    float3 coord = sqrt(saturate(color)) * ((KEY_LUT_SIZE - 1.0) / KEY_LUT_SIZE) + 0.5 / KEY_LUT_SIZE;
+    float4 entry = keyLUT.SampleLevel(samplerState, coord, 0);
+    return float4(1.0 - smoothstep(0.0, 1.0, entry.x), entry.yzw);
+}
@@ -14,6 +14,13 @@ enum EPassthroughBlendMode
 	Opaque
 };
 
+enum EKeyColorSpace
+{
+	KeyColorSpace_CIELAB = 0,
+	KeyColorSpace_YCbCr,
+	KeyColorSpace_HSV
+};
+
 enum EStereoFrameLayout
 {
 	Mono = 0,
@@ -22,14 +29,52 @@ enum EStereoFrameLayout
 };
 
 
+struct WarpMeshVertex
+{
+	Vector2 position;
+	Vector3 uvCoords;
+};
+
+
+// Coarse scene depth in meters, laid out over the camera image of one eye with the first row at the top.
+struct DepthGrid
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<float> depth;
+};
+
+
+// Tangents of the view angles at the edges of a frustum, in the layout used by IVRSystem::GetProjectionRaw.
+struct FrustumTangents
+{
+	float left = -1.0f;
+	float right = 1.0f;
+	float top = -1.0f;
+	float bottom = 1.0f;
+};
+
+
+// Rectangle in normalized render target coordinates, with the origin at the top left.
+struct TargetRect
+{
+	float left = 0.0f;
+	float top = 0.0f;
+	float right = 1.0f;
+	float bottom = 1.0f;
+};
+
+
 struct CameraFrame
 {
 	CameraFrame()
 		: header()
 		, frameTextureResource(nullptr)
+		, frameBufferHeader()
 		, frameUVProjectionLeft()
 		, frameUVProjectionRight()
 		, frameLayout(Mono)
+		, bIsDistorted(false)
 		, bIsValid(false)
 	{
 	}
@@ -37,9 +82,20 @@ struct CameraFrame
 	vr::CameraVideoStreamFrameHeader_t header;
 	ID3D11ShaderResourceView* frameTextureResource;
 	std::shared_ptr<std::vector<uint8_t>> frameBuffer;
+	// Header of the image in the frame buffer. With the shared texture the buffer is read separately,
+	// and may hold a newer frame than the texture.
+	vr::CameraVideoStreamFrameHeader_t frameBufferHeader;
+	std::shared_ptr<DepthGrid> depthGrid;
 	Matrix4 frameUVProjectionLeft;
 	Matrix4 frameUVProjectionRight;
+	std::vector<WarpMeshVertex> warpMeshLeft;
+	std::vector<WarpMeshVertex> warpMeshRight;
+	// The parts of the render targets where the warp meshes sample inside the camera image.
+	TargetRect warpMeshCoverageLeft;
+	TargetRect warpMeshCoverageRight;
 	EStereoFrameLayout frameLayout;
+	// The frame buffer holds the raw lens distorted image, to be undistorted by the warp mesh.
+	bool bIsDistorted;
 	bool bIsValid;
 };
 
@@ -50,6 +106,17 @@ struct RenderFrame
 		, textureRight()
 		, hmdTrackingToViewLeft()
 		, hmdTrackingToViewRight()
+		, textureBoundsU(1.0f)
+		, textureBoundsV(1.0f)
+		, targetWidth(0)
+		, targetHeight(0)
+		, renderFrustumLeft()
+		, renderFrustumRight()
+		, displayUVTransformLeft(1.0f, 1.0f, 0.0f, 0.0f)
+		, displayUVTransformRight(1.0f, 1.0f, 0.0f, 0.0f)
+		, maskHistoryProjectionLeft()
+		, maskHistoryProjectionRight()
+		, bHasMaskHistoryProjection(false)
 	{
 	}
 
@@ -57,4 +124,21 @@ struct RenderFrame
 	ComPtr<ID3D11Texture2D> textureRight;
 	Matrix4 hmdTrackingToViewLeft;
 	Matrix4 hmdTrackingToViewRight;
+	// Fraction of the textures rendered to, starting from the top left corner.
+	float textureBoundsU;
+	float textureBoundsV;
+
+	// Render target size for the field of view covered by both the camera and the display.
+	uint32_t targetWidth;
+	uint32_t targetHeight;
+	// The frustums the targets are rendered with, and the UV scale and offset mapping them into the display frustums.
+	FrustumTangents renderFrustumLeft;
+	FrustumTangents renderFrustumRight;
+	Vector4 displayUVTransformLeft;
+	Vector4 displayUVTransformRight;
+
+	// Homographies from the clip space of this frame to the previous one, for reprojecting the key mask history.
+	Matrix4 maskHistoryProjectionLeft;
+	Matrix4 maskHistoryProjectionRight;
+	bool bHasMaskHistoryProjection;
 };
\ No newline at end of file
@@ -0,0 +1,215 @@
+
+#include "pch.h"
+#include "stereo_depth.h"
+#include <emmintrin.h>
+
+
+StereoDepthEstimator::StereoDepthEstimator(const uint32_t numThreads)
+	: m_workerPool(numThreads)
+{
+}
+
+
+bool StereoDepthEstimator::EstimateDepth(const uint8_t* frameData, const vr::CameraVideoStreamFrameHeader_t& header, const EStereoFrameLayout layout, const StereoCameraParameters& cameraParams, DepthGrid& outGrid)
+{
+	if (!frameData || layout == Mono || header.nBytesPerPixel < 3 || cameraParams.focalLength <= 0.0f || cameraParams.baseline <= 0.0f)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER perfFrequency;
+	LARGE_INTEGER startTime;
+	QueryPerformanceFrequency(&perfFrequency);
+	QueryPerformanceCounter(&startTime);
+
+	uint32_t eyeWidth = (layout == StereoHorizontalLayout) ? header.nWidth / 2 : header.nWidth;
+	uint32_t eyeHeight = (layout == StereoVerticalLayout) ? header.nHeight / 2 : header.nHeight;
+
+	m_imageWidth = eyeWidth / STEREO_DEPTH_DOWNSCALE;
+	m_imageHeight = eyeHeight / STEREO_DEPTH_DOWNSCALE;
+
+	if (m_imageWidth < STEREO_DEPTH_BLOCK_WIDTH || m_imageHeight < STEREO_DEPTH_BLOCK_HEIGHT)
+	{
+		return false;
+	}
+
+	m_leftImage.resize(m_imageWidth * m_imageHeight);
+	m_rightImage.resize(m_imageWidth * m_imageHeight);
+
+	// The vertical layout has the left camera at the bottom.
+	uint32_t leftOffsetX = 0;
+	uint32_t leftOffsetY = (layout == StereoVerticalLayout) ? eyeHeight : 0;
+	uint32_t rightOffsetX = (layout == StereoHorizontalLayout) ? eyeWidth : 0;
+	uint32_t rightOffsetY = 0;
+
+	const uint32_t rowsPerJob = 8;
+	const uint32_t numRowJobs = (m_imageHeight + rowsPerJob - 1) / rowsPerJob;
+
+	m_workerPool.ParallelFor(numRowJobs * 2, [&](uint32_t job)
+	{
+		uint32_t startRow = (job / 2) * rowsPerJob;
+		uint32_t endRow = std::min(startRow + rowsPerJob, m_imageHeight);
+
+		if (job % 2 == 0)
+		{
+			DownscaleEye(frameData, header, leftOffsetX, leftOffsetY, m_leftImage, startRow, endRow);
+		}
+		else
+		{
+			DownscaleEye(frameData, header, rightOffsetX, rightOffsetY, m_rightImage, startRow, endRow);
+		}
+	});
+
+	m_disparity.resize(STEREO_DEPTH_GRID_WIDTH * STEREO_DEPTH_GRID_HEIGHT);
+
+	m_workerPool.ParallelFor(STEREO_DEPTH_GRID_HEIGHT, [&](uint32_t gridY)
+	{
+		uint32_t centerY = (uint32_t)((gridY + 0.5f) * m_imageHeight / STEREO_DEPTH_GRID_HEIGHT);
+
+		for (uint32_t gridX = 0; gridX < STEREO_DEPTH_GRID_WIDTH; gridX++)
+		{
+			uint32_t centerX = (uint32_t)((gridX + 0.5f) * m_imageWidth / STEREO_DEPTH_GRID_WIDTH);
+			m_disparity[gridY * STEREO_DEPTH_GRID_WIDTH + gridX] = MatchBlock(centerX, centerY);
+		}
+	});
+
+	outGrid.width = STEREO_DEPTH_GRID_WIDTH;
+	outGrid.height = STEREO_DEPTH_GRID_HEIGHT;
+	outGrid.depth.resize(STEREO_DEPTH_GRID_WIDTH * STEREO_DEPTH_GRID_HEIGHT);
+
+	float scaledFocalLength = cameraParams.focalLength / STEREO_DEPTH_DOWNSCALE;
+
+	// 3x3 median of the disparities to reject single mismatched cells.
+	for (int y = 0; y < STEREO_DEPTH_GRID_HEIGHT; y++)
+	{
+		for (int x = 0; x < STEREO_DEPTH_GRID_WIDTH; x++)
+		{
+			float values[9];
+			int numValues = 0;
+
+			for (int offsetY = -1; offsetY <= 1; offsetY++)
+			{
+				for (int offsetX = -1; offsetX <= 1; offsetX++)
+				{
+					int sampleX = std::clamp(x + offsetX, 0, STEREO_DEPTH_GRID_WIDTH - 1);
+					int sampleY = std::clamp(y + offsetY, 0, STEREO_DEPTH_GRID_HEIGHT - 1);
+					values[numValues++] = m_disparity[sampleY * STEREO_DEPTH_GRID_WIDTH + sampleX];
+				}
+			}
+
+			std::nth_element(values, values + 4, values + 9);
+			float disparity = values[4];
+
+			outGrid.depth[y * STEREO_DEPTH_GRID_WIDTH + x] = (disparity > 0.0f) ? scaledFocalLength * cameraParams.baseline / disparity : STEREO_DEPTH_INVALID;
+		}
+	}
+
+	LARGE_INTEGER endTime;
+	QueryPerformanceCounter(&endTime);
+
+	float estimateTime = (float)(endTime.QuadPart - startTime.QuadPart);
+	estimateTime *= 1000.0f;
+	estimateTime /= perfFrequency.QuadPart;
+	m_lastEstimateTimeMS = estimateTime;
+
+	return true;
+}
+
+
+void StereoDepthEstimator::DownscaleEye(const uint8_t* frameData, const vr::CameraVideoStreamFrameHeader_t& header, const uint32_t offsetX, const uint32_t offsetY, std::vector<uint8_t>& outImage, const uint32_t startRow, const uint32_t endRow)
+{
+	const uint32_t pixelSize = header.nBytesPerPixel;
+	const uint32_t rowPitch = header.nWidth * pixelSize;
+
+	for (uint32_t y = startRow; y < endRow; y++)
+	{
+		for (uint32_t x = 0; x < m_imageWidth; x++)
+		{
+			uint32_t sum = 0;
+
+			// Box filter luma approximation of (R + 2G + B) / 4.
+			for (uint32_t blockY = 0; blockY < STEREO_DEPTH_DOWNSCALE; blockY++)
+			{
+				const uint8_t* pixel = frameData + (offsetY + y * STEREO_DEPTH_DOWNSCALE + blockY) * rowPitch + (offsetX + x * STEREO_DEPTH_DOWNSCALE) * pixelSize;
+
+				for (uint32_t blockX = 0; blockX < STEREO_DEPTH_DOWNSCALE; blockX++)
+				{
+					sum += pixel[0] + 2 * pixel[1] + pixel[2];
+					pixel += pixelSize;
+				}
+			}
+
+			outImage[y * m_imageWidth + x] = (uint8_t)(sum / (4 * STEREO_DEPTH_DOWNSCALE * STEREO_DEPTH_DOWNSCALE));
+		}
+	}
+}
+
+
+// Finds the disparity of the block around the given point in the left image
+// by searching along the same row in the right image. Returns 0 for no reliable match.
+float StereoDepthEstimator::MatchBlock(const uint32_t centerX, const uint32_t centerY)
+{
+	int blockX = std::clamp((int)centerX - STEREO_DEPTH_BLOCK_WIDTH / 2, 0, (int)m_imageWidth - STEREO_DEPTH_BLOCK_WIDTH);
+	int blockY = std::clamp((int)centerY - STEREO_DEPTH_BLOCK_HEIGHT / 2, 0, (int)m_imageHeight - STEREO_DEPTH_BLOCK_HEIGHT);
+
+	int maxDisparity = std::min(STEREO_DEPTH_MAX_DISPARITY, blockX);
+
+	if (maxDisparity < 2)
+	{
+		return 0.0f;
+	}
+
+	__m128i leftRows[STEREO_DEPTH_BLOCK_HEIGHT];
+	for (int row = 0; row < STEREO_DEPTH_BLOCK_HEIGHT; row++)
+	{
+		leftRows[row] = _mm_loadu_si128((const __m128i*)&m_leftImage[(blockY + row) * m_imageWidth + blockX]);
+	}
+
+	uint32_t costs[STEREO_DEPTH_MAX_DISPARITY + 1];
+	uint32_t bestCost = UINT32_MAX;
+	int bestDisparity = 0;
+
+	for (int disparity = 0; disparity <= maxDisparity; disparity++)
+	{
+		__m128i sad = _mm_setzero_si128();
+		const uint8_t* right = &m_rightImage[blockY * m_imageWidth + blockX - disparity];
+
+		for (int row = 0; row < STEREO_DEPTH_BLOCK_HEIGHT; row++)
+		{
+			__m128i rightRow = _mm_loadu_si128((const __m128i*)(right + row * m_imageWidth));
+			sad = _mm_add_epi64(sad, _mm_sad_epu8(leftRows[row], rightRow));
+		}
+
+		uint32_t cost = (uint32_t)(_mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4));
+		costs[disparity] = cost;
+
+		if (cost < bestCost)
+		{
+			bestCost = cost;
+			bestDisparity = disparity;
+		}
+	}
+
+	// Reject ambiguous matches where another disparity outside the best peak is nearly as good.
+	uint32_t secondCost = UINT32_MAX;
+	for (int disparity = 0; disparity <= maxDisparity; disparity++)
+	{
+		if (abs(disparity - bestDisparity) > 1)
+		{
+			secondCost = std::min(secondCost, costs[disparity]);
+		}
+	}
+
+	if (bestDisparity == 0 || bestDisparity == maxDisparity || bestCost * 5 > secondCost * 4)
+	{
+		return 0.0f;
+	}
+
+	// Parabola fit for sub-pixel disparity.
+	float costPrev = (float)costs[bestDisparity - 1];
+	float costNext = (float)costs[bestDisparity + 1];
+	float denominator = costPrev - 2.0f * bestCost + costNext;
+	float offset = (denominator > 0.0f) ? 0.5f * (costPrev - costNext) / denominator : 0.0f;
+
+	return bestDisparity + std::clamp(offset, -0.5f, 0.5f);
+}
@@ -0,0 +1,56 @@
+
+#pragma once
+
+#include "shared_structs.h"
+#include "worker_pool.h"
+
+
+#define STEREO_DEPTH_DOWNSCALE 4
+#define STEREO_DEPTH_GRID_WIDTH 32
+#define STEREO_DEPTH_GRID_HEIGHT 32
+#define STEREO_DEPTH_MAX_DISPARITY 64
+
+// Matching window size in downscaled pixels, the width is one SSE register.
+#define STEREO_DEPTH_BLOCK_WIDTH 16
+#define STEREO_DEPTH_BLOCK_HEIGHT 8
+
+// Depth assigned to cells without a reliable match, clamped to the far plane on use.
+#define STEREO_DEPTH_INVALID 1000.0f
+
+
+struct StereoCameraParameters
+{
+	// Focal length in pixels of a single camera image.
+	float focalLength = 0.0f;
+	// Distance between the camera centers in meters.
+	float baseline = 0.0f;
+};
+
+
+// Estimates a coarse depth grid from the left and right camera views of a stereo frame
+// with block matching on downscaled grayscale images. Assumes the frames are close to rectified.
+class StereoDepthEstimator
+{
+public:
+
+	StereoDepthEstimator(const uint32_t numThreads);
+
+	bool EstimateDepth(const uint8_t* frameData, const vr::CameraVideoStreamFrameHeader_t& header, const EStereoFrameLayout layout, const StereoCameraParameters& cameraParams, DepthGrid& outGrid);
+
+	float GetLastEstimateTimeMS() const { return m_lastEstimateTimeMS; }
+
+private:
+
+	void DownscaleEye(const uint8_t* frameData, const vr::CameraVideoStreamFrameHeader_t& header, const uint32_t offsetX, const uint32_t offsetY, std::vector<uint8_t>& outImage, const uint32_t startRow, const uint32_t endRow);
+	float MatchBlock(const uint32_t centerX, const uint32_t centerY);
+
+	WorkerPool m_workerPool;
+
+	uint32_t m_imageWidth = 0;
+	uint32_t m_imageHeight = 0;
+	std::vector<uint8_t> m_leftImage;
+	std::vector<uint8_t> m_rightImage;
+	std::vector<float> m_disparity;
+
+	float m_lastEstimateTimeMS = 0.0f;
+};
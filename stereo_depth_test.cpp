@@ -0,0 +1,113 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "stereo_depth.h"
+
+
+// Stereo camera of the depth estimation check, with a focal length in pixels and a baseline in meters.
+#define SELF_TEST_STEREO_EYE_SIZE 960
+#define SELF_TEST_STEREO_FOCAL_LENGTH 700.0f
+#define SELF_TEST_STEREO_BASELINE 0.064f
+#define SELF_TEST_STEREO_ITERATIONS 20
+
+
+// Disparity in pixels of a plane slanted away to the left, over the left eye image x.
+static float GetSlantedPlaneDisparity(const float x)
+{
+	return 60.0f + 80.0f * x / SELF_TEST_STEREO_EYE_SIZE;
+}
+
+
+// Depth from a horizontal stereo frame of a textured slanted plane, with sensor noise in both views.
+// Compares the grid against the plane depth at the cell centers, and times the estimation.
+bool TestStereoDepth()
+{
+	const uint32_t eyeSize = SELF_TEST_STEREO_EYE_SIZE;
+	const uint32_t frameWidth = eyeSize * 2;
+
+	vr::CameraVideoStreamFrameHeader_t header = {};
+	header.nWidth = frameWidth;
+	header.nHeight = eyeSize;
+	header.nBytesPerPixel = 4;
+
+	LatticeTexture texture(eyeSize * 2, eyeSize, 6, 1);
+	std::vector<uint8_t> frame(frameWidth * eyeSize * 4);
+	uint32_t noiseState = 2;
+
+	// The disparity is linear over the left image, so the left position seen at each right pixel
+	// is solved from xRight = xLeft - (a + b * xLeft).
+	const float disparityOffset = GetSlantedPlaneDisparity(0.0f);
+	const float disparitySlope = GetSlantedPlaneDisparity(1.0f) - disparityOffset;
+
+	for (uint32_t y = 0; y < eyeSize; y++)
+	{
+		for (uint32_t x = 0; x < frameWidth; x++)
+		{
+			float eyeX = (float)(x % eyeSize) + 0.5f;
+			float planeX = (x < eyeSize) ? eyeX : (eyeX + disparityOffset) / (1.0f - disparitySlope);
+			float noise = (float)(NextRandom(noiseState) % 9) - 4.0f;
+			uint8_t value = (uint8_t)std::clamp(texture.Sample(planeX, y + 0.5f) + noise, 0.0f, 255.0f);
+
+			uint8_t* pixel = &frame[(y * frameWidth + x) * 4];
+			pixel[0] = pixel[1] = pixel[2] = value;
+			pixel[3] = 255;
+		}
+	}
+
+	StereoCameraParameters cameraParams;
+	cameraParams.focalLength = SELF_TEST_STEREO_FOCAL_LENGTH;
+	cameraParams.baseline = SELF_TEST_STEREO_BASELINE;
+
+	StereoDepthEstimator estimator(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+	DepthGrid grid;
+	float totalTimeMS = 0.0f;
+
+	for (int i = 0; i < SELF_TEST_STEREO_ITERATIONS; i++)
+	{
+		if (!estimator.EstimateDepth(frame.data(), header, StereoHorizontalLayout, cameraParams, grid))
+		{
+			Log("Stereo depth estimation failed\n");
+			return false;
+		}
+		totalTimeMS += estimator.GetLastEstimateTimeMS();
+	}
+
+	// The edge columns have their blocks clamped inside the image, and are left out.
+	std::vector<float> errors;
+	uint32_t numCells = 0;
+
+	for (uint32_t gridY = 0; gridY < grid.height; gridY++)
+	{
+		for (uint32_t gridX = 1; gridX < grid.width - 1; gridX++)
+		{
+			numCells++;
+			float depth = grid.depth[gridY * grid.width + gridX];
+			if (depth >= STEREO_DEPTH_INVALID) { continue; }
+
+			float expectedDepth = SELF_TEST_STEREO_FOCAL_LENGTH * SELF_TEST_STEREO_BASELINE / GetSlantedPlaneDisparity((gridX + 0.5f) * eyeSize / grid.width);
+			errors.push_back(fabsf(depth - expectedDepth) / expectedDepth);
+		}
+	}
+
+	if (errors.empty())
+	{
+		Log("Stereo depth: no valid cells\n");
+		return false;
+	}
+
+	std::sort(errors.begin(), errors.end());
+	float validFraction = (float)errors.size() / numCells;
+	float medianError = errors[errors.size() / 2];
+	float error90 = errors[errors.size() * 9 / 10];
+	float averageTimeMS = totalTimeMS / SELF_TEST_STEREO_ITERATIONS;
+
+	Log("Stereo depth: %.0f%% valid cells, relative error %.2f%% median, %.2f%% 90th percentile, %.2fms per %ux%u frame on %u threads\n",
+		validFraction * 100.0f, medianError * 100.0f, error90 * 100.0f, averageTimeMS, frameWidth, eyeSize, std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+
+	return validFraction > 0.8f && medianError < 0.03f && error90 < 0.08f;
+}
+
+#endif
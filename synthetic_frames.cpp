@@ -0,0 +1,399 @@
+
+#include "pch.h"
+#include "synthetic_frames.h"
+#include "key_mask.h"
+#include "logging.h"
+#include <random>
+
+
+// Smallest LAB chroma distance between the object colors and the key, so the objects don't key out.
+#define SYNTHETIC_MIN_OBJECT_CHROMA_DISTANCE 40.0f
+
+#define SYNTHETIC_PI 3.14159265f
+
+
+static void GetSyntheticHeadAngles(const float time, float& outYaw, float& outPitch, float& outYawRate, float& outPitchRate)
+{
+	// Slow looks around the scene with faster small turns mixed in.
+	outYaw = 0.35f * sinf(0.5f * time) + 0.1f * sinf(1.7f * time);
+	outPitch = 0.15f * sinf(0.37f * time + 1.0f);
+	outYawRate = 0.35f * 0.5f * cosf(0.5f * time) + 0.1f * 1.7f * cosf(1.7f * time);
+	outPitchRate = 0.15f * 0.37f * cosf(0.37f * time + 1.0f);
+}
+
+
+void GetSyntheticHMDPose(const float time, Matrix4& outPose, Vector3& outAngularVelocity)
+{
+	float yaw, pitch, yawRate, pitchRate;
+	GetSyntheticHeadAngles(time, yaw, pitch, yawRate, pitchRate);
+
+	float cy = cosf(yaw);
+	float sy = sinf(yaw);
+	float cp = cosf(pitch);
+	float sp = sinf(pitch);
+
+	// Yaw around Y followed by pitch around X, with the head swaying at standing height.
+	outPose = Matrix4(
+		cy, 0.0f, -sy, 0.0f,
+		sy * sp, cp, cy * sp, 0.0f,
+		sy * cp, -sp, cy * cp, 0.0f,
+		0.05f * sinf(0.3f * time), 1.6f + 0.02f * sinf(0.9f * time), 0.03f * sinf(0.41f * time), 1.0f
+	);
+
+	// The pitch axis turns with the yaw.
+	outAngularVelocity = Vector3(pitchRate * cy, yawRate, -pitchRate * sy);
+}
+
+
+static inline uint32_t HashNoise(uint32_t value)
+{
+	value ^= value >> 16;
+	value *= 0x7feb352d;
+	value ^= value >> 15;
+	value *= 0x846ca68b;
+	value ^= value >> 16;
+	return value;
+}
+
+
+// Approximately normal with unit deviation, from the sum of the four bytes of the hash.
+static inline float GaussianNoise(const uint32_t hash)
+{
+	float sum = (float)((hash & 0xFF) + ((hash >> 8) & 0xFF) + ((hash >> 16) & 0xFF) + (hash >> 24));
+	return (sum / 255.0f - 2.0f) * 1.7320508f;
+}
+
+
+SyntheticScene::SyntheticScene(const SyntheticSceneParams& params)
+	: m_params(params)
+{
+	m_params.numObjects = std::min(m_params.numObjects, (uint32_t)SYNTHETIC_MAX_OBJECTS);
+
+	for (int i = 0; i < 4096; i++)
+	{
+		float value = i / 4095.0f;
+		float encoded = (value <= 0.0031308f) ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+		m_linearToSRGB[i] = encoded * 255.0f;
+	}
+
+	// Same conversion as FillMaskedConstants.
+	for (int c = 0; c < 3; c++)
+	{
+		m_keyLinear[c] = powf(m_params.keyColor[c], 2.2f);
+	}
+
+	float keyLAB[3];
+	LinearRGBToLAB(m_keyLinear, keyLAB);
+
+	std::mt19937 random(m_params.seed);
+	auto uniform = [&random](float min, float max) { return std::uniform_real_distribution<float>(min, max)(random); };
+
+	float gradientAngle = uniform(0.0f, 2.0f * SYNTHETIC_PI);
+	m_gradientDirection[0] = cosf(gradientAngle);
+	m_gradientDirection[1] = sinf(gradientAngle);
+
+	for (uint32_t i = 0; i < m_params.numObjects; i++)
+	{
+		SceneObject object;
+		object.bBox = (i % 2) == 1;
+
+		for (int axis = 0; axis < 2; axis++)
+		{
+			object.center[axis] = uniform(-0.8f, 0.8f) * (axis == 0 ? 1.0f : 0.6f);
+			object.amplitude[axis] = uniform(0.05f, 0.3f);
+			object.rate[axis] = uniform(0.3f, 1.5f);
+			object.phase[axis] = uniform(0.0f, 2.0f * SYNTHETIC_PI);
+			object.size[axis] = uniform(0.05f, 0.18f);
+		}
+		object.depth = uniform(0.6f, 2.0f);
+
+		float lab[3];
+		do
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				object.colorLinear[c] = powf(uniform(0.05f, 0.95f), 2.2f);
+			}
+			LinearRGBToLAB(object.colorLinear, lab);
+		}
+		while (hypotf(lab[1] - keyLAB[1], lab[2] - keyLAB[2]) < SYNTHETIC_MIN_OBJECT_CHROMA_DISTANCE);
+
+		m_objects.push_back(object);
+	}
+
+	// Front to back, for compositing.
+	std::sort(m_objects.begin(), m_objects.end(), [](const SceneObject& a, const SceneObject& b) { return a.depth < b.depth; });
+}
+
+
+void SyntheticScene::Render(WorkerPool& workerPool, const uint32_t index, SyntheticFrame& outFrame) const
+{
+	outFrame.index = index;
+	outFrame.width = m_params.width;
+	outFrame.height = m_params.height;
+	outFrame.layout = m_params.layout;
+	outFrame.image.resize((size_t)m_params.width * m_params.height * 4);
+	outFrame.alpha.resize((size_t)m_params.width * m_params.height);
+
+	float frameTime = index / m_params.frameRate;
+	GetSyntheticHMDPose(frameTime, outFrame.hmdPose, outFrame.angularVelocity);
+
+	ExposureSample samples[SYNTHETIC_BLUR_SAMPLES];
+
+	for (int s = 0; s < SYNTHETIC_BLUR_SAMPLES; s++)
+	{
+		float time = frameTime + ((s + 0.5f) / SYNTHETIC_BLUR_SAMPLES - 0.5f) * m_params.exposureMS / 1000.0f;
+
+		float yawRate, pitchRate;
+		GetSyntheticHeadAngles(time, samples[s].headYaw, samples[s].headPitch, yawRate, pitchRate);
+
+		for (uint32_t i = 0; i < m_objects.size(); i++)
+		{
+			const SceneObject& object = m_objects[i];
+			float azimuth = object.center[0] + object.amplitude[0] * sinf(object.rate[0] * time + object.phase[0]);
+			float elevation = object.center[1] + object.amplitude[1] * sinf(object.rate[1] * time + object.phase[1]);
+
+			// The left eye sees the object further right, at a lower azimuth.
+			float disparity = 0.5f * SYNTHETIC_IPD / object.depth;
+			samples[s].objectCenters[0][i][0] = azimuth - disparity;
+			samples[s].objectCenters[1][i][0] = azimuth + disparity;
+			samples[s].objectCenters[0][i][1] = elevation;
+			samples[s].objectCenters[1][i][1] = elevation;
+		}
+	}
+
+	uint32_t numJobs = (m_params.height + SYNTHETIC_ROWS_PER_JOB - 1) / SYNTHETIC_ROWS_PER_JOB;
+
+	workerPool.ParallelFor(numJobs, [&](uint32_t job)
+	{
+		uint32_t startRow = job * SYNTHETIC_ROWS_PER_JOB;
+		RenderRows(samples, startRow, std::min(startRow + SYNTHETIC_ROWS_PER_JOB, m_params.height), index, outFrame);
+	});
+}
+
+
+void SyntheticScene::RenderRows(const ExposureSample* samples, const uint32_t startRow, const uint32_t endRow, const uint32_t index, SyntheticFrame& outFrame) const
+{
+	const uint32_t width = m_params.width;
+	const uint32_t height = m_params.height;
+	const EStereoFrameLayout layout = m_params.layout;
+
+	const uint32_t viewWidth = (layout == StereoHorizontalLayout) ? width / 2 : width;
+	const uint32_t viewHeight = (layout == StereoVerticalLayout) ? height / 2 : height;
+
+	const float pixelsPerRadian = viewWidth / (SYNTHETIC_FOV_DEGREES * SYNTHETIC_PI / 180.0f);
+	const float radiansPerPixel = 1.0f / pixelsPerRadian;
+	const float screenDisparity = 0.5f * SYNTHETIC_IPD / SYNTHETIC_SCREEN_DISTANCE;
+	const float lightingGradient = m_params.lightingGradient;
+	const float gradientX = m_gradientDirection[0];
+	const float gradientY = m_gradientDirection[1];
+	const float keyLinear[3] = { m_keyLinear[0], m_keyLinear[1], m_keyLinear[2] };
+	const float spillStrength = m_params.spill;
+	const float noiseSigma = m_params.noiseSigma;
+	const uint32_t noiseSeed = HashNoise(index * 0x9E3779B9 + m_params.seed);
+
+	float* outAlpha = outFrame.alpha.data();
+	uint8_t* outImage = outFrame.image.data();
+
+	for (uint32_t y = startRow; y < endRow; y++)
+	{
+		uint32_t rowEye = 0;
+		uint32_t viewY = y;
+
+		if (layout == StereoVerticalLayout)
+		{
+			// The left view is at the bottom.
+			rowEye = (y < viewHeight) ? 1 : 0;
+			viewY = (rowEye == 1) ? y : y - viewHeight;
+		}
+
+		float viewAngleY = (viewY + 0.5f - viewHeight * 0.5f) * radiansPerPixel;
+
+		// Objects reaching the row at any of the exposure samples, most rows have few or none.
+		uint32_t rowObjects[2][SYNTHETIC_MAX_OBJECTS];
+		uint32_t numRowObjects[2] = { 0, 0 };
+
+		for (uint32_t eye = 0; eye < 2; eye++)
+		{
+			for (uint32_t i = 0; i < m_objects.size(); i++)
+			{
+				const SceneObject& object = m_objects[i];
+				float sizeY = object.bBox ? object.size[1] : object.size[0];
+
+				for (int s = 0; s < SYNTHETIC_BLUR_SAMPLES; s++)
+				{
+					if (fabsf(samples[s].headPitch - viewAngleY - samples[s].objectCenters[eye][i][1]) <= sizeY + radiansPerPixel)
+					{
+						rowObjects[eye][numRowObjects[eye]++] = i;
+						break;
+					}
+				}
+			}
+		}
+
+		for (uint32_t x = 0; x < width; x++)
+		{
+			uint32_t eye = rowEye;
+			uint32_t viewX = x;
+
+			if (layout == StereoHorizontalLayout && x >= viewWidth)
+			{
+				eye = 1;
+				viewX = x - viewWidth;
+			}
+
+			float viewAngleX = (viewX + 0.5f - viewWidth * 0.5f) * radiansPerPixel;
+
+			float color[3] = { 0.0f, 0.0f, 0.0f };
+			float alpha = 0.0f;
+
+			for (int s = 0; s < SYNTHETIC_BLUR_SAMPLES; s++)
+			{
+				const ExposureSample& sample = samples[s];
+				float azimuth = sample.headYaw - viewAngleX;
+				float elevation = sample.headPitch - viewAngleY;
+
+				float screenAzimuth = azimuth + (eye == 0 ? screenDisparity : -screenDisparity);
+				float light = 1.0f + lightingGradient * (screenAzimuth * gradientX + elevation * gradientY);
+				light = std::clamp(light, 0.2f, 2.0f);
+
+				float keyLit[3] = { keyLinear[0] * light, keyLinear[1] * light, keyLinear[2] * light };
+				float transmittance = 1.0f;
+
+				for (uint32_t j = 0; j < numRowObjects[eye] && transmittance > 0.0f; j++)
+				{
+					uint32_t i = rowObjects[eye][j];
+					const SceneObject& object = m_objects[i];
+					float dx = fabsf(azimuth - sample.objectCenters[eye][i][0]);
+					float dy = fabsf(elevation - sample.objectCenters[eye][i][1]);
+
+					float sizeY = object.bBox ? object.size[1] : object.size[0];
+					if (dx > object.size[0] + radiansPerPixel || dy > sizeY + radiansPerPixel) { continue; }
+
+					float distance;
+					if (object.bBox)
+					{
+						float ex = dx - object.size[0];
+						float ey = dy - object.size[1];
+						float outsideX = std::max(ex, 0.0f);
+						float outsideY = std::max(ey, 0.0f);
+						distance = sqrtf(outsideX * outsideX + outsideY * outsideY) + std::min(std::max(ex, ey), 0.0f);
+					}
+					else
+					{
+						distance = sqrtf(dx * dx + dy * dy) - object.size[0];
+					}
+
+					// Pixel coverage of a straight edge at the signed distance.
+					float distancePixels = distance * pixelsPerRadian;
+					float coverage = std::clamp(0.5f - distancePixels, 0.0f, 1.0f);
+					if (coverage <= 0.0f) { continue; }
+
+					float spill = spillStrength * (0.5f + 0.5f * std::min(expf(distancePixels / SYNTHETIC_SPILL_EDGE_PIXELS), 1.0f));
+					float weight = transmittance * coverage;
+
+					for (int c = 0; c < 3; c++)
+					{
+						color[c] += weight * (object.colorLinear[c] * light * (1.0f - spill) + keyLit[c] * spill);
+					}
+					transmittance *= 1.0f - coverage;
+				}
+
+				for (int c = 0; c < 3; c++)
+				{
+					color[c] += transmittance * keyLit[c];
+				}
+				alpha += transmittance;
+			}
+
+			size_t pixel = (size_t)y * width + x;
+			outAlpha[pixel] = alpha / SYNTHETIC_BLUR_SAMPLES;
+
+			uint8_t* out = &outImage[pixel * 4];
+			for (int c = 0; c < 3; c++)
+			{
+				float value = std::min(color[c] / SYNTHETIC_BLUR_SAMPLES, 1.0f);
+				float encoded = m_linearToSRGB[(uint32_t)(value * 4095.0f + 0.5f)];
+				encoded += noiseSigma * GaussianNoise(HashNoise(noiseSeed ^ (uint32_t)(pixel * 3 + c)));
+				out[c] = (uint8_t)std::clamp(encoded + 0.5f, 0.0f, 255.0f);
+			}
+			out[3] = 255;
+		}
+	}
+}
+
+
+
+SyntheticFrameGenerator::SyntheticFrameGenerator(const SyntheticSceneParams& params, const uint32_t numThreads)
+	: m_scene(params)
+	, m_workerPool(numThreads)
+{
+	m_thread = std::thread(&SyntheticFrameGenerator::RunThread, this);
+}
+
+SyntheticFrameGenerator::~SyntheticFrameGenerator()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_bRunThread = false;
+	}
+	m_threadCondition.notify_all();
+
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+
+void SyntheticFrameGenerator::GetFrame(SyntheticFrame& inOutFrame)
+{
+	{
+		std::unique_lock<std::mutex> lock(m_threadMutex);
+		m_threadCondition.wait(lock, [this] { return !m_readyFrames.empty(); });
+
+		std::swap(inOutFrame, m_readyFrames.front());
+		m_freeFrames.push_back(std::move(m_readyFrames.front()));
+		m_readyFrames.pop_front();
+	}
+	m_threadCondition.notify_all();
+}
+
+
+void SyntheticFrameGenerator::RunThread()
+{
+	std::unique_lock<std::mutex> lock(m_threadMutex);
+
+	while (true)
+	{
+		m_threadCondition.wait(lock, [this] { return !m_bRunThread || m_readyFrames.size() < SYNTHETIC_FRAME_QUEUE_SIZE; });
+
+		if (!m_bRunThread) { return; }
+
+		SyntheticFrame frame;
+		if (!m_freeFrames.empty())
+		{
+			frame = std::move(m_freeFrames.back());
+			m_freeFrames.pop_back();
+		}
+		uint32_t index = m_nextIndex++;
+
+		lock.unlock();
+
+		LARGE_INTEGER perfFrequency;
+		LARGE_INTEGER startTime;
+		LARGE_INTEGER endTime;
+		QueryPerformanceFrequency(&perfFrequency);
+		QueryPerformanceCounter(&startTime);
+
+		m_scene.Render(m_workerPool, index, frame);
+
+		QueryPerformanceCounter(&endTime);
+		m_generateTimeMS = (float)((endTime.QuadPart - startTime.QuadPart) * 1000.0 / perfFrequency.QuadPart);
+
+		lock.lock();
+
+		m_readyFrames.push_back(std::move(frame));
+		m_threadCondition.notify_all();
+	}
+}
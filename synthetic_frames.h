@@ -0,0 +1,152 @@
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "shared_structs.h"
+#include "worker_pool.h"
+
+
+// Frames generated ahead of the consumer.
+#define SYNTHETIC_FRAME_QUEUE_SIZE 3
+
+#define SYNTHETIC_MAX_OBJECTS 8
+
+// Exposure samples averaged for the motion blur.
+#define SYNTHETIC_BLUR_SAMPLES 4
+
+#define SYNTHETIC_ROWS_PER_JOB 16
+
+// Horizontal field of view of each view, the scene is placed in angles from the view center.
+#define SYNTHETIC_FOV_DEGREES 100.0f
+
+// The key screen and the interpupillary distance the object disparity is computed from, in meters.
+#define SYNTHETIC_SCREEN_DISTANCE 2.5f
+#define SYNTHETIC_IPD 0.064f
+
+// Distance in pixels from the object edges over which the spill falls off to half.
+#define SYNTHETIC_SPILL_EDGE_PIXELS 12.0f
+
+
+struct SyntheticSceneParams
+{
+	// Size of the full frame, holding both views in the stereo layouts.
+	uint32_t width = 1920;
+	uint32_t height = 960;
+	EStereoFrameLayout layout = StereoHorizontalLayout;
+
+	// Key screen color in gamma space, like the MaskedKeyColor setting.
+	float keyColor[3] = { 0.15f, 0.7f, 0.25f };
+	uint32_t numObjects = 6;
+	// Brightness change of the screen across the view, as a fraction of the average.
+	float lightingGradient = 0.3f;
+	// Standard deviation of the sensor noise in 8-bit sRGB units.
+	float noiseSigma = 4.0f;
+	float exposureMS = 8.0f;
+	// Fraction of the key light reflected by the objects at their edges.
+	float spill = 0.15f;
+	float frameRate = 60.0f;
+	uint32_t seed = 1;
+};
+
+
+struct SyntheticFrame
+{
+	uint32_t index = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	EStereoFrameLayout layout = Mono;
+	// RGBA8 sRGB, like the camera frame buffers.
+	std::vector<uint8_t> image;
+	// Exact key alpha of each pixel before the noise: the visible fraction of the key screen,
+	// averaged over the pixel and the exposure. It matches the alpha the masked shaders compute.
+	std::vector<float> alpha;
+	// Scripted HMD pose in the tracking space at the middle of the exposure.
+	Matrix4 hmdPose;
+	Vector3 angularVelocity;
+};
+
+
+// Scripted head motion looking around the scene, in the tracking space.
+void GetSyntheticHMDPose(const float time, Matrix4& outPose, Vector3& outAngularVelocity);
+
+
+// Renders key screen test frames with known alpha: the screen is lit with a gradient, and moving
+// foreground objects pick up key spill near their edges. Head and object motion are blurred over the
+// exposure, and sensor noise is added. The scene is placed in angles around the viewer, with
+// small angle approximations, and the objects are offset between the views by their disparity.
+class SyntheticScene
+{
+public:
+
+	SyntheticScene(const SyntheticSceneParams& params);
+
+	void Render(WorkerPool& workerPool, const uint32_t index, SyntheticFrame& outFrame) const;
+
+private:
+
+	struct SceneObject
+	{
+		bool bBox;
+		// Center, swing amplitude and rate of the path in radians, and the size in radians.
+		float center[2];
+		float amplitude[2];
+		float rate[2];
+		float phase[2];
+		float size[2];
+		float depth;
+		float colorLinear[3];
+	};
+
+	// Object centers and head angles at one exposure sample.
+	struct ExposureSample
+	{
+		float headYaw;
+		float headPitch;
+		float objectCenters[2][SYNTHETIC_MAX_OBJECTS][2];
+	};
+
+	void RenderRows(const ExposureSample* samples, const uint32_t startRow, const uint32_t endRow, const uint32_t index, SyntheticFrame& outFrame) const;
+
+	SyntheticSceneParams m_params;
+	std::vector<SceneObject> m_objects;
+	float m_keyLinear[3];
+	float m_gradientDirection[2];
+	float m_linearToSRGB[4096];
+};
+
+
+// Generates the frames ahead of the consumer on a background thread, with the rows of each
+// frame split between the workers.
+class SyntheticFrameGenerator
+{
+public:
+
+	SyntheticFrameGenerator(const SyntheticSceneParams& params, const uint32_t numThreads);
+	~SyntheticFrameGenerator();
+
+	// Swaps the next frame in sequence into the given frame, waiting if it isn't finished yet.
+	// The buffers of the given frame are reused for a later frame.
+	void GetFrame(SyntheticFrame& inOutFrame);
+
+	float GetGenerateTimeMS() const { return m_generateTimeMS; }
+
+private:
+
+	void RunThread();
+
+	SyntheticScene m_scene;
+	WorkerPool m_workerPool;
+
+	std::thread m_thread;
+	std::mutex m_threadMutex;
+	std::condition_variable m_threadCondition;
+	bool m_bRunThread = true;
+
+	std::deque<SyntheticFrame> m_readyFrames;
+	std::vector<SyntheticFrame> m_freeFrames;
+	uint32_t m_nextIndex = 0;
+	std::atomic<float> m_generateTimeMS = 0.0f;
+};
@@ -0,0 +1,139 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "synthetic_frames.h"
+#include "key_mask.h"
+
+
+// Frames taken from the generator for each layout, and the largest 8-bit difference of the screen pixels from the lit key.
+#define SELF_TEST_GENERATOR_FRAMES 4
+#define SELF_TEST_SCREEN_COLOR_ERROR 2.0f
+
+
+// Checks the exact alpha of the synthetic frames without noise: the pixels with alpha 1 only show the lit
+// key, and the ones with alpha 0 don't key. The left view of both stereo layouts matches the mono frame.
+// Then takes noisy frames of each layout from the generator, keying them against the exact alpha.
+bool TestSyntheticFrames()
+{
+	WorkerPool workerPool(std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+	SyntheticSceneParams sceneParams = GetKeySceneParams();
+	sceneParams.noiseSigma = 0.0f;
+	KeyMaskParams keyParams = GetKeySceneMaskParams(sceneParams);
+	const float* toLinear = GetSRGBToLinearTable();
+
+	SyntheticScene monoScene(sceneParams);
+	SyntheticFrame monoFrame;
+	monoScene.Render(workerPool, 0, monoFrame);
+
+	// The screen pixels are the key scaled by the lighting, predicted here from the brightest channel.
+	int brightest = 0;
+	for (int c = 1; c < 3; c++)
+	{
+		if (keyParams.keyColor[c] > keyParams.keyColor[brightest]) { brightest = c; }
+	}
+
+	float screenColorError = 0.0f;
+	uint32_t numScreen = 0;
+	uint32_t numForeground = 0;
+	uint32_t numPartial = 0;
+	uint32_t numForegroundKeyed = 0;
+
+	for (size_t i = 0; i < monoFrame.alpha.size(); i++)
+	{
+		const uint8_t* pixel = &monoFrame.image[i * 4];
+		float rgb[3] = { toLinear[pixel[0]], toLinear[pixel[1]], toLinear[pixel[2]] };
+
+		if (monoFrame.alpha[i] == 1.0f)
+		{
+			numScreen++;
+			float light = rgb[brightest] / keyParams.keyColor[brightest];
+
+			for (int c = 0; c < 3; c++)
+			{
+				float value = std::min(keyParams.keyColor[c] * light, 1.0f);
+				float predicted = 255.0f * ((value <= 0.0031308f) ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f);
+				screenColorError = std::max(screenColorError, fabsf(predicted - pixel[c]));
+			}
+		}
+		else if (monoFrame.alpha[i] == 0.0f)
+		{
+			numForeground++;
+			numForegroundKeyed += EvaluateKeyAlpha(rgb, keyParams) > 0.0f;
+		}
+		else
+		{
+			numPartial++;
+		}
+	}
+
+	bool bViewsMatch = true;
+	const EStereoFrameLayout stereoLayouts[2] = { StereoHorizontalLayout, StereoVerticalLayout };
+
+	for (EStereoFrameLayout layout : stereoLayouts)
+	{
+		SyntheticSceneParams stereoParams = sceneParams;
+		stereoParams.layout = layout;
+		stereoParams.width *= (layout == StereoHorizontalLayout) ? 2 : 1;
+		stereoParams.height *= (layout == StereoVerticalLayout) ? 2 : 1;
+
+		SyntheticScene stereoScene(stereoParams);
+		SyntheticFrame stereoFrame;
+		stereoScene.Render(workerPool, 0, stereoFrame);
+
+		// The left view is at the left of the horizontal layout and at the bottom of the vertical one.
+		uint32_t offsetY = (layout == StereoVerticalLayout) ? sceneParams.height : 0;
+
+		for (uint32_t y = 0; y < sceneParams.height && bViewsMatch; y++)
+		{
+			size_t monoRow = (size_t)y * sceneParams.width;
+			size_t stereoRow = (size_t)(y + offsetY) * stereoParams.width;
+
+			bViewsMatch = memcmp(&monoFrame.image[monoRow * 4], &stereoFrame.image[stereoRow * 4], sceneParams.width * 4) == 0 &&
+				memcmp(&monoFrame.alpha[monoRow], &stereoFrame.alpha[stereoRow], sceneParams.width * sizeof(float)) == 0;
+		}
+	}
+
+	Log("Synthetic frames: %u screen pixels within %.2f of the lit key, %u foreground pixels with %u keyed, %u partial, left views %s the mono frame\n",
+		numScreen, screenColorError, numForeground, numForegroundKeyed, numPartial, bViewsMatch ? "match" : "DIFFER from");
+
+	const char* layoutNames[3] = { "mono", "stereo vertical", "stereo horizontal" };
+	bool bGeneratorPassed = true;
+
+	for (int layout = 0; layout < 3; layout++)
+	{
+		SyntheticSceneParams generatorParams = GetKeySceneParams();
+		generatorParams.layout = (EStereoFrameLayout)layout;
+		generatorParams.width *= (layout == StereoHorizontalLayout) ? 2 : 1;
+		generatorParams.height *= (layout == StereoVerticalLayout) ? 2 : 1;
+
+		SyntheticFrameGenerator generator(generatorParams, std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+		SyntheticFrame frame;
+		float minIoU = 1.0f;
+		float generateTimeMS = 0.0f;
+
+		for (uint32_t i = 0; i < SELF_TEST_GENERATOR_FRAMES; i++)
+		{
+			generator.GetFrame(frame);
+			generateTimeMS += generator.GetGenerateTimeMS();
+			bGeneratorPassed = bGeneratorPassed && frame.index == i && frame.layout == generatorParams.layout;
+
+			KeyMaskImage mask;
+			GenerateKeyMaskReference(frame.image.data(), frame.width, frame.height, keyParams, 1, mask);
+			minIoU = std::min(minIoU, GetKeyIoU(frame, mask.alpha));
+		}
+
+		generateTimeMS /= SELF_TEST_GENERATOR_FRAMES;
+
+		Log("Synthetic frames: %s %ux%u generated in %.2f ms (%.1f Mpix/s), key IoU at least %.3f against the exact alpha\n",
+			layoutNames[layout], generatorParams.width, generatorParams.height, generateTimeMS, (float)generatorParams.width * generatorParams.height / (generateTimeMS * 1000.0f), minIoU);
+
+		bGeneratorPassed = bGeneratorPassed && minIoU > 0.95f;
+	}
+
+	return numScreen > 0 && screenColorError <= SELF_TEST_SCREEN_COLOR_ERROR && numForeground > 0 && numForegroundKeyed == 0 && numPartial > 0 && bViewsMatch && bGeneratorPassed;
+}
+
+#endif
@@ -0,0 +1,130 @@
+"""Turns a flight recorder dump into a readable timeline.
+
+Usage: python decode_flight_recorder.py <dump.bin> [--thread <id>] [--last <seconds>]
+
+The dumps are written to %LOCALAPPDATA% when an error is logged, when a thread stalls,
+or when requested from the dashboard. The enums below mirror flight_recorder.h.
+"""
+
+import argparse
+import struct
+import sys
+
+FLIGHT_RECORDER_MAGIC = 0x52464C46
+FLIGHT_RECORDER_VERSION = 1
+
+HEADER_FORMAT = "<IIQQII"
+EVENT_FORMAT = "<QIHHIIQ"
+
+EVENT_TYPES = [
+    "None",
+    "ServeWake",
+    "FrameServed",
+    "RenderStart",
+    "RenderEnd",
+    "FrameSubmitted",
+    "OpenVRError",
+    "ConfigGeneration",
+    "ErrorLogged",
+    "Stall",
+    "DumpRequested",
+    "QualityTier",
+]
+
+EVENT_SOURCES = [
+    "None",
+    "FrameHeader",
+    "FrameTexture",
+    "FrameBuffer",
+    "OverlaySubmit",
+    "RenderThread",
+    "ServeThread",
+    "DashboardThread",
+]
+
+DUMP_REASONS = ["None", "Error", "Stall", "User"]
+
+QUALITY_TIERS = ["Full", "NoColorAdjustment", "ReducedDetail", "ReprojectOnly"]
+
+
+def lookup(names, value):
+    return names[value] if value < len(names) else str(value)
+
+
+def describe(event_type, data32, data64, timestamp, ticks_to_ms):
+    name = lookup(EVENT_TYPES, event_type)
+
+    if name in ("FrameServed", "RenderStart"):
+        latency = (timestamp - data64) * ticks_to_ms if data64 else 0.0
+        return "frame %u, %.2fms since exposure" % (data32, latency)
+    if name == "RenderEnd":
+        return "frame %u, %.2fms" % (data32, data64 * ticks_to_ms)
+    if name == "FrameSubmitted":
+        return "frame %u" % data32
+    if name == "OpenVRError":
+        return "error %i from %s" % (struct.unpack("<i", struct.pack("<I", data32))[0], lookup(EVENT_SOURCES, data64))
+    if name == "ConfigGeneration":
+        return "generation %u on %s" % (data64, lookup(EVENT_SOURCES, data32))
+    if name == "ErrorLogged":
+        return "format hash %08x" % data32
+    if name == "Stall":
+        return "%ums without a heartbeat from %s" % (data32, lookup(EVENT_SOURCES, data64))
+    if name == "DumpRequested":
+        return "reason %s" % lookup(DUMP_REASONS, data32)
+    if name == "QualityTier":
+        return "%s, was %s" % (lookup(QUALITY_TIERS, data32), lookup(QUALITY_TIERS, data64))
+    return ""
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a flight recorder dump.")
+    parser.add_argument("dump")
+    parser.add_argument("--thread", type=int, help="only show events from this thread id")
+    parser.add_argument("--last", type=float, help="only show events from the last seconds before the dump")
+    args = parser.parse_args()
+
+    with open(args.dump, "rb") as file:
+        data = file.read()
+
+    header_size = struct.calcsize(HEADER_FORMAT)
+    event_size = struct.calcsize(EVENT_FORMAT)
+
+    if len(data) < header_size:
+        sys.exit("File too small for a flight recorder dump")
+
+    magic, version, frequency, dump_time, reason, num_events = struct.unpack_from(HEADER_FORMAT, data, 0)
+
+    if magic != FLIGHT_RECORDER_MAGIC or version != FLIGHT_RECORDER_VERSION:
+        sys.exit("Not a flight recorder dump, or an unsupported version")
+
+    num_events = min(num_events, (len(data) - header_size) // event_size)
+    ticks_to_ms = 1000.0 / frequency
+
+    print("Dump reason: %s, %u events" % (lookup(DUMP_REASONS, reason), num_events))
+    print("%12s %8s %6s  %-17s %s" % ("time (ms)", "index", "thread", "event", "details"))
+
+    last_render_start = None
+
+    for i in range(num_events):
+        timestamp, index, event_type, _, thread_id, data32, data64 = struct.unpack_from(EVENT_FORMAT, data, header_size + i * event_size)
+
+        relative_ms = (timestamp - dump_time) * ticks_to_ms
+
+        if args.last is not None and relative_ms < -args.last * 1000.0:
+            continue
+        if args.thread is not None and thread_id != args.thread:
+            continue
+
+        details = describe(event_type, data32, data64, timestamp, ticks_to_ms)
+
+        # Highlight the gaps between rendered frames, which show up as stutter.
+        if lookup(EVENT_TYPES, event_type) == "RenderStart":
+            if last_render_start is not None:
+                details += ", %.2fms since last frame" % ((timestamp - last_render_start) * ticks_to_ms)
+            last_render_start = timestamp
+
+        print("%12.3f %8u %6u  %-17s %s" % (relative_ms, index, thread_id, lookup(EVENT_TYPES, event_type), details))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,401 @@
+
+#include "pch.h"
+#include "warp_mesh.h"
+#include <emmintrin.h>
+
+
+// Homography rows broadcast for evaluating four vertices at a time.
+// Each row holds the x, y and constant terms, with the clip space z and w both set to 1.
+struct HomographySIMD
+{
+	__m128 row[3][3];
+};
+
+
+inline HomographySIMD LoadHomographySIMD(const Matrix4& m)
+{
+	HomographySIMD h;
+	for (int i = 0; i < 3; i++)
+	{
+		h.row[i][0] = _mm_set1_ps(m[i]);
+		h.row[i][1] = _mm_set1_ps(m[4 + i]);
+		h.row[i][2] = _mm_set1_ps(m[8 + i] + m[12 + i]);
+	}
+	return h;
+}
+
+
+inline __m128 EvaluateHomographyRow(const __m128* row, const __m128 x, const __m128 y)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(row[0], x), _mm_mul_ps(row[1], y)), row[2]);
+}
+
+
+// Reciprocal that keeps the sign but avoids dividing by values close to zero.
+inline __m128 SafeReciprocal(const __m128 value)
+{
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	__m128 sign = _mm_and_ps(value, signMask);
+	__m128 magnitude = _mm_max_ps(_mm_andnot_ps(signMask, value), _mm_set1_ps(0.0001f));
+	return _mm_div_ps(_mm_set1_ps(1.0f), _mm_or_ps(magnitude, sign));
+}
+
+
+inline __m128 Clamp(const __m128 value, const __m128 minVal, const __m128 maxVal)
+{
+	return _mm_min_ps(_mm_max_ps(value, minVal), maxVal);
+}
+
+
+static float SampleDepthGrid(const DepthGrid& grid, const float clipU, const float clipV)
+{
+	// Same flip from clip space to image coordinates as in the pixel shaders. The eye spans
+	// half of the frame width there, while the grid only covers the eye.
+	float x = std::clamp((0.5f - 0.5f * clipU) * 2.0f, 0.0f, 1.0f) * (grid.width - 1);
+	float y = std::clamp(0.5f - 0.5f * clipV, 0.0f, 1.0f) * (grid.height - 1);
+
+	uint32_t x0 = std::min((uint32_t)x, grid.width - 1);
+	uint32_t y0 = std::min((uint32_t)y, grid.height - 1);
+	uint32_t x1 = std::min(x0 + 1, grid.width - 1);
+	uint32_t y1 = std::min(y0 + 1, grid.height - 1);
+	float fx = x - x0;
+	float fy = y - y0;
+
+	const float* depth = grid.depth.data();
+	float top = depth[y0 * grid.width + x0] * (1.0f - fx) + depth[y0 * grid.width + x1] * fx;
+	float bottom = depth[y1 * grid.width + x0] * (1.0f - fx) + depth[y1 * grid.width + x1] * fx;
+
+	return top * (1.0f - fy) + bottom * fy;
+}
+
+
+void GenerateWarpMesh(std::vector<WarpMeshVertex>& outMesh, const WarpMeshParams& params)
+{
+	const uint32_t cells = std::clamp(params.cells, 1u, (uint32_t)WARP_MESH_MAX_CELLS);
+	const uint32_t rowVertices = cells + 1;
+	const float cellSize = 2.0f / cells;
+
+	outMesh.resize(rowVertices * rowVertices);
+
+	HomographySIMD farPlane = LoadHomographySIMD(params.uvProjectionFar);
+	HomographySIMD nearPlane = LoadHomographySIMD(params.uvProjectionNear);
+
+	const bool bUseBands = params.bandProjections && params.numBands > 1;
+	const bool bUseDepth = params.depthGrid && params.depthGrid->width > 0 && params.depthGrid->height > 0 &&
+		params.depthGrid->depth.size() == params.depthGrid->width * params.depthGrid->height;
+
+	// Band homography coefficients for gathering per vertex.
+	float bandCoefs[ROLLING_SHUTTER_BANDS][9];
+	const uint32_t numBands = bUseBands ? std::min(params.numBands, (uint32_t)ROLLING_SHUTTER_BANDS) : 0;
+
+	for (uint32_t band = 0; band < numBands; band++)
+	{
+		const Matrix4& m = params.bandProjections[band];
+		for (int i = 0; i < 3; i++)
+		{
+			bandCoefs[band][i * 3 + 0] = m[i];
+			bandCoefs[band][i * 3 + 1] = m[4 + i];
+			bandCoefs[band][i * 3 + 2] = m[8 + i] + m[12 + i];
+		}
+	}
+
+	// The projected position of a point is interpolated linearly in inverse depth between the planes.
+	const float invFar = 1.0f / params.distanceFar;
+	const float invNear = 1.0f / params.distanceNear;
+	const float invRange = (fabsf(invNear - invFar) > 0.00001f) ? 1.0f / (invNear - invFar) : 0.0f;
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 laneOffsets = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+
+	alignas(16) float outX[4], outU[4], outV[4], outW[4];
+	alignas(16) float farU[4], farV[4];
+	alignas(16) float bandPos[4];
+
+	for (uint32_t y = 0; y < rowVertices; y++)
+	{
+		const __m128 posY = _mm_set1_ps(y * cellSize - 1.0f);
+
+		for (uint32_t x = 0; x < rowVertices; x += 4)
+		{
+			__m128 posX = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_set1_ps((float)x), laneOffsets), _mm_set1_ps(cellSize)), one);
+
+			__m128 farW = EvaluateHomographyRow(farPlane.row[2], posX, posY);
+			__m128 farRcp = SafeReciprocal(farW);
+			__m128 uFar = _mm_mul_ps(EvaluateHomographyRow(farPlane.row[0], posX, posY), farRcp);
+			__m128 vFar = _mm_mul_ps(EvaluateHomographyRow(farPlane.row[1], posX, posY), farRcp);
+
+			__m128 nearRcp = SafeReciprocal(EvaluateHomographyRow(nearPlane.row[2], posX, posY));
+			__m128 uNear = _mm_mul_ps(EvaluateHomographyRow(nearPlane.row[0], posX, posY), nearRcp);
+			__m128 vNear = _mm_mul_ps(EvaluateHomographyRow(nearPlane.row[1], posX, posY), nearRcp);
+
+			__m128 depthWeight = zero;
+
+			if (bUseDepth)
+			{
+				_mm_store_ps(farU, uFar);
+				_mm_store_ps(farV, vFar);
+
+				alignas(16) float weights[4];
+				for (int lane = 0; lane < 4; lane++)
+				{
+					float depth = std::clamp(SampleDepthGrid(*params.depthGrid, farU[lane], farV[lane]), params.distanceNear, params.distanceFar);
+					weights[lane] = (1.0f / depth - invFar) * invRange;
+				}
+				depthWeight = Clamp(_mm_load_ps(weights), zero, one);
+			}
+
+			__m128 u = _mm_add_ps(uFar, _mm_mul_ps(_mm_sub_ps(uNear, uFar), depthWeight));
+			__m128 v = _mm_add_ps(vFar, _mm_mul_ps(_mm_sub_ps(vNear, vFar), depthWeight));
+
+			if (bUseBands)
+			{
+				// Find the camera row the vertex maps to, using the same flip as the pixel shaders.
+				// The bands are centered on their rows, so the rows past the outer band centers extrapolate from the outer pair.
+				__m128 row = Clamp(_mm_sub_ps(half, _mm_mul_ps(half, vFar)), zero, one);
+				__m128 bandPosVec = _mm_sub_ps(_mm_mul_ps(row, _mm_set1_ps((float)numBands)), half);
+				_mm_store_ps(bandPos, bandPosVec);
+
+				alignas(16) float band0Coefs[9][4];
+				alignas(16) float band1Coefs[9][4];
+				alignas(16) float bandFactor[4];
+
+				for (int lane = 0; lane < 4; lane++)
+				{
+					uint32_t band0 = std::min((uint32_t)std::max(bandPos[lane], 0.0f), numBands - 2);
+					uint32_t band1 = band0 + 1;
+					bandFactor[lane] = bandPos[lane] - band0;
+
+					for (int i = 0; i < 9; i++)
+					{
+						band0Coefs[i][lane] = bandCoefs[band0][i];
+						band1Coefs[i][lane] = bandCoefs[band1][i];
+					}
+				}
+
+				__m128 band0Row[3][3];
+				__m128 band1Row[3][3];
+				for (int i = 0; i < 9; i++)
+				{
+					band0Row[i / 3][i % 3] = _mm_load_ps(band0Coefs[i]);
+					band1Row[i / 3][i % 3] = _mm_load_ps(band1Coefs[i]);
+				}
+
+				__m128 band0Rcp = SafeReciprocal(EvaluateHomographyRow(band0Row[2], posX, posY));
+				__m128 band1Rcp = SafeReciprocal(EvaluateHomographyRow(band1Row[2], posX, posY));
+				__m128 u0 = _mm_mul_ps(EvaluateHomographyRow(band0Row[0], posX, posY), band0Rcp);
+				__m128 v0 = _mm_mul_ps(EvaluateHomographyRow(band0Row[1], posX, posY), band0Rcp);
+				__m128 u1 = _mm_mul_ps(EvaluateHomographyRow(band1Row[0], posX, posY), band1Rcp);
+				__m128 v1 = _mm_mul_ps(EvaluateHomographyRow(band1Row[1], posX, posY), band1Rcp);
+
+				__m128 factor = _mm_load_ps(bandFactor);
+				__m128 uBand = _mm_add_ps(u0, _mm_mul_ps(_mm_sub_ps(u1, u0), factor));
+				__m128 vBand = _mm_add_ps(v0, _mm_mul_ps(_mm_sub_ps(v1, v0), factor));
+
+				// Rotation during readout shifts the image nearly independent of depth,
+				// so the far plane offset is applied to all depths.
+				u = _mm_add_ps(u, _mm_sub_ps(uBand, uFar));
+				v = _mm_add_ps(v, _mm_sub_ps(vBand, vFar));
+			}
+
+			// Keep the homogenous divisor of the far projection to retain perspective correct interpolation.
+			_mm_store_ps(outX, posX);
+			_mm_store_ps(outU, _mm_mul_ps(u, farW));
+			_mm_store_ps(outV, _mm_mul_ps(v, farW));
+			_mm_store_ps(outW, farW);
+
+			uint32_t numLanes = std::min(4u, rowVertices - x);
+			for (uint32_t lane = 0; lane < numLanes; lane++)
+			{
+				WarpMeshVertex& vertex = outMesh[y * rowVertices + x + lane];
+				vertex.position = Vector2(outX[lane], y * cellSize - 1.0f);
+				vertex.uvCoords = Vector3(outU[lane], outV[lane], outW[lane]);
+			}
+		}
+	}
+}
+
+
+void GenerateWarpMeshIndices(std::vector<uint16_t>& outIndices, const uint32_t cells)
+{
+	outIndices.resize(GetWarpMeshIndexCount(cells));
+
+	int index = 0;
+	for (uint32_t y = 0; y < cells; y++)
+	{
+		for (uint32_t x = 0; x < cells; x++)
+		{
+			uint16_t topLeft = (uint16_t)(y * (cells + 1) + x);
+			uint16_t topRight = topLeft + 1;
+			uint16_t bottomLeft = (uint16_t)(topLeft + (cells + 1));
+			uint16_t bottomRight = bottomLeft + 1;
+
+			outIndices[index++] = topLeft;
+			outIndices[index++] = bottomLeft;
+			outIndices[index++] = topRight;
+
+			outIndices[index++] = topRight;
+			outIndices[index++] = bottomLeft;
+			outIndices[index++] = bottomRight;
+		}
+	}
+}
+
+
+TargetRect GetWarpMeshCoverage(const std::vector<WarpMeshVertex>& mesh)
+{
+	const uint32_t cells = GetWarpMeshCells(mesh.size());
+	const uint32_t rowVertices = cells + 1;
+
+	TargetRect fullRect;
+	if (cells == 0) { return fullRect; }
+
+	float minX = 1.0f;
+	float minY = 1.0f;
+	float maxX = -1.0f;
+	float maxY = -1.0f;
+
+	for (uint32_t y = 0; y < cells; y++)
+	{
+		for (uint32_t x = 0; x < cells; x++)
+		{
+			const WarpMeshVertex* corners[4] =
+			{
+				&mesh[y * rowVertices + x],
+				&mesh[y * rowVertices + x + 1],
+				&mesh[(y + 1) * rowVertices + x],
+				&mesh[(y + 1) * rowVertices + x + 1]
+			};
+
+			float minU = FLT_MAX;
+			float minV = FLT_MAX;
+			float maxU = -FLT_MAX;
+			float maxV = -FLT_MAX;
+			bool bBehind = false;
+
+			for (const WarpMeshVertex* vertex : corners)
+			{
+				if (vertex->uvCoords.z <= 0.0f)
+				{
+					bBehind = true;
+					break;
+				}
+
+				// Same transform as the passthrough pixel shaders, without the clamp.
+				float u = vertex->uvCoords.x / vertex->uvCoords.z * -0.5f + 0.5f;
+				float v = vertex->uvCoords.y / vertex->uvCoords.z * -0.5f + 0.5f;
+
+				minU = std::min(minU, u);
+				minV = std::min(minV, v);
+				maxU = std::max(maxU, u);
+				maxV = std::max(maxV, v);
+			}
+
+			// With positive divisors the interpolated UVs stay within the bounds of the
+			// vertex UVs, so cells entirely to one side of the eye image are skipped.
+			// A divisor crossing zero inside the cell can wrap the UVs anywhere.
+			if (!bBehind && (maxU < 0.0f || minU > 0.5f || maxV < 0.0f || minV > 1.0f))
+			{
+				continue;
+			}
+
+			minX = std::min(minX, corners[0]->position.x);
+			minY = std::min(minY, corners[0]->position.y);
+			maxX = std::max(maxX, corners[3]->position.x);
+			maxY = std::max(maxY, corners[3]->position.y);
+		}
+	}
+
+	TargetRect rect;
+
+	if (maxX < minX || maxY < minY)
+	{
+		rect.left = rect.top = rect.right = rect.bottom = 0.0f;
+		return rect;
+	}
+
+	// Clip space y points up, while the target rows start at the top.
+	rect.left = minX * 0.5f + 0.5f;
+	rect.right = maxX * 0.5f + 0.5f;
+	rect.top = 0.5f - maxY * 0.5f;
+	rect.bottom = 0.5f - minY * 0.5f;
+
+	return rect;
+}
+
+
+ScissorRect GetCoverageScissor(const TargetRect& coverage, const uint32_t width, const uint32_t height)
+{
+	ScissorRect scissor;
+	scissor.left = (uint32_t)std::clamp(floorf(coverage.left * width), 0.0f, (float)width);
+	scissor.top = (uint32_t)std::clamp(floorf(coverage.top * height), 0.0f, (float)height);
+	scissor.right = (uint32_t)std::clamp(ceilf(coverage.right * width), (float)scissor.left, (float)width);
+	scissor.bottom = (uint32_t)std::clamp(ceilf(coverage.bottom * height), (float)scissor.top, (float)height);
+
+	return scissor;
+}
+
+
+void RenderWarpMeshReference(const std::vector<WarpMeshVertex>& mesh, const uint8_t* frameData, const uint32_t frameWidth, const uint32_t frameHeight, const Vector2& uvOffset, uint8_t* outImage, const uint32_t outWidth, const uint32_t outHeight, uint8_t* outCoverage)
+{
+	const uint32_t cells = GetWarpMeshCells(mesh.size());
+	const uint32_t rowVertices = cells + 1;
+
+	if (cells == 0 || frameWidth < 2 || frameHeight < 2) { return; }
+
+	for (uint32_t y = 0; y < outHeight; y++)
+	{
+		// Output rows start at the top, while the mesh rows start at the bottom of clip space.
+		float gridY = (1.0f - (y + 0.5f) / outHeight) * cells;
+		uint32_t cellY = std::min((uint32_t)gridY, cells - 1);
+		float fy = gridY - cellY;
+
+		for (uint32_t x = 0; x < outWidth; x++)
+		{
+			float gridX = (x + 0.5f) / outWidth * cells;
+			uint32_t cellX = std::min((uint32_t)gridX, cells - 1);
+			float fx = gridX - cellX;
+
+			const Vector3& uv00 = mesh[cellY * rowVertices + cellX].uvCoords;
+			const Vector3& uv10 = mesh[cellY * rowVertices + cellX + 1].uvCoords;
+			const Vector3& uv01 = mesh[(cellY + 1) * rowVertices + cellX].uvCoords;
+			const Vector3& uv11 = mesh[(cellY + 1) * rowVertices + cellX + 1].uvCoords;
+
+			// Same triangle split as GenerateWarpMeshIndices.
+			Vector3 uv = (fx + fy <= 1.0f) ?
+				uv00 + (uv10 - uv00) * fx + (uv01 - uv00) * fy :
+				uv11 + (uv01 - uv11) * (1.0f - fx) + (uv10 - uv11) * (1.0f - fy);
+
+			float w = (fabsf(uv.z) < 0.0001f) ? 0.0001f : uv.z;
+			float eyeU = uv.x / w * -0.5f + 0.5f;
+			float eyeV = uv.y / w * -0.5f + 0.5f;
+
+			if (outCoverage)
+			{
+				outCoverage[y * outWidth + x] = (eyeU >= 0.0f && eyeU <= 0.5f && eyeV >= 0.0f && eyeV <= 1.0f) ? 1 : 0;
+			}
+
+			float u = std::clamp(eyeU, 0.0f, 0.5f) + uvOffset.x;
+			float v = std::clamp(eyeV, 0.0f, 1.0f) + uvOffset.y;
+
+			float sampleX = std::clamp(u * frameWidth - 0.5f, 0.0f, frameWidth - 1.0f);
+			float sampleY = std::clamp(v * frameHeight - 0.5f, 0.0f, frameHeight - 1.0f);
+			uint32_t x0 = std::min((uint32_t)sampleX, frameWidth - 2);
+			uint32_t y0 = std::min((uint32_t)sampleY, frameHeight - 2);
+			float sfx = sampleX - x0;
+			float sfy = sampleY - y0;
+
+			const uint8_t* top = frameData + (y0 * frameWidth + x0) * 4;
+			const uint8_t* bottom = top + frameWidth * 4;
+			uint8_t* outPixel = outImage + (y * outWidth + x) * 4;
+
+			for (int c = 0; c < 4; c++)
+			{
+				float upper = top[c] + (top[c + 4] - top[c]) * sfx;
+				float lower = bottom[c] + (bottom[c + 4] - bottom[c]) * sfx;
+				outPixel[c] = (uint8_t)(upper + (lower - upper) * sfy + 0.5f);
+			}
+		}
+	}
+}
@@ -0,0 +1,71 @@
+
+#pragma once
+
+#include "shared_structs.h"
+
+
+#define WARP_MESH_DEFAULT_CELLS 32
+#define WARP_MESH_MAX_CELLS 64
+#define WARP_MESH_MAX_VERTICES ((WARP_MESH_MAX_CELLS + 1) * (WARP_MESH_MAX_CELLS + 1))
+
+#define ROLLING_SHUTTER_BANDS 8
+
+
+struct WarpMeshParams
+{
+	// Homographies from HMD clip space to camera clip space for the far and near projection planes.
+	Matrix4 uvProjectionFar;
+	Matrix4 uvProjectionNear;
+	float distanceFar = 5.0f;
+	float distanceNear = 1.0f;
+
+	// Optional per row band projections for the far plane, used for rolling shutter compensation.
+	const Matrix4* bandProjections = nullptr;
+	uint32_t numBands = 0;
+
+	// Optional scene depth in camera clip space, vertices default to the far plane without it.
+	const DepthGrid* depthGrid = nullptr;
+
+	uint32_t cells = WARP_MESH_DEFAULT_CELLS;
+};
+
+
+// Generates a clip space grid where each vertex holds the homogenous camera UVs.
+// The UVs are interpolated between the near and far planes in inverse depth,
+// and offset by the rolling shutter band the vertex lands on.
+void GenerateWarpMesh(std::vector<WarpMeshVertex>& outMesh, const WarpMeshParams& params);
+
+void GenerateWarpMeshIndices(std::vector<uint16_t>& outIndices, const uint32_t cells);
+
+struct ScissorRect
+{
+	uint32_t left;
+	uint32_t top;
+	uint32_t right;
+	uint32_t bottom;
+};
+
+
+// Conservative bounds of the render target pixels that sample inside the camera image of an eye.
+// Pixels outside only repeat the clamped image edge, and can be skipped with a scissor.
+TargetRect GetWarpMeshCoverage(const std::vector<WarpMeshVertex>& mesh);
+
+// Pixel bounds of the coverage in a target of the given size. The bounds are rounded outwards,
+// so all pixels with their centers inside are kept.
+ScissorRect GetCoverageScissor(const TargetRect& coverage, const uint32_t width, const uint32_t height);
+
+// Reference rasterizer for the passthrough draw, for checking meshes without a GPU.
+// Interpolates the mesh UVs the same way as the rasterizer and pixel shaders,
+// and bilinear samples the RGBA camera frame into the RGBA output image.
+// The optional coverage is set to 1 for the pixels sampling inside the eye image, and 0 for those clamped to its edge.
+void RenderWarpMeshReference(const std::vector<WarpMeshVertex>& mesh, const uint8_t* frameData, const uint32_t frameWidth, const uint32_t frameHeight, const Vector2& uvOffset, uint8_t* outImage, const uint32_t outWidth, const uint32_t outHeight, uint8_t* outCoverage = nullptr);
+
+inline uint32_t GetWarpMeshCells(const size_t numVertices)
+{
+	return (uint32_t)(sqrtf((float)numVertices) + 0.5f) - 1;
+}
+
+inline uint32_t GetWarpMeshIndexCount(const uint32_t cells)
+{
+	return cells * cells * 6;
+}
@@ -0,0 +1,449 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "warp_mesh.h"
+#include "stereo_depth.h"
+
+
+#define SELF_TEST_PI 3.14159265f
+
+// Size of each eye view in the synthetic camera frames and the rendered outputs.
+#define SELF_TEST_EYE_SIZE 256
+#define SELF_TEST_FOV_RADIANS (SELF_TEST_PI * 0.5f)
+
+// Vertical stripes over the field of view, their phase gives the horizontal shift of each row.
+#define SELF_TEST_STRIPE_PERIODS 8
+
+#define SELF_TEST_ANGULAR_VELOCITY 4.0f
+#define SELF_TEST_READOUT_MS 15.0f
+
+// Camera offset from the eye and the plane distances for the depth interpolation check, in meters.
+#define SELF_TEST_CAMERA_OFFSET 0.05f
+#define SELF_TEST_DISTANCE_NEAR 0.5f
+#define SELF_TEST_DISTANCE_FAR 5.0f
+
+#define SELF_TEST_BENCHMARK_ITERATIONS 200
+
+// Random head rotations between the camera and the eye view, up to the angle around each axis.
+#define SELF_TEST_SCISSOR_POSES 200
+#define SELF_TEST_SCISSOR_MAX_ANGLE (SELF_TEST_PI * 0.25f)
+#define SELF_TEST_SCISSOR_EYE_TAN 1.2f
+#define SELF_TEST_SCISSOR_CAMERA_TAN 1.0f
+
+
+// Homography from HMD clip space to the left eye camera clip space for a camera yawed by the angle.
+// The HMD and camera views share the field of view, and the small angle rotation is a horizontal shift.
+static Matrix4 GetYawProjection(const float angle)
+{
+	// The left eye spans half of the frame width.
+	const float radiansPerU = SELF_TEST_FOV_RADIANS / 0.5f;
+
+	Matrix4 projection;
+	projection[0] = -0.5f;
+	projection[12] = 0.5f + 2.0f * angle / radiansPerU;
+	return projection;
+}
+
+
+// Horizontal stereo frame of stripes at fixed azimuths, seen by a camera yawing at a constant rate.
+// Each row is exposed at its own time during the readout, starting from the top.
+static void RenderYawingFrame(std::vector<uint8_t>& outFrame, const float angularVelocity, const float readoutMS)
+{
+	const uint32_t width = SELF_TEST_EYE_SIZE * 2;
+	const uint32_t height = SELF_TEST_EYE_SIZE;
+	const float radiansPerU = SELF_TEST_FOV_RADIANS / 0.5f;
+	const float stripeFrequency = 2.0f * SELF_TEST_PI * SELF_TEST_STRIPE_PERIODS / SELF_TEST_FOV_RADIANS;
+
+	outFrame.resize(width * height * 4);
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		float time = ((y + 0.5f) / height - 0.5f) * readoutMS * 0.001f;
+
+		for (uint32_t x = 0; x < width; x++)
+		{
+			float azimuth = ((x + 0.5f) / width - 0.25f) * radiansPerU + angularVelocity * time;
+			uint8_t value = (uint8_t)(128.0f + 100.0f * sinf(azimuth * stripeFrequency) + 0.5f);
+
+			uint8_t* pixel = &outFrame[(y * width + x) * 4];
+			pixel[0] = pixel[1] = pixel[2] = value;
+			pixel[3] = 255;
+		}
+	}
+}
+
+
+// Horizontal position of the stripes on each row of an eye image in pixels, from the phase of the stripe frequency.
+static void MeasureStripeShifts(const std::vector<uint8_t>& image, std::vector<float>& outShifts)
+{
+	const uint32_t size = SELF_TEST_EYE_SIZE;
+	outShifts.resize(size);
+
+	for (uint32_t y = 0; y < size; y++)
+	{
+		double sumSin = 0.0;
+		double sumCos = 0.0;
+
+		for (uint32_t x = 0; x < size; x++)
+		{
+			double phase = 2.0 * SELF_TEST_PI * SELF_TEST_STRIPE_PERIODS * (x + 0.5) / size;
+			sumSin += image[(y * size + x) * 4] * sin(phase);
+			sumCos += image[(y * size + x) * 4] * cos(phase);
+		}
+
+		outShifts[y] = (float)(atan2(sumSin, sumCos) / (2.0 * SELF_TEST_PI)) * size / SELF_TEST_STRIPE_PERIODS;
+	}
+}
+
+
+// Largest difference in the horizontal shift between the rows of the image and the reference.
+static float GetResidualShear(const std::vector<float>& shifts, const std::vector<float>& referenceShifts)
+{
+	const float period = (float)SELF_TEST_EYE_SIZE / SELF_TEST_STRIPE_PERIODS;
+	float minShift = FLT_MAX;
+	float maxShift = -FLT_MAX;
+
+	for (size_t y = 0; y < shifts.size(); y++)
+	{
+		float shift = shifts[y] - referenceShifts[y];
+		shift -= period * floorf(shift / period + 0.5f);
+
+		minShift = std::min(minShift, shift);
+		maxShift = std::max(maxShift, shift);
+	}
+
+	return maxShift - minShift;
+}
+
+
+// A yawing camera with a rolling shutter shears vertical stripes. The band projections of the warp
+// mesh should straighten them back to the global shutter image.
+bool TestRollingShutterShear()
+{
+	const uint32_t frameWidth = SELF_TEST_EYE_SIZE * 2;
+	const uint32_t frameHeight = SELF_TEST_EYE_SIZE;
+	const Vector2 uvOffset(0.0f, 0.0f);
+
+	std::vector<uint8_t> globalFrame;
+	std::vector<uint8_t> rollingFrame;
+	RenderYawingFrame(globalFrame, SELF_TEST_ANGULAR_VELOCITY, 0.0f);
+	RenderYawingFrame(rollingFrame, SELF_TEST_ANGULAR_VELOCITY, SELF_TEST_READOUT_MS);
+
+	Matrix4 bandProjections[ROLLING_SHUTTER_BANDS];
+	for (uint32_t band = 0; band < ROLLING_SHUTTER_BANDS; band++)
+	{
+		float time = ((band + 0.5f) / ROLLING_SHUTTER_BANDS - 0.5f) * SELF_TEST_READOUT_MS * 0.001f;
+		bandProjections[band] = GetYawProjection(SELF_TEST_ANGULAR_VELOCITY * time);
+	}
+
+	WarpMeshParams params;
+	params.uvProjectionFar = GetYawProjection(0.0f);
+	params.uvProjectionNear = params.uvProjectionFar;
+
+	std::vector<WarpMeshVertex> mesh;
+	std::vector<WarpMeshVertex> bandMesh;
+	GenerateWarpMesh(mesh, params);
+
+	params.bandProjections = bandProjections;
+	params.numBands = ROLLING_SHUTTER_BANDS;
+	GenerateWarpMesh(bandMesh, params);
+
+	std::vector<uint8_t> image(SELF_TEST_EYE_SIZE * SELF_TEST_EYE_SIZE * 4);
+	std::vector<float> referenceShifts;
+	std::vector<float> shifts;
+
+	RenderWarpMeshReference(mesh, globalFrame.data(), frameWidth, frameHeight, uvOffset, image.data(), SELF_TEST_EYE_SIZE, SELF_TEST_EYE_SIZE);
+	MeasureStripeShifts(image, referenceShifts);
+
+	RenderWarpMeshReference(mesh, rollingFrame.data(), frameWidth, frameHeight, uvOffset, image.data(), SELF_TEST_EYE_SIZE, SELF_TEST_EYE_SIZE);
+	MeasureStripeShifts(image, shifts);
+	float uncompensatedShear = GetResidualShear(shifts, referenceShifts);
+
+	RenderWarpMeshReference(bandMesh, rollingFrame.data(), frameWidth, frameHeight, uvOffset, image.data(), SELF_TEST_EYE_SIZE, SELF_TEST_EYE_SIZE);
+	MeasureStripeShifts(image, shifts);
+	float compensatedShear = GetResidualShear(shifts, referenceShifts);
+
+	// Rotation between the first and last row, in output pixels.
+	float expectedShear = SELF_TEST_ANGULAR_VELOCITY * SELF_TEST_READOUT_MS * 0.001f * (frameHeight - 1) / frameHeight * SELF_TEST_EYE_SIZE / SELF_TEST_FOV_RADIANS;
+
+	Log("Rolling shutter shear: %.2f px uncompensated (%.2f px expected), %.2f px with %u bands\n", uncompensatedShear, expectedShear, compensatedShear, ROLLING_SHUTTER_BANDS);
+
+	return fabsf(uncompensatedShear - expectedShear) < expectedShear * 0.1f &&
+		compensatedShear < 0.5f && compensatedShear < uncompensatedShear * 0.1f;
+}
+
+
+// Homography from HMD clip space to the left eye camera clip space for points at the distance,
+// with the camera offset sideways from the eye. The views share a 90 degree field of view.
+static Matrix4 GetParallaxProjection(const float distance)
+{
+	Matrix4 projection;
+	projection[0] = -0.5f;
+	projection[12] = 0.5f + 0.5f * SELF_TEST_CAMERA_OFFSET / distance;
+	return projection;
+}
+
+
+// Inverse depth of a plane tilted in both directions, over the eye image coordinates.
+// Inverse depth is linear over the image for any plane.
+static float GetTiltedPlaneInverseDepth(const float x, const float y)
+{
+	const float invNear = 1.0f / SELF_TEST_DISTANCE_NEAR;
+	const float invFar = 1.0f / SELF_TEST_DISTANCE_FAR;
+	return invFar + (invNear - invFar) * (0.1f + 0.6f * x + 0.2f * y);
+}
+
+
+static void GetTiltedPlaneDepthGrid(DepthGrid& outGrid, const uint32_t width, const uint32_t height)
+{
+	outGrid.width = width;
+	outGrid.height = height;
+	outGrid.depth.resize(width * height);
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			outGrid.depth[y * width + x] = 1.0f / GetTiltedPlaneInverseDepth((float)x / (width - 1), (float)y / (height - 1));
+		}
+	}
+}
+
+
+// Camera clip space u of the point on the plane seen along the eye ray with the far plane u at the
+// given offset, and at the eye image row. Iterated since the depth depends on the solved position.
+static float GetTiltedPlaneCameraU(const float rayU, const float row)
+{
+	float u = rayU;
+	for (int i = 0; i < 20; i++)
+	{
+		u = rayU + 0.5f * SELF_TEST_CAMERA_OFFSET * GetTiltedPlaneInverseDepth(1.0f - u, row);
+	}
+	return u;
+}
+
+
+// The mesh UVs for a tilted plane should land where the offset camera sees the plane.
+// The plane depth varies across the whole eye, so sampling the grid at the wrong place shows up
+// as parallax errors. The mesh samples the depth at the far plane position of each vertex,
+// which leaves a small error where the depth changes over the parallax.
+bool TestTiltedPlaneDepth()
+{
+	// Pixels per camera clip space unit, the eye spans u from 0 to 1.
+	const float eyeWidth = 640.0f;
+
+	DepthGrid grid;
+	GetTiltedPlaneDepthGrid(grid, STEREO_DEPTH_GRID_WIDTH, STEREO_DEPTH_GRID_HEIGHT);
+
+	WarpMeshParams params;
+	params.uvProjectionFar = GetParallaxProjection(SELF_TEST_DISTANCE_FAR);
+	params.uvProjectionNear = GetParallaxProjection(SELF_TEST_DISTANCE_NEAR);
+	params.distanceFar = SELF_TEST_DISTANCE_FAR;
+	params.distanceNear = SELF_TEST_DISTANCE_NEAR;
+	params.depthGrid = &grid;
+
+	std::vector<WarpMeshVertex> mesh;
+	GenerateWarpMesh(mesh, params);
+
+	float maxError = 0.0f;
+	float maxSamplingError = 0.0f;
+	float maxParallax = 0.0f;
+
+	for (const WarpMeshVertex& vertex : mesh)
+	{
+		float u = vertex.uvCoords.x / vertex.uvCoords.z;
+		float row = 0.5f - 0.5f * vertex.uvCoords.y / vertex.uvCoords.z;
+
+		float rayU = 0.5f - 0.5f * vertex.position.x;
+		float farU = rayU + 0.5f * SELF_TEST_CAMERA_OFFSET / SELF_TEST_DISTANCE_FAR;
+		float expectedU = GetTiltedPlaneCameraU(rayU, row);
+
+		if (expectedU < 0.0f || expectedU > 1.0f) { continue; }
+
+		// The error expected from sampling the depth at the far plane position instead of the solved one.
+		float sampledU = rayU + 0.5f * SELF_TEST_CAMERA_OFFSET * GetTiltedPlaneInverseDepth(1.0f - farU, row);
+
+		maxError = std::max(maxError, fabsf(expectedU - u) * eyeWidth);
+		maxSamplingError = std::max(maxSamplingError, fabsf(expectedU - sampledU) * eyeWidth);
+		maxParallax = std::max(maxParallax, fabsf(expectedU - farU) * eyeWidth);
+	}
+
+	Log("Tilted plane depth: max error %.3f px, %.3f px expected from the depth sampling, %.2f px parallax at the far plane\n", maxError, maxSamplingError, maxParallax);
+
+	return maxError < maxSamplingError + 0.05f && maxError < maxParallax * 0.1f;
+}
+
+
+// Homography from HMD clip space to the left eye camera clip space for a camera rotated from the eye view
+// by the yaw, pitch and roll, for points far enough away for the offset between them not to matter.
+static Matrix4 GetRotatedProjection(const float yaw, const float pitch, const float roll)
+{
+	const float cy = cosf(yaw), sy = sinf(yaw);
+	const float cp = cosf(pitch), sp = sinf(pitch);
+	const float cr = cosf(roll), sr = sinf(roll);
+
+	// Rows of the rotation from the eye view to the camera view, yaw around y, then pitch around x, then roll around z.
+	const float rotation[3][3] =
+	{
+		{ cr * cy + sr * sp * sy, -sr * cp, -cr * sy + sr * sp * cy },
+		{ sr * cy - cr * sp * sy, cr * cp, -sr * sy - cr * sp * cy },
+		{ cp * sy, sp, cp * cy },
+	};
+
+	// The eye ray of a clip space position is (x * tan, y * tan, -1). The eye image spans the clip space u
+	// from 0 to 1 with u flipped, and v from -1 to 1, divided by the depth in front of the camera.
+	float rayRows[3][3];
+	for (int i = 0; i < 3; i++)
+	{
+		rayRows[i][0] = rotation[i][0] * SELF_TEST_SCISSOR_EYE_TAN;
+		rayRows[i][1] = rotation[i][1] * SELF_TEST_SCISSOR_EYE_TAN;
+		rayRows[i][2] = -rotation[i][2];
+	}
+
+	Matrix4 projection;
+	for (int column = 0; column < 3; column++)
+	{
+		float x = rayRows[0][column];
+		float y = rayRows[1][column];
+		float z = rayRows[2][column];
+
+		projection[column * 4 + 0] = (-z - x / SELF_TEST_SCISSOR_CAMERA_TAN) * 0.5f;
+		projection[column * 4 + 1] = y / SELF_TEST_SCISSOR_CAMERA_TAN;
+		projection[column * 4 + 2] = -z;
+		projection[column * 4 + 3] = 0.0f;
+	}
+
+	// The mesh evaluates the constant terms with both the clip space z and w set to 1.
+	for (int i = 0; i < 4; i++)
+	{
+		projection[12 + i] = 0.0f;
+	}
+
+	return projection;
+}
+
+
+// Every pixel the reference rasterizer samples inside the eye image should be inside the rounded scissor
+// from the mesh coverage, over random head poses. Also reports the fraction of the target skipped by the scissor.
+bool TestWarpMeshScissorCoverage()
+{
+	const uint32_t frameWidth = SELF_TEST_EYE_SIZE * 2;
+	const uint32_t frameHeight = SELF_TEST_EYE_SIZE;
+	const Vector2 uvOffset(0.0f, 0.0f);
+
+	std::vector<uint8_t> frame(frameWidth * frameHeight * 4, 128);
+	std::vector<uint8_t> image(SELF_TEST_EYE_SIZE * SELF_TEST_EYE_SIZE * 4);
+	std::vector<uint8_t> coverage(SELF_TEST_EYE_SIZE * SELF_TEST_EYE_SIZE);
+	std::vector<WarpMeshVertex> mesh;
+
+	uint32_t seed = 1;
+	uint32_t numMissedPixels = 0;
+	uint32_t numFailedPoses = 0;
+	double skippedFractionSum = 0.0;
+	double uncoveredFractionSum = 0.0;
+
+	for (uint32_t pose = 0; pose < SELF_TEST_SCISSOR_POSES; pose++)
+	{
+		float angles[3];
+		for (float& angle : angles)
+		{
+			angle = ((NextRandom(seed) / (float)(1 << 24)) * 2.0f - 1.0f) * SELF_TEST_SCISSOR_MAX_ANGLE;
+		}
+
+		WarpMeshParams params;
+		params.uvProjectionFar = GetRotatedProjection(angles[0], angles[1], angles[2]);
+		params.uvProjectionNear = params.uvProjectionFar;
+		GenerateWarpMesh(mesh, params);
+
+		ScissorRect scissor = GetCoverageScissor(GetWarpMeshCoverage(mesh), SELF_TEST_EYE_SIZE, SELF_TEST_EYE_SIZE);
+		RenderWarpMeshReference(mesh, frame.data(), frameWidth, frameHeight, uvOffset, image.data(), SELF_TEST_EYE_SIZE, SELF_TEST_EYE_SIZE, coverage.data());
+
+		uint32_t missedPixels = 0;
+		uint32_t uncoveredPixels = 0;
+
+		for (uint32_t y = 0; y < SELF_TEST_EYE_SIZE; y++)
+		{
+			for (uint32_t x = 0; x < SELF_TEST_EYE_SIZE; x++)
+			{
+				if (!coverage[y * SELF_TEST_EYE_SIZE + x])
+				{
+					uncoveredPixels++;
+				}
+				else if (x < scissor.left || x >= scissor.right || y < scissor.top || y >= scissor.bottom)
+				{
+					missedPixels++;
+				}
+			}
+		}
+
+		if (missedPixels > 0)
+		{
+			numFailedPoses++;
+		}
+
+		numMissedPixels += missedPixels;
+
+		const float numPixels = (float)(SELF_TEST_EYE_SIZE * SELF_TEST_EYE_SIZE);
+		skippedFractionSum += 1.0f - (scissor.right - scissor.left) * (scissor.bottom - scissor.top) / numPixels;
+		uncoveredFractionSum += uncoveredPixels / numPixels;
+	}
+
+	Log("Warp mesh scissor: %u pixels outside the scissor over %u of %u poses, %.1f%% skipped on average, %.1f%% not sampling the image\n",
+		numMissedPixels, numFailedPoses, SELF_TEST_SCISSOR_POSES, skippedFractionSum * 100.0 / SELF_TEST_SCISSOR_POSES, uncoveredFractionSum * 100.0 / SELF_TEST_SCISSOR_POSES);
+
+	return numMissedPixels == 0 && skippedFractionSum > 0.0;
+}
+
+
+// Mesh generation time over the grid sizes, with a full size depth grid and the rolling shutter bands.
+bool BenchmarkWarpMesh()
+{
+	DepthGrid grid;
+	GetTiltedPlaneDepthGrid(grid, STEREO_DEPTH_GRID_WIDTH, STEREO_DEPTH_GRID_HEIGHT);
+
+	Matrix4 bandProjections[ROLLING_SHUTTER_BANDS];
+	for (uint32_t band = 0; band < ROLLING_SHUTTER_BANDS; band++)
+	{
+		bandProjections[band] = GetYawProjection(0.001f * band);
+	}
+
+	WarpMeshParams params;
+	params.uvProjectionFar = GetParallaxProjection(SELF_TEST_DISTANCE_FAR);
+	params.uvProjectionNear = GetParallaxProjection(SELF_TEST_DISTANCE_NEAR);
+	params.distanceFar = SELF_TEST_DISTANCE_FAR;
+	params.distanceNear = SELF_TEST_DISTANCE_NEAR;
+
+	std::vector<WarpMeshVertex> mesh;
+
+	for (uint32_t cells = 8; cells <= WARP_MESH_MAX_CELLS; cells *= 2)
+	{
+		params.cells = cells;
+		float times[3];
+
+		for (int mode = 0; mode < 3; mode++)
+		{
+			params.depthGrid = (mode >= 1) ? &grid : nullptr;
+			params.bandProjections = (mode >= 2) ? bandProjections : nullptr;
+			params.numBands = (mode >= 2) ? ROLLING_SHUTTER_BANDS : 0;
+
+			LARGE_INTEGER startTime;
+			QueryPerformanceCounter(&startTime);
+
+			for (int i = 0; i < SELF_TEST_BENCHMARK_ITERATIONS; i++)
+			{
+				GenerateWarpMesh(mesh, params);
+			}
+
+			times[mode] = GetElapsedMS(startTime) * 1000.0f / SELF_TEST_BENCHMARK_ITERATIONS;
+		}
+
+		Log("Warp mesh %ux%u cells: %.1f us planes only, %.1f us with depth, %.1f us with depth and bands\n", cells, cells, times[0], times[1], times[2]);
+	}
+
+	return true;
+}
+
+#endif
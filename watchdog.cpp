@@ -0,0 +1,205 @@
+
+#include "pch.h"
+#include "watchdog.h"
+#include "logging.h"
+#include "flight_recorder.h"
+
+
+static const char* g_sourceNames[WatchdogSource_Count] = { "Frame serving", "Render", "Dashboard" };
+static const uint32_t g_sourceStallMS[WatchdogSource_Count] = { WATCHDOG_STALL_MS_SERVE, WATCHDOG_STALL_MS_RENDER, WATCHDOG_STALL_MS_DASHBOARD };
+static const EFlightEventSource g_sourceFlightSources[WatchdogSource_Count] = { FlightSource_ServeThread, FlightSource_RenderThread, FlightSource_DashboardThread };
+
+static const char* g_qualityTierNames[QualityTier_Count] = { "full quality", "no color adjustment", "reduced detail", "reprojection only" };
+
+
+Watchdog::Watchdog(const bool bStartThread)
+{
+	for (int i = 0; i < WatchdogSource_Count; i++)
+	{
+		m_lastHeartbeat[i] = 0;
+		m_bSourceActive[i] = false;
+	}
+
+	if (bStartThread)
+	{
+		m_thread = std::thread(&Watchdog::RunThread, this);
+	}
+}
+
+Watchdog::~Watchdog()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_bRunThread = false;
+	}
+	m_threadCondition.notify_all();
+
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+
+void Watchdog::Heartbeat(const EWatchdogSource source)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	m_lastHeartbeat[source].store(now.QuadPart, std::memory_order_relaxed);
+	m_bSourceActive[source].store(true, std::memory_order_release);
+}
+
+void Watchdog::SetSourceInactive(const EWatchdogSource source)
+{
+	m_bSourceActive[source].store(false, std::memory_order_release);
+}
+
+
+void Watchdog::ReportFrame(const float processingTimeMS, const float budgetMS, const bool bMissedFence)
+{
+	bool bOverrun = bMissedFence || processingTimeMS > budgetMS;
+
+	m_budgetMS.store(budgetMS, std::memory_order_relaxed);
+	m_intervalFrameTimeUS.fetch_add((uint64_t)(processingTimeMS * 1000.0f), std::memory_order_relaxed);
+	m_intervalFrames.fetch_add(1, std::memory_order_relaxed);
+	m_numFrames.fetch_add(1, std::memory_order_relaxed);
+
+	if (bOverrun)
+	{
+		m_intervalOverruns.fetch_add(1, std::memory_order_relaxed);
+		m_numOverruns.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+
+void Watchdog::GetStats(WatchdogStats& outStats) const
+{
+	outStats.qualityTier = m_qualityTier.load(std::memory_order_relaxed);
+	outStats.numTierChanges = m_numTierChanges.load(std::memory_order_relaxed);
+	outStats.numStalls = m_numStalls.load(std::memory_order_relaxed);
+	outStats.numOverruns = m_numOverruns.load(std::memory_order_relaxed);
+	outStats.numFrames = m_numFrames.load(std::memory_order_relaxed);
+}
+
+
+void Watchdog::RunThread()
+{
+	LARGE_INTEGER perfFrequency;
+	QueryPerformanceFrequency(&perfFrequency);
+
+	std::unique_lock<std::mutex> lock(m_threadMutex);
+
+	while (!m_threadCondition.wait_for(lock, WATCHDOG_CHECK_INTERVAL, [this] { return !m_bRunThread; }))
+	{
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+
+		CheckHeartbeats(now.QuadPart, perfFrequency.QuadPart);
+		EvaluateQuality();
+	}
+}
+
+
+// Stalls are reported once when they are detected and once when the thread recovers.
+void Watchdog::CheckHeartbeats(const LONGLONG now, const LONGLONG perfFrequency)
+{
+	for (int i = 0; i < WatchdogSource_Count; i++)
+	{
+		if (!m_bSourceActive[i].load(std::memory_order_acquire))
+		{
+			m_bSourceStalled[i] = false;
+			continue;
+		}
+
+		LONGLONG lastHeartbeat = m_lastHeartbeat[i].load(std::memory_order_relaxed);
+		uint32_t sinceHeartbeatMS = (now > lastHeartbeat) ? (uint32_t)((now - lastHeartbeat) * 1000 / perfFrequency) : 0;
+
+		if (sinceHeartbeatMS > g_sourceStallMS[i])
+		{
+			if (!m_bSourceStalled[i])
+			{
+				m_bSourceStalled[i] = true;
+				m_numStalls++;
+
+				RecordFlightEvent(FlightEvent_Stall, sinceHeartbeatMS, g_sourceFlightSources[i]);
+				Log("Watchdog: %s thread stalled, no heartbeat for %ums\n", g_sourceNames[i], sinceHeartbeatMS);
+				RequestFlightRecorderDump(FlightDump_Stall);
+			}
+		}
+		else if (m_bSourceStalled[i])
+		{
+			m_bSourceStalled[i] = false;
+			Log("Watchdog: %s thread recovered\n", g_sourceNames[i]);
+		}
+	}
+}
+
+
+// Steps the quality down on repeated overruns within the window, and back up one tier
+// at a time once frames have been comfortably within budget for a while.
+void Watchdog::EvaluateQuality()
+{
+	uint32_t frames = m_intervalFrames.exchange(0, std::memory_order_relaxed);
+	uint32_t overruns = m_intervalOverruns.exchange(0, std::memory_order_relaxed);
+	uint64_t frameTimeUS = m_intervalFrameTimeUS.exchange(0, std::memory_order_relaxed);
+	float budgetMS = m_budgetMS.load(std::memory_order_relaxed);
+
+	// Nothing is rendered while passthrough is off, keep the current tier.
+	if (frames == 0)
+	{
+		return;
+	}
+
+	m_windowOverruns[m_windowIndex] = overruns;
+	m_windowIndex = (m_windowIndex + 1) % WATCHDOG_DEGRADE_WINDOW_CHECKS;
+
+	uint32_t windowOverruns = 0;
+	for (uint32_t count : m_windowOverruns)
+	{
+		windowOverruns += count;
+	}
+
+	EQualityTier tier = m_qualityTier.load(std::memory_order_relaxed);
+
+	if (windowOverruns >= WATCHDOG_DEGRADE_OVERRUNS)
+	{
+		m_checksWithHeadroom = 0;
+
+		if (tier + 1 < QualityTier_Count)
+		{
+			SetQualityTier((EQualityTier)(tier + 1), "frame budget overruns");
+
+			// Give the lower tier a full window to take effect before judging it.
+			memset(m_windowOverruns, 0, sizeof(m_windowOverruns));
+		}
+		return;
+	}
+
+	float averageFrameMS = frameTimeUS / 1000.0f / frames;
+
+	if (overruns == 0 && averageFrameMS < budgetMS * WATCHDOG_RECOVER_BUDGET_FRACTION)
+	{
+		m_checksWithHeadroom++;
+	}
+	else
+	{
+		m_checksWithHeadroom = 0;
+	}
+
+	if (m_checksWithHeadroom >= WATCHDOG_RECOVER_CHECKS && tier > QualityTier_Full)
+	{
+		m_checksWithHeadroom = 0;
+		SetQualityTier((EQualityTier)(tier - 1), "headroom available");
+	}
+}
+
+
+void Watchdog::SetQualityTier(const EQualityTier tier, const char* reason)
+{
+	EQualityTier previousTier = m_qualityTier.exchange(tier, std::memory_order_relaxed);
+	m_numTierChanges++;
+
+	RecordFlightEvent(FlightEvent_QualityTier, tier, previousTier);
+	Log("Watchdog: Quality changed from %s to %s, %s\n", g_qualityTierNames[previousTier], g_qualityTierNames[tier], reason);
+}
@@ -0,0 +1,108 @@
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+
+#define WATCHDOG_CHECK_INTERVAL (std::chrono::milliseconds(100))
+
+// Time without a heartbeat after which a thread is considered stalled.
+#define WATCHDOG_STALL_MS_SERVE 500
+#define WATCHDOG_STALL_MS_RENDER 250
+#define WATCHDOG_STALL_MS_DASHBOARD 1000
+
+// The quality is stepped down when this many frames overrun the budget within the window.
+#define WATCHDOG_DEGRADE_OVERRUNS 3
+#define WATCHDOG_DEGRADE_WINDOW_CHECKS 5
+
+// The quality is stepped up after this many checks in a row without overruns and with the
+// average frame time below the fraction of the budget.
+#define WATCHDOG_RECOVER_CHECKS 20
+#define WATCHDOG_RECOVER_BUDGET_FRACTION 0.6f
+
+
+enum EWatchdogSource
+{
+	WatchdogSource_Serve = 0,
+	WatchdogSource_Render,
+	WatchdogSource_Dashboard,
+	WatchdogSource_Count
+};
+
+// Each tier includes the reductions of the tiers above it.
+enum EQualityTier : uint32_t
+{
+	QualityTier_Full = 0,
+	QualityTier_NoColorAdjustment,
+	QualityTier_ReducedDetail,
+	QualityTier_ReprojectOnly,
+	QualityTier_Count
+};
+
+
+struct WatchdogStats
+{
+	EQualityTier qualityTier;
+	uint32_t numTierChanges;
+	uint32_t numStalls;
+	uint32_t numOverruns;
+	uint64_t numFrames;
+};
+
+
+class Watchdog
+{
+public:
+
+	// Without the thread nothing is monitored until EvaluateQuality is called by the owner.
+	Watchdog(const bool bStartThread = true);
+	~Watchdog();
+
+	// Marks the source alive. A source is monitored from its first heartbeat until it is set inactive.
+	void Heartbeat(const EWatchdogSource source);
+	void SetSourceInactive(const EWatchdogSource source);
+
+	// Called by the render loop for every rendered frame, with the CPU time spent before waiting for the compositor.
+	void ReportFrame(const float processingTimeMS, const float budgetMS, const bool bMissedFence);
+
+	EQualityTier GetQualityTier() const { return m_qualityTier.load(std::memory_order_relaxed); }
+	void GetStats(WatchdogStats& outStats) const;
+
+	// Collects the frames reported since the last call and adjusts the quality tier.
+	// Called by the watchdog thread every check, and must only be called directly on an instance without it.
+	void EvaluateQuality();
+
+private:
+
+	void RunThread();
+	void CheckHeartbeats(const LONGLONG now, const LONGLONG perfFrequency);
+	void SetQualityTier(const EQualityTier tier, const char* reason);
+
+	std::thread m_thread;
+	std::mutex m_threadMutex;
+	std::condition_variable m_threadCondition;
+	bool m_bRunThread = true;
+
+	std::atomic<LONGLONG> m_lastHeartbeat[WatchdogSource_Count];
+	std::atomic_bool m_bSourceActive[WatchdogSource_Count];
+	bool m_bSourceStalled[WatchdogSource_Count] = {};
+
+	// Written by the render loop, collected by the watchdog thread on every check.
+	std::atomic<uint32_t> m_intervalFrames = 0;
+	std::atomic<uint32_t> m_intervalOverruns = 0;
+	std::atomic<uint64_t> m_intervalFrameTimeUS = 0;
+	std::atomic<float> m_budgetMS = 0.0f;
+
+	uint32_t m_windowOverruns[WATCHDOG_DEGRADE_WINDOW_CHECKS] = {};
+	uint32_t m_windowIndex = 0;
+	uint32_t m_checksWithHeadroom = 0;
+
+	std::atomic<EQualityTier> m_qualityTier = QualityTier_Full;
+	std::atomic<uint32_t> m_numTierChanges = 0;
+	std::atomic<uint32_t> m_numStalls = 0;
+	std::atomic<uint32_t> m_numOverruns = 0;
+	std::atomic<uint64_t> m_numFrames = 0;
+};
@@ -0,0 +1,109 @@
+#include "pch.h"
+#include "self_test_util.h"
+
+#ifdef _DEBUG
+
+#include "logging.h"
+#include "watchdog.h"
+
+
+#define SELF_TEST_WATCHDOG_BUDGET_MS 11.0f
+#define SELF_TEST_WATCHDOG_FRAMES_PER_CHECK 9
+#define SELF_TEST_WATCHDOG_TRACE_CHECKS 200
+
+
+// Reports one check interval of frames, the first overruns of which miss the budget, and evaluates it.
+static void ReportWatchdogCheck(Watchdog& watchdog, const float frameMS, const uint32_t overruns)
+{
+	for (uint32_t i = 0; i < SELF_TEST_WATCHDOG_FRAMES_PER_CHECK; i++)
+	{
+		watchdog.ReportFrame((i < overruns) ? SELF_TEST_WATCHDOG_BUDGET_MS * 1.5f : frameMS, SELF_TEST_WATCHDOG_BUDGET_MS, false);
+	}
+
+	watchdog.EvaluateQuality();
+}
+
+
+// Drives the quality tier with an overload trace followed by a headroom trace, checking that every step
+// down happens within the degrade window and every step up only after the recovery checks.
+bool TestWatchdogQuality()
+{
+	Watchdog watchdog(false);
+	bool bPassed = true;
+
+	// One overrun per check reaches the degrade threshold after that many checks.
+	uint32_t lastChangeCheck = 0;
+	uint32_t maxDegradeChecks = 0;
+
+	for (uint32_t check = 1; check <= SELF_TEST_WATCHDOG_TRACE_CHECKS && watchdog.GetQualityTier() + 1 < QualityTier_Count; check++)
+	{
+		EQualityTier tier = watchdog.GetQualityTier();
+		ReportWatchdogCheck(watchdog, SELF_TEST_WATCHDOG_BUDGET_MS * 0.9f, 1);
+
+		if (watchdog.GetQualityTier() != tier)
+		{
+			maxDegradeChecks = std::max(maxDegradeChecks, check - lastChangeCheck);
+			lastChangeCheck = check;
+		}
+	}
+
+	if (watchdog.GetQualityTier() != QualityTier_ReprojectOnly || maxDegradeChecks > WATCHDOG_DEGRADE_WINDOW_CHECKS)
+	{
+		Log("Watchdog overload: tier %u, up to %u checks per step down\n", watchdog.GetQualityTier(), maxDegradeChecks);
+		bPassed = false;
+	}
+
+	// Frames within budget but above the recovery fraction hold the tier.
+	for (uint32_t check = 0; check < WATCHDOG_RECOVER_CHECKS * 2; check++)
+	{
+		ReportWatchdogCheck(watchdog, SELF_TEST_WATCHDOG_BUDGET_MS * (WATCHDOG_RECOVER_BUDGET_FRACTION + 0.2f), 0);
+	}
+
+	if (watchdog.GetQualityTier() != QualityTier_ReprojectOnly)
+	{
+		Log("Watchdog marginal headroom: stepped up to tier %u\n", watchdog.GetQualityTier());
+		bPassed = false;
+	}
+
+	// A single overrun restarts the recovery count.
+	lastChangeCheck = 0;
+	uint32_t minRecoverChecks = UINT32_MAX;
+	uint32_t maxRecoverChecks = 0;
+	uint32_t interruptCheck = WATCHDOG_RECOVER_CHECKS / 2;
+
+	for (uint32_t check = 1; check <= SELF_TEST_WATCHDOG_TRACE_CHECKS && watchdog.GetQualityTier() > QualityTier_Full; check++)
+	{
+		EQualityTier tier = watchdog.GetQualityTier();
+		ReportWatchdogCheck(watchdog, SELF_TEST_WATCHDOG_BUDGET_MS * 0.3f, (check == interruptCheck) ? 1 : 0);
+
+		if (watchdog.GetQualityTier() != tier)
+		{
+			uint32_t checks = check - lastChangeCheck;
+			if (lastChangeCheck < interruptCheck && check > interruptCheck)
+			{
+				checks = check - interruptCheck;
+			}
+
+			minRecoverChecks = std::min(minRecoverChecks, checks);
+			maxRecoverChecks = std::max(maxRecoverChecks, checks);
+			lastChangeCheck = check;
+		}
+	}
+
+	if (watchdog.GetQualityTier() != QualityTier_Full || minRecoverChecks != WATCHDOG_RECOVER_CHECKS || maxRecoverChecks != WATCHDOG_RECOVER_CHECKS)
+	{
+		Log("Watchdog headroom: tier %u, %u to %u checks per step up, expected %u\n",
+			watchdog.GetQualityTier(), minRecoverChecks, maxRecoverChecks, WATCHDOG_RECOVER_CHECKS);
+		bPassed = false;
+	}
+
+	WatchdogStats stats;
+	watchdog.GetStats(stats);
+
+	Log("Watchdog quality: %u tier changes, up to %u checks per step down, %u checks per step up\n",
+		stats.numTierChanges, maxDegradeChecks, maxRecoverChecks);
+
+	return bPassed && stats.numTierChanges == (QualityTier_Count - 1) * 2;
+}
+
+#endif
@@ -0,0 +1,89 @@
+
+#include "pch.h"
+#include "worker_pool.h"
+
+
+WorkerPool::WorkerPool(const uint32_t numThreads)
+{
+	// The calling thread also processes jobs, so one less worker is needed.
+	for (uint32_t i = 1; i < std::max(numThreads, 1u); i++)
+	{
+		m_threads.push_back(std::thread(&WorkerPool::RunThread, this));
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_jobMutex);
+		m_bRunThreads = false;
+	}
+	m_startCondition.notify_all();
+
+	for (std::thread& thread : m_threads)
+	{
+		if (thread.joinable())
+		{
+			thread.join();
+		}
+	}
+}
+
+void WorkerPool::ParallelFor(const uint32_t count, const std::function<void(uint32_t)>& function)
+{
+	if (count == 0) { return; }
+
+	std::lock_guard<std::mutex> callLock(m_callMutex);
+
+	{
+		std::lock_guard<std::mutex> lock(m_jobMutex);
+		m_function = &function;
+		m_jobCount = count;
+		m_nextJob = 0;
+		m_activeWorkers = (uint32_t)m_threads.size();
+		m_jobGeneration++;
+	}
+	m_startCondition.notify_all();
+
+	ProcessJobs();
+
+	std::unique_lock<std::mutex> lock(m_jobMutex);
+	m_doneCondition.wait(lock, [this] { return m_activeWorkers == 0; });
+	m_function = nullptr;
+}
+
+void WorkerPool::RunThread()
+{
+	uint64_t lastGeneration = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_jobMutex);
+			m_startCondition.wait(lock, [&] { return !m_bRunThreads || m_jobGeneration != lastGeneration; });
+
+			if (!m_bRunThreads) { return; }
+
+			lastGeneration = m_jobGeneration;
+		}
+
+		ProcessJobs();
+
+		{
+			std::lock_guard<std::mutex> lock(m_jobMutex);
+			m_activeWorkers--;
+		}
+		m_doneCondition.notify_one();
+	}
+}
+
+void WorkerPool::ProcessJobs()
+{
+	while (true)
+	{
+		uint32_t job = m_nextJob.fetch_add(1);
+		if (job >= m_jobCount) { return; }
+
+		(*m_function)(job);
+	}
+}
@@ -0,0 +1,41 @@
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+
+
+// Persistent worker threads for splitting per-frame CPU work into parallel jobs.
+class WorkerPool
+{
+public:
+
+	WorkerPool(const uint32_t numThreads);
+	~WorkerPool();
+
+	// Runs the function for each index in [0, count) on the workers and the calling thread, and waits for completion.
+	void ParallelFor(const uint32_t count, const std::function<void(uint32_t)>& function);
+
+	uint32_t GetNumThreads() const { return (uint32_t)m_threads.size() + 1; }
+
+private:
+
+	void RunThread();
+	void ProcessJobs();
+
+	std::vector<std::thread> m_threads;
+	std::mutex m_callMutex;
+	std::mutex m_jobMutex;
+	std::condition_variable m_startCondition;
+	std::condition_variable m_doneCondition;
+
+	const std::function<void(uint32_t)>* m_function = nullptr;
+	uint32_t m_jobCount = 0;
+	std::atomic<uint32_t> m_nextJob = 0;
+	uint32_t m_activeWorkers = 0;
+	uint64_t m_jobGeneration = 0;
+	bool m_bRunThreads = true;
+};